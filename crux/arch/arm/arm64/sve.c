@@ -155,6 +155,47 @@ void sve_restore_state(struct vcpu *v)
     sve_load_ctx(v->arch.vfp.sve_zreg_ctx_end, v->arch.vfp.fpregs, 1);
 }
 
+#ifdef CONFIG_SELF_TESTS
+/*
+ * Time loops save/restore pairs of a whole SVE context at the maximum vector
+ * length, i.e. what an eager context switch costs an SVE vCPU.
+ */
+s_time_t __init sve_bench_switch(unsigned int loops)
+{
+    unsigned int vl = get_sys_vl_len();
+    register_t cptr_bits = READ_SYSREG(CPTR_EL2);
+    uint64_t pregs[64] __vfp_aligned;
+    uint64_t *ctx, *ctx_end;
+    s_time_t start, elapsed;
+    unsigned int i;
+
+    ctx = _xzalloc(sve_zreg_ctx_size(vl) + sve_ffrreg_ctx_size(vl),
+                   L1_CACHE_BYTES);
+    if ( !ctx )
+        return 0;
+    ctx_end = ctx + (sve_zreg_ctx_size(vl) / sizeof(uint64_t));
+
+    WRITE_SYSREG(cptr_bits & ~HCPTR_CP(8), CPTR_EL2);
+    isb();
+    WRITE_SYSREG(vl_to_zcr(vl), ZCR_EL2);
+
+    start = NOW();
+    for ( i = 0; i < loops; i++ )
+    {
+        sve_save_ctx(ctx_end, pregs, 1);
+        sve_load_ctx(ctx_end, pregs, 1);
+    }
+    elapsed = NOW() - start;
+
+    WRITE_SYSREG(cptr_bits, CPTR_EL2);
+    isb();
+
+    xfree(ctx);
+
+    return elapsed;
+}
+#endif /* CONFIG_SELF_TESTS */
+
 bool __init sve_domctl_vl_param(int val, unsigned int *out)
 {
     /*
@@ -1,9 +1,38 @@
+#include <crux/init.h>
+#include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/sched.h>
 #include <asm/processor.h>
 #include <asm/cpufeature.h>
 #include <asm/vfp.h>
 #include <asm/arm64/sve.h>
 
+/*
+ * Lazy FP/SIMD/SVE switching.
+ *
+ * Rather than unconditionally saving and restoring the whole register file
+ * on every context switch, vCPUs are scheduled in with FP (and SVE) accesses
+ * trapped by CPTR_EL2. Only on the first access, vfp_lazy_trap() lifts the
+ * trap and loads the state, and only the vCPUs which did that get their
+ * state saved when scheduled out. On top of that, each pCPU remembers whose
+ * state its registers hold, and if that's still the vCPU trapping, there is
+ * nothing to load at all (e.g., when a vCPU alternates with the idle vCPU
+ * or with vCPUs not using FP).
+ *
+ * Crux itself never touches the FP/SIMD registers, so only vCPUs can change
+ * them, and they must take the trap, and become the owner, first.
+ */
+static bool __read_mostly opt_vfp_lazy = true;
+boolean_param("vfp-lazy", opt_vfp_lazy);
+
+static DEFINE_PER_CPU(struct vcpu *, vfp_owner);
+
+/* CPTR_EL2.TFP and, for vCPUs allowed to use it, CPTR_EL2.TZ */
+static register_t vfp_trap_bits(const struct vcpu *v)
+{
+    return HCPTR_CP(10) | (is_sve_domain(v->domain) ? HCPTR_CP(8) : 0);
+}
+
 static inline void save_state(uint64_t *fpregs)
 {
     asm volatile("stp q0, q1, [%1, #16 * 0]\n\t"
@@ -51,6 +80,20 @@ void vfp_save_state(struct vcpu *v)
     if ( !cpu_has_fp )
         return;
 
+    if ( opt_vfp_lazy )
+    {
+        if ( !v->arch.vfp.loaded )
+        {
+            perfc_incr(vfp_lazy_save_skipped);
+            return;
+        }
+
+        /* Trap the first access again, next time v is scheduled in. */
+        v->arch.vfp.loaded = false;
+        v->arch.vfp.last_cpu = smp_processor_id();
+        v->arch.cptr_el2 |= vfp_trap_bits(v);
+    }
+
     if ( is_sve_domain(v->domain) )
         sve_save_state(v);
     else
@@ -62,11 +105,8 @@ void vfp_save_state(struct vcpu *v)
         v->arch.vfp.fpexc32_el2 = READ_SYSREG(FPEXC32_EL2);
 }
 
-void vfp_restore_state(struct vcpu *v)
+static void vfp_load_state(struct vcpu *v)
 {
-    if ( !cpu_has_fp )
-        return;
-
     if ( is_sve_domain(v->domain) )
         sve_restore_state(v);
     else
@@ -77,3 +117,111 @@ void vfp_restore_state(struct vcpu *v)
     if ( is_32bit_domain(v->domain) )
         WRITE_SYSREG(v->arch.vfp.fpexc32_el2, FPEXC32_EL2);
 }
+
+void vfp_restore_state(struct vcpu *v)
+{
+    /* In lazy mode, this is done on first use, by vfp_lazy_trap(). */
+    if ( !cpu_has_fp || opt_vfp_lazy )
+        return;
+
+    vfp_load_state(v);
+}
+
+void vfp_vcpu_init(struct vcpu *v)
+{
+    v->arch.vfp.loaded = false;
+    v->arch.vfp.last_cpu = NR_CPUS;
+
+    if ( cpu_has_fp && opt_vfp_lazy )
+        v->arch.cptr_el2 |= vfp_trap_bits(v);
+}
+
+/*
+ * Called on FP/SIMD (sve == false) or SVE (sve == true) access traps from
+ * the guest. Returns whether the trap was for lazy switching, in which case
+ * the access can just be retried.
+ */
+bool vfp_lazy_trap(bool sve)
+{
+    struct vcpu *v = current;
+    unsigned int cpu = smp_processor_id();
+
+    if ( !cpu_has_fp || !opt_vfp_lazy || v->arch.vfp.loaded ||
+         (sve && !is_sve_domain(v->domain)) )
+        return false;
+
+    v->arch.cptr_el2 &= ~vfp_trap_bits(v);
+    WRITE_SYSREG(v->arch.cptr_el2, CPTR_EL2);
+    isb();
+
+    if ( this_cpu(vfp_owner) == v && v->arch.vfp.last_cpu == cpu )
+        perfc_incr(vfp_lazy_load_skipped);
+    else
+    {
+        perfc_incr(vfp_lazy_load);
+        vfp_load_state(v);
+        this_cpu(vfp_owner) = v;
+        v->arch.vfp.last_cpu = cpu;
+    }
+
+    v->arch.vfp.loaded = true;
+
+    return true;
+}
+
+#ifdef CONFIG_SELF_TESTS
+/*
+ * vfp-bench -> time, at boot, what an eager context switch spends on the
+ * FP/SIMD and SVE state of a vCPU, which lazy switching saves for vCPUs not
+ * using it, and the CPTR_EL2 update lazy switching does instead, on first
+ * use (on top of the trap itself).
+ */
+static bool __initdata opt_vfp_bench;
+boolean_param("vfp-bench", opt_vfp_bench);
+
+#define VFP_BENCH_LOOPS 100000
+
+static int __init cf_check vfp_bench(void)
+{
+    static uint64_t __initdata fpregs[64] __vfp_aligned;
+    register_t cptr = READ_SYSREG(CPTR_EL2);
+    s_time_t start, ns;
+    unsigned int i;
+
+    if ( !opt_vfp_bench || !cpu_has_fp )
+        return 0;
+
+    start = NOW();
+    for ( i = 0; i < VFP_BENCH_LOOPS; i++ )
+    {
+        save_state(fpregs);
+        restore_state(fpregs);
+        WRITE_SYSREG(READ_SYSREG(FPSR), FPSR);
+        WRITE_SYSREG(READ_SYSREG(FPCR), FPCR);
+    }
+    ns = NOW() - start;
+    printk(CRUXLOG_INFO "vfp-bench: eager FP/SIMD switch: %"PRI_stime" ps\n",
+           ns * 1000 / VFP_BENCH_LOOPS);
+
+    if ( cpu_has_sve )
+    {
+        ns = sve_bench_switch(VFP_BENCH_LOOPS);
+        printk(CRUXLOG_INFO
+               "vfp-bench: eager SVE switch (VL %u): %"PRI_stime" ps\n",
+               get_sys_vl_len(), ns * 1000 / VFP_BENCH_LOOPS);
+    }
+
+    start = NOW();
+    for ( i = 0; i < VFP_BENCH_LOOPS; i++ )
+    {
+        WRITE_SYSREG(cptr, CPTR_EL2);
+        isb();
+    }
+    ns = NOW() - start;
+    printk(CRUXLOG_INFO "vfp-bench: lazy trap CPTR_EL2 update: %"PRI_stime" ps\n",
+           ns * 1000 / VFP_BENCH_LOOPS);
+
+    return 0;
+}
+__initcall(vfp_bench);
+#endif /* CONFIG_SELF_TESTS */
@@ -28,6 +28,8 @@ int dm_op(const struct dmop_args *op_args)
         [CRUX_DMOP_destroy_ioreq_server]             = sizeof(struct crux_dm_op_destroy_ioreq_server),
         [CRUX_DMOP_set_irq_level]                    = sizeof(struct crux_dm_op_set_irq_level),
         [CRUX_DMOP_nr_vcpus]                         = sizeof(struct crux_dm_op_nr_vcpus),
+        [CRUX_DMOP_map_doorbell_to_ioreq_server]     = sizeof(struct crux_dm_op_ioreq_server_doorbell),
+        [CRUX_DMOP_unmap_doorbell_from_ioreq_server] = sizeof(struct crux_dm_op_ioreq_server_doorbell),
     };
 
     rc = rcu_lock_remote_domain_by_id(op_args->domid, &d);
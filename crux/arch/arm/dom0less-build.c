@@ -267,6 +267,13 @@ int __init init_vuart(struct domain *d, struct kernel_info *kinfo,
         rc = domain_vpl011_init(d, NULL);
         if ( rc < 0 )
             return rc;
+
+        if ( dt_property_read_bool(node, "vpl011-pv") )
+        {
+            rc = domain_vpl011_init_pv(d);
+            if ( rc < 0 )
+                return rc;
+        }
     }
 
     return rc;
@@ -277,6 +284,7 @@ int __init arch_parse_dom0less_node(struct dt_device_node *node,
 {
     struct crux_domctl_createdomain *d_cfg = &bd->create_cfg;
     unsigned int flags = bd->create_flags;
+    const char *wfi;
     uint32_t val;
 
     d_cfg->arch.gic_version = CRUX_DOMCTL_CONFIG_GIC_NATIVE;
@@ -345,6 +353,18 @@ int __init arch_parse_dom0less_node(struct dt_device_node *node,
 #endif
     }
 
+    if ( !dt_property_read_string(node, "wfi", &wfi) )
+    {
+        if ( !strcmp(wfi, "trap") )
+            d_cfg->arch.wfi_policy = CRUX_DOMCTL_CONFIG_WFI_TRAP;
+        else if ( !strcmp(wfi, "native") )
+            d_cfg->arch.wfi_policy = CRUX_DOMCTL_CONFIG_WFI_NATIVE;
+        else if ( !strcmp(wfi, "adaptive") )
+            d_cfg->arch.wfi_policy = CRUX_DOMCTL_CONFIG_WFI_ADAPTIVE;
+        else
+            panic("wfi: supported values are trap, native or adaptive\n");
+    }
+
     /* Trap unmapped accesses by default. */
     d_cfg->flags |= CRUX_DOMCTL_CDF_trap_unmapped_accesses;
     if ( dt_property_read_u32(node, "trap-unmapped-accesses", &val) )
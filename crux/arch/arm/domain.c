@@ -8,6 +8,7 @@
 #include <crux/ioreq.h>
 #include <crux/lib.h>
 #include <crux/livepatch.h>
+#include <crux/param.h>
 #include <crux/sched.h>
 #include <crux/softirq.h>
 #include <crux/wait.h>
@@ -18,6 +19,7 @@
 #include <asm/current.h>
 #include <asm/event.h>
 #include <asm/gic.h>
+#include <asm/gic_v3_its.h>
 #include <asm/guest_atomics.h>
 #include <asm/irq.h>
 #include <asm/p2m.h>
@@ -164,6 +166,56 @@ static void ctxt_switch_from(struct vcpu *p)
     isb();
 }
 
+static void vcpu_wfi_account(struct vcpu *v, bool polled)
+{
+    s_time_t kicked = read_atomic(&v->arch.wfi.kicked), delta;
+
+    if ( !kicked )
+        return;
+
+    write_atomic(&v->arch.wfi.kicked, 0);
+
+    delta = NOW() - kicked;
+    if ( polled )
+        v->arch.wfi.polled++;
+    else
+        v->arch.wfi.blocked++;
+    v->arch.wfi.latency_sum += delta;
+    if ( delta > v->arch.wfi.latency_max )
+        v->arch.wfi.latency_max = delta;
+}
+
+/*
+ * Trapping WFI/WFE is what lets another vCPU have the pCPU while this one
+ * idles.  If nobody else can be scheduled here, letting the guest execute
+ * them natively saves a block/wake round trip through the scheduler.
+ * Re-evaluated every time the vCPU is scheduled in.
+ */
+static void vcpu_update_wfx_traps(struct vcpu *n)
+{
+    bool trap;
+
+    switch ( n->domain->arch.wfi_policy )
+    {
+    case CRUX_DOMCTL_CONFIG_WFI_NATIVE:
+        trap = false;
+        break;
+
+    case CRUX_DOMCTL_CONFIG_WFI_ADAPTIVE:
+        trap = !vcpu_has_exclusive_pcpu(n);
+        break;
+
+    default:
+        trap = true;
+        break;
+    }
+
+    if ( trap )
+        n->arch.hcr_el2 |= HCR_TWI | HCR_TWE;
+    else
+        n->arch.hcr_el2 &= ~(HCR_TWI | HCR_TWE);
+}
+
 static void ctxt_switch_to(struct vcpu *n)
 {
     register_t vpidr;
@@ -174,6 +226,8 @@ static void ctxt_switch_to(struct vcpu *n)
     if ( is_idle_vcpu(n) )
         return;
 
+    vcpu_wfi_account(n, false);
+
     vpidr = READ_SYSREG(MIDR_EL1);
     WRITE_SYSREG(vpidr, VPIDR_EL2);
     WRITE_SYSREG(n->arch.vmpidr, VMPIDR_EL2);
@@ -224,6 +278,9 @@ static void ctxt_switch_to(struct vcpu *n)
 #endif
     isb();
 
+    /* Picked up by p2m_restore_state() below. */
+    vcpu_update_wfx_traps(n);
+
     /*
      * ARM64_WORKAROUND_AT_SPECULATE: The P2M should be restored after
      * the stage-1 MMU sysregs have been restored.
@@ -287,6 +344,10 @@ static void schedule_tail(struct vcpu *prev)
 
     local_irq_enable();
 
+    /* May wait for the ITS, so not done with interrupts disabled. */
+    if ( !is_idle_vcpu(current) )
+        gicv3_its_vpe_migrate(current);
+
     sched_context_switched(prev, current);
 
     update_runstate_area(current);
@@ -566,6 +627,7 @@ int arch_vcpu_create(struct vcpu *v)
             goto fail;
         v->arch.cptr_el2 &= ~HCPTR_CP(8);
     }
+    vfp_vcpu_init(v);
 
     v->arch.hcr_el2 = get_default_hcr_flags();
 
@@ -693,6 +755,13 @@ int arch_sanitise_domain_config(struct crux_domctl_createdomain *config)
         return -EINVAL;
     }
 
+    if ( config->arch.wfi_policy > CRUX_DOMCTL_CONFIG_WFI_ADAPTIVE ||
+         config->arch.pad[0] || config->arch.pad[1] || config->arch.pad[2] )
+    {
+        dprintk(CRUXLOG_INFO, "Unsupported WFI policy\n");
+        return -EINVAL;
+    }
+
     if ( config->altp2m.opts )
     {
         dprintk(CRUXLOG_INFO, "Altp2m not supported\n");
@@ -729,6 +798,8 @@ int arch_domain_create(struct domain *d,
     clear_page(d->shared_info);
     share_crux_page_with_guest(virt_to_page(d->shared_info), d, SHARE_rw);
 
+    d->arch.wfi_policy = config->arch.wfi_policy ?: wfi_default_policy();
+
     switch ( config->arch.gic_version )
     {
     case CRUX_DOMCTL_CONFIG_GIC_V2:
@@ -1159,8 +1230,16 @@ long do_vcpu_op(int cmd, unsigned int vcpuid, CRUX_GUEST_HANDLE_PARAM(void) arg)
 
 void arch_dump_vcpu_info(struct vcpu *v)
 {
+    unsigned long wakes = v->arch.wfi.polled + v->arch.wfi.blocked;
+
     gic_dump_info(v);
     gic_dump_vgic_info(v);
+
+    if ( wakes )
+        printk("    WFI wake-ups: %lu polled, %lu blocked, "
+               "latency avg %"PRI_stime"ns max %"PRI_stime"ns\n",
+               v->arch.wfi.polled, v->arch.wfi.blocked,
+               v->arch.wfi.latency_sum / wakes, v->arch.wfi.latency_max);
 }
 
 void vcpu_mark_events_pending(struct vcpu *v)
@@ -1189,18 +1268,89 @@ void vcpu_update_evtchn_irq(struct vcpu *v)
  */
 void vcpu_block_unless_event_pending(struct vcpu *v)
 {
+    /*
+     * A resident vPE doesn't fire its doorbell, so descheduling it is the
+     * only way to be woken up by direct LPIs, and to find out about the
+     * ones already pending.
+     */
+    gicv3_its_vpe_put(v);
     vcpu_block();
     if ( local_events_need_delivery_nomask() )
         vcpu_unblock(current);
 }
 
+static unsigned int __ro_after_init opt_vwfi_poll_us = 20;
+integer_param("vwfi-poll-us", opt_vwfi_poll_us);
+
+/*
+ * Before blocking a vCPU of an adaptive domain on WFI, spin for a while in
+ * case an interrupt turns up: that saves a trip through the scheduler, and
+ * vcpu_kick() doesn't need to send an SGI either.  Polling stops as soon as
+ * this pCPU has other work to do.  Returns true if an interrupt arrived.
+ */
+bool vcpu_wfi_poll(struct vcpu *v)
+{
+    unsigned int cpu = smp_processor_id();
+    s_time_t deadline;
+    bool woken = false;
+
+    ASSERT(v == current);
+
+    if ( v->domain->arch.wfi_policy != CRUX_DOMCTL_CONFIG_WFI_ADAPTIVE ||
+         !opt_vwfi_poll_us )
+        return false;
+
+    deadline = NOW() + MICROSECS(opt_vwfi_poll_us);
+
+    write_atomic(&v->arch.wfi.polling, true);
+    smp_mb();
+
+    do {
+        if ( local_events_need_delivery_nomask() )
+        {
+            woken = true;
+            break;
+        }
+        cpu_relax();
+    } while ( !softirq_pending(cpu) && NOW() < deadline );
+
+    write_atomic(&v->arch.wfi.polling, false);
+    /* Pairs with vcpu_kick(): catch an interrupt which came without an SGI. */
+    smp_mb();
+    if ( !woken )
+        woken = local_events_need_delivery_nomask();
+
+    if ( woken )
+    {
+        perfc_incr(wfi_poll_hit);
+        vcpu_wfi_account(v, true);
+    }
+    else
+        perfc_incr(wfi_poll_miss);
+
+    return woken;
+}
+
 void vcpu_kick(struct vcpu *v)
 {
     bool running = v->is_running;
 
+    if ( !read_atomic(&v->arch.wfi.kicked) &&
+         (read_atomic(&v->arch.wfi.polling) ||
+          test_bit(_VPF_blocked, &v->pause_flags)) )
+        write_atomic(&v->arch.wfi.kicked, NOW());
+
     vcpu_unblock(v);
     if ( running && v != current )
     {
+        /* Order the interrupt being made pending against reading ->polling. */
+        smp_mb();
+        if ( read_atomic(&v->arch.wfi.polling) )
+        {
+            perfc_incr(vcpu_kick_polling);
+            return;
+        }
+
         perfc_incr(vcpu_kick);
         smp_send_event_check_mask(cpumask_of(v->processor));
     }
@@ -179,6 +179,27 @@ long arch_do_domctl(struct crux_domctl *domctl, struct domain *d,
     }
     case CRUX_DOMCTL_dt_overlay:
         return dt_overlay_domctl(d, &domctl->u.dt_overlay);
+
+    case CRUX_DOMCTL_shadow_op:
+    {
+        int rc;
+
+        if ( d == current->domain )
+            return -EINVAL;
+
+        domain_pause(d);
+        rc = p2m_shadow_op(d, &domctl->u.shadow_op);
+        domain_unpause(d);
+
+        if ( rc == -ERESTART )
+            rc = hypercall_create_continuation(__HYPERVISOR_domctl,
+                                               "h", u_domctl);
+        else if ( !rc && __copy_to_guest(u_domctl, domctl, 1) )
+            rc = -EFAULT;
+
+        return rc;
+    }
+
     default:
         return subarch_do_domctl(domctl, d, u_domctl);
     }
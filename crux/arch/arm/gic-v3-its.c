@@ -13,6 +13,8 @@
 #include <crux/iocap.h>
 #include <crux/libfdt/libfdt.h>
 #include <crux/mm.h>
+#include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/rbtree.h>
 #include <crux/sched.h>
 #include <crux/sizes.h>
@@ -30,6 +32,20 @@
  */
 LIST_HEAD(host_its_list);
 
+/*
+ * GICv4 direct injection of virtual LPIs, off by default. This is only
+ * supported with a single host ITS, which spares us from keeping the vPE
+ * mappings of several ITSes in sync on VMOVP.
+ */
+static bool __initdata opt_gicv4;
+boolean_param("gicv4", opt_gicv4);
+
+static struct host_its *__read_mostly vlpi_its;
+
+#define GICV4_MAX_VPES                  1024
+static DECLARE_BITMAP(vpe_ids, GICV4_MAX_VPES);
+static DEFINE_SPINLOCK(vpe_ids_lock);
+
 /*
  * Describes a device which is using the ITS and is used by a guest.
  * Since device IDs are per ITS (in contrast to vLPIs, which are per
@@ -49,6 +65,7 @@ struct its_device {
     uint32_t eventids;                  /* Number of event IDs (MSIs) */
     uint32_t *host_lpi_blocks;          /* Which LPIs are used on the host */
     struct pending_irq *pend_irqs;      /* One struct per event */
+    unsigned long *vlpi_map;            /* Events injected directly (GICv4) */
 };
 
 /*
@@ -170,12 +187,17 @@ static int its_send_command(struct host_its *hw_its, const void *its_cmd)
      */
     s_time_t deadline = NOW() + MILLISECS(1);
     uint64_t readp, writep;
+    unsigned long flags;
     int ret = -EBUSY;
 
-    /* No ITS commands from an interrupt handler (at the moment). */
+    /*
+     * No ITS commands from an interrupt handler (at the moment). They may
+     * however be sent with interrupts disabled, when moving a vPE to the
+     * redistributor it is about to be scheduled on.
+     */
     ASSERT(!in_irq());
 
-    spin_lock(&hw_its->cmd_lock);
+    spin_lock_irqsave(&hw_its->cmd_lock, flags);
 
     do {
         readp = readq_relaxed(hw_its->its_base + GITS_CREADR) & BUFPTR_MASK;
@@ -191,15 +213,15 @@ static int its_send_command(struct host_its *hw_its, const void *its_cmd)
          * If the command queue is full, wait for a bit in the hope it drains
          * before giving up.
          */
-        spin_unlock(&hw_its->cmd_lock);
+        spin_unlock_irqrestore(&hw_its->cmd_lock, flags);
         cpu_relax();
         udelay(1);
-        spin_lock(&hw_its->cmd_lock);
+        spin_lock_irqsave(&hw_its->cmd_lock, flags);
     } while ( NOW() <= deadline );
 
     if ( ret )
     {
-        spin_unlock(&hw_its->cmd_lock);
+        spin_unlock_irqrestore(&hw_its->cmd_lock, flags);
         if ( printk_ratelimit() )
             printk(CRUXLOG_WARNING "host ITS: command queue full.\n");
         return ret;
@@ -215,7 +237,7 @@ static int its_send_command(struct host_its *hw_its, const void *its_cmd)
     writep = (writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ;
     writeq_relaxed(writep & BUFPTR_MASK, hw_its->its_base + GITS_CWRITER);
 
-    spin_unlock(&hw_its->cmd_lock);
+    spin_unlock_irqrestore(&hw_its->cmd_lock, flags);
 
     return 0;
 }
@@ -231,12 +253,13 @@ static int gicv3_its_wait_commands(struct host_its *hw_its)
      */
     s_time_t deadline = NOW() + MILLISECS(100);
     uint64_t readp, writep;
+    unsigned long flags;
 
     do {
-        spin_lock(&hw_its->cmd_lock);
+        spin_lock_irqsave(&hw_its->cmd_lock, flags);
         readp = readq_relaxed(hw_its->its_base + GITS_CREADR) & BUFPTR_MASK;
         writep = readq_relaxed(hw_its->its_base + GITS_CWRITER) & BUFPTR_MASK;
-        spin_unlock(&hw_its->cmd_lock);
+        spin_unlock_irqrestore(&hw_its->cmd_lock, flags);
 
         if ( readp == writep )
             return 0;
@@ -335,6 +358,110 @@ static int its_send_cmd_inv(struct host_its *its,
     return its_send_command(its, cmd);
 }
 
+/* DISCARD, INV, INT or CLEAR, which only take a device and event ID. */
+static int its_send_cmd_event(struct host_its *its, uint8_t cmdnr,
+                              uint32_t deviceid, uint32_t eventid)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = cmdnr | ((uint64_t)deviceid << 32);
+    cmd[1] = eventid;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vsync(struct host_its *its, const struct its_vpe *vpe)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VSYNC;
+    cmd[1] = (uint64_t)vpe->vpe_id << 32;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vmapp(struct host_its *its, const struct its_vpe *vpe,
+                              unsigned int id_bits, bool valid)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMAPP;
+    cmd[1] = (uint64_t)vpe->vpe_id << 32;
+    cmd[2] = encode_rdbase(its, vpe->cpu, 0x0);
+    cmd[3] = 0x00;
+    if ( valid )
+    {
+        ASSERT(!(virt_to_maddr(vpe->vpt) & ~GENMASK(51, 16)));
+
+        cmd[2] |= GITS_VALID_BIT;
+        cmd[3] = virt_to_maddr(vpe->vpt) | (id_bits - 1);
+    }
+
+    return its_send_command(its, cmd);
+}
+
+/*
+ * With a single ITS there is neither an ITS list nor a sequence number
+ * to provide.
+ */
+static int its_send_cmd_vmovp(struct host_its *its, const struct its_vpe *vpe,
+                              unsigned int cpu)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMOVP;
+    cmd[1] = (uint64_t)vpe->vpe_id << 32;
+    cmd[2] = encode_rdbase(its, cpu, 0x0);
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vmapti(struct host_its *its,
+                               uint32_t deviceid, uint32_t eventid,
+                               const struct its_vpe *vpe, uint32_t vintid)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMAPTI | ((uint64_t)deviceid << 32);
+    cmd[1] = eventid | ((uint64_t)vpe->vpe_id << 32);
+    cmd[2] = vintid | ((uint64_t)vpe->doorbell << 32);
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vmovi(struct host_its *its,
+                              uint32_t deviceid, uint32_t eventid,
+                              const struct its_vpe *vpe)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMOVI | ((uint64_t)deviceid << 32);
+    cmd[1] = eventid | ((uint64_t)vpe->vpe_id << 32);
+    /* Bit 0 tells the ITS that the doorbell LPI is valid. */
+    cmd[2] = 0x01 | ((uint64_t)vpe->doorbell << 32);
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vinvall(struct host_its *its, const struct its_vpe *vpe)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VINVALL;
+    cmd[1] = (uint64_t)vpe->vpe_id << 32;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
 /* Set up the (1:1) collection mapping for the given host CPU. */
 int gicv3_its_setup_collection(unsigned int cpu)
 {
@@ -547,6 +674,7 @@ static int gicv3_disable_its(struct host_its *hw_its)
 static int gicv3_its_init_single_its(struct host_its *hw_its)
 {
     uint64_t reg;
+    unsigned int nr_vpes = 1;
     int i, ret;
 
     hw_its->its_base = ioremap_nocache(hw_its->addr, hw_its->size);
@@ -565,6 +693,8 @@ static int gicv3_its_init_single_its(struct host_its *hw_its)
     hw_its->itte_size = GITS_TYPER_ITT_SIZE(reg);
     if ( reg & GITS_TYPER_PTA )
         hw_its->flags |= HOST_ITS_USES_PTA;
+    if ( opt_gicv4 && (reg & GITS_TYPER_VIRTUAL) )
+        nr_vpes = GICV4_MAX_VPES;
     spin_lock_init(&hw_its->cmd_lock);
 
     for ( i = 0; i < GITS_BASER_NR_REGS; i++ )
@@ -588,11 +718,16 @@ static int gicv3_its_init_single_its(struct host_its *hw_its)
             if ( ret )
                 return ret;
             break;
-        /* In case this is a GICv4, provide a (dummy) vPE table as well. */
+        /*
+         * In case this is a GICv4, provide a vPE table as well. This is a
+         * dummy one unless we are going to inject virtual LPIs directly.
+         */
         case GITS_BASER_TYPE_VCPU:
-            ret = its_map_baser(basereg, reg, 1);
+            ret = its_map_baser(basereg, reg, nr_vpes);
             if ( ret )
                 return ret;
+            if ( nr_vpes > 1 )
+                vlpi_its = hw_its;
             break;
         default:
             continue;
@@ -639,6 +774,7 @@ static int remove_mapped_guest_device(struct its_device *dev)
     free_cruxheap_pages(dev->itt_addr, dev->itt_order);
     xfree(dev->pend_irqs);
     xfree(dev->host_lpi_blocks);
+    xfree(dev->vlpi_map);
     xfree(dev);
 
     return 0;
@@ -822,6 +958,10 @@ int gicv3_its_map_guest_device(struct domain *d,
     if ( !dev->host_lpi_blocks )
         goto out_unlock;
 
+    dev->vlpi_map = xzalloc_array(unsigned long, BITS_TO_LONGS(nr_events));
+    if ( !dev->vlpi_map )
+        goto out_unlock;
+
     ret = its_send_cmd_mapd(hw_its, host_devid, fls(nr_events - 1),
                             virt_to_maddr(itt_addr), true);
     if ( ret )
@@ -885,6 +1025,7 @@ out:
     {
         xfree(dev->pend_irqs);
         xfree(dev->host_lpi_blocks);
+        xfree(dev->vlpi_map);
     }
     if ( itt_addr )
         free_cruxheap_pages(itt_addr, order);
@@ -996,6 +1137,431 @@ struct pending_irq *gicv3_assign_guest_event(struct domain *d,
     return pirq;
 }
 
+bool gicv3_its_has_vlpis(void)
+{
+    return vlpi_its;
+}
+
+/* Called when bringing up a redistributor which can't handle vLPIs. */
+void gicv3_its_disable_vlpis(void)
+{
+    if ( !vlpi_its )
+        return;
+
+    printk(CRUXLOG_WARNING
+           "GICv4: CPU%u redistributor lacks vLPI support, disabling direct injection\n",
+           smp_processor_id());
+    vlpi_its = NULL;
+}
+
+int gicv3_its_vm_init(struct domain *d)
+{
+    struct its_vm *vm;
+    unsigned long nr_ids = BIT(d->arch.vgic.intid_bits, UL);
+    unsigned int i;
+    int ret = -ENOMEM;
+
+    if ( !vlpi_its || d->arch.vgic.intid_bits < 14 )
+        return -ENODEV;
+
+    vm = xzalloc(struct its_vm);
+    if ( !vm )
+        return -ENOMEM;
+
+    /*
+     * The property table holds one byte per LPI, starting at LPI 8192. All
+     * vLPIs start out disabled, until the guest's INV or INVALL commands
+     * tell us about its own table.
+     */
+    vm->prop_order = get_order_from_bytes(nr_ids - LPI_OFFSET);
+    vm->proptable = alloc_cruxheap_pages(vm->prop_order,
+                                         gicv3_its_get_memflags());
+    if ( !vm->proptable )
+        goto fail;
+
+    memset(vm->proptable, GIC_PRI_IRQ | LPI_PROP_RES1, nr_ids - LPI_OFFSET);
+    clean_and_invalidate_dcache_va_range(vm->proptable, nr_ids - LPI_OFFSET);
+
+    vm->vpropbaser  = gicv3_its_get_cacheability() <<
+                      GICR_PROPBASER_INNER_CACHEABILITY_SHIFT;
+    vm->vpropbaser |= GIC_BASER_CACHE_SameAsInner <<
+                      GICR_PROPBASER_OUTER_CACHEABILITY_SHIFT;
+    vm->vpropbaser |= gicv3_its_get_shareability() <<
+                      GICR_PROPBASER_SHAREABILITY_SHIFT;
+    vm->vpropbaser |= (d->arch.vgic.intid_bits - 1) &
+                      GICR_VPROPBASER_IDBITS_MASK;
+    vm->vpropbaser |= virt_to_maddr(vm->proptable);
+
+    /* One doorbell per vCPU, allocated in blocks like any other host LPI. */
+    vm->nr_doorbell_blocks = DIV_ROUND_UP(d->max_vcpus, LPI_BLOCK);
+    vm->doorbell_blocks = xzalloc_array(uint32_t, vm->nr_doorbell_blocks);
+    if ( !vm->doorbell_blocks )
+        goto fail;
+
+    for ( i = 0; i < vm->nr_doorbell_blocks; i++ )
+    {
+        ret = gicv3_allocate_host_lpi_block(d, &vm->doorbell_blocks[i]);
+        if ( ret )
+            goto fail;
+    }
+
+    d->arch.vgic.its_vm = vm;
+
+    return 0;
+
+fail:
+    d->arch.vgic.its_vm = vm;
+    gicv3_its_vm_destroy(d);
+
+    return ret;
+}
+
+void gicv3_its_vm_destroy(struct domain *d)
+{
+    struct its_vm *vm = d->arch.vgic.its_vm;
+    unsigned int i;
+
+    if ( !vm )
+        return;
+
+    if ( vm->doorbell_blocks )
+    {
+        for ( i = 0; i < vm->nr_doorbell_blocks; i++ )
+        {
+            if ( vm->doorbell_blocks[i] )
+                gicv3_free_host_lpi_block(vm->doorbell_blocks[i]);
+        }
+    }
+
+    if ( vm->proptable )
+        free_cruxheap_pages(vm->proptable, vm->prop_order);
+    xfree(vm->doorbell_blocks);
+    xfree(vm);
+    d->arch.vgic.its_vm = NULL;
+}
+
+/*
+ * Mirror a byte of the guest's LPI property table into the one the
+ * redistributors use for this domain's vPEs.
+ */
+void gicv3_its_vm_set_property(struct domain *d, uint32_t vlpi,
+                               uint8_t property)
+{
+    struct its_vm *vm = d->arch.vgic.its_vm;
+
+    if ( !vm || vlpi < LPI_OFFSET ||
+         vlpi >= BIT(d->arch.vgic.intid_bits, UL) )
+        return;
+
+    vm->proptable[vlpi - LPI_OFFSET] = property | LPI_PROP_RES1;
+    clean_and_invalidate_dcache_va_range(&vm->proptable[vlpi - LPI_OFFSET],
+                                         sizeof(uint8_t));
+}
+
+int gicv3_its_vpe_init(struct vcpu *v)
+{
+    struct domain *d = v->domain;
+    const struct its_vm *vm = d->arch.vgic.its_vm;
+    unsigned int id_bits = d->arch.vgic.intid_bits;
+    struct its_vpe *vpe;
+    unsigned int id;
+    int ret;
+
+    ASSERT(vm);
+
+    vpe = xzalloc(struct its_vpe);
+    if ( !vpe )
+        return -ENOMEM;
+
+    spin_lock(&vpe_ids_lock);
+    id = find_first_zero_bit(vpe_ids, GICV4_MAX_VPES);
+    if ( id < GICV4_MAX_VPES )
+        __set_bit(id, vpe_ids);
+    spin_unlock(&vpe_ids_lock);
+
+    ret = -ENOSPC;
+    if ( id >= GICV4_MAX_VPES )
+        goto out_free_vpe;
+
+    /*
+     * The virtual pending table has the same layout as the physical one,
+     * including its 64KB alignment requirement.
+     */
+    ret = -ENOMEM;
+    vpe->vpt_order = get_order_from_bytes(max(BIT(id_bits, UL) / 8,
+                                              (unsigned long)SZ_64K));
+    vpe->vpt = alloc_cruxheap_pages(vpe->vpt_order, gicv3_its_get_memflags());
+    if ( !vpe->vpt )
+        goto out_free_id;
+
+    memset(vpe->vpt, 0, PAGE_SIZE << vpe->vpt_order);
+    if ( virt_to_maddr(vpe->vpt) & ~GENMASK(51, 16) )
+    {
+        ret = -ERANGE;
+        goto out_free_vpt;
+    }
+    clean_and_invalidate_dcache_va_range(vpe->vpt,
+                                         PAGE_SIZE << vpe->vpt_order);
+
+    vpe->vpe_id = id;
+    vpe->doorbell = vm->doorbell_blocks[v->vcpu_id / LPI_BLOCK] +
+                    v->vcpu_id % LPI_BLOCK;
+    vpe->cpu = v->processor;
+    /* The redistributor has no cached state for a fresh table. */
+    vpe->idai = true;
+
+    gicv3_lpi_update_host_doorbell(vpe->doorbell, d->domain_id, v->vcpu_id);
+
+    ret = its_send_cmd_vmapp(vlpi_its, vpe, id_bits, true);
+    if ( !ret )
+        ret = its_send_cmd_vsync(vlpi_its, vpe);
+    if ( !ret )
+        ret = gicv3_its_wait_commands(vlpi_its);
+    if ( ret )
+        goto out_clear_doorbell;
+
+    v->arch.vgic.its_vpe = vpe;
+
+    return 0;
+
+out_clear_doorbell:
+    gicv3_lpi_update_host_entry(vpe->doorbell, d->domain_id, INVALID_LPI);
+out_free_vpt:
+    free_cruxheap_pages(vpe->vpt, vpe->vpt_order);
+out_free_id:
+    spin_lock(&vpe_ids_lock);
+    __clear_bit(id, vpe_ids);
+    spin_unlock(&vpe_ids_lock);
+out_free_vpe:
+    xfree(vpe);
+
+    return ret;
+}
+
+void gicv3_its_vpe_destroy(struct vcpu *v)
+{
+    struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    int ret;
+
+    if ( !vpe )
+        return;
+
+    ASSERT(!vpe->resident);
+
+    ret = its_send_cmd_vmapp(vlpi_its, vpe, 0, false);
+    if ( !ret )
+        ret = gicv3_its_wait_commands(vlpi_its);
+
+    gicv3_lpi_update_host_entry(vpe->doorbell, v->domain->domain_id,
+                                INVALID_LPI);
+
+    /* The ITS may still use the table, better leak it than corrupt memory. */
+    if ( ret )
+        printk(CRUXLOG_ERR "%pv: cannot unmap vPE %u: %d\n",
+               v, vpe->vpe_id, ret);
+    else
+    {
+        free_cruxheap_pages(vpe->vpt, vpe->vpt_order);
+
+        spin_lock(&vpe_ids_lock);
+        __clear_bit(vpe->vpe_id, vpe_ids);
+        spin_unlock(&vpe_ids_lock);
+    }
+
+    xfree(vpe);
+    v->arch.vgic.its_vpe = NULL;
+}
+
+/*
+ * Retarget a vPE to the redistributor of @cpu, before it becomes resident
+ * there. This waits for the ITS to complete the VMOVP, so avoid calling it
+ * with interrupts disabled.
+ */
+int gicv3_its_vpe_move(struct its_vpe *vpe, unsigned int cpu)
+{
+    int ret;
+
+    ASSERT(!vpe->resident);
+
+    ret = its_send_cmd_vmovp(vlpi_its, vpe, cpu);
+    if ( !ret )
+        ret = its_send_cmd_vsync(vlpi_its, vpe);
+    if ( !ret )
+        ret = gicv3_its_wait_commands(vlpi_its);
+    if ( ret )
+    {
+        if ( printk_ratelimit() )
+            printk(CRUXLOG_WARNING "GICv4: cannot move vPE %u to CPU%u: %d\n",
+                   vpe->vpe_id, cpu, ret);
+        return ret;
+    }
+
+    perfc_incr(vpe_moves);
+    vpe->cpu = cpu;
+
+    return 0;
+}
+
+int gicv3_its_vpe_invall(const struct vcpu *v)
+{
+    const struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    int ret;
+
+    if ( !vpe )
+        return -ENOENT;
+
+    ret = its_send_cmd_vinvall(vlpi_its, vpe);
+    if ( ret )
+        return ret;
+
+    return its_send_cmd_vsync(vlpi_its, vpe);
+}
+
+/*
+ * Look up the device behind a guest event which is (or can be) injected
+ * directly. Must be called with the its_devices_lock held.
+ */
+static struct its_device *get_vlpi_device(struct domain *d, paddr_t vdoorbell,
+                                          uint32_t vdevid, uint32_t eventid)
+{
+    struct its_device *dev = get_its_device(d, vdoorbell, vdevid);
+
+    if ( !dev || eventid >= dev->eventids || dev->hw_its != vlpi_its )
+        return NULL;
+
+    return dev;
+}
+
+/* Hand an event back to its host LPI, so that it gets emulated again. */
+static int unmap_vlpi(struct its_device *dev, uint32_t eventid)
+{
+    int ret;
+
+    ret = its_send_cmd_event(dev->hw_its, GITS_CMD_DISCARD, dev->host_devid,
+                             eventid);
+    if ( !ret )
+        ret = gicv3_its_map_host_events(dev->hw_its, dev->host_devid, eventid,
+                                        dev->host_lpi_blocks[eventid / LPI_BLOCK] +
+                                        eventid % LPI_BLOCK, 1);
+    if ( ret && printk_ratelimit() )
+        printk(CRUXLOG_WARNING
+               "GICv4: cannot remap event 0x%x of device 0x%x: %d\n",
+               eventid, dev->host_devid, ret);
+
+    clear_bit(eventid, dev->vlpi_map);
+
+    return ret;
+}
+
+int gicv3_its_map_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid,
+                       const struct vcpu *v, uint32_t virt_lpi)
+{
+    const struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    struct its_device *dev;
+    int ret = -ENOENT;
+
+    if ( !vpe )
+        return ret;
+
+    spin_lock(&d->arch.vgic.its_devices_lock);
+
+    dev = get_vlpi_device(d, vdoorbell_address, vdevid, eventid);
+    if ( !dev || test_bit(eventid, dev->vlpi_map) )
+        goto out_unlock;
+
+    /* Mapping an event which is already mapped is UNPREDICTABLE. */
+    ret = its_send_cmd_event(dev->hw_its, GITS_CMD_DISCARD, dev->host_devid,
+                             eventid);
+    if ( !ret )
+        ret = its_send_cmd_vmapti(dev->hw_its, dev->host_devid, eventid,
+                                  vpe, virt_lpi);
+    if ( !ret )
+        ret = its_send_cmd_inv(dev->hw_its, dev->host_devid, eventid);
+    if ( !ret )
+        ret = its_send_cmd_vsync(dev->hw_its, vpe);
+    if ( !ret )
+        ret = gicv3_its_wait_commands(dev->hw_its);
+
+    if ( !ret )
+        set_bit(eventid, dev->vlpi_map);
+    else
+        unmap_vlpi(dev, eventid);
+
+out_unlock:
+    spin_unlock(&d->arch.vgic.its_devices_lock);
+
+    return ret;
+}
+
+int gicv3_its_unmap_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                         uint32_t vdevid, uint32_t eventid)
+{
+    struct its_device *dev;
+    int ret = -ENOENT;
+
+    spin_lock(&d->arch.vgic.its_devices_lock);
+
+    dev = get_vlpi_device(d, vdoorbell_address, vdevid, eventid);
+    if ( dev && test_bit(eventid, dev->vlpi_map) )
+        ret = unmap_vlpi(dev, eventid);
+
+    spin_unlock(&d->arch.vgic.its_devices_lock);
+
+    return ret;
+}
+
+int gicv3_its_move_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                        uint32_t vdevid, uint32_t eventid,
+                        const struct vcpu *v)
+{
+    const struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    struct its_device *dev;
+    int ret = -ENOENT;
+
+    spin_lock(&d->arch.vgic.its_devices_lock);
+
+    dev = get_vlpi_device(d, vdoorbell_address, vdevid, eventid);
+    if ( !dev || !test_bit(eventid, dev->vlpi_map) )
+        goto out_unlock;
+
+    /* A target vCPU without a vPE gets its LPIs emulated. */
+    if ( !vpe )
+    {
+        unmap_vlpi(dev, eventid);
+        goto out_unlock;
+    }
+
+    ret = its_send_cmd_vmovi(dev->hw_its, dev->host_devid, eventid, vpe);
+    if ( !ret )
+        ret = its_send_cmd_vsync(dev->hw_its, vpe);
+
+out_unlock:
+    spin_unlock(&d->arch.vgic.its_devices_lock);
+
+    return ret;
+}
+
+int gicv3_its_vlpi_cmd(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid, uint8_t cmd)
+{
+    struct its_device *dev;
+    int ret = -ENOENT;
+
+    ASSERT(cmd == GITS_CMD_INV || cmd == GITS_CMD_INT ||
+           cmd == GITS_CMD_CLEAR);
+
+    spin_lock(&d->arch.vgic.its_devices_lock);
+
+    dev = get_vlpi_device(d, vdoorbell_address, vdevid, eventid);
+    if ( dev && test_bit(eventid, dev->vlpi_map) )
+        ret = its_send_cmd_event(dev->hw_its, cmd, dev->host_devid, eventid);
+
+    spin_unlock(&d->arch.vgic.its_devices_lock);
+
+    return ret;
+}
+
 int gicv3_its_deny_access(struct domain *d)
 {
     int rc = 0;
@@ -1203,6 +1769,13 @@ int gicv3_its_init(void)
 
     gicv3_its_validate_quirks();
 
+    if ( vlpi_its && !list_is_singular(&host_its_list) )
+        vlpi_its = NULL;
+
+    if ( opt_gicv4 )
+        printk("GICv4: direct injection of virtual LPIs %s\n",
+               vlpi_its ? "enabled" : "not supported");
+
     return 0;
 }
 
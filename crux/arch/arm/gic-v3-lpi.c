@@ -8,9 +8,11 @@
  */
 
 #include <crux/cpu.h>
+#include <crux/delay.h>
 #include <crux/lib.h>
 #include <crux/mm.h>
 #include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/sched.h>
 #include <crux/sizes.h>
 #include <crux/warning.h>
@@ -33,16 +35,20 @@
  * approach relying on the architectural atomicity of native data types:
  * We read or write the "data" view of this union atomically, then can
  * access the broken-down fields in our local copy.
+ * GICv4 doorbells are host LPIs as well, they store the vCPU ID in place
+ * of the virtual LPI number.
  */
 union host_lpi {
     uint64_t data;
     struct {
         uint32_t virt_lpi;
         uint16_t dom_id;
-        uint16_t pad;
+        uint16_t flags;
     };
 };
 
+#define HOST_LPI_DOORBELL               (1U << 0)
+
 #define LPI_PROPTABLE_NEEDS_FLUSHING    (1U << 0)
 
 /* Global state */
@@ -74,6 +80,7 @@ struct lpi_redist_data {
     paddr_t             redist_addr;
     unsigned int        redist_id;
     void                *pending_table;
+    void __iomem        *vlpi_base;     /* GICv4 VLPI_base frame */
 };
 
 static DEFINE_PER_CPU(struct lpi_redist_data, lpi_redist);
@@ -148,6 +155,27 @@ void vgic_vcpu_inject_lpi(struct domain *d, unsigned int virq)
     vgic_inject_irq(d, d->vcpu[vcpu_id], virq, true);
 }
 
+/*
+ * A virtual LPI arrived for a vPE which is not resident. It sits in the
+ * vPE's pending table until the vCPU gets scheduled again, so just make
+ * sure that happens.
+ */
+static void vgic_vcpu_doorbell(struct domain *d, unsigned int vcpu_id)
+{
+    struct vcpu *v;
+
+    if ( vcpu_id >= d->max_vcpus )
+        return;
+
+    v = d->vcpu[vcpu_id];
+    if ( !v || !v->arch.vgic.its_vpe )
+        return;
+
+    perfc_incr(vlpi_doorbells);
+    ACCESS_ONCE(v->arch.vgic.its_vpe->vlpi_pending) = true;
+    vcpu_unblock(v);
+}
+
 /*
  * Handle incoming LPIs, which are a bit special, because they are potentially
  * numerous and also only get injected into guests. Treat them specially here,
@@ -177,6 +205,17 @@ void gicv3_do_LPI(unsigned int lpi)
 
     hlpi.data = read_u64_atomic(&hlpip->data);
 
+    if ( hlpi.flags & HOST_LPI_DOORBELL )
+    {
+        d = rcu_lock_domain_by_id(hlpi.dom_id);
+        if ( !d )
+            goto out;
+
+        vgic_vcpu_doorbell(d, hlpi.virt_lpi);
+        rcu_unlock_domain(d);
+        goto out;
+    }
+
     /*
      * Unmapped events are marked with an invalid LPI ID. We can safely
      * ignore them, as they have no further state and no-one can expect
@@ -199,6 +238,7 @@ void gicv3_do_LPI(unsigned int lpi)
      * See the thread around here for some background:
      * https://lists.crux.org/archives/html/crux-devel/2016-12/msg00003.html
      */
+    perfc_incr(lpis);
     vgic_vcpu_inject_lpi(d, hlpi.virt_lpi);
 
     rcu_unlock_domain(d);
@@ -220,10 +260,175 @@ void gicv3_lpi_update_host_entry(uint32_t host_lpi, int domain_id,
 
     hlpi.virt_lpi = virt_lpi;
     hlpi.dom_id = domain_id;
+    hlpi.flags = 0;
 
     write_u64_atomic(&hlpip->data, hlpi.data);
 }
 
+/* Turn an allocated host LPI into the doorbell of the given vCPU. */
+void gicv3_lpi_update_host_doorbell(uint32_t host_lpi, int domain_id,
+                                    unsigned int vcpu_id)
+{
+    union host_lpi *hlpip, hlpi;
+
+    ASSERT(host_lpi >= LPI_OFFSET);
+
+    host_lpi -= LPI_OFFSET;
+
+    hlpip = &lpi_data.host_lpis[host_lpi / HOST_LPIS_PER_PAGE][host_lpi % HOST_LPIS_PER_PAGE];
+
+    hlpi.virt_lpi = vcpu_id;
+    hlpi.dom_id = domain_id;
+    hlpi.flags = HOST_LPI_DOORBELL;
+
+    write_u64_atomic(&hlpip->data, hlpi.data);
+}
+
+/*
+ * Retarget the vPE of a vCPU which has just been scheduled on this pCPU.
+ * The VMOVP may wait for the ITS for a while, so this runs from the
+ * context switch with interrupts enabled, rather than from
+ * gicv3_its_vpe_load(). If it fails, the vPE stays non-resident and its
+ * vLPIs keep firing the doorbell until the next attempt.
+ */
+void gicv3_its_vpe_migrate(struct vcpu *v)
+{
+    struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    unsigned int cpu = smp_processor_id();
+
+    ASSERT(local_irq_is_enabled());
+
+    if ( !vpe || vpe->resident || vpe->cpu == cpu )
+        return;
+
+    gicv3_its_vpe_move(vpe, cpu);
+}
+
+/*
+ * Make the vPE of a vCPU resident on the local redistributor, so that the
+ * vLPIs targeting it get delivered without trapping. This happens lazily
+ * on the way back to the guest, with interrupts disabled.
+ */
+void gicv3_its_vpe_load(struct vcpu *v)
+{
+    struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    void __iomem *vlpi_base = this_cpu(lpi_redist).vlpi_base;
+    unsigned int cpu = smp_processor_id();
+    uint64_t val;
+
+    if ( !vpe || vpe->resident )
+        return;
+
+    ASSERT(vlpi_base);
+
+    /*
+     * The ITS must forward vLPIs (and doorbells) to this redistributor,
+     * which gicv3_its_vpe_migrate() should have arranged already.
+     */
+    if ( vpe->cpu != cpu )
+        return;
+
+    writeq_relaxed(v->domain->arch.vgic.its_vm->vpropbaser,
+                   vlpi_base + GICR_VPROPBASER);
+
+    val  = virt_to_maddr(vpe->vpt);
+    val |= gicv3_its_get_cacheability() << GICR_PENDBASER_INNER_CACHEABILITY_SHIFT;
+    val |= GIC_BASER_CACHE_SameAsInner << GICR_PENDBASER_OUTER_CACHEABILITY_SHIFT;
+    val |= gicv3_its_get_shareability() << GICR_PENDBASER_SHAREABILITY_SHIFT;
+    /*
+     * We can't tell whether the pending table is empty, a doorbell may
+     * have raced with us. So always have the redistributor scan it.
+     */
+    val |= GICR_VPENDBASER_PENDINGLAST;
+    if ( vpe->idai )
+        val |= GICR_VPENDBASER_IDAI;
+    val |= GICR_VPENDBASER_VALID;
+
+    writeq_relaxed(val, vlpi_base + GICR_VPENDBASER);
+
+    vpe->idai = false;
+    vpe->pending_last = false;
+    ACCESS_ONCE(vpe->vlpi_pending) = false;
+    vpe->resident = true;
+}
+
+/*
+ * Take a vPE off the local redistributor. From now on, any vLPI for it
+ * fires its doorbell instead.
+ */
+void gicv3_its_vpe_put(struct vcpu *v)
+{
+    struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    void __iomem *vlpi_base = this_cpu(lpi_redist).vlpi_base;
+    s_time_t deadline;
+    uint64_t val;
+
+    if ( !vpe || !vpe->resident )
+        return;
+
+    val = readq_relaxed(vlpi_base + GICR_VPENDBASER);
+    val &= ~(GICR_VPENDBASER_VALID | GICR_VPENDBASER_IDAI |
+             GICR_VPENDBASER_PENDINGLAST);
+    writeq_relaxed(val, vlpi_base + GICR_VPENDBASER);
+
+    /* Wait for the redistributor to write back the pending state. */
+    deadline = NOW() + MILLISECS(1);
+    do {
+        val = readq_relaxed(vlpi_base + GICR_VPENDBASER);
+        if ( !(val & GICR_VPENDBASER_DIRTY) )
+            break;
+
+        cpu_relax();
+        udelay(1);
+    } while ( NOW() <= deadline );
+
+    if ( (val & GICR_VPENDBASER_DIRTY) && printk_ratelimit() )
+        printk(CRUXLOG_WARNING "%pv: vPE still dirty after descheduling\n", v);
+
+    vpe->resident = false;
+
+    /* A still dirty table can't be trusted, so don't trust PendingLast. */
+    vpe->pending_last = val & (GICR_VPENDBASER_PENDINGLAST |
+                               GICR_VPENDBASER_DIRTY);
+}
+
+/*
+ * Whether a descheduled vPE has virtual LPIs waiting for it. A resident
+ * vPE gets them delivered by the redistributor. A doorbell means a vLPI
+ * is pending for sure. PendingLast, as read when descheduling, may be set
+ * conservatively though: confirm it against the pending table, but only
+ * once per descheduling, as this is on the block and wakeup paths.
+ */
+bool gicv3_its_vpe_pending(const struct vcpu *v)
+{
+    struct its_vpe *vpe = v->arch.vgic.its_vpe;
+    unsigned long nr_bits;
+
+    if ( !vpe || vpe->resident )
+        return false;
+
+    if ( ACCESS_ONCE(vpe->vlpi_pending) )
+        return true;
+
+    if ( !vpe->pending_last )
+        return false;
+
+    /* Only current looks at this, see vgic_vcpu_pending_irq(). */
+    vpe->pending_last = false;
+
+    nr_bits = (PAGE_SIZE << vpe->vpt_order) * 8;
+    invalidate_dcache_va_range(vpe->vpt, PAGE_SIZE << vpe->vpt_order);
+
+    /* The first 1KB of the table (below LPI_OFFSET) is IMP DEF. */
+    if ( find_next_bit((const unsigned long *)vpe->vpt, nr_bits,
+                       LPI_OFFSET) >= nr_bits )
+        return false;
+
+    ACCESS_ONCE(vpe->vlpi_pending) = true;
+
+    return true;
+}
+
 static int gicv3_lpi_allocate_pendtable(unsigned int cpu)
 {
     void *pendtable;
@@ -379,6 +584,20 @@ int gicv3_lpi_init_rdist(void __iomem * rdist_base)
     if ( ret )
         return ret;
 
+    if ( gicv3_its_has_vlpis() )
+    {
+        if ( readl_relaxed(rdist_base + GICR_TYPER) & GICR_TYPER_VLPIS )
+        {
+            void __iomem *vlpi_base = rdist_base + GICR_VLPI_OFFSET;
+
+            /* Don't inherit a resident vPE from the firmware. */
+            writeq_relaxed(0, vlpi_base + GICR_VPENDBASER);
+            this_cpu(lpi_redist).vlpi_base = vlpi_base;
+        }
+        else
+            gicv3_its_disable_vlpis();
+    }
+
     return gicv3_lpi_set_proptable(rdist_base);
 }
 
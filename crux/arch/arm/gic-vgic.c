@@ -14,6 +14,7 @@
 #include <crux/sched.h>
 #include <asm/domain.h>
 #include <asm/gic.h>
+#include <asm/gic_v3_its.h>
 #include <asm/vgic.h>
 
 #define lr_all_full()                                           \
@@ -276,6 +277,8 @@ static void gic_restore_pending_irqs(struct vcpu *v)
 
     spin_lock(&v->arch.vgic.lock);
 
+    vgic_fold_deferred_irqs(v);
+
     if ( list_empty(&v->arch.vgic.lr_pending) )
         goto out;
 
@@ -354,11 +357,17 @@ int vgic_vcpu_pending_irq(struct vcpu *v)
     /* We rely on reading the VMCR, which is only accessible locally. */
     ASSERT(v == current);
 
+    /* Directly injected LPIs are tracked by the GIC itself. */
+    if ( gicv3_its_vpe_pending(v) )
+        return 1;
+
     mask_priority = gic_hw_ops->read_vmcr_priority();
     active_priority = find_first_bit(&apr, 32);
 
     spin_lock_irqsave(&v->arch.vgic.lock, flags);
 
+    vgic_fold_deferred_irqs(v);
+
     /* TODO: We order the guest irqs by priority, but we don't change
      * the priority of host irqs. */
 
@@ -386,6 +395,7 @@ void vgic_sync_to_lrs(void)
 {
     ASSERT(!local_irq_is_enabled());
 
+    gicv3_its_vpe_load(current);
     gic_restore_pending_irqs(current);
 
     if ( !list_empty(&current->arch.vgic.lr_pending) && lr_all_full() )
@@ -44,6 +44,8 @@ static inline bool is_sve_domain(const struct domain *d)
 
 unsigned int get_sys_vl_len(void);
 
+s_time_t sve_bench_switch(unsigned int loops);
+
 #else /* !CONFIG_ARM64_SVE */
 
 #define opt_dom0_sve     0
@@ -58,6 +60,11 @@ static inline unsigned int get_sys_vl_len(void)
     return 0;
 }
 
+static inline s_time_t sve_bench_switch(unsigned int loops)
+{
+    return 0;
+}
+
 #endif /* CONFIG_ARM64_SVE */
 
 #endif /* _ARM_ARM64_SVE_H */
@@ -26,6 +26,14 @@ struct vfp_state
     register_t fpcr;
     register_t fpexc32_el2;
     register_t fpsr;
+
+    /*
+     * Lazy switching (see vfp.c): whether the registers hold the live state
+     * of the vCPU, which must hence be saved when descheduling it, and the
+     * pCPU where they were last loaded from or saved to memory.
+     */
+    bool loaded;
+    unsigned int last_cpu;
 };
 
 #endif /* _ARM_ARM64_VFP_H */
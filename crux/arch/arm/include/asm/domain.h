@@ -121,6 +121,9 @@ struct arch_domain
     void *tee;
 #endif
 
+    /* CRUX_DOMCTL_CONFIG_WFI_*, never _DEFAULT. */
+    uint8_t wfi_policy;
+
 }  __cacheline_aligned;
 
 struct arch_vcpu
@@ -243,6 +246,19 @@ struct arch_vcpu
      */
     bool need_flush_to_ram;
 
+    /* Copies of the last MMIO handlers used, most recent first. */
+    struct mmio_handler mmio_cache[MMIO_HANDLER_CACHE_SIZE];
+
+    struct {
+        /* Spinning in vcpu_wfi_poll(), so vcpu_kick() needn't send an SGI. */
+        bool polling;
+        /* When the first interrupt since the vCPU started waiting arrived. */
+        s_time_t kicked;
+        /* Wake-ups, and their latency from interrupt to guest entry. */
+        unsigned long polled, blocked;
+        s_time_t latency_sum, latency_max;
+    } wfi;
+
 }  __cacheline_aligned;
 
 void vcpu_show_registers(struct vcpu *v);
@@ -91,6 +91,11 @@
 #define GICR_SYNCR                   (0x00C0)
 #define GICR_PIDR2                   GICD_PIDR2
 
+/* GICv4 VLPI_base frame, following RD_base and SGI_base */
+#define GICR_VLPI_OFFSET             (2 * SZ_64K)
+#define GICR_VPROPBASER              (0x0070)
+#define GICR_VPENDBASER              (0x0078)
+
 /* GICR for SGI's & PPI's */
 
 #define GICR_IGROUPR0                (0x0080)
@@ -158,6 +163,13 @@
         (BIT(63, ULL) | GENMASK_ULL(61, 59) | GENMASK_ULL(55, 52) |  \
          GENMASK_ULL(15, 12) | GENMASK_ULL(6, 0))
 
+#define GICR_VPROPBASER_IDBITS_MASK                     0x1fULL
+
+#define GICR_VPENDBASER_VALID                           BIT(63, ULL)
+#define GICR_VPENDBASER_IDAI                            BIT(62, ULL)
+#define GICR_VPENDBASER_PENDINGLAST                     BIT(61, ULL)
+#define GICR_VPENDBASER_DIRTY                           BIT(60, ULL)
+
 #define DEFAULT_PMR_VALUE            0xff
 
 #define LPI_PROP_PRIO_MASK           0xfc
@@ -59,6 +59,7 @@
 #define GITS_TYPER_ITT_SIZE(r)          ((((r) & GITS_TYPER_ITT_SIZE_MASK) >> \
                                                  GITS_TYPER_ITT_SIZE_SHIFT) + 1)
 #define GITS_TYPER_PHYSICAL             (1U << 0)
+#define GITS_TYPER_VIRTUAL              (1U << 1)
 
 #define GITS_BASER_INDIRECT             BIT(62, UL)
 #define GITS_BASER_INNER_CACHEABILITY_SHIFT        59
@@ -100,6 +101,12 @@
 #define GITS_CMD_INVALL                 0x0d
 #define GITS_CMD_MOVALL                 0x0e
 #define GITS_CMD_DISCARD                0x0f
+#define GITS_CMD_VMOVI                  0x21
+#define GITS_CMD_VMOVP                  0x22
+#define GITS_CMD_VSYNC                  0x25
+#define GITS_CMD_VMAPP                  0x29
+#define GITS_CMD_VMAPTI                 0x2a
+#define GITS_CMD_VINVALL                0x2d
 
 #define ITS_DOORBELL_OFFSET             0x10040
 #define GICV3_ITS_SIZE                  SZ_128K
@@ -131,6 +138,32 @@ struct host_its {
     unsigned int flags;
 };
 
+/*
+ * GICv4 direct injection state of a domain: the property table shared by
+ * all its vPEs, mirroring the guest's own table, and the host LPIs used as
+ * doorbells for its vCPUs.
+ */
+struct its_vm {
+    uint8_t *proptable;
+    unsigned int prop_order;
+    uint64_t vpropbaser;
+    unsigned int nr_doorbell_blocks;
+    uint32_t *doorbell_blocks;
+};
+
+/* A vCPU as seen by the ITS and the redistributors (a "vPE"). */
+struct its_vpe {
+    uint16_t vpe_id;
+    uint32_t doorbell;                  /* Host LPI fired while descheduled */
+    void *vpt;                          /* Virtual LPI pending table */
+    unsigned int vpt_order;
+    unsigned int cpu;                   /* Redistributor targeted by VMAPP */
+    bool resident;
+    bool idai;
+    bool pending_last;                  /* PendingLast when descheduled */
+    bool vlpi_pending;                  /* Known to have vLPIs pending */
+};
+
 
 #ifdef CONFIG_HAS_ITS
 
@@ -199,6 +232,46 @@ struct pending_irq *gicv3_assign_guest_event(struct domain *d,
                                              uint32_t virt_lpi);
 void gicv3_lpi_update_host_entry(uint32_t host_lpi, int domain_id,
                                  uint32_t virt_lpi);
+void gicv3_lpi_update_host_doorbell(uint32_t host_lpi, int domain_id,
+                                    unsigned int vcpu_id);
+
+/*
+ * GICv4 direct injection of virtual LPIs. Only available if enabled on the
+ * command line and supported by the ITS and all redistributors.
+ */
+bool gicv3_its_has_vlpis(void);
+void gicv3_its_disable_vlpis(void);
+int gicv3_its_vm_init(struct domain *d);
+void gicv3_its_vm_destroy(struct domain *d);
+int gicv3_its_vpe_init(struct vcpu *v);
+void gicv3_its_vpe_destroy(struct vcpu *v);
+int gicv3_its_vpe_move(struct its_vpe *vpe, unsigned int cpu);
+int gicv3_its_vpe_invall(const struct vcpu *v);
+void gicv3_its_vm_set_property(struct domain *d, uint32_t vlpi,
+                               uint8_t property);
+
+/* Make a vPE resident on (or remove it from) the local redistributor. */
+void gicv3_its_vpe_migrate(struct vcpu *v);
+void gicv3_its_vpe_load(struct vcpu *v);
+void gicv3_its_vpe_put(struct vcpu *v);
+bool gicv3_its_vpe_pending(const struct vcpu *v);
+
+/*
+ * Route a guest event straight to its vCPU, bypassing the host LPI. Those
+ * return -ENOENT if the event is not (or cannot be) directly injected, in
+ * which case the caller falls back to emulating it.
+ */
+int gicv3_its_map_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid,
+                       const struct vcpu *v, uint32_t virt_lpi);
+int gicv3_its_unmap_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                         uint32_t vdevid, uint32_t eventid);
+int gicv3_its_move_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                        uint32_t vdevid, uint32_t eventid,
+                        const struct vcpu *v);
+/* Forward an INV, INT or CLEAR command for a directly injected event. */
+int gicv3_its_vlpi_cmd(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid, uint8_t cmd);
 
 /* ITS quirks handling. */
 uint64_t gicv3_its_get_cacheability(void);
@@ -256,6 +329,32 @@ static inline void gicv3_set_redist_address(paddr_t address,
 {
 }
 
+static inline void gicv3_its_vpe_migrate(struct vcpu *v)
+{
+}
+
+static inline void gicv3_its_vpe_load(struct vcpu *v)
+{
+}
+
+static inline void gicv3_its_vpe_put(struct vcpu *v)
+{
+}
+
+static inline bool gicv3_its_vpe_pending(const struct vcpu *v)
+{
+    return false;
+}
+
+static inline int gicv3_its_vpe_init(struct vcpu *v)
+{
+    return 0;
+}
+
+static inline void gicv3_its_vpe_destroy(struct vcpu *v)
+{
+}
+
 static inline int gicv3_its_setup_collection(unsigned int cpu)
 {
     /* We should never get here without an ITS. */
@@ -74,6 +74,9 @@ struct mmio_handler {
     void *priv;
 };
 
+/* Number of MMIO handlers each vCPU remembers, see find_mmio_handler(). */
+#define MMIO_HANDLER_CACHE_SIZE 2
+
 struct vmmio {
     unsigned int num_entries;
     unsigned int max_num_entries;
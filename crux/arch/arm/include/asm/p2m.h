@@ -75,6 +75,19 @@ struct p2m_domain {
      */
     bool need_flush;
 
+    /*
+     * IOMMU TLB invalidations for removed mappings are deferred until the
+     * end of p2m_set_entry() (or an earlier p2m_tlb_flush_sync()),
+     * accumulating the range of GFNs to flush. rc holds an error from an
+     * early flush for p2m_set_entry() to return.
+     */
+    struct {
+        gfn_t start;
+        gfn_t end;
+        unsigned int flags;
+        int rc;
+    } iommu_flush;
+
     /* Gather some statistics for information purposes only */
     struct {
         /* Number of mappings at each p2m tree level */
@@ -82,8 +95,23 @@ struct p2m_domain {
         /* Number of times we have shattered a mapping
          * at each p2m tree level. */
         unsigned long shattered[4];
+        /* Number of times we have rebuilt a mapping
+         * at each p2m tree level. */
+        unsigned long coalesced[4];
     } stats;
 
+    /* Where the superpage coalescing scanner resumes from. */
+    gfn_t coalesce_gfn;
+
+    /*
+     * A superpage was shattered since the current coalescing pass started,
+     * so another pass is needed.
+     */
+    bool coalesce_pending;
+
+    /* A coalescing pass over the P2M is in progress. */
+    bool coalesce_scanning;
+
     /*
      * If true, and an access fault comes in and there is no vm_event listener,
      * pause domain. Otherwise, remove access restrictions.
@@ -106,6 +134,26 @@ struct p2m_domain {
      */
     struct radix_tree_root mem_access_settings;
 
+    /*
+     * Log-dirty tracking.  While enabled, guest RAM is mapped as
+     * p2m_ram_logdirty (read-only) and the first write to a page records
+     * its GFN in the bitmap before the page is made writable again.
+     * Protected by the p2m lock.
+     */
+    struct {
+        /* Whether newly dirtied pages get recorded */
+        bool enabled;
+        /* One bit per GFN below nr_gfns. Allocated as long as in use. */
+        unsigned long *bitmap;
+        unsigned long nr_gfns;
+        /* CRUX_DOMCTL_SHADOW_OP_* which got preempted, and where */
+        unsigned int preempt_op;
+        gfn_t preempt_gfn;
+        /* Statistics since the last CRUX_DOMCTL_SHADOW_OP_CLEAN */
+        uint32_t fault_count;
+        uint32_t dirty_count;
+    } log_dirty;
+
     /* back pointer to domain */
     struct domain *domain;
 
@@ -131,6 +179,7 @@ typedef enum {
     p2m_map_foreign_ro, /* Read-only RAM pages from foreign domain */
     p2m_grant_map_rw,   /* Read/write grant mapping */
     p2m_grant_map_ro,   /* Read-only grant mapping */
+    p2m_ram_logdirty,   /* Read-only; writes are logged, then allowed */
     /* The types below are only used to decide the page attribute in the P2M */
     p2m_iommu_map_rw,   /* Read/write iommu mapping */
     p2m_iommu_map_ro,   /* Read-only iommu mapping */
@@ -142,7 +191,16 @@ typedef enum {
 
 /* RAM types, which map to real machine frames */
 #define P2M_RAM_TYPES (p2m_to_mask(p2m_ram_rw) |        \
-                       p2m_to_mask(p2m_ram_ro))
+                       p2m_to_mask(p2m_ram_ro) |        \
+                       p2m_to_mask(p2m_ram_logdirty))
+
+/*
+ * RAM types the guest can write to. p2m_ram_logdirty is only write-protected
+ * so that the guest's first write gets logged: crux writing to such a page,
+ * or letting something else do so, must record it with p2m_log_dirty_mark().
+ */
+#define P2M_RAM_WRITABLE_TYPES (p2m_to_mask(p2m_ram_rw) |       \
+                                p2m_to_mask(p2m_ram_logdirty))
 
 /* Grant mapping types, which map to a real frame in another VM */
 #define P2M_GRANT_TYPES (p2m_to_mask(p2m_grant_map_rw) |  \
@@ -154,6 +212,7 @@ typedef enum {
 
 /* Useful predicates */
 #define p2m_is_ram(_t) (p2m_to_mask(_t) & P2M_RAM_TYPES)
+#define p2m_is_ram_writable(_t) (p2m_to_mask(_t) & P2M_RAM_WRITABLE_TYPES)
 #define p2m_is_foreign(_t) (p2m_to_mask(_t) & P2M_FOREIGN_TYPES)
 #define p2m_is_any_ram(_t) (p2m_to_mask(_t) &                   \
                             (P2M_RAM_TYPES | P2M_GRANT_TYPES |  \
@@ -288,6 +347,19 @@ int p2m_set_entry(struct p2m_domain *p2m,
 
 bool p2m_resolve_translation_fault(struct domain *d, gfn_t gfn);
 
+/*
+ * Log-dirty support.
+ *
+ * p2m_log_dirty_fault() resolves a stage-2 write permission fault caused by
+ * log-dirty, returning false if the fault wasn't for a log-dirty page.
+ * p2m_log_dirty_mark() records writes done by crux (or a device, or another
+ * partition) on behalf of the guest, to nr pages from gfn.
+ */
+struct crux_domctl_shadow_op;
+int p2m_shadow_op(struct domain *d, struct crux_domctl_shadow_op *sc);
+bool p2m_log_dirty_fault(struct domain *d, gfn_t gfn);
+void p2m_log_dirty_mark(struct domain *d, gfn_t gfn, unsigned long nr);
+
 void p2m_domain_creation_finished(struct domain *d);
 
 /*
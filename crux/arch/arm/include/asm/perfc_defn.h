@@ -19,6 +19,7 @@ PERFCOUNTER(trap_hvc32,    "trap: 32-bit hvc")
 PERFCOUNTER(trap_smc64,    "trap: 64-bit smc")
 PERFCOUNTER(trap_hvc64,    "trap: 64-bit hvc")
 PERFCOUNTER(trap_sysreg,   "trap: sysreg access")
+PERFCOUNTER(trap_fp,       "trap: lazy fp/simd/sve access")
 #endif
 PERFCOUNTER(trap_iabt,     "trap: guest instr abort")
 PERFCOUNTER(trap_dabt,     "trap: guest data abort")
@@ -35,6 +36,9 @@ PERFCOUNTER(vpsci_cpu_affinity_info,   "vpsci: cpu_affinity_info")
 PERFCOUNTER(vpsci_features,            "vpsci: features")
 
 PERFCOUNTER(vcpu_kick,                 "vcpu: notify other vcpu")
+PERFCOUNTER(vcpu_kick_polling,         "vcpu: notify polling vcpu")
+PERFCOUNTER(wfi_poll_hit,              "wfi: interrupt while polling")
+PERFCOUNTER(wfi_poll_miss,             "wfi: blocked after polling")
 
 PERFCOUNTER(vgicd_reads,                "vgicd: read")
 PERFCOUNTER(vgicd_writes,               "vgicd: write")
@@ -48,10 +52,20 @@ PERFCOUNTER(vgic_sgi_list  ,            "vgic: SGI send to list")
 PERFCOUNTER(vgic_sgi_others,            "vgic: SGI send to others")
 PERFCOUNTER(vgic_sgi_self,              "vgic: SGI send to self")
 PERFCOUNTER(vgic_irq_migrates,          "vgic: irq migration")
+PERFCOUNTER(vgic_inject_deferred,       "vgic: deferred injection")
+PERFCOUNTER(vgic_inject_coalesced,      "vgic: deferred injection coalesced")
+PERFCOUNTER(vgic_deferred_folds,        "vgic: deferred irqs folded")
+
+PERFCOUNTER(mmio_cache_hit,  "mmio: handler cache hit")
+PERFCOUNTER(mmio_cache_miss, "mmio: handler cache miss")
 
 PERFCOUNTER(vuart_reads,  "vuart: read")
 PERFCOUNTER(vuart_writes, "vuart: write")
 
+PERFCOUNTER(vpl011_dr_writes, "vpl011: trapped UARTDR write")
+PERFCOUNTER(vpl011_pv_kicks,  "vpl011: PV console kick")
+PERFCOUNTER(vpl011_pv_bytes,  "vpl011: PV console byte")
+
 PERFCOUNTER(vtimer_cp32_reads,   "vtimer: cp32 read")
 PERFCOUNTER(vtimer_cp32_writes,  "vtimer: cp32 write")
 
@@ -68,6 +82,9 @@ PERFCOUNTER(vtimer_virt_inject,   "vtimer: virt expired, injected")
 PERFCOUNTER(ppis,                 "#PPIs")
 PERFCOUNTER(spis,                 "#SPIs")
 PERFCOUNTER(guest_irqs,           "#GUEST-IRQS")
+PERFCOUNTER(lpis,                 "#LPIs")
+PERFCOUNTER(vlpi_doorbells,       "#vLPI doorbells")
+PERFCOUNTER(vpe_moves,            "vPE moves")
 
 PERFCOUNTER(hyp_timer_irqs,   "Hypervisor timer interrupts")
 PERFCOUNTER(virt_timer_irqs,  "Virtual timer interrupts")
@@ -76,6 +93,15 @@ PERFCOUNTER(maintenance_irqs, "Maintenance interrupts")
 PERFCOUNTER(atomics_guest,    "atomics: guest access")
 PERFCOUNTER(atomics_guest_paused,   "atomics: guest paused")
 
+PERFCOUNTER(p2m_superpage_split,    "p2m: superpage shattered")
+PERFCOUNTER(p2m_superpage_coalesce, "p2m: superpage rebuilt")
+
+#ifdef CONFIG_ARM_64
+PERFCOUNTER(vfp_lazy_load,          "vfp: lazy load")
+PERFCOUNTER(vfp_lazy_load_skipped,  "vfp: lazy load, state still live")
+PERFCOUNTER(vfp_lazy_save_skipped,  "vfp: save skipped, state unused")
+#endif
+
 /*#endif*/ /* __CRUX_PERFC_DEFN_H__ */
 
 /*
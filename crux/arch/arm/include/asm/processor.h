@@ -582,9 +582,11 @@ void show_stack(const struct cpu_user_regs *regs);
 
 #define cpu_relax() barrier() /* Could yield? */
 
-/* All a bit UP for the moment */
-#define cpu_to_core(_cpu)   (0)
-#define cpu_to_socket(_cpu) (0)
+/* Topology, as described by the device tree's cpu-map (see smpboot.c). */
+extern unsigned int cpu_core_id[], cpu_cluster_id[], cpu_socket_id[];
+#define cpu_to_core(_cpu)    (cpu_core_id[_cpu])
+#define cpu_to_cluster(_cpu) (cpu_cluster_id[_cpu])
+#define cpu_to_socket(_cpu)  (cpu_socket_id[_cpu])
 
 struct vcpu;
 void vcpu_regs_hyp_to_user(const struct vcpu *vcpu,
@@ -598,6 +600,8 @@ void do_trap_guest_serror(struct cpu_user_regs *regs);
 
 register_t get_default_hcr_flags(void);
 
+unsigned int wfi_default_policy(void);
+
 register_t get_default_cptr_flags(void);
 
 /*
@@ -14,6 +14,14 @@ struct vcpu;
 void vfp_save_state(struct vcpu *v);
 void vfp_restore_state(struct vcpu *v);
 
+#ifdef CONFIG_ARM_64
+void vfp_vcpu_init(struct vcpu *v);
+bool vfp_lazy_trap(bool sve);
+#else
+static inline void vfp_vcpu_init(struct vcpu *v) {}
+static inline bool vfp_lazy_trap(bool sve) { return false; }
+#endif
+
 #endif /* _ASM_VFP_H */
 /*
  * Local variables:
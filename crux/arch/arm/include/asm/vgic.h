@@ -172,6 +172,7 @@ struct vgic_dist {
     struct radix_tree_root pend_lpi_tree; /* Stores struct pending_irq's */
     rwlock_t pend_lpi_tree_lock;        /* Protects the pend_lpi_tree */
     struct list_head vits_list;         /* List of virtual ITSes */
+    struct its_vm *its_vm;              /* GICv4 direct injection state */
     unsigned int intid_bits;
     /*
      * TODO: if there are more bool's being added below, consider
@@ -207,12 +208,23 @@ struct vgic_cpu {
     struct list_head lr_pending;
     spinlock_t lock;
 
+    /*
+     * Non-LPI IRQs injected from another pCPU without taking the lock
+     * above: one bit per IRQ, plus one summary bit per non-zero word.
+     * They are folded into inflight_irqs by vgic_fold_deferred_irqs().
+     */
+    unsigned long *deferred_irqs;
+    unsigned long deferred_summary;
+
     /* GICv3: redistributor base and flags for this vCPU */
     paddr_t rdist_base;
     uint64_t rdist_pendbase;
 #define VGIC_V3_RDIST_LAST      (1 << 0)        /* last vCPU of the rdist */
 #define VGIC_V3_LPIS_ENABLED    (1 << 1)
     uint8_t flags;
+
+    /* GICv4: vPE backing this vCPU, if LPIs are injected directly */
+    struct its_vpe *its_vpe;
 };
 
 struct sgi_target {
@@ -229,6 +241,8 @@ static inline void sgi_target_init(struct sgi_target *sgi_target)
 struct vgic_ops {
     /* Initialize vGIC */
     int (*vcpu_init)(struct vcpu *v);
+    /* Release resources that were allocated by vcpu_init (optional) */
+    void (*vcpu_free)(struct vcpu *v);
     /* domain specific initialization of vGIC */
     int (*domain_init)(struct domain *d);
     /* Release resources that were allocated by domain_init */
@@ -295,6 +309,7 @@ static inline paddr_t vgic_dist_base(const struct vgic_dist *vgic)
 extern struct vcpu *vgic_get_target_vcpu(struct vcpu *v, unsigned int virq);
 extern void vgic_remove_irq_from_queues(struct vcpu *v, struct pending_irq *p);
 extern void gic_remove_from_lr_pending(struct vcpu *v, struct pending_irq *p);
+extern void vgic_fold_deferred_irqs(struct vcpu *v);
 extern void vgic_init_pending_irq(struct pending_irq *p, unsigned int virq);
 extern struct pending_irq *irq_to_pending(struct vcpu *v, unsigned int irq);
 extern struct pending_irq *spi_to_pending(struct domain *d, unsigned int irq);
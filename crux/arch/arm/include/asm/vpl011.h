@@ -47,6 +47,13 @@ struct vpl011 {
         } dom;
         struct vpl011_crux_backend *crux;
     } backend;
+    /* Optional PV console ring, only when the backend is in crux. */
+    struct {
+        struct cruxcons_interface *intf;
+        struct page_info *page;
+        evtchn_port_t evtchn;   /* crux end of the loopback channel */
+        bool connected;         /* guest has kicked at least once */
+    } pv;
     uint32_t    uartfr;         /* Flag register */
     uint32_t    uartcr;         /* Control register */
     uint32_t    uartimsc;       /* Interrupt mask register*/
@@ -69,6 +76,7 @@ struct vpl011_init_info {
 int domain_vpl011_init(struct domain *d,
                        struct vpl011_init_info *info);
 void domain_vpl011_deinit(struct domain *d);
+int domain_vpl011_init_pv(struct domain *d);
 int vpl011_rx_char_crux(struct domain *d, char c);
 #else
 static inline int domain_vpl011_init(struct domain *d,
@@ -78,6 +86,11 @@ static inline int domain_vpl011_init(struct domain *d,
 }
 
 static inline void domain_vpl011_deinit(struct domain *d) { }
+
+static inline int domain_vpl011_init_pv(struct domain *d)
+{
+    return -ENOSYS;
+}
 #endif
 #endif  /* _VPL011_H_ */
 
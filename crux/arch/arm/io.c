@@ -10,6 +10,7 @@
 #include <crux/bsearch.h>
 #include <crux/ioreq.h>
 #include <crux/lib.h>
+#include <crux/perfc.h>
 #include <crux/spinlock.h>
 #include <crux/sched.h>
 #include <crux/sort.h>
@@ -107,16 +108,49 @@ static void swap_mmio_handler(void *_a, void *_b)
     SWAP(*a, *b);
 }
 
-static const struct mmio_handler *find_mmio_handler(struct domain *d,
+/*
+ * Guests tend to hammer the same couple of regions (typically the vGIC
+ * distributor and one device), so each vCPU keeps copies of the handlers
+ * it used last and only searches the domain's array, under its lock, on a
+ * miss.  Handlers are never unregistered, and registering more doesn't
+ * change existing ones, so a copy stays valid for the life of the domain
+ * even though register_mmio_handler() moves the array entries around.
+ */
+static const struct mmio_handler *find_mmio_handler(struct vcpu *v,
                                                     paddr_t gpa)
 {
-    struct vmmio *vmmio = &d->arch.vmmio;
+    struct vmmio *vmmio = &v->domain->arch.vmmio;
+    struct mmio_handler *cache = v->arch.mmio_cache;
     struct mmio_handler key = {.addr = gpa};
     const struct mmio_handler *handler;
+    unsigned int i;
+
+    ASSERT(v == current);
+
+    for ( i = 0; i < MMIO_HANDLER_CACHE_SIZE; i++ )
+    {
+        /* Unused entries have a zero size and never match. */
+        if ( gpa - cache[i].addr < cache[i].size )
+        {
+            perfc_incr(mmio_cache_hit);
+            if ( i )
+                SWAP(cache[0], cache[i]);
+            return &cache[0];
+        }
+    }
+
+    perfc_incr(mmio_cache_miss);
 
     read_lock(&vmmio->lock);
     handler = bsearch(&key, vmmio->handlers, vmmio->num_entries,
                       sizeof(*handler), cmp_mmio_handler);
+    if ( handler )
+    {
+        for ( i = MMIO_HANDLER_CACHE_SIZE - 1; i; i-- )
+            cache[i] = cache[i - 1];
+        cache[0] = *handler;
+        handler = &cache[0];
+    }
     read_unlock(&vmmio->lock);
 
     return handler;
@@ -198,7 +232,7 @@ enum io_state try_handle_mmio(struct cpu_user_regs *regs,
         return IO_ABORT;
     }
 
-    handler = find_mmio_handler(v->domain, info->gpa);
+    handler = find_mmio_handler(v, info->gpa);
     if ( !handler )
     {
         bool trap_unmapped = v->domain->options &
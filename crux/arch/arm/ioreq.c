@@ -97,6 +97,11 @@ enum io_state try_fwd_ioserv(struct cpu_user_regs *regs,
      * So restrict the value it can access.
      */
     p.data = p.dir ? 0 : get_user_reg(regs, info->dabt.reg) & access_mask;
+
+    /* Doorbell writes don't need to wait for the Device Model. */
+    if ( !p.dir && ioreq_send_doorbell(s, &p) == IO_HANDLED )
+        return IO_HANDLED;
+
     vio->req = p;
     vio->suspended = false;
     vio->info.dabt_instr = instr;
@@ -15,6 +15,7 @@
 #include <crux/init.h>
 #include <crux/errno.h>
 #include <crux/sched.h>
+#include <crux/stats.h>
 
 #include <asm/gic.h>
 #include <asm/vgic.h>
@@ -219,6 +220,7 @@ void do_IRQ(struct cpu_user_regs *regs, unsigned int irq, int is_fiq)
     const struct cpu_user_regs *old_regs = set_irq_regs(regs);
 
     perfc_incr(irqs);
+    stats_event(CRUX_HYPFS_STATS_EV_IRQ);
 
     /* Statically assigned SGIs do not come down this path */
     ASSERT(irq >= GIC_SGI_STATIC_MAX);
@@ -170,6 +170,8 @@ static void __init kernel_zimage_load(struct kernel_info *info)
 
 /* uImage Compression Types */
 #define IH_COMP_GZIP            1
+#define IH_COMP_LZ4             5
+#define IH_COMP_ZSTD            6
 
 /*
  * Check if the image is a uImage and setup kernel_info
@@ -209,8 +211,9 @@ int __init kernel_uimage_probe(struct kernel_info *info,
     if ( len > size - sizeof(uimage) )
         return -EINVAL;
 
-    /* Only gzip compression is supported. */
-    if ( uimage.comp && uimage.comp != IH_COMP_GZIP )
+    /* Only gzip, lz4 and zstd compression are supported. */
+    if ( uimage.comp && uimage.comp != IH_COMP_GZIP &&
+         uimage.comp != IH_COMP_LZ4 && uimage.comp != IH_COMP_ZSTD )
     {
         printk(CRUXLOG_ERR
                "Unsupported uImage compression type %"PRIu8"\n", uimage.comp);
@@ -251,9 +254,9 @@ int __init kernel_uimage_probe(struct kernel_info *info,
         int rc;
 
         /*
-         * In case of a compressed uImage, the gzip header is right after
-         * the u-boot header, so pass sizeof(uimage) as an offset to gzip
-         * header.
+         * In case of a compressed uImage, the compression header is right
+         * after the u-boot header, so pass sizeof(uimage) as an offset to
+         * it.
          */
         rc = kernel_decompress(mod, sizeof(uimage));
         if ( rc )
@@ -201,7 +201,7 @@ p2m_mem_access_check_and_get_page(vaddr_t gva, unsigned long flag,
     /*
      * Base type doesn't allow r/w
      */
-    if ( t != p2m_ram_rw )
+    if ( !p2m_is_ram_writable(t) )
         goto err;
 
     page = mfn_to_page(mfn);
@@ -212,6 +212,10 @@ p2m_mem_access_check_and_get_page(vaddr_t gva, unsigned long flag,
 err:
     p2m_read_unlock(p2m);
 
+    /* Crux writes through its own mapping, only record the page. */
+    if ( page && (flag & GV2M_WRITE) && t == p2m_ram_logdirty )
+        p2m_log_dirty_mark(v->domain, gaddr_to_gfn(ipa), 1);
+
     return page;
 }
 
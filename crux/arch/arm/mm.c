@@ -179,7 +179,16 @@ int cruxmem_add_to_physmap_one(
         }
 
         if ( p2m_is_ram(p2mt) )
-            t = (p2mt == p2m_ram_rw) ? p2m_map_foreign_rw : p2m_map_foreign_ro;
+        {
+            /*
+             * Writes through a foreign mapping are not trapped, so consider
+             * a log-dirty page dirty as soon as it is mapped writable.
+             */
+            if ( p2mt == p2m_ram_logdirty )
+                p2m_log_dirty_mark(od, _gfn(idx), 1);
+            t = p2m_is_ram_writable(p2mt) ? p2m_map_foreign_rw
+                                          : p2m_map_foreign_ro;
+        }
         else
         {
             put_page(page);
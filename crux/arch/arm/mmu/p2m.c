@@ -1,21 +1,35 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 #include <crux/cpu.h>
 #include <crux/domain_page.h>
+#include <crux/guest_access.h>
+#include <crux/hypfs.h>
 #include <crux/ioreq.h>
 #include <crux/lib.h>
+#include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/sched.h>
 #include <crux/softirq.h>
+#include <crux/timer.h>
+#include <crux/xvmalloc.h>
 
 #include <asm/alternative.h>
 #include <asm/event.h>
 #include <asm/flushtlb.h>
 #include <asm/page.h>
 
+#include <public/domctl.h>
+
 unsigned int __read_mostly p2m_root_order;
 unsigned int __read_mostly p2m_root_level;
 
 static mfn_t __read_mostly empty_root_mfn;
 
+/* Superpages shattered and rebuilt, across all domains. */
+static unsigned long p2m_superpages_demoted;
+static unsigned long p2m_superpages_promoted;
+
+static void p2m_coalesce_kick(void);
+
 static uint64_t generate_vttbr(uint16_t vmid, mfn_t root_mfn)
 {
     return (mfn_to_maddr(root_mfn) | ((uint64_t)vmid << 48));
@@ -170,10 +184,12 @@ void p2m_dump_info(struct domain *d)
     printk("p2m mappings for domain %d (vmid %d):\n",
            d->domain_id, p2m->vmid);
     BUG_ON(p2m->stats.mappings[0] || p2m->stats.shattered[0]);
-    printk("  1G mappings: %ld (shattered %ld)\n",
-           p2m->stats.mappings[1], p2m->stats.shattered[1]);
-    printk("  2M mappings: %ld (shattered %ld)\n",
-           p2m->stats.mappings[2], p2m->stats.shattered[2]);
+    printk("  1G mappings: %ld (shattered %ld, rebuilt %ld)\n",
+           p2m->stats.mappings[1], p2m->stats.shattered[1],
+           p2m->stats.coalesced[1]);
+    printk("  2M mappings: %ld (shattered %ld, rebuilt %ld)\n",
+           p2m->stats.mappings[2], p2m->stats.shattered[2],
+           p2m->stats.coalesced[2]);
     printk("  4K mappings: %ld\n", p2m->stats.mappings[3]);
     p2m_read_unlock(p2m);
 }
@@ -293,10 +309,39 @@ void p2m_force_tlb_flush_sync(struct p2m_domain *p2m)
     p2m->need_flush = false;
 }
 
+/*
+ * Issue the deferred IOMMU flush, if any. Returns its error, or the one
+ * latched by an earlier flush, and clears the latter.
+ */
+static int p2m_iommu_flush_sync(struct p2m_domain *p2m)
+{
+    int rc = p2m->iommu_flush.rc;
+
+    p2m->iommu_flush.rc = 0;
+
+    if ( p2m->iommu_flush.flags )
+    {
+        int ret = iommu_iotlb_flush(p2m->domain,
+                                    _dfn(gfn_x(p2m->iommu_flush.start)),
+                                    gfn_x(p2m->iommu_flush.end) -
+                                    gfn_x(p2m->iommu_flush.start) + 1,
+                                    p2m->iommu_flush.flags);
+
+        p2m->iommu_flush.flags = 0;
+        if ( !rc )
+            rc = ret;
+    }
+
+    return rc;
+}
+
 void p2m_tlb_flush_sync(struct p2m_domain *p2m)
 {
     if ( p2m->need_flush )
         p2m_force_tlb_flush_sync(p2m);
+
+    /* Keep any error for p2m_set_entry() to report. */
+    p2m->iommu_flush.rc = p2m_iommu_flush_sync(p2m);
 }
 
 /*
@@ -534,6 +579,7 @@ static void p2m_set_permission(lpae_t *e, p2m_type_t t, p2m_access_t a)
         break;
 
     case p2m_ram_ro:
+    case p2m_ram_logdirty:
         e->p2m.xn = 0;
         e->p2m.write = 0;
         break;
@@ -921,6 +967,11 @@ static bool p2m_split_superpage(struct p2m_domain *p2m, lpae_t *entry,
     p2m->stats.shattered[level]++;
     p2m->stats.mappings[level]--;
     p2m->stats.mappings[next_level] += CRUX_PT_LPAE_ENTRIES;
+    perfc_incr(p2m_superpage_split);
+    arch_fetch_and_add(&p2m_superpages_demoted, 1);
+
+    p2m->coalesce_pending = true;
+    p2m_coalesce_kick();
 
     /*
      * Shatter superpage in the page to the level we want to make the
@@ -946,6 +997,340 @@ static bool p2m_split_superpage(struct p2m_domain *p2m, lpae_t *entry,
     return rv;
 }
 
+/*
+ * Superpage coalescing.
+ *
+ * Superpages shattered to change a single page (e.g. mem_access, grant
+ * mappings or ballooning) are never rebuilt by __p2m_set_entry(). Shattering
+ * a superpage arms a timer which walks the P2M of the affected domains, a few
+ * 2MB regions at a time, looking for tables whose entries map contiguous
+ * memory with identical attributes and folds them back into a single block
+ * entry. The timer stops once no domain has anything left to scan.
+ */
+static bool __read_mostly opt_p2m_coalesce = true;
+boolean_param("p2m-coalesce", opt_p2m_coalesce);
+
+#define P2M_COALESCE_PERIOD MILLISECS(100)
+/* Number of 2MB regions looked at per domain and per period. */
+#define P2M_COALESCE_BATCH  64
+/* Number of 2MB regions looked at per hold of the P2M lock. */
+#define P2M_COALESCE_CHUNK  8
+
+static struct timer p2m_coalesce_timer;
+/* Set while the timer is pending, or until it has been initialised. */
+static bool p2m_coalesce_armed = true;
+
+/* Called when a domain may have superpages to rebuild. */
+static void p2m_coalesce_kick(void)
+{
+    if ( opt_p2m_coalesce && !test_and_set_bool(p2m_coalesce_armed) )
+        set_timer(&p2m_coalesce_timer, NOW() + P2M_COALESCE_PERIOD);
+}
+
+/*
+ * Check whether the table referenced by @entry, at @level, can be replaced
+ * by a block entry. The block entry is returned in @block.
+ */
+static bool p2m_table_is_foldable(lpae_t entry, unsigned int level,
+                                  lpae_t *block)
+{
+    unsigned int i, next_level = level + 1;
+    unsigned int order = CRUX_PT_LEVEL_ORDER(next_level);
+    const lpae_t *table;
+    lpae_t first, expected;
+    mfn_t mfn;
+    bool ok = true;
+
+    ASSERT(level == 1 || level == 2);
+
+    if ( !lpae_is_valid(entry) || !lpae_is_table(entry, level) )
+        return false;
+
+    table = map_domain_page(lpae_get_mfn(entry));
+    first = table[0];
+    mfn = lpae_get_mfn(first);
+
+    /*
+     * Only fold RAM: foreign mappings hold a reference per page, which
+     * p2m_put_page() cannot drop for a block at level 1.
+     */
+    if ( !lpae_is_valid(first) || !p2m_is_mapping(first, next_level) ||
+         !p2m_is_ram(first.p2m.type) ||
+         !IS_ALIGNED(mfn_x(mfn), 1UL << CRUX_PT_LEVEL_ORDER(level)) )
+        ok = false;
+
+    /*
+     * Every entry must be the first one with the MFN shifted, so type,
+     * permissions and memory attributes match as well.
+     */
+    for ( i = 1; ok && i < CRUX_PT_LPAE_ENTRIES; i++ )
+    {
+        expected = first;
+        lpae_set_mfn(expected, mfn_add(mfn, i << order));
+        ok = (table[i].bits == expected.bits);
+    }
+
+    unmap_domain_page(table);
+
+    if ( ok )
+    {
+        *block = first;
+        block->p2m.table = 0;
+    }
+
+    return ok;
+}
+
+/* Release the table previously referenced by a folded @entry. */
+static void p2m_free_folded_table(struct p2m_domain *p2m, lpae_t entry,
+                                  unsigned int level)
+{
+    struct page_info *pg = mfn_to_page(lpae_get_mfn(entry));
+
+    page_list_del(pg, &p2m->pages);
+    p2m_free_page(p2m->domain, pg);
+
+    p2m->stats.mappings[level + 1] -= CRUX_PT_LPAE_ENTRIES;
+    p2m->stats.mappings[level]++;
+    p2m->stats.coalesced[level]++;
+    perfc_incr(p2m_superpage_coalesce);
+    arch_fetch_and_add(&p2m_superpages_promoted, 1);
+}
+
+/*
+ * Fold the foldable entries in [@start, @end) of the level-2 @table. All the
+ * entries are removed first, so break-before-make only costs one TLB flush.
+ */
+static void p2m_coalesce_l2(struct p2m_domain *p2m, lpae_t *table,
+                            unsigned int start, unsigned int end)
+{
+    lpae_t old[P2M_COALESCE_CHUNK], block;
+    unsigned long fold = 0;
+    unsigned int i;
+
+    BUILD_BUG_ON(P2M_COALESCE_CHUNK > BITS_PER_LONG);
+    ASSERT(end - start <= P2M_COALESCE_CHUNK);
+
+    for ( i = start; i < end; i++ )
+        if ( p2m_table_is_foldable(table[i], 2, &block) )
+        {
+            fold |= 1UL << (i - start);
+            old[i - start] = table[i];
+            p2m_remove_pte(&table[i], p2m->clean_pte);
+        }
+
+    if ( !fold )
+        return;
+
+    p2m_force_tlb_flush_sync(p2m);
+
+    for_each_set_bit ( i, fold )
+    {
+        p2m_table_is_foldable(old[i], 2, &block);
+        p2m_write_pte(&table[start + i], block, p2m->clean_pte);
+        p2m_free_folded_table(p2m, old[i], 2);
+    }
+}
+
+/*
+ * Look at the 2MB regions from @gfn up to the end of the chunk or of the
+ * 1GB region. Return the index of the level-2 entry to resume from.
+ */
+static unsigned int p2m_coalesce_range(struct p2m_domain *p2m, gfn_t gfn)
+{
+    DECLARE_OFFSETS(offsets, gfn_to_gaddr(gfn));
+    unsigned int level, end;
+    lpae_t *table, *entry, *l2, block, orig;
+
+    end = min_t(unsigned int, offsets[2] + P2M_COALESCE_CHUNK,
+                CRUX_PT_LPAE_ENTRIES);
+
+    table = p2m_get_root_pointer(p2m, gfn);
+    if ( !table )
+        return end;
+
+    for ( level = P2M_ROOT_LEVEL; level < 1; level++ )
+    {
+        if ( p2m_next_level(p2m, true, level, &table,
+                            offsets[level]) != GUEST_TABLE_NORMAL_PAGE )
+            goto out;
+    }
+
+    entry = table + offsets[1];
+    if ( !lpae_is_valid(*entry) || !lpae_is_table(*entry, 1) )
+    {
+        /* Nothing to rebuild in this 1GB region. */
+        end = CRUX_PT_LPAE_ENTRIES;
+        goto out;
+    }
+
+    l2 = map_domain_page(lpae_get_mfn(*entry));
+    p2m_coalesce_l2(p2m, l2, offsets[2], end);
+    unmap_domain_page(l2);
+
+    /* The level-2 table has been scanned to the end, try a 1GB block. */
+    if ( end == CRUX_PT_LPAE_ENTRIES &&
+         p2m_table_is_foldable(*entry, 1, &block) )
+    {
+        orig = *entry;
+        p2m_remove_pte(entry, p2m->clean_pte);
+        p2m_force_tlb_flush_sync(p2m);
+        p2m_write_pte(entry, block, p2m->clean_pte);
+        p2m_free_folded_table(p2m, orig, 1);
+    }
+
+ out:
+    unmap_domain_page(table);
+
+    return end;
+}
+
+/*
+ * Scan the next chunk of 2MB regions of @p2m. Return whether @p2m still has
+ * regions to scan.
+ */
+static bool p2m_coalesce_domain(struct p2m_domain *p2m)
+{
+    const unsigned long l1_mask = (1UL << CRUX_PT_LEVEL_ORDER(1)) - 1;
+    unsigned int end;
+    gfn_t gfn;
+    bool more = true;
+
+    p2m_write_lock(p2m);
+
+    /*
+     * The timer only checked these without the lock, and the lock is
+     * dropped between chunks. p2m_teardown() frees the tables, under the
+     * lock, once the domain is dying. Access settings are kept per GFN
+     * outside of the P2M entries, and folding would lose them.
+     */
+    if ( p2m->domain->is_dying || p2m->mem_access_enabled )
+    {
+        p2m->coalesce_scanning = false;
+        p2m->coalesce_pending = false;
+        more = false;
+        goto out;
+    }
+
+    if ( !p2m->coalesce_scanning )
+    {
+        /* Only start a pass if a superpage was shattered since the last. */
+        if ( !p2m->coalesce_pending )
+        {
+            more = false;
+            goto out;
+        }
+
+        p2m->coalesce_pending = false;
+        p2m->coalesce_scanning = true;
+        p2m->coalesce_gfn = _gfn(gfn_x(p2m->lowest_mapped_gfn) &
+                                 ~((1UL << CRUX_PT_LEVEL_ORDER(2)) - 1));
+    }
+
+    gfn = p2m->coalesce_gfn;
+    if ( gfn_x(gfn) > gfn_x(p2m->max_mapped_gfn) )
+    {
+        /* End of the pass. */
+        p2m->coalesce_scanning = false;
+        more = p2m->coalesce_pending;
+        goto out;
+    }
+
+    end = p2m_coalesce_range(p2m, gfn);
+    p2m->coalesce_gfn = _gfn((gfn_x(gfn) & ~l1_mask) +
+                             ((unsigned long)end << CRUX_PT_LEVEL_ORDER(2)));
+
+ out:
+    p2m_write_unlock(p2m);
+
+    return more;
+}
+
+static void cf_check p2m_coalesce_timer_fn(void *unused)
+{
+    struct domain *d;
+    bool again = false;
+
+    /*
+     * Let p2m_coalesce_kick() re-arm the timer. A superpage shattered from
+     * now on is either seen by the scan below or re-arms the timer.
+     */
+    write_atomic(&p2m_coalesce_armed, false);
+    smp_mb();
+
+    rcu_read_lock(&domlist_read_lock);
+
+    for_each_domain ( d )
+    {
+        struct p2m_domain *p2m = p2m_get_hostp2m(d);
+        unsigned int i;
+        bool more;
+
+        /*
+         * The page-tables are shared with the IOMMU, which cannot cope
+         * with the transient invalid entry of break-before-make. Dying
+         * domains are about to free their P2M anyway, and mem_access ones
+         * are skipped, see p2m_coalesce_domain().
+         */
+        if ( is_iommu_enabled(d) || d->is_dying ||
+             p2m->mem_access_enabled || !get_domain(d) )
+            continue;
+
+        /* Leave paused domains alone, but come back to them later. */
+        if ( d->controller_pause_count )
+        {
+            again |= ACCESS_ONCE(p2m->coalesce_pending) ||
+                     ACCESS_ONCE(p2m->coalesce_scanning);
+            put_domain(d);
+            continue;
+        }
+
+        /* Drop the P2M lock between chunks to bound the time it is held. */
+        more = p2m->root;
+        for ( i = 0; more && i < P2M_COALESCE_BATCH; i += P2M_COALESCE_CHUNK )
+            more = p2m_coalesce_domain(p2m);
+        again |= more;
+
+        put_domain(d);
+    }
+
+    rcu_read_unlock(&domlist_read_lock);
+
+    if ( again )
+        p2m_coalesce_kick();
+}
+
+#ifdef CONFIG_HYPFS
+static HYPFS_DIR_INIT(p2m_hypfs_dir, "p2m");
+static HYPFS_UINT_INIT(p2m_hypfs_promoted, "superpages-promoted",
+                       p2m_superpages_promoted);
+static HYPFS_UINT_INIT(p2m_hypfs_demoted, "superpages-demoted",
+                       p2m_superpages_demoted);
+#endif
+
+static int __init cf_check p2m_coalesce_init(void)
+{
+#ifdef CONFIG_HYPFS
+    hypfs_add_dir(&hypfs_root, &p2m_hypfs_dir, true);
+    hypfs_add_leaf(&p2m_hypfs_dir, &p2m_hypfs_promoted, true);
+    hypfs_add_leaf(&p2m_hypfs_dir, &p2m_hypfs_demoted, true);
+#endif
+
+    if ( !opt_p2m_coalesce )
+        return 0;
+
+    init_timer(&p2m_coalesce_timer, p2m_coalesce_timer_fn, NULL,
+               smp_processor_id());
+
+    /* Pick up the superpages shattered while building the domains so far. */
+    write_atomic(&p2m_coalesce_armed, false);
+    smp_mb();
+    p2m_coalesce_kick();
+
+    return 0;
+}
+__initcall(p2m_coalesce_init);
+
 /*
  * Insert an entry in the p2m. This should be called with a mapping
  * equal to a page/superpage (4K, 2M, 1G).
@@ -1104,12 +1489,18 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
          * to keep coherency when the previous entry was valid.
          *
          * Although, it could be defered when only the permissions are
-         * changed (e.g in case of memaccess).
+         * changed (e.g in case of memaccess or log-dirty). The p2m type
+         * is ignored by the hardware.
          */
         if ( lpae_is_valid(orig_pte) )
         {
-            if ( likely(!p2m->mem_access_enabled) ||
-                 P2M_CLEAR_PERM(pte) != P2M_CLEAR_PERM(orig_pte) )
+            lpae_t cmp = orig_pte;
+
+            cmp.p2m.type = pte.p2m.type;
+
+            if ( likely(!p2m->mem_access_enabled &&
+                        !p2m->log_dirty.bitmap) ||
+                 P2M_CLEAR_PERM(pte) != P2M_CLEAR_PERM(cmp) )
                 p2m_force_tlb_flush_sync(p2m);
             else
                 p2m->need_flush = true;
@@ -1134,8 +1525,32 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
         if ( lpae_is_valid(*entry) )
             flush_flags |= IOMMU_FLUSHF_added;
 
-        rc = iommu_iotlb_flush(p2m->domain, _dfn(gfn_x(sgfn)),
-                               1UL << page_order, flush_flags);
+        /*
+         * Like the TLB flush above, the IOMMU flush can be deferred when
+         * the entry is removed so that unmapping a range ends up with a
+         * single invalidation.
+         */
+        if ( removing_mapping )
+        {
+            gfn_t end = gfn_add(sgfn, (1UL << page_order) - 1);
+
+            if ( !p2m->iommu_flush.flags )
+            {
+                p2m->iommu_flush.start = sgfn;
+                p2m->iommu_flush.end = end;
+            }
+            else
+            {
+                p2m->iommu_flush.start = gfn_min(p2m->iommu_flush.start,
+                                                 sgfn);
+                p2m->iommu_flush.end = gfn_max(p2m->iommu_flush.end, end);
+            }
+            p2m->iommu_flush.flags |= flush_flags;
+            rc = 0;
+        }
+        else
+            rc = iommu_iotlb_flush(p2m->domain, _dfn(gfn_x(sgfn)),
+                                   1UL << page_order, flush_flags);
     }
     else
         rc = 0;
@@ -1146,7 +1561,26 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
      */
     if ( p2m_is_valid(orig_pte) &&
          !mfn_eq(lpae_get_mfn(*entry), lpae_get_mfn(orig_pte)) )
+    {
+        /*
+         * p2m_free_entry() drops the references on foreign pages, which may
+         * then be freed and reused. Devices must not be able to reach them
+         * by then, so don't defer the IOMMU flush past this point. Tables
+         * may map foreign pages too, and p2m_free_entry() would flush
+         * before freeing them anyway.
+         */
+        if ( p2m->iommu_flush.flags &&
+             (p2m_is_foreign(orig_pte.p2m.type) ||
+              lpae_is_table(orig_pte, level)) )
+        {
+            int ret = p2m_iommu_flush_sync(p2m);
+
+            if ( !rc )
+                rc = ret;
+        }
+
         p2m_free_entry(p2m, orig_pte, level);
+    }
 
 out:
     unmap_domain_page(table);
@@ -1154,6 +1588,19 @@ out:
     return rc;
 }
 
+/* Record GFNs as dirty. The p2m should be write locked. */
+static void p2m_log_dirty_mark_range(struct p2m_domain *p2m, gfn_t gfn,
+                                     unsigned long nr)
+{
+    unsigned long i, end = min(gfn_x(gfn) + nr, p2m->log_dirty.nr_gfns);
+
+    ASSERT(p2m_is_write_locked(p2m));
+
+    for ( i = gfn_x(gfn); i < end; i++ )
+        if ( !__test_and_set_bit(i, p2m->log_dirty.bitmap) )
+            p2m->log_dirty.dirty_count++;
+}
+
 int p2m_set_entry(struct p2m_domain *p2m,
                   gfn_t sgfn,
                   unsigned long nr,
@@ -1161,7 +1608,7 @@ int p2m_set_entry(struct p2m_domain *p2m,
                   p2m_type_t t,
                   p2m_access_t a)
 {
-    int rc = 0;
+    int rc = 0, rc2;
 
     /*
      * Any reference taken by the P2M mappings (e.g. foreign mapping) will
@@ -1201,6 +1648,10 @@ int p2m_set_entry(struct p2m_domain *p2m,
         if ( rc )
             break;
 
+        /* Writable RAM is dirty as far as log-dirty is concerned. */
+        if ( unlikely(p2m->log_dirty.enabled) && t == p2m_ram_rw )
+            p2m_log_dirty_mark_range(p2m, sgfn, 1UL << order);
+
         sgfn = gfn_add(sgfn, (1 << order));
         if ( !mfn_eq(smfn, INVALID_MFN) )
            smfn = mfn_add(smfn, (1 << order));
@@ -1208,7 +1659,13 @@ int p2m_set_entry(struct p2m_domain *p2m,
         nr -= (1 << order);
     }
 
-    return rc;
+    /*
+     * Removals only queued their IOMMU flush: do it for the whole range
+     * now, so that the callers still get to see its errors.
+     */
+    rc2 = p2m_iommu_flush_sync(p2m);
+
+    return rc ?: rc2;
 }
 
 /* Invalidate all entries in the table. The p2m should be write locked. */
@@ -1406,6 +1863,402 @@ out:
     return resolved;
 }
 
+/*
+ * Log-dirty.
+ *
+ * Enabling log-dirty retypes every p2m_ram_rw entry to p2m_ram_logdirty,
+ * keeping superpages intact. The first write to such a page is trapped by
+ * p2m_log_dirty_fault(), which marks the GFN dirty and maps the 4K page
+ * alone back as p2m_ram_rw, splitting any superpage on the way. Cleaning
+ * the bitmap write-protects again whatever was reported dirty.
+ *
+ * GFNs above the highest one mapped when log-dirty got enabled are not
+ * tracked.
+ */
+
+/*
+ * Retype the entry covering *@gfn from @ot to @nt, if it currently has
+ * type @ot, and advance *@gfn past the entry.
+ */
+static int p2m_log_dirty_retype(struct p2m_domain *p2m, gfn_t *gfn,
+                                p2m_type_t ot, p2m_type_t nt)
+{
+    unsigned int order;
+    p2m_type_t t;
+    p2m_access_t a;
+    mfn_t mfn = p2m_get_entry(p2m, *gfn, &t, &a, &order, NULL);
+    gfn_t base = _gfn(gfn_x(*gfn) & ~((1UL << order) - 1));
+    int rc = 0;
+
+    if ( t == ot )
+        rc = __p2m_set_entry(p2m, base, order,
+                             mfn_add(mfn, -(gfn_x(*gfn) - gfn_x(base))),
+                             nt, a);
+
+    *gfn = gfn_next_boundary(*gfn, order);
+
+    return rc;
+}
+
+/* Retype all entries from @ot to @nt, resuming where a prior call stopped. */
+static int p2m_log_dirty_retype_all(struct p2m_domain *p2m, unsigned int op,
+                                    p2m_type_t ot, p2m_type_t nt)
+{
+    unsigned long count = 0;
+    gfn_t gfn, end;
+    int rc = 0;
+
+    p2m_write_lock(p2m);
+
+    if ( p2m->log_dirty.preempt_op != op )
+    {
+        p2m->log_dirty.preempt_op = op;
+        p2m->log_dirty.preempt_gfn = p2m->lowest_mapped_gfn;
+    }
+
+    gfn = p2m->log_dirty.preempt_gfn;
+    end = gfn_add(p2m->max_mapped_gfn, 1);
+
+    while ( gfn_x(gfn) < gfn_x(end) )
+    {
+        /* Arbitrarily preempt every 512 iterations. */
+        if ( !(++count % 512) && hypercall_preempt_check() )
+        {
+            rc = -ERESTART;
+            break;
+        }
+
+        rc = p2m_log_dirty_retype(p2m, &gfn, ot, nt);
+        if ( rc )
+            break;
+    }
+
+    p2m->log_dirty.preempt_gfn = gfn;
+    if ( rc != -ERESTART )
+        p2m->log_dirty.preempt_op = 0;
+
+    p2m_write_unlock(p2m);
+
+    return rc;
+}
+
+static int p2m_log_dirty_enable(struct domain *d)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long *bitmap = NULL;
+    unsigned long nr_gfns;
+
+    /* DMA writes by devices can't be tracked. */
+    if ( is_iommu_enabled(d) )
+        return -EINVAL;
+
+    p2m_read_lock(p2m);
+    nr_gfns = gfn_x(p2m->max_mapped_gfn) + 1;
+    p2m_read_unlock(p2m);
+
+    /* Allocate outside of the lock, not needed when resuming. */
+    if ( !p2m->log_dirty.bitmap )
+    {
+        bitmap = xvzalloc_array(unsigned long, BITS_TO_LONGS(nr_gfns));
+        if ( !bitmap )
+            return -ENOMEM;
+    }
+
+    p2m_write_lock(p2m);
+
+    if ( p2m->log_dirty.preempt_op &&
+         p2m->log_dirty.preempt_op != CRUX_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY )
+    {
+        p2m_write_unlock(p2m);
+        xvfree(bitmap);
+        return -EBUSY;
+    }
+
+    if ( !p2m->log_dirty.preempt_op )
+    {
+        if ( p2m->log_dirty.bitmap )
+        {
+            p2m_write_unlock(p2m);
+            xvfree(bitmap);
+            return -EEXIST;
+        }
+
+        p2m->log_dirty.bitmap = bitmap;
+        p2m->log_dirty.nr_gfns = nr_gfns;
+        p2m->log_dirty.fault_count = 0;
+        p2m->log_dirty.dirty_count = 0;
+        p2m->log_dirty.enabled = true;
+    }
+    else
+        xvfree(bitmap);
+
+    p2m_write_unlock(p2m);
+
+    return p2m_log_dirty_retype_all(p2m, CRUX_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                                    p2m_ram_rw, p2m_ram_logdirty);
+}
+
+static int p2m_log_dirty_disable(struct domain *d)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int rc;
+
+    p2m_write_lock(p2m);
+
+    if ( !p2m->log_dirty.bitmap )
+    {
+        p2m_write_unlock(p2m);
+        return 0;
+    }
+
+    if ( p2m->log_dirty.preempt_op &&
+         p2m->log_dirty.preempt_op != CRUX_DOMCTL_SHADOW_OP_OFF )
+    {
+        p2m_write_unlock(p2m);
+        return -EBUSY;
+    }
+
+    p2m->log_dirty.enabled = false;
+
+    p2m_write_unlock(p2m);
+
+    rc = p2m_log_dirty_retype_all(p2m, CRUX_DOMCTL_SHADOW_OP_OFF,
+                                  p2m_ram_logdirty, p2m_ram_rw);
+    if ( rc )
+        return rc;
+
+    p2m_write_lock(p2m);
+    XVFREE(p2m->log_dirty.bitmap);
+    p2m->log_dirty.nr_gfns = 0;
+    p2m_write_unlock(p2m);
+
+    return 0;
+}
+
+/* Number of bitmap words processed per p2m lock hold. */
+#define LOG_DIRTY_BATCH 64
+
+/*
+ * Copy the dirty bitmap to the caller and, for CRUX_DOMCTL_SHADOW_OP_CLEAN,
+ * clear it and write-protect the reported pages for the next round.
+ */
+static int p2m_log_dirty_op(struct domain *d, struct crux_domctl_shadow_op *sc)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    bool clean = (sc->op == CRUX_DOMCTL_SHADOW_OP_CLEAN);
+    unsigned long snap[LOG_DIRTY_BATCH];
+    unsigned long i, nr_words, bytes;
+    int rc = 0;
+
+    /*
+     * crux writes to some guest pages through its own mappings, which
+     * stage-2 write protection doesn't see. Report them in every round,
+     * but not again when resuming a preempted one.
+     */
+    if ( !ACCESS_ONCE(p2m->log_dirty.preempt_op) )
+        domain_mark_guest_areas_dirty(d);
+
+    p2m_write_lock(p2m);
+
+    if ( !p2m->log_dirty.enabled )
+    {
+        p2m_write_unlock(p2m);
+        return -EINVAL;
+    }
+
+    if ( p2m->log_dirty.preempt_op && p2m->log_dirty.preempt_op != sc->op )
+    {
+        p2m_write_unlock(p2m);
+        return -EBUSY;
+    }
+
+    if ( !p2m->log_dirty.preempt_op )
+    {
+        p2m->log_dirty.preempt_op = sc->op;
+        p2m->log_dirty.preempt_gfn = _gfn(0);
+    }
+
+    sc->pages = min_t(uint64_t, sc->pages, p2m->log_dirty.nr_gfns);
+    bytes = DIV_ROUND_UP(sc->pages, 8);
+    nr_words = BITS_TO_LONGS(sc->pages);
+    i = gfn_x(p2m->log_dirty.preempt_gfn) / BITS_PER_LONG;
+
+    p2m_write_unlock(p2m);
+
+    while ( i < nr_words )
+    {
+        unsigned long j, n = min_t(unsigned long, nr_words - i,
+                                   LOG_DIRTY_BATCH);
+
+        p2m_write_lock(p2m);
+
+        for ( j = 0; j < n; j++ )
+        {
+            unsigned long bits = p2m->log_dirty.bitmap[i + j];
+            gfn_t gfn;
+
+            snap[j] = bits;
+            if ( !clean || !bits )
+                continue;
+
+            p2m->log_dirty.bitmap[i + j] = 0;
+
+            /*
+             * Retyping covers whole entries, so a single dirty GFN in a
+             * writable superpage protects all of it again.
+             */
+            while ( bits )
+            {
+                gfn = _gfn((i + j) * BITS_PER_LONG + ffsl(bits) - 1);
+                rc = p2m_log_dirty_retype(p2m, &gfn, p2m_ram_rw,
+                                          p2m_ram_logdirty);
+                if ( rc )
+                    break;
+
+                if ( gfn_x(gfn) >= (i + j + 1) * BITS_PER_LONG )
+                    bits = 0;
+                else
+                    bits &= ~0UL << (gfn_x(gfn) % BITS_PER_LONG);
+            }
+            if ( rc )
+                break;
+        }
+
+        /* Unlocking flushes the TLBs, so no stale writable entries remain. */
+        p2m_write_unlock(p2m);
+
+        if ( rc )
+            break;
+
+        if ( copy_to_guest_offset(sc->dirty_bitmap, i * sizeof(long),
+                                  (uint8_t *)snap,
+                                  min(n * sizeof(long),
+                                      bytes - i * sizeof(long))) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        i += n;
+
+        if ( i < nr_words && hypercall_preempt_check() )
+        {
+            rc = -ERESTART;
+            break;
+        }
+    }
+
+    p2m_write_lock(p2m);
+
+    if ( rc == -ERESTART )
+        p2m->log_dirty.preempt_gfn = _gfn(i * BITS_PER_LONG);
+    else
+    {
+        p2m->log_dirty.preempt_op = 0;
+
+        sc->stats.fault_count = p2m->log_dirty.fault_count;
+        sc->stats.dirty_count = p2m->log_dirty.dirty_count;
+        if ( clean )
+        {
+            p2m->log_dirty.fault_count = 0;
+            p2m->log_dirty.dirty_count = 0;
+        }
+    }
+
+    p2m_write_unlock(p2m);
+
+    return rc;
+}
+
+int p2m_shadow_op(struct domain *d, struct crux_domctl_shadow_op *sc)
+{
+    if ( unlikely(d == current->domain) )
+    {
+        gdprintk(CRUXLOG_INFO, "Tried to do a log-dirty op on itself.\n");
+        return -EINVAL;
+    }
+
+    switch ( sc->op )
+    {
+    case CRUX_DOMCTL_SHADOW_OP_OFF:
+        return p2m_log_dirty_disable(d);
+
+    case CRUX_DOMCTL_SHADOW_OP_ENABLE:
+        if ( sc->mode != CRUX_DOMCTL_SHADOW_ENABLE_LOG_DIRTY )
+            return -EINVAL;
+        /* Fallthrough */
+    case CRUX_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
+        return p2m_log_dirty_enable(d);
+
+    case CRUX_DOMCTL_SHADOW_OP_CLEAN:
+    case CRUX_DOMCTL_SHADOW_OP_PEEK:
+        return p2m_log_dirty_op(d, sc);
+
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+bool p2m_log_dirty_fault(struct domain *d, gfn_t gfn)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    bool resolved = false;
+    p2m_type_t t;
+    p2m_access_t a;
+    mfn_t mfn;
+
+    if ( likely(!ACCESS_ONCE(p2m->log_dirty.bitmap)) )
+        return false;
+
+    p2m_write_lock(p2m);
+
+    mfn = p2m_get_entry(p2m, gfn, &t, &a, NULL, NULL);
+
+    switch ( t )
+    {
+    case p2m_ram_logdirty:
+        /*
+         * Mapping the page as p2m_ram_rw marks it dirty if log-dirty is
+         * still enabled (i.e. not being turned off).
+         */
+        if ( p2m_set_entry(p2m, gfn, 1, mfn, p2m_ram_rw, a) )
+        {
+            gprintk(CRUXLOG_ERR,
+                    "Unable to make gfn %#"PRI_gfn" writable for log-dirty\n",
+                    gfn_x(gfn));
+            domain_crash(d);
+        }
+        p2m->log_dirty.fault_count++;
+        resolved = true;
+        break;
+
+    case p2m_ram_rw:
+        /* Raced with another vCPU. */
+        resolved = true;
+        break;
+
+    default:
+        break;
+    }
+
+    p2m_write_unlock(p2m);
+
+    return resolved;
+}
+
+void p2m_log_dirty_mark(struct domain *d, gfn_t gfn, unsigned long nr)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
+    if ( !ACCESS_ONCE(p2m->log_dirty.enabled) )
+        return;
+
+    p2m_write_lock(p2m);
+    if ( p2m->log_dirty.enabled )
+        p2m_log_dirty_mark_range(p2m, gfn, nr);
+    p2m_write_unlock(p2m);
+}
+
 static struct page_info *p2m_allocate_root(void)
 {
     struct page_info *page;
@@ -1498,6 +2351,8 @@ void p2m_final_teardown(struct domain *d)
 
     radix_tree_destroy(&p2m->mem_access_settings, NULL);
 
+    XVFREE(p2m->log_dirty.bitmap);
+
     p2m->domain = NULL;
 }
 
@@ -1857,6 +2712,61 @@ static int __init cpu_virt_paging_init(void)
  */
 __initcall(cpu_virt_paging_init);
 
+#ifdef CONFIG_SELF_TESTS
+/* Check the log-dirty bookkeeping against a scratch p2m, at boot. */
+static int __init cf_check p2m_log_dirty_selftest(void)
+{
+    struct p2m_domain *p2m = xzalloc(struct p2m_domain);
+    unsigned long *bitmap = xzalloc_array(unsigned long, BITS_TO_LONGS(128));
+    static const struct {
+        unsigned long gfn, nr;
+        uint32_t dirty;
+    } __initconst tests[] = {
+        { 10, 5, 5 },           /* Plain range. */
+        { 12, 5, 7 },           /* Overlap only counts the new GFNs. */
+        { 98, 10, 9 },          /* Clamped to nr_gfns. */
+        { 200, 1, 9 },          /* Beyond nr_gfns altogether. */
+    };
+    unsigned int i;
+
+    if ( !p2m || !bitmap )
+        panic("%s: out of memory\n", __func__);
+
+    rwlock_init(&p2m->lock);
+    p2m->log_dirty.bitmap = bitmap;
+    p2m->log_dirty.nr_gfns = 100;
+
+    /* Nothing to flush: don't go through p2m_write_unlock(). */
+    write_lock(&p2m->lock);
+    for ( i = 0; i < ARRAY_SIZE(tests); i++ )
+    {
+        p2m_log_dirty_mark_range(p2m, _gfn(tests[i].gfn), tests[i].nr);
+        if ( p2m->log_dirty.dirty_count != tests[i].dirty )
+            panic("%s: test %u: %u dirty GFNs, expected %u\n", __func__, i,
+                  p2m->log_dirty.dirty_count, tests[i].dirty);
+    }
+    write_unlock(&p2m->lock);
+
+    if ( find_first_bit(bitmap, 128) != 10 ||
+         find_next_zero_bit(bitmap, 128, 10) != 17 ||
+         find_next_bit(bitmap, 128, 17) != 98 ||
+         find_next_bit(bitmap, 128, 100) != 128 )
+        panic("%s: unexpected bitmap contents\n", __func__);
+
+    if ( !p2m_is_ram_writable(p2m_ram_rw) ||
+         !p2m_is_ram_writable(p2m_ram_logdirty) ||
+         p2m_is_ram_writable(p2m_ram_ro) ||
+         p2m_is_ram_writable(p2m_map_foreign_rw) )
+        panic("%s: p2m_is_ram_writable() is wrong\n", __func__);
+
+    xfree(bitmap);
+    xfree(p2m);
+
+    return 0;
+}
+__initcall(p2m_log_dirty_selftest);
+#endif /* CONFIG_SELF_TESTS */
+
 /*
  * Local variables:
  * mode: C
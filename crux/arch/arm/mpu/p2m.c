@@ -55,6 +55,18 @@ bool p2m_resolve_translation_fault(struct domain *d, gfn_t gfn)
     return false;
 }
 
+int p2m_shadow_op(struct domain *d, struct crux_domctl_shadow_op *sc)
+{
+    return -EOPNOTSUPP;
+}
+
+bool p2m_log_dirty_fault(struct domain *d, gfn_t gfn)
+{
+    return false;
+}
+
+void p2m_log_dirty_mark(struct domain *d, gfn_t gfn, unsigned long nr) {}
+
 void p2m_flush_vm(struct vcpu *v) {}
 
 int relinquish_p2m_mapping(struct domain *d)
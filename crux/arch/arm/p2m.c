@@ -558,7 +558,12 @@ struct page_info *get_page_from_gva(struct vcpu *v, vaddr_t va,
             return NULL;
 
         if ( (flags & GV2M_WRITE) && t != p2m_ram_rw )
-            return NULL;
+        {
+            /* Crux writes through its own mapping, only record the page. */
+            if ( t != p2m_ram_logdirty )
+                return NULL;
+            p2m_log_dirty_mark(d, gaddr_to_gfn(ipa), 1);
+        }
     }
     else
         mfn = maddr_to_mfn(maddr);
@@ -77,6 +77,19 @@ DEFINE_PER_CPU_READ_MOSTLY(cpumask_var_t, cpu_sibling_mask);
 /* representing HT and core siblings of each logical CPU */
 DEFINE_PER_CPU_READ_MOSTLY(cpumask_var_t, cpu_core_mask);
 
+/*
+ * Topology of each logical CPU. Core IDs are unique system-wide, cluster
+ * IDs identify the innermost cluster of the cpu-map (typically the CPUs
+ * sharing a last level cache). Without a cpu-map in the device tree, every
+ * CPU is a core of its own in cluster 0 of socket 0.
+ */
+unsigned int __read_mostly cpu_core_id[NR_CPUS];
+unsigned int __read_mostly cpu_cluster_id[NR_CPUS];
+unsigned int __read_mostly cpu_socket_id[NR_CPUS];
+
+/* DT node of each logical CPU, for resolving the cpu-map phandles. */
+static const struct dt_device_node *__initdata cpu_dt_node[NR_CPUS];
+
 /*
  * By default non-boot CPUs not identical to the boot CPU will be
  * parked.
@@ -86,17 +99,26 @@ boolean_param("hmp-unsafe", opt_hmp_unsafe);
 
 static int setup_cpu_sibling_map(int cpu)
 {
+    unsigned int i;
+
     if ( !zalloc_cpumask_var(&per_cpu(cpu_sibling_mask, cpu)) ||
          !zalloc_cpumask_var(&per_cpu(cpu_core_mask, cpu)) )
         return -ENOMEM;
 
     /*
-     * Currently we assume there is no multithread and NUMA, so
-     * a CPU is a sibling with itself, and the all possible CPUs
-     * are supposed to belong to the same socket (NUMA node).
+     * Threads are siblings if the cpu-map put them in the same core, and
+     * cores are siblings if they are in the same socket. A CPU is always a
+     * sibling with itself.
      */
     cpumask_set_cpu(cpu, per_cpu(cpu_sibling_mask, cpu));
-    cpumask_copy(per_cpu(cpu_core_mask, cpu), &cpu_possible_map);
+    for_each_cpu ( i, &cpu_possible_map )
+    {
+        if ( cpu_to_socket(i) != cpu_to_socket(cpu) )
+            continue;
+        cpumask_set_cpu(i, per_cpu(cpu_core_mask, cpu));
+        if ( cpu_to_core(i) == cpu_to_core(cpu) )
+            cpumask_set_cpu(i, per_cpu(cpu_sibling_mask, cpu));
+    }
 
     return 0;
 }
@@ -114,6 +136,136 @@ void __init smp_prepare_boot_cpu(void)
     cpu_logical_map(0) = READ_SYSREG(MPIDR_EL1) & MPIDR_HWID_MASK;
 }
 
+static void __init reset_cpu_topology(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_CPUS; i++ )
+    {
+        cpu_core_id[i] = i;
+        cpu_cluster_id[i] = 0;
+        cpu_socket_id[i] = 0;
+    }
+}
+
+static unsigned int __initdata dt_next_core, dt_next_cluster;
+
+static bool __init dt_topology_cpu(const struct dt_device_node *np,
+                                   unsigned int socket, unsigned int cluster,
+                                   unsigned int core)
+{
+    const struct dt_device_node *cpu_np = dt_parse_phandle(np, "cpu", 0);
+    unsigned int i;
+
+    if ( !cpu_np )
+        return false;
+
+    for ( i = 0; i < NR_CPUS; i++ )
+    {
+        if ( cpu_dt_node[i] != cpu_np )
+            continue;
+        cpu_core_id[i] = core;
+        cpu_cluster_id[i] = cluster;
+        cpu_socket_id[i] = socket;
+        break;
+    }
+
+    /* Not finding it is fine: the CPU may have been capped or failed init. */
+    return true;
+}
+
+static bool __init dt_topology_core(const struct dt_device_node *core,
+                                    unsigned int socket, unsigned int cluster)
+{
+    const struct dt_device_node *np;
+    bool threads = false;
+
+    dt_for_each_child_node ( core, np )
+    {
+        if ( strncmp(dt_node_name(np), "thread", 6) )
+            continue;
+        if ( !dt_topology_cpu(np, socket, cluster, dt_next_core) )
+            return false;
+        threads = true;
+    }
+
+    if ( !threads && !dt_topology_cpu(core, socket, cluster, dt_next_core) )
+        return false;
+
+    dt_next_core++;
+
+    return true;
+}
+
+static bool __init dt_topology_cluster(const struct dt_device_node *cluster,
+                                       unsigned int socket)
+{
+    const struct dt_device_node *np;
+    bool cores = false;
+
+    /* Clusters may nest: only the ones directly holding cores count. */
+    dt_for_each_child_node ( cluster, np )
+    {
+        if ( !strncmp(dt_node_name(np), "cluster", 7) )
+        {
+            if ( !dt_topology_cluster(np, socket) )
+                return false;
+        }
+        else if ( !strncmp(dt_node_name(np), "core", 4) )
+        {
+            if ( !dt_topology_core(np, socket, dt_next_cluster) )
+                return false;
+            cores = true;
+        }
+    }
+
+    if ( cores )
+        dt_next_cluster++;
+
+    return true;
+}
+
+/*
+ * Parse /cpus/cpu-map, as per the Linux cpu-topology binding: optional
+ * socketN nodes, containing (possibly nested) clusterN nodes, containing
+ * coreN nodes, each with either a cpu phandle or threadN subnodes.
+ */
+static void __init dt_init_cpu_topology(void)
+{
+    const struct dt_device_node *map = dt_find_node_by_path("/cpus/cpu-map");
+    const struct dt_device_node *np;
+    unsigned int socket = 0;
+    bool ok = true;
+
+    if ( !map )
+        return;
+
+    dt_for_each_child_node ( map, np )
+    {
+        if ( !strncmp(dt_node_name(np), "socket", 6) )
+        {
+            const struct dt_device_node *cluster;
+
+            dt_for_each_child_node ( np, cluster )
+                if ( !strncmp(dt_node_name(cluster), "cluster", 7) )
+                    ok = ok && dt_topology_cluster(cluster, socket);
+            socket++;
+        }
+        else if ( !strncmp(dt_node_name(np), "cluster", 7) )
+            ok = ok && dt_topology_cluster(np, 0);
+    }
+
+    if ( !ok || !dt_next_core )
+    {
+        printk(CRUXLOG_WARNING "Malformed /cpus/cpu-map, ignoring it\n");
+        reset_cpu_topology();
+        return;
+    }
+
+    printk(CRUXLOG_INFO "CPU topology: %u socket(s), %u cluster(s), %u core(s)\n",
+           socket ?: 1, dt_next_cluster, dt_next_core);
+}
+
 /* Parse the device tree and build the logical map array containing
  * MPIDR values related to logical cpus
  * Code base on Linux arch/arm/kernel/devtree.c
@@ -241,7 +393,10 @@ static void __init dt_smp_init_cpus(void)
             tmp_map[i] = MPIDR_INVALID;
         }
         else
+        {
             tmp_map[i] = hwid;
+            cpu_dt_node[i] = cpu;
+        }
     }
 
     if ( !bootcpu_valid )
@@ -258,12 +413,16 @@ static void __init dt_smp_init_cpus(void)
         cpumask_set_cpu(i, &cpu_possible_map);
         cpu_logical_map(i) = tmp_map[i];
     }
+
+    dt_init_cpu_topology();
 }
 
 void __init smp_init_cpus(void)
 {
     int rc;
 
+    reset_cpu_topology();
+
     /* initialize PSCI and set a global variable */
     psci_init();
 
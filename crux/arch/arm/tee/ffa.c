@@ -33,10 +33,12 @@
  * o FFA_MEM_SHARE_*: only supports sharing
  *   - from a VM to an SP
  *   - with one borrower
- *   - with the memory transaction descriptor in the RX/TX buffer
+ *   - with the memory transaction descriptor in the RX/TX buffer, possibly
+ *     in several fragments but with one fragmented share at a time per guest
  *   - normal memory
  *   - at most 512 kB large memory regions
- *   - at most 32 shared memory regions per guest
+ *   - at most 32 shared memory regions per guest, unless changed with
+ *     "ffa_max_shm="
  * o FFA_MSG_SEND_DIRECT_REQ:
  *   - only supported from a VM to an SP
  * o FFA_NOTIFICATION_*:
@@ -99,6 +101,7 @@ static const struct ffa_fw_abi ffa_fw_abi_needed[] = {
     FW_ABI(FFA_MEM_SHARE_32),
     FW_ABI(FFA_MEM_SHARE_64),
     FW_ABI(FFA_MEM_RECLAIM),
+    FW_ABI(FFA_MEM_FRAG_TX),
     FW_ABI(FFA_MSG_SEND_DIRECT_REQ_32),
     FW_ABI(FFA_MSG_SEND_DIRECT_REQ_64),
     FW_ABI(FFA_MSG_SEND2),
@@ -199,6 +202,13 @@ static void handle_features(struct cpu_user_regs *regs)
     case FFA_MSG_SEND2:
         ffa_set_regs_success(regs, 0, 0);
         break;
+    case FFA_MEM_FRAG_TX:
+        /* Fragmented shares can only be forwarded fragmented. */
+        if ( ffa_fw_supports_fid(FFA_MEM_FRAG_TX) )
+            ffa_set_regs_success(regs, 0, 0);
+        else
+            ffa_set_regs_error(regs, FFA_RET_NOT_SUPPORTED);
+        break;
     case FFA_MEM_SHARE_64:
     case FFA_MEM_SHARE_32:
         /*
@@ -284,6 +294,9 @@ static bool ffa_handle_call(struct cpu_user_regs *regs)
     case FFA_MEM_SHARE_64:
         ffa_handle_mem_share(regs);
         return true;
+    case FFA_MEM_FRAG_TX:
+        ffa_handle_mem_frag_tx(regs);
+        return true;
     case FFA_MEM_RECLAIM:
         e = ffa_handle_mem_reclaim(regpair_to_uint64(get_user_reg(regs, 2),
                                                      get_user_reg(regs, 1)),
@@ -343,7 +356,7 @@ static int ffa_domain_init(struct domain *d)
 
     d->arch.tee = ctx;
     ctx->teardown_d = d;
-    INIT_LIST_HEAD(&ctx->shm_list);
+    ctx->shm_tree = RB_ROOT;
 
     /*
      * ffa_domain_teardown() will be called if ffa_domain_init() returns an
@@ -11,6 +11,7 @@
 #include <crux/types.h>
 #include <crux/mm.h>
 #include <crux/list.h>
+#include <crux/rbtree.h>
 #include <crux/spinlock.h>
 #include <crux/sched.h>
 #include <crux/time.h>
@@ -98,7 +99,7 @@
  * Limits the number of shared buffers that guest can have at once. This
  * is to prevent case, when guests trick CRUX into exhausting its own
  * memory by allocating many small buffers. This value has been chosen
- * arbitrarily.
+ * arbitrarily, and is only the default: use "ffa_max_shm=" to change it.
  */
 #define FFA_MAX_SHM_COUNT               32
 
@@ -298,13 +299,17 @@ struct ffa_ctx {
     /* FF-A version used by the guest */
     uint32_t guest_vers;
     bool rx_is_free;
-    /* Used shared memory objects, struct ffa_shm_mem */
-    struct list_head shm_list;
+    /* Used shared memory objects, struct ffa_shm_mem, by handle */
+    struct rb_root shm_tree;
     /* Number of allocated shared memory object */
     unsigned int shm_count;
+    /* Memory share being received in fragments, if any */
+    struct ffa_shm_frag *shm_frag;
+    /* Used to make up handles for shm_frag */
+    uint32_t shm_frag_seq;
     struct ffa_ctx_notif notif;
     /*
-     * tx_lock is used to serialize access to tx
+     * tx_lock is used to serialize access to tx and shm_frag
      * rx_lock is used to serialize access to rx_is_free
      * lock is used for the rest in this struct
      */
@@ -330,6 +335,7 @@ extern DECLARE_BITMAP(ffa_fw_abi_supported, FFA_ABI_BITMAP_SIZE);
 
 bool ffa_shm_domain_destroy(struct domain *d);
 void ffa_handle_mem_share(struct cpu_user_regs *regs);
+void ffa_handle_mem_frag_tx(struct cpu_user_regs *regs);
 int ffa_handle_mem_reclaim(uint64_t handle, uint32_t flags);
 
 bool ffa_partinfo_init(void);
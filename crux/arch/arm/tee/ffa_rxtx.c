@@ -82,7 +82,7 @@ uint32_t ffa_handle_rxtx_map(uint32_t fid, register_t tx_addr,
         return FFA_RET_INVALID_PARAMETERS;
 
     /* Only normal RW RAM for now */
-    if ( t != p2m_ram_rw )
+    if ( !p2m_is_ram_writable(t) )
         goto err_put_tx_pg;
 
     rx_pg = get_page_from_gfn(d, gfn_x(gaddr_to_gfn(rx_addr)), &t, P2M_ALLOC);
@@ -90,9 +90,12 @@ uint32_t ffa_handle_rxtx_map(uint32_t fid, register_t tx_addr,
         goto err_put_tx_pg;
 
     /* Only normal RW RAM for now */
-    if ( t != p2m_ram_rw )
+    if ( !p2m_is_ram_writable(t) )
         goto err_put_rx_pg;
 
+    /* crux and the SPMC write to the RX buffer. */
+    p2m_log_dirty_mark(d, gaddr_to_gfn(rx_addr), 1);
+
     tx = __map_domain_page_global(tx_pg);
     if ( !tx )
         goto err_put_rx_pg;
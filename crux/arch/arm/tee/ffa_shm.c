@@ -6,11 +6,14 @@
 #include <crux/const.h>
 #include <crux/sizes.h>
 #include <crux/types.h>
+#include <crux/init.h>
 #include <crux/mm.h>
 #include <crux/lib.h>
-#include <crux/list.h>
+#include <crux/param.h>
+#include <crux/rbtree.h>
 #include <crux/spinlock.h>
 
+#include <asm/p2m.h>
 #include <asm/smccc.h>
 #include <asm/regs.h>
 
@@ -88,7 +91,7 @@ struct ffa_mem_transaction_int {
 };
 
 struct ffa_shm_mem {
-    struct list_head list;
+    struct rb_node node;        /* In ctx->shm_tree, by handle */
     uint16_t sender_id;
     uint16_t ep_id;     /* endpoint, the one lending */
     uint64_t handle;    /* FFA_HANDLE_INVALID if not set yet */
@@ -96,6 +99,46 @@ struct ffa_shm_mem {
     struct page_info *pages[];
 };
 
+/*
+ * A memory share the guest is transmitting in several fragments. The address
+ * ranges are consumed, and their pages pinned, as the fragments come in, so
+ * that only the ranges of the current fragment are ever looked at.
+ */
+struct ffa_shm_frag {
+    struct ffa_shm_mem *shm;
+    uint64_t handle;            /* Identifies the transaction to the guest */
+    uint32_t tot_len;           /* Of the memory transaction descriptor */
+    uint32_t offs;              /* How much of it has been received */
+    unsigned int pg_idx;        /* Number of pages pinned so far */
+};
+
+/* See FFA_MAX_SHM_COUNT */
+static unsigned int __read_mostly ffa_max_shm_count = FFA_MAX_SHM_COUNT;
+integer_param("ffa_max_shm", ffa_max_shm_count);
+
+static int32_t ffa_mem_share_ret(const struct arm_smccc_1_2_regs *resp,
+                                 uint64_t *handle)
+{
+    switch ( resp->a0 )
+    {
+    case FFA_ERROR:
+        if ( resp->a2 )
+            return resp->a2;
+        else
+            return FFA_RET_NOT_SUPPORTED;
+    case FFA_SUCCESS_32:
+        *handle = regpair_to_uint64(resp->a3, resp->a2);
+        return FFA_RET_OK;
+    case FFA_MEM_FRAG_RX:
+        *handle = regpair_to_uint64(resp->a2, resp->a1);
+        if ( resp->a3 > INT32_MAX ) /* Impossible value */
+            return FFA_RET_ABORTED;
+        return resp->a3 & INT32_MAX;
+    default:
+        return FFA_RET_NOT_SUPPORTED;
+    }
+}
+
 static int32_t ffa_mem_share(uint32_t tot_len, uint32_t frag_len,
                              register_t addr, uint32_t pg_count,
                              uint64_t *handle)
@@ -111,24 +154,24 @@ static int32_t ffa_mem_share(uint32_t tot_len, uint32_t frag_len,
 
     arm_smccc_1_2_smc(&arg, &resp);
 
-    switch ( resp.a0 )
-    {
-    case FFA_ERROR:
-        if ( resp.a2 )
-            return resp.a2;
-        else
-            return FFA_RET_NOT_SUPPORTED;
-    case FFA_SUCCESS_32:
-        *handle = regpair_to_uint64(resp.a3, resp.a2);
-        return FFA_RET_OK;
-    case FFA_MEM_FRAG_RX:
-        *handle = regpair_to_uint64(resp.a2, resp.a1);
-        if ( resp.a3 > INT32_MAX ) /* Impossible value */
-            return FFA_RET_ABORTED;
-        return resp.a3 & INT32_MAX;
-    default:
-        return FFA_RET_NOT_SUPPORTED;
-    }
+    return ffa_mem_share_ret(&resp, handle);
+}
+
+static int32_t ffa_mem_frag_tx(uint64_t *handle, uint32_t frag_len,
+                               uint16_t sender_id)
+{
+    struct arm_smccc_1_2_regs arg = {
+        .a0 = FFA_MEM_FRAG_TX,
+        .a1 = (uint32_t)*handle,
+        .a2 = *handle >> 32,
+        .a3 = frag_len,
+        .a4 = (uint32_t)sender_id << 16,
+    };
+    struct arm_smccc_1_2_regs resp;
+
+    arm_smccc_1_2_smc(&arg, &resp);
+
+    return ffa_mem_share_ret(&resp, handle);
 }
 
 static int32_t ffa_mem_reclaim(uint32_t handle_lo, uint32_t handle_hi,
@@ -141,48 +184,76 @@ static int32_t ffa_mem_reclaim(uint32_t handle_lo, uint32_t handle_hi,
 }
 
 /*
- * Gets all page and assigns them to the supplied shared memory object. If
- * this function fails then the caller is still expected to call
- * put_shm_pages() as a cleanup.
+ * Gets the pages of range_count address ranges and assigns them to the
+ * supplied shared memory object, starting at index *pg_idx, which is
+ * updated. The p2m lock is taken once, and the p2m walked once per mapping
+ * rather than once per page. If this function fails then the caller is
+ * still expected to call put_shm_pages() as a cleanup.
  */
 static int get_shm_pages(struct domain *d, struct ffa_shm_mem *shm,
                          const struct ffa_address_range *range,
-                         uint32_t range_count)
+                         uint32_t range_count, unsigned int *pg_idx)
 {
-    unsigned int pg_idx = 0;
-    gfn_t gfn;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int ret = FFA_RET_OK;
     unsigned int n;
-    unsigned int m;
-    p2m_type_t t;
-    uint64_t addr;
-    uint64_t page_count;
+
+    p2m_read_lock(p2m);
 
     for ( n = 0; n < range_count; n++ )
     {
-        page_count = ACCESS_ONCE(range[n].page_count);
-        addr = ACCESS_ONCE(range[n].address);
-        for ( m = 0; m < page_count; m++ )
+        uint64_t page_count = ACCESS_ONCE(range[n].page_count);
+        gfn_t gfn = gaddr_to_gfn(ACCESS_ONCE(range[n].address));
+
+        if ( page_count > shm->page_count - *pg_idx )
+        {
+            ret = FFA_RET_INVALID_PARAMETERS;
+            goto out;
+        }
+
+        while ( page_count )
         {
-            if ( pg_idx >= shm->page_count )
-                return FFA_RET_INVALID_PARAMETERS;
-
-            gfn = gaddr_to_gfn(addr + m * FFA_PAGE_SIZE);
-            shm->pages[pg_idx] = get_page_from_gfn(d, gfn_x(gfn), &t,
-						   P2M_ALLOC);
-            if ( !shm->pages[pg_idx] )
-                return FFA_RET_DENIED;
+            unsigned int order;
+            p2m_type_t t;
+            mfn_t mfn = p2m_get_entry(p2m, gfn, &t, NULL, &order, NULL);
+            uint64_t nr;
+
             /* Only normal RW RAM for now */
-            if ( t != p2m_ram_rw )
-                return FFA_RET_DENIED;
-            pg_idx++;
+            if ( !p2m_is_ram_writable(t) )
+            {
+                ret = FFA_RET_DENIED;
+                goto out;
+            }
+
+            /* All the pages up to the end of the mapping come for free. */
+            nr = min(page_count,
+                     (1UL << order) - (gfn_x(gfn) & ((1UL << order) - 1)));
+            page_count -= nr;
+            gfn = gfn_add(gfn, nr);
+
+            for ( ; nr; nr--, mfn = mfn_add(mfn, 1) )
+            {
+                struct page_info *pg = mfn_to_page(mfn);
+
+                if ( !mfn_valid(mfn) || !get_page(pg, d) )
+                {
+                    ret = FFA_RET_DENIED;
+                    goto out;
+                }
+                shm->pages[(*pg_idx)++] = pg;
+            }
         }
     }
 
-    /* The ranges must add up */
-    if ( pg_idx < shm->page_count )
-            return FFA_RET_INVALID_PARAMETERS;
+ out:
+    p2m_read_unlock(p2m);
 
-    return FFA_RET_OK;
+    /* The receivers may write to the pages behind the guest's back. */
+    for ( n = 0; ret == FFA_RET_OK && n < range_count; n++ )
+        p2m_log_dirty_mark(d, gaddr_to_gfn(ACCESS_ONCE(range[n].address)),
+                           ACCESS_ONCE(range[n].page_count));
+
+    return ret;
 }
 
 static void put_shm_pages(struct ffa_shm_mem *shm)
@@ -202,7 +273,7 @@ static bool inc_ctx_shm_count(struct domain *d, struct ffa_ctx *ctx)
 
     spin_lock(&ctx->lock);
 
-    if ( ctx->shm_count >= FFA_MAX_SHM_COUNT )
+    if ( ctx->shm_count >= ffa_max_shm_count )
     {
         ret = false;
     }
@@ -258,7 +329,10 @@ static struct ffa_shm_mem *alloc_ffa_shm_mem(struct domain *d,
 
     shm = xzalloc_flex_struct(struct ffa_shm_mem, pages, page_count);
     if ( shm )
+    {
         shm->page_count = page_count;
+        shm->handle = FFA_HANDLE_INVALID;
+    }
     else
         dec_ctx_shm_count(d, ctx);
 
@@ -277,6 +351,44 @@ static void free_ffa_shm_mem(struct domain *d, struct ffa_shm_mem *shm)
     xfree(shm);
 }
 
+/* Must only be called with ctx->lock held */
+static void insert_shm_mem(struct ffa_ctx *ctx, struct ffa_shm_mem *shm)
+{
+    struct rb_node **link = &ctx->shm_tree.rb_node, *parent = NULL;
+
+    while ( *link )
+    {
+        parent = *link;
+        if ( shm->handle < rb_entry(parent, struct ffa_shm_mem, node)->handle )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&shm->node, parent, link);
+    rb_insert_color(&shm->node, &ctx->shm_tree);
+}
+
+/* Must only be called with ctx->lock held */
+static struct ffa_shm_mem *find_shm_mem(struct ffa_ctx *ctx, uint64_t handle)
+{
+    struct rb_node *node = ctx->shm_tree.rb_node;
+
+    while ( node )
+    {
+        struct ffa_shm_mem *shm = rb_entry(node, struct ffa_shm_mem, node);
+
+        if ( handle < shm->handle )
+            node = node->rb_left;
+        else if ( handle > shm->handle )
+            node = node->rb_right;
+        else
+            return shm;
+    }
+
+    return NULL;
+}
+
 static void init_range(struct ffa_address_range *addr_range,
                        paddr_t pa)
 {
@@ -285,10 +397,60 @@ static void init_range(struct ffa_address_range *addr_range,
     addr_range->page_count = 1;
 }
 
+/*
+ * Transmit the frag_len bytes at the start of the ffa_tx buffer to the SPMC,
+ * as the next fragment of a tot_len long memory transaction descriptor, of
+ * which *sent bytes have already been transmitted.
+ */
+static int share_shm_frag(struct ffa_shm_mem *shm, uint32_t tot_len,
+                          uint32_t frag_len, uint32_t *sent)
+{
+    register_t handle_hi;
+    register_t handle_lo;
+    int32_t ret;
+
+    if ( !*sent )
+        ret = ffa_mem_share(tot_len, frag_len, 0, 0, &shm->handle);
+    else
+        ret = ffa_mem_frag_tx(&shm->handle, frag_len, shm->sender_id);
+
+    if ( ret >= 0 )
+    {
+        *sent += frag_len;
+
+        /*
+         * The SPMC must ask for the rest of the descriptor with
+         * FFA_MEM_FRAG_RX until it has it all, and only then return a
+         * handle with FFA_SUCCESS.
+         */
+        if ( *sent == tot_len )
+            ret = ret == FFA_RET_OK ? FFA_RET_OK : FFA_RET_ABORTED;
+        else if ( ret != FFA_RET_OK )
+            ret = ret == *sent ? FFA_RET_OK : FFA_RET_ABORTED;
+        else
+            /* Shared before we got to tell about all of the pages. */
+            ret = FFA_RET_ABORTED;
+    }
+
+    /*
+     * Once the SPMC has handed out a handle it holds on to the transaction,
+     * complete or not, until it is reclaimed. Do so before the caller drops
+     * its references to the pages.
+     */
+    if ( ret && shm->handle != FFA_HANDLE_INVALID )
+    {
+        uint64_to_regpair(&handle_hi, &handle_lo, shm->handle);
+        ffa_mem_reclaim(handle_lo, handle_hi, 0);
+        shm->handle = FFA_HANDLE_INVALID;
+    }
+
+    return ret;
+}
+
 /*
  * This function uses the ffa_tx buffer to transmit the memory transaction
- * descriptor. The function depends ffa_tx_buffer_lock to be used to guard
- * the buffer from concurrent use.
+ * descriptor, in several fragments if it doesn't fit. The function depends
+ * ffa_tx_buffer_lock to be used to guard the buffer from concurrent use.
  */
 static int share_shm(struct ffa_shm_mem *shm)
 {
@@ -301,9 +463,11 @@ static int share_shm(struct ffa_shm_mem *shm)
     void *buf = ffa_tx;
     uint32_t frag_len;
     uint32_t tot_len;
+    uint32_t sent = 0;
     paddr_t last_pa;
     unsigned int n;
     paddr_t pa;
+    int ret;
 
     ASSERT(spin_is_locked(&ffa_tx_buffer_lock));
     ASSERT(shm->page_count);
@@ -311,7 +475,6 @@ static int share_shm(struct ffa_shm_mem *shm)
     descr = buf;
     memset(descr, 0, sizeof(*descr));
     descr->sender_id = shm->sender_id;
-    descr->handle = shm->handle;
     descr->mem_reg_attr = FFA_NORMAL_MEM_REG_ATTR;
     descr->mem_access_count = 1;
     descr->mem_access_size = sizeof(*mem_access_array);
@@ -339,7 +502,7 @@ static int share_shm(struct ffa_shm_mem *shm)
 
     tot_len = ADDR_RANGE_OFFSET(descr->mem_access_count, region_count,
                                 region_descr->address_range_count);
-    if ( tot_len > max_frag_len )
+    if ( tot_len > max_frag_len && !ffa_fw_supports_fid(FFA_MEM_FRAG_TX) )
         return FFA_RET_NOT_SUPPORTED;
 
     addr_range = region_descr->address_range_array;
@@ -355,12 +518,51 @@ static int share_shm(struct ffa_shm_mem *shm)
             continue;
         }
 
+        /* Send what we have if there is no room for another range. */
+        if ( frag_len + sizeof(*addr_range) > max_frag_len )
+        {
+            ret = share_shm_frag(shm, tot_len, frag_len, &sent);
+            if ( ret )
+                return ret;
+            addr_range = buf;
+            frag_len = 0;
+        }
+        else
+            addr_range++;
+
         frag_len += sizeof(*addr_range);
-        addr_range++;
         init_range(addr_range, pa);
     }
 
-    return ffa_mem_share(tot_len, frag_len, 0, 0, &shm->handle);
+    return share_shm_frag(shm, tot_len, frag_len, &sent);
+}
+
+/*
+ * All the pages of shm have been collected: share them with the SPMC and,
+ * if that worked, start tracking shm.
+ */
+static int commit_shm(struct domain *d, struct ffa_shm_mem *shm,
+                      unsigned int pg_idx)
+{
+    struct ffa_ctx *ctx = d->arch.tee;
+    int ret;
+
+    /* The ranges must add up */
+    if ( pg_idx < shm->page_count )
+        return FFA_RET_INVALID_PARAMETERS;
+
+    /* Note that share_shm() uses our tx buffer */
+    spin_lock(&ffa_tx_buffer_lock);
+    ret = share_shm(shm);
+    spin_unlock(&ffa_tx_buffer_lock);
+    if ( ret )
+        return ret;
+
+    spin_lock(&ctx->lock);
+    insert_shm_mem(ctx, shm);
+    spin_unlock(&ctx->lock);
+
+    return FFA_RET_OK;
 }
 
 static int read_mem_transaction(uint32_t ffa_vers, const void *buf, size_t blen,
@@ -449,11 +651,15 @@ void ffa_handle_mem_share(struct cpu_user_regs *regs)
     struct domain *d = current->domain;
     struct ffa_ctx *ctx = d->arch.tee;
     struct ffa_shm_mem *shm = NULL;
+    struct ffa_shm_frag *frag;
     register_t handle_hi = 0;
     register_t handle_lo = 0;
     int ret = FFA_RET_DENIED;
+    unsigned int pg_idx = 0;
     uint32_t range_count;
+    uint32_t frag_ranges;
     uint32_t region_offs;
+    size_t ranges_offs;
     uint16_t dst_id;
 
     if ( !ffa_fw_supports_fid(FFA_MEM_SHARE_64) )
@@ -479,8 +685,7 @@ void ffa_handle_mem_share(struct cpu_user_regs *regs)
         goto out_set_ret;
     }
 
-    /* We currently only support a single fragment */
-    if ( frag_len != tot_len )
+    if ( frag_len != tot_len && !ffa_fw_supports_fid(FFA_MEM_FRAG_TX) )
     {
         ret = FFA_RET_NOT_SUPPORTED;
         goto out_set_ret;
@@ -492,6 +697,13 @@ void ffa_handle_mem_share(struct cpu_user_regs *regs)
         goto out_set_ret;
     }
 
+    /* Only one fragmented share in flight at a time */
+    if ( ctx->shm_frag )
+    {
+        ret = FFA_RET_BUSY;
+        goto out_unlock;
+    }
+
     if ( frag_len > ctx->page_count * FFA_PAGE_SIZE )
         goto out_unlock;
 
@@ -565,30 +777,53 @@ void ffa_handle_mem_share(struct cpu_user_regs *regs)
     shm->ep_id = dst_id;
 
     /*
-     * Check that the Composite memory region descriptor fits.
+     * Check that the Composite memory region descriptor fits. If the
+     * descriptor is fragmented the address ranges must be all that follows
+     * it, and the first fragment must end on a range boundary.
      */
-    if ( sizeof(*region_descr) + region_offs +
-         range_count * sizeof(struct ffa_address_range) > frag_len )
+    ranges_offs = sizeof(*region_descr) + region_offs;
+    frag_ranges = (frag_len - ranges_offs) / sizeof(struct ffa_address_range);
+    if ( frag_len == tot_len ? frag_ranges < range_count :
+         tot_len != ranges_offs +
+                    range_count * sizeof(struct ffa_address_range) ||
+         (frag_len - ranges_offs) % sizeof(struct ffa_address_range) )
     {
         ret = FFA_RET_INVALID_PARAMETERS;
         goto out;
     }
 
-    ret = get_shm_pages(d, shm, region_descr->address_range_array, range_count);
+    ret = get_shm_pages(d, shm, region_descr->address_range_array,
+                        min(frag_ranges, range_count), &pg_idx);
     if ( ret )
         goto out;
 
-    /* Note that share_shm() uses our tx buffer */
-    spin_lock(&ffa_tx_buffer_lock);
-    ret = share_shm(shm);
-    spin_unlock(&ffa_tx_buffer_lock);
+    if ( frag_len != tot_len )
+    {
+        frag = xzalloc(struct ffa_shm_frag);
+        if ( !frag )
+        {
+            ret = FFA_RET_NO_MEMORY;
+            goto out;
+        }
+        frag->shm = shm;
+        frag->handle = FFA_HANDLE_HYP_FLAG | ++ctx->shm_frag_seq;
+        frag->tot_len = tot_len;
+        frag->offs = frag_len;
+        frag->pg_idx = pg_idx;
+        ctx->shm_frag = frag;
+
+        /* Ask for the rest, see ffa_handle_mem_frag_tx() */
+        uint64_to_regpair(&handle_hi, &handle_lo, frag->handle);
+        ffa_set_regs(regs, FFA_MEM_FRAG_RX, handle_lo, handle_hi, frag_len,
+                     0, 0, 0, 0);
+        spin_unlock(&ctx->tx_lock);
+        return;
+    }
+
+    ret = commit_shm(d, shm, pg_idx);
     if ( ret )
         goto out;
 
-    spin_lock(&ctx->lock);
-    list_add_tail(&shm->list, &ctx->shm_list);
-    spin_unlock(&ctx->lock);
-
     uint64_to_regpair(&handle_hi, &handle_lo, shm->handle);
 
 out:
@@ -604,16 +839,81 @@ out_set_ret:
             ffa_set_regs_error(regs, ret);
 }
 
-/* Must only be called with ctx->lock held */
-static struct ffa_shm_mem *find_shm_mem(struct ffa_ctx *ctx, uint64_t handle)
+static void abort_shm_frag(struct domain *d)
+{
+    struct ffa_ctx *ctx = d->arch.tee;
+
+    free_ffa_shm_mem(d, ctx->shm_frag->shm);
+    XFREE(ctx->shm_frag);
+}
+
+void ffa_handle_mem_frag_tx(struct cpu_user_regs *regs)
 {
+    uint64_t handle = regpair_to_uint64(get_user_reg(regs, 2),
+                                        get_user_reg(regs, 1));
+    uint32_t frag_len = get_user_reg(regs, 3);
+    struct domain *d = current->domain;
+    struct ffa_ctx *ctx = d->arch.tee;
+    struct ffa_shm_frag *frag;
     struct ffa_shm_mem *shm;
+    register_t handle_hi;
+    register_t handle_lo;
+    int ret;
 
-    list_for_each_entry(shm, &ctx->shm_list, list)
-        if ( shm->handle == handle )
-            return shm;
+    if ( !spin_trylock(&ctx->tx_lock) )
+    {
+        ffa_set_regs_error(regs, FFA_RET_BUSY);
+        return;
+    }
 
-    return NULL;
+    frag = ctx->shm_frag;
+    if ( !frag || frag->handle != handle )
+    {
+        ret = FFA_RET_INVALID_PARAMETERS;
+        goto out_unlock;
+    }
+
+    /* From here on any error aborts the whole transaction. */
+    if ( !frag_len || frag_len > ctx->page_count * FFA_PAGE_SIZE ||
+         frag_len > frag->tot_len - frag->offs ||
+         frag_len % sizeof(struct ffa_address_range) )
+    {
+        ret = FFA_RET_INVALID_PARAMETERS;
+        goto out_abort;
+    }
+
+    ret = get_shm_pages(d, frag->shm, ctx->tx,
+                        frag_len / sizeof(struct ffa_address_range),
+                        &frag->pg_idx);
+    if ( ret )
+        goto out_abort;
+
+    frag->offs += frag_len;
+    if ( frag->offs < frag->tot_len )
+    {
+        uint64_to_regpair(&handle_hi, &handle_lo, handle);
+        ffa_set_regs(regs, FFA_MEM_FRAG_RX, handle_lo, handle_hi, frag->offs,
+                     0, 0, 0, 0);
+        spin_unlock(&ctx->tx_lock);
+        return;
+    }
+
+    ret = commit_shm(d, frag->shm, frag->pg_idx);
+    if ( ret )
+        goto out_abort;
+
+    shm = frag->shm;
+    XFREE(ctx->shm_frag);
+    uint64_to_regpair(&handle_hi, &handle_lo, shm->handle);
+    spin_unlock(&ctx->tx_lock);
+    ffa_set_regs_success(regs, handle_lo, handle_hi);
+    return;
+
+out_abort:
+    abort_shm_frag(d);
+out_unlock:
+    spin_unlock(&ctx->tx_lock);
+    ffa_set_regs_error(regs, ret);
 }
 
 int ffa_handle_mem_reclaim(uint64_t handle, uint32_t flags)
@@ -631,7 +931,7 @@ int ffa_handle_mem_reclaim(uint64_t handle, uint32_t flags)
     spin_lock(&ctx->lock);
     shm = find_shm_mem(ctx, handle);
     if ( shm )
-        list_del(&shm->list);
+        rb_erase(&shm->node, &ctx->shm_tree);
     spin_unlock(&ctx->lock);
     if ( !shm )
         return FFA_RET_INVALID_PARAMETERS;
@@ -642,7 +942,7 @@ int ffa_handle_mem_reclaim(uint64_t handle, uint32_t flags)
     if ( ret )
     {
         spin_lock(&ctx->lock);
-        list_add_tail(&shm->list, &ctx->shm_list);
+        insert_shm_mem(ctx, shm);
         spin_unlock(&ctx->lock);
     }
     else
@@ -656,21 +956,27 @@ int ffa_handle_mem_reclaim(uint64_t handle, uint32_t flags)
 bool ffa_shm_domain_destroy(struct domain *d)
 {
     struct ffa_ctx *ctx = d->arch.tee;
-    struct ffa_shm_mem *shm, *tmp;
+    struct rb_node *node, *next;
     int32_t res;
 
-    list_for_each_entry_safe(shm, tmp, &ctx->shm_list, list)
+    if ( ctx->shm_frag )
+        abort_shm_frag(d);
+
+    for ( node = rb_first(&ctx->shm_tree); node; node = next )
     {
+        struct ffa_shm_mem *shm = rb_entry(node, struct ffa_shm_mem, node);
         register_t handle_hi;
         register_t handle_lo;
 
+        next = rb_next(node);
+
         uint64_to_regpair(&handle_hi, &handle_lo, shm->handle);
         res = ffa_mem_reclaim(handle_lo, handle_hi, 0);
         switch ( res ) {
         case FFA_RET_OK:
             printk(CRUXLOG_G_DEBUG "%pd: ffa: Reclaimed handle %#lx\n",
                    d, shm->handle);
-            list_del(&shm->list);
+            rb_erase(&shm->node, &ctx->shm_tree);
             free_ffa_shm_mem(d, shm);
             break;
         case FFA_RET_DENIED:
@@ -695,12 +1001,12 @@ bool ffa_shm_domain_destroy(struct domain *d)
                    d, shm->handle, res);
 
             /*
-             * Remove the shm from the list and free it, but don't drop
+             * Remove the shm from the tree and free it, but don't drop
              * references. This results in having the shared physical pages
              * permanently allocate and also keeps the domain as a zombie
              * domain.
              */
-            list_del(&shm->list);
+            rb_erase(&shm->node, &ctx->shm_tree);
             xfree(shm);
             break;
         }
@@ -708,3 +1014,74 @@ bool ffa_shm_domain_destroy(struct domain *d)
 
     return !ctx->shm_count;
 }
+
+#ifdef CONFIG_SELF_TESTS
+/*
+ * ffa-shm-bench -> time looking up, and adding and removing, the handles of
+ * many shares, as done by FFA_MEM_SHARE and FFA_MEM_RECLAIM.
+ */
+static bool __initdata opt_shm_bench;
+boolean_param("ffa-shm-bench", opt_shm_bench);
+
+#define SHM_BENCH_COUNT 10000
+
+static int __init cf_check ffa_shm_bench(void)
+{
+    struct ffa_shm_mem **shm;
+    struct ffa_ctx *ctx;
+    s_time_t t[4];
+    unsigned int i;
+    int rc = -ENOMEM;
+
+    if ( !opt_shm_bench )
+        return 0;
+
+    ctx = xzalloc(struct ffa_ctx);
+    shm = xzalloc_array(struct ffa_shm_mem *, SHM_BENCH_COUNT);
+    if ( !ctx || !shm )
+        goto out;
+    ctx->shm_tree = RB_ROOT;
+
+    for ( i = 0; i < SHM_BENCH_COUNT; i++ )
+    {
+        shm[i] = xzalloc_flex_struct(struct ffa_shm_mem, pages, 0);
+        if ( !shm[i] )
+            goto out;
+        /* SPMCs hand out handles in all kinds of orders, scatter them. */
+        shm[i]->handle = (i + 1) * 0x9e3779b97f4a7c15UL;
+    }
+
+    t[0] = NOW();
+    for ( i = 0; i < SHM_BENCH_COUNT; i++ )
+        insert_shm_mem(ctx, shm[i]);
+    t[1] = NOW();
+    for ( i = 0; i < SHM_BENCH_COUNT; i++ )
+        if ( find_shm_mem(ctx, shm[i]->handle) != shm[i] )
+        {
+            printk(CRUXLOG_ERR "ffa: shm bench: lost handle %#lx\n",
+                   shm[i]->handle);
+            rc = -EINVAL;
+            goto out;
+        }
+    t[2] = NOW();
+    for ( i = 0; i < SHM_BENCH_COUNT; i++ )
+        rb_erase(&shm[i]->node, &ctx->shm_tree);
+    t[3] = NOW();
+
+    printk(CRUXLOG_INFO
+           "ffa: %u shares: insert %"PRI_stime" find %"PRI_stime" erase %"PRI_stime" ns per op\n",
+           SHM_BENCH_COUNT, (t[1] - t[0]) / SHM_BENCH_COUNT,
+           (t[2] - t[1]) / SHM_BENCH_COUNT, (t[3] - t[2]) / SHM_BENCH_COUNT);
+    rc = 0;
+
+ out:
+    if ( shm )
+        for ( i = 0; i < SHM_BENCH_COUNT; i++ )
+            xfree(shm[i]);
+    xfree(shm);
+    xfree(ctx);
+
+    return rc;
+}
+__initcall(ffa_shm_bench);
+#endif /* CONFIG_SELF_TESTS */
@@ -279,7 +279,7 @@ static struct page_info *get_domain_ram_page(gfn_t gfn)
     p2m_type_t t;
 
     page = get_page_from_gfn(current->domain, gfn_x(gfn), &t, P2M_ALLOC);
-    if ( !page || t != p2m_ram_rw )
+    if ( !page || !p2m_is_ram_writable(t) )
     {
         if ( page )
             put_page(page);
@@ -287,6 +287,9 @@ static struct page_info *get_domain_ram_page(gfn_t gfn)
         return NULL;
     }
 
+    /* OP-TEE may write to the page without crux noticing. */
+    p2m_log_dirty_mark(current->domain, gfn, 1);
+
     return page;
 }
 
@@ -22,6 +22,7 @@
 #include <crux/perfc.h>
 #include <crux/smp.h>
 #include <crux/softirq.h>
+#include <crux/stats.h>
 #include <crux/string.h>
 #include <crux/symbols.h>
 #include <crux/version.h>
@@ -41,6 +42,7 @@
 #include <asm/setup.h>
 #include <asm/smccc.h>
 #include <asm/traps.h>
+#include <asm/vfp.h>
 #include <asm/vgic.h>
 #include <asm/vtimer.h>
 
@@ -84,12 +86,15 @@ integer_param("debug_stack_lines", debug_stack_lines);
 static enum {
 	TRAP,
 	NATIVE,
+	ADAPTIVE,
 } vwfi;
 
 static int __init parse_vwfi(const char *s)
 {
 	if ( !strcmp(s, "native") )
 		vwfi = NATIVE;
+	else if ( !strcmp(s, "adaptive") )
+		vwfi = ADAPTIVE;
 	else
 		vwfi = TRAP;
 
@@ -97,6 +102,20 @@ static int __init parse_vwfi(const char *s)
 }
 custom_param("vwfi", parse_vwfi);
 
+/* Policy for domains created with CRUX_DOMCTL_CONFIG_WFI_DEFAULT. */
+unsigned int wfi_default_policy(void)
+{
+    switch ( vwfi )
+    {
+    case NATIVE:
+        return CRUX_DOMCTL_CONFIG_WFI_NATIVE;
+    case ADAPTIVE:
+        return CRUX_DOMCTL_CONFIG_WFI_ADAPTIVE;
+    default:
+        return CRUX_DOMCTL_CONFIG_WFI_TRAP;
+    }
+}
+
 register_t get_default_hcr_flags(void)
 {
     return  (HCR_PTW|HCR_BSU_INNER|HCR_AMO|HCR_IMO|HCR_FMO|HCR_VM|
@@ -1410,6 +1429,7 @@ static void do_trap_hypercall(struct cpu_user_regs *regs, register_t *nr,
                               const union hsr hsr)
 {
     struct vcpu *curr = current;
+    cycles_t start;
 
     if ( hsr.iss != CRUX_HYPERCALL_TAG )
     {
@@ -1421,10 +1441,14 @@ static void do_trap_hypercall(struct cpu_user_regs *regs, register_t *nr,
 
     perfc_incra(hypercalls, *nr);
 
+    start = stats_hypercall_start();
+
     call_handlers_arm(*nr, HYPERCALL_RESULT_REG(regs), HYPERCALL_ARG1(regs),
                       HYPERCALL_ARG2(regs), HYPERCALL_ARG3(regs),
                       HYPERCALL_ARG4(regs), HYPERCALL_ARG5(regs));
 
+    stats_hypercall_end(*nr, start);
+
 #ifndef NDEBUG
     if ( !curr->hcall_preempted && HYPERCALL_RESULT_REG(regs) != -ENOSYS )
     {
@@ -1831,6 +1855,8 @@ static void do_trap_stage2_abort_guest(struct cpu_user_regs *regs,
     mmio_info_t info;
     enum io_state state;
 
+    stats_event(CRUX_HYPFS_STATS_EV_P2M_FAULT);
+
     /*
      * If this bit has been set, it means that this stage-2 abort is caused
      * by a guest external abort. We treat this stage-2 abort as guest SError.
@@ -1875,9 +1901,13 @@ static void do_trap_stage2_abort_guest(struct cpu_user_regs *regs,
             .kind = xabt.s1ptw ? npfec_kind_in_gpt : npfec_kind_with_gla
         };
 
+        if ( npfec.write_access &&
+             p2m_log_dirty_fault(current->domain, gaddr_to_gfn(gpa)) )
+            return;
+
         p2m_mem_access_check(gpa, gva, npfec);
         /*
-         * The only way to get here right now is because of mem_access,
+         * The only ways to get here right now are mem_access and log-dirty,
          * thus reinjecting the exception to the guest is never required.
          */
         return;
@@ -2025,6 +2055,8 @@ void asmlinkage do_trap_guest_sync(struct cpu_user_regs *regs)
 {
     const union hsr hsr = { .bits = regs->hsr };
 
+    stats_trap(hsr.ec);
+
     switch ( hsr.ec )
     {
     case HSR_EC_WFI_WFE:
@@ -2046,7 +2078,8 @@ void asmlinkage do_trap_guest_sync(struct cpu_user_regs *regs)
         } else {
             /* Block the VCPU for WFI */
             perfc_incr(trap_wfi);
-            vcpu_block_unless_event_pending(current);
+            if ( !vcpu_wfi_poll(current) )
+                vcpu_block_unless_event_pending(current);
         }
         advance_pc(regs, hsr);
         break;
@@ -2081,6 +2114,17 @@ void asmlinkage do_trap_guest_sync(struct cpu_user_regs *regs)
         do_cp10(regs, hsr);
         break;
     case HSR_EC_CP:
+#ifdef CONFIG_ARM_64
+        /*
+         * On arm64, this is also how FP/SIMD accesses trapped by
+         * CPTR_EL2.TFP are reported, for both AArch32 and AArch64.
+         */
+        if ( vfp_lazy_trap(false) )
+        {
+            perfc_incr(trap_fp);
+            break;
+        }
+#endif
         GUEST_BUG_ON(!regs_mode_is_32bit(regs));
         perfc_incr(trap_cp);
         do_cp(regs, hsr);
@@ -2142,6 +2186,11 @@ void asmlinkage do_trap_guest_sync(struct cpu_user_regs *regs)
         break;
     case HSR_EC_SVE:
         GUEST_BUG_ON(regs_mode_is_32bit(regs));
+        if ( vfp_lazy_trap(true) )
+        {
+            perfc_incr(trap_fp);
+            break;
+        }
         gprintk(CRUXLOG_WARNING, "domain tried to use SVE while not allowed\n");
         inject_undef_exception(regs);
         break;
@@ -303,6 +303,11 @@ static int its_handle_int(struct virt_its *its, uint64_t *cmdptr)
     if ( vlpi == INVALID_LPI )
         return -1;
 
+    /* Directly injected events are made pending by the host ITS. */
+    if ( !gicv3_its_vlpi_cmd(its->d, its->doorbell_address, devid, eventid,
+                             GITS_CMD_INT) )
+        return 0;
+
     vgic_vcpu_inject_lpi(its->d, vlpi);
 
     return 0;
@@ -349,6 +354,13 @@ static int its_handle_clear(struct virt_its *its, uint64_t *cmdptr)
     if ( !read_itte(its, devid, eventid, &vcpu, &vlpi) )
         goto out_unlock;
 
+    if ( !gicv3_its_vlpi_cmd(its->d, its->doorbell_address, devid, eventid,
+                             GITS_CMD_CLEAR) )
+    {
+        ret = 0;
+        goto out_unlock;
+    }
+
     p = gicv3_its_get_event_pending_irq(its->d, its->doorbell_address,
                                         devid, eventid);
     /* Protect against an invalid LPI number. */
@@ -411,6 +423,7 @@ static int update_lpi_property(struct domain *d, struct pending_irq *p)
         return ret;
 
     write_atomic(&p->lpi_priority, property & LPI_PROP_PRIO_MASK);
+    gicv3_its_vm_set_property(d, p->irq, property);
 
     if ( property & LPI_PROP_ENABLED )
         set_bit(GIC_IRQ_GUEST_ENABLED, &p->status);
@@ -485,6 +498,10 @@ static int its_handle_inv(struct virt_its *its, uint64_t *cmdptr)
     /* Check whether the LPI needs to go on a VCPU. */
     update_lpi_vgic_status(vcpu, p);
 
+    /* Have the redistributor reload the mirrored property as well. */
+    gicv3_its_vlpi_cmd(d, its->doorbell_address, devid, eventid,
+                       GITS_CMD_INV);
+
     ret = 0;
 
 out_unlock:
@@ -569,6 +586,9 @@ static int its_handle_invall(struct virt_its *its, uint64_t *cmdptr)
     read_unlock(&its->d->arch.vgic.pend_lpi_tree_lock);
     spin_unlock_irqrestore(&vcpu->arch.vgic.lock, flags);
 
+    if ( its->d->arch.vgic.its_vm )
+        gicv3_its_vpe_invall(vcpu);
+
     return ret;
 }
 
@@ -614,6 +634,9 @@ static int its_discard_event(struct virt_its *its,
 
     spin_unlock_irqrestore(&vcpu->arch.vgic.lock, flags);
 
+    /* Hand a directly injected event back to its host LPI first. */
+    gicv3_its_unmap_vlpi(its->d, its->doorbell_address, vdevid, vevid);
+
     /* Remove the corresponding host LPI entry */
     return gicv3_remove_guest_event(its->d, its->doorbell_address,
                                     vdevid, vevid);
@@ -776,7 +799,18 @@ static int its_handle_mapti(struct virt_its *its, uint64_t *cmdptr)
     write_unlock(&its->d->arch.vgic.pend_lpi_tree_lock);
 
     if ( !ret )
+    {
+        /*
+         * With GICv4, have the ITS deliver this event straight to the
+         * vCPU. Should that fail, the host LPI mapped above stays in place
+         * and we keep emulating it.
+         */
+        if ( its->d->arch.vgic.its_vm )
+            gicv3_its_map_vlpi(its->d, its->doorbell_address, devid, eventid,
+                               vcpu, intid);
+
         return 0;
+    }
 
     /*
      * radix_tree_insert() returns an error either due to an internal
@@ -850,6 +884,8 @@ static int its_handle_movi(struct virt_its *its, uint64_t *cmdptr)
     if ( !write_itte(its, devid, eventid, collid, vlpi) )
         goto out_unlock;
 
+    gicv3_its_move_vlpi(its->d, its->doorbell_address, devid, eventid, nvcpu);
+
     ret = 0;
 
 out_unlock:
@@ -1554,6 +1590,15 @@ int vgic_v3_its_init_domain(struct domain *d)
         }
     }
 
+    if ( d->arch.vgic.has_its && gicv3_its_has_vlpis() )
+    {
+        ret = gicv3_its_vm_init(d);
+        if ( ret )
+            printk(CRUXLOG_WARNING
+                   "d%d: cannot inject LPIs directly (%d), emulating them\n",
+                   d->domain_id, ret);
+    }
+
     return 0;
 }
 
@@ -1561,6 +1606,8 @@ void vgic_v3_its_free_domain(struct domain *d)
 {
     struct virt_its *pos, *temp;
 
+    gicv3_its_vm_destroy(d);
+
     /* Cope with unitialized vITS */
     if ( list_head_is_null(&d->arch.vgic.vits_list) )
         return;
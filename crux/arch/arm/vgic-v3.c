@@ -1634,9 +1634,22 @@ static int vgic_v3_vcpu_init(struct vcpu *v)
     if ( v->vcpu_id == last_cpu || (v->vcpu_id == (d->max_vcpus - 1)) )
         v->arch.vgic.flags |= VGIC_V3_RDIST_LAST;
 
+    /*
+     * Without a vPE, LPIs targeting this vCPU keep going through the
+     * host LPI, so a failure here is not fatal.
+     */
+    if ( d->arch.vgic.its_vm && gicv3_its_vpe_init(v) )
+        printk(CRUXLOG_G_WARNING
+               "%pv: no vPE, falling back to emulated LPI injection\n", v);
+
     return 0;
 }
 
+static void vgic_v3_vcpu_free(struct vcpu *v)
+{
+    gicv3_its_vpe_destroy(v);
+}
+
 /*
  * Return the maximum number possible of re-distributor regions for
  * a given domain.
@@ -1806,6 +1819,7 @@ static int vgic_v3_lpi_get_priority(struct domain *d, uint32_t vlpi)
 
 static const struct vgic_ops v3_ops = {
     .vcpu_init   = vgic_v3_vcpu_init,
+    .vcpu_free   = vgic_v3_vcpu_free,
     .domain_init = vgic_v3_domain_init,
     .domain_free = vgic_v3_domain_free,
     .emulate_reg  = vgic_v3_emulate_reg,
@@ -14,8 +14,10 @@
 #include <crux/domain_page.h>
 #include <crux/softirq.h>
 #include <crux/irq.h>
+#include <crux/param.h>
 #include <crux/sched.h>
 #include <crux/perfc.h>
+#include <crux/stats.h>
 
 #include <asm/event.h>
 #include <asm/current.h>
@@ -24,6 +26,13 @@
 #include <asm/gic.h>
 #include <asm/vgic.h>
 
+/*
+ * Let injections into a vCPU running elsewhere (or not at all) set a bit
+ * rather than contend for its vgic lock.
+ */
+static bool __read_mostly opt_vgic_defer = true;
+boolean_param("vgic-defer-inject", opt_vgic_defer);
+
 static inline struct vgic_irq_rank *vgic_get_rank(struct vcpu *v,
                                                   unsigned int rank)
 {
@@ -204,6 +213,16 @@ int vcpu_vgic_init(struct vcpu *v)
     if ( v->arch.vgic.private_irqs == NULL )
       return -ENOMEM;
 
+    /* The summary word has a bit per word of the bitmap. */
+    ASSERT(BITS_TO_LONGS(vgic_num_irqs(v->domain)) <= BITS_PER_LONG);
+    v->arch.vgic.deferred_irqs =
+        xzalloc_array(unsigned long, BITS_TO_LONGS(vgic_num_irqs(v->domain)));
+    if ( v->arch.vgic.deferred_irqs == NULL )
+    {
+        XFREE(v->arch.vgic.private_irqs);
+        return -ENOMEM;
+    }
+
     /* SGIs/PPIs are always routed to this VCPU */
     vgic_rank_init(v->arch.vgic.private_irqs, 0, v->vcpu_id);
 
@@ -222,7 +241,12 @@ int vcpu_vgic_init(struct vcpu *v)
 
 int vcpu_vgic_free(struct vcpu *v)
 {
+    const struct vgic_ops *handler = v->domain->arch.vgic.handler;
+
+    if ( handler && handler->vcpu_free )
+        handler->vcpu_free(v);
     xfree(v->arch.vgic.private_irqs);
+    xfree(v->arch.vgic.deferred_irqs);
     return 0;
 }
 
@@ -255,6 +279,8 @@ bool vgic_migrate_irq(struct vcpu *old, struct vcpu *new, unsigned int irq)
 
     spin_lock_irqsave(&old->arch.vgic.lock, flags);
 
+    vgic_fold_deferred_irqs(old);
+
     p = irq_to_pending(old, irq);
 
     /* nothing to do for virtual interrupts */
@@ -550,6 +576,8 @@ void vgic_clear_pending_irqs(struct vcpu *v)
     unsigned long flags;
 
     spin_lock_irqsave(&v->arch.vgic.lock, flags);
+    write_atomic(&v->arch.vgic.deferred_summary, 0);
+    bitmap_zero(v->arch.vgic.deferred_irqs, vgic_num_irqs(v->domain));
     list_for_each_entry_safe ( p, t, &v->arch.vgic.inflight_irqs, inflight )
         list_del_init(&p->inflight);
     gic_clear_pending_irqs(v);
@@ -565,13 +593,116 @@ void vgic_remove_irq_from_queues(struct vcpu *v, struct pending_irq *p)
     gic_remove_from_lr_pending(v, p);
 }
 
+/* Mark @n pending and queue it for @v's LRs. */
+static void vgic_queue_irq(struct vcpu *v, struct pending_irq *n,
+                           unsigned int virq)
+{
+    struct pending_irq *iter;
+    uint8_t priority;
+
+    ASSERT(spin_is_locked(&v->arch.vgic.lock));
+
+    set_bit(GIC_IRQ_GUEST_QUEUED, &n->status);
+
+    if ( !list_empty(&n->inflight) )
+    {
+        gic_raise_inflight_irq(v, virq);
+        return;
+    }
+
+    priority = vgic_get_virq_priority(v, virq);
+    n->priority = priority;
+
+    /* the irq is enabled */
+    if ( test_bit(GIC_IRQ_GUEST_ENABLED, &n->status) )
+        gic_raise_guest_irq(v, virq, priority);
+
+    list_for_each_entry ( iter, &v->arch.vgic.inflight_irqs, inflight )
+    {
+        if ( iter->priority > priority )
+        {
+            list_add_tail(&n->inflight, &iter->inflight);
+            return;
+        }
+    }
+    list_add_tail(&n->inflight, &v->arch.vgic.inflight_irqs);
+}
+
+/*
+ * Injecting into a vCPU other than current only needs it to notice the
+ * IRQ before it next runs guest code, so record it in the vCPU's deferred
+ * bitmap and let vgic_fold_deferred_irqs() queue it under the vCPU's own
+ * lock.  An IRQ which is already deferred is coalesced, just as a second
+ * injection of a queued IRQ is.  LPIs still take the locked path.
+ */
+static bool vgic_defer_irq(struct vcpu *v, unsigned int virq)
+{
+    if ( !opt_vgic_defer || v == current || is_lpi(virq) )
+        return false;
+
+    /* vcpu offline */
+    if ( test_bit(_VPF_down, &v->pause_flags) )
+        return true;
+
+    perfc_incr(vgic_inject_deferred);
+
+    if ( test_and_set_bit(virq, v->arch.vgic.deferred_irqs) )
+    {
+        perfc_incr(vgic_inject_coalesced);
+        return true;
+    }
+
+    /* Pairs with the xchg() in vgic_fold_deferred_irqs(). */
+    smp_mb__before_atomic();
+    set_bit(virq / BITS_PER_LONG, &v->arch.vgic.deferred_summary);
+
+    vcpu_kick(v);
+
+    return true;
+}
+
+/*
+ * Queue all the IRQs deferred by vgic_defer_irq() in one pass.  Must be
+ * called with @v's vgic lock held.
+ */
+void vgic_fold_deferred_irqs(struct vcpu *v)
+{
+    unsigned long summary;
+    bool down;
+
+    ASSERT(spin_is_locked(&v->arch.vgic.lock));
+
+    if ( likely(!read_atomic(&v->arch.vgic.deferred_summary)) )
+        return;
+
+    summary = xchg(&v->arch.vgic.deferred_summary, 0UL);
+    down = test_bit(_VPF_down, &v->pause_flags);
+
+    for_each_set_bit ( w, summary )
+    {
+        unsigned long pending = xchg(&v->arch.vgic.deferred_irqs[w], 0UL);
+
+        if ( down )
+            continue;
+
+        for_each_set_bit ( i, pending )
+        {
+            unsigned int virq = w * BITS_PER_LONG + i;
+
+            vgic_queue_irq(v, irq_to_pending(v, virq), virq);
+            perfc_incr(vgic_deferred_folds);
+        }
+    }
+}
+
 void vgic_inject_irq(struct domain *d, struct vcpu *v, unsigned int virq,
                      bool level)
 {
-    uint8_t priority;
-    struct pending_irq *iter, *n;
+    struct pending_irq *n;
     unsigned long flags;
 
+    stats_event(CRUX_HYPFS_STATS_EV_VGIC_INJECT);
+
     /*
      * For edge triggered interrupts we always ignore a "falling edge".
      * For level triggered interrupts we shouldn't, but do anyways.
@@ -587,6 +718,9 @@ void vgic_inject_irq(struct domain *d, struct vcpu *v, unsigned int virq,
         v = vgic_get_target_vcpu(d->vcpu[0], virq);
     };
 
+    if ( vgic_defer_irq(v, virq) )
+        return;
+
     spin_lock_irqsave(&v->arch.vgic.lock, flags);
 
     n = irq_to_pending(v, virq);
@@ -604,31 +738,8 @@ void vgic_inject_irq(struct domain *d, struct vcpu *v, unsigned int virq,
         return;
     }
 
-    set_bit(GIC_IRQ_GUEST_QUEUED, &n->status);
-
-    if ( !list_empty(&n->inflight) )
-    {
-        gic_raise_inflight_irq(v, virq);
-        goto out;
-    }
-
-    priority = vgic_get_virq_priority(v, virq);
-    n->priority = priority;
-
-    /* the irq is enabled */
-    if ( test_bit(GIC_IRQ_GUEST_ENABLED, &n->status) )
-        gic_raise_guest_irq(v, virq, priority);
+    vgic_queue_irq(v, n, virq);
 
-    list_for_each_entry ( iter, &v->arch.vgic.inflight_irqs, inflight )
-    {
-        if ( iter->priority > priority )
-        {
-            list_add_tail(&n->inflight, &iter->inflight);
-            goto out;
-        }
-    }
-    list_add_tail(&n->inflight, &v->arch.vgic.inflight_irqs);
-out:
     spin_unlock_irqrestore(&v->arch.vgic.lock, flags);
 
     /* we have a new higher priority irq, inject it into the guest */
@@ -732,6 +843,8 @@ void vgic_check_inflight_irqs_pending(struct vcpu *v, unsigned int rank, uint32_
 
         spin_lock_irqsave(&v_target->arch.vgic.lock, flags);
 
+        vgic_fold_deferred_irqs(v_target);
+
         p = irq_to_pending(v_target, irq);
 
         if ( p && !list_empty(&p->inflight) )
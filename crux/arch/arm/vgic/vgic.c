@@ -18,6 +18,7 @@
 #include <crux/bug.h>
 #include <crux/list_sort.h>
 #include <crux/sched.h>
+#include <crux/stats.h>
 #include <asm/event.h>
 #include <asm/new_vgic.h>
 
@@ -384,6 +385,8 @@ void vgic_inject_irq(struct domain *d, struct vcpu *vcpu, unsigned int intid,
     struct vgic_irq *irq;
     unsigned long flags;
 
+    stats_event(CRUX_HYPFS_STATS_EV_VGIC_INJECT);
+
     irq = vgic_get_irq(d, vcpu, intid);
     if ( !irq )
         return;
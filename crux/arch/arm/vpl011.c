@@ -16,6 +16,7 @@
 #include <crux/init.h>
 #include <crux/lib.h>
 #include <crux/mm.h>
+#include <crux/perfc.h>
 #include <crux/sched.h>
 #include <crux/console.h>
 #include <crux/serial.h>
@@ -70,17 +71,15 @@ static void vpl011_update_interrupt_status(struct domain *d)
 }
 
 /*
- * vpl011_write_data_crux writes chars from the vpl011 out buffer to the
- * console. Only to be used when the backend is crux.
+ * vpl011_crux_putc adds a char to the vpl011 out buffer, flushing it to the
+ * console when a line is complete. Called with the lock taken.
  */
-static void vpl011_write_data_crux(struct domain *d, uint8_t data)
+static void vpl011_crux_putc(struct domain *d, const struct domain *input,
+                             uint8_t data)
 {
-    unsigned long flags;
-    struct vpl011 *vpl011 = &d->arch.vpl011;
-    struct vpl011_crux_backend *intf = vpl011->backend.crux;
-    struct domain *input = console_get_domain();
+    struct vpl011_crux_backend *intf = d->arch.vpl011.backend.crux;
 
-    VPL011_LOCK(d, flags);
+    ASSERT(spin_is_locked(&d->arch.vpl011.lock));
 
     intf->out[intf->out_prod++] = data;
     if ( d == input )
@@ -111,6 +110,23 @@ static void vpl011_write_data_crux(struct domain *d, uint8_t data)
             intf->out_prod = 0;
         }
     }
+}
+
+/*
+ * vpl011_write_data_crux writes chars from the vpl011 out buffer to the
+ * console. Only to be used when the backend is crux.
+ */
+static void vpl011_write_data_crux(struct domain *d, uint8_t data)
+{
+    unsigned long flags;
+    struct vpl011 *vpl011 = &d->arch.vpl011;
+    struct domain *input = console_get_domain();
+
+    perfc_incr(vpl011_dr_writes);
+
+    VPL011_LOCK(d, flags);
+
+    vpl011_crux_putc(d, input, data);
 
     /*
      * When backend is in crux, we tell guest we are always ready for new data
@@ -582,6 +598,193 @@ static void vpl011_data_avail(struct domain *d,
         vpl011->uartfr |= TXFE;
 }
 
+/*
+ * Paravirtual console ring.
+ *
+ * With the backend in crux every byte written to UARTDR costs the guest a
+ * trap. Domains which ask for it additionally get a standard PV console
+ * page in their magic region, and an event channel looped back to crux,
+ * both advertised through HVM_PARAM_CONSOLE_{PFN,EVTCHN}. The guest fills
+ * the out ring and kicks once per batch; the data is then fed through the
+ * same line buffer as the emulated UART, which remains usable throughout.
+ */
+#define VPL011_PV_PFN_OFFSET 0
+
+static int vpl011_pv_rx_char(struct domain *d, char c)
+{
+    unsigned long flags;
+    struct vpl011 *vpl011 = &d->arch.vpl011;
+    struct cruxcons_interface *intf = vpl011->pv.intf;
+    CRUXCONS_RING_IDX in_cons, in_prod;
+
+    VPL011_LOCK(d, flags);
+
+    in_cons = ACCESS_ONCE(intf->in_cons);
+    in_prod = intf->in_prod;
+
+    smp_mb();
+
+    if ( cruxcons_queued(in_prod, in_cons, sizeof(intf->in)) >=
+         sizeof(intf->in) )
+    {
+        VPL011_UNLOCK(d, flags);
+        return -ENOSPC;
+    }
+
+    intf->in[cruxcons_mask(in_prod, sizeof(intf->in))] = c;
+
+    smp_wmb();
+
+    intf->in_prod = in_prod + 1;
+
+    VPL011_UNLOCK(d, flags);
+
+    notify_via_crux_event_channel(d, vpl011->pv.evtchn);
+
+    return 0;
+}
+
+static void vpl011_pv_notification(struct vcpu *v, unsigned int port)
+{
+    unsigned long flags;
+    struct domain *d = v->domain;
+    struct vpl011 *vpl011 = &d->arch.vpl011;
+    struct cruxcons_interface *intf = vpl011->pv.intf;
+    struct domain *input = console_get_domain();
+    CRUXCONS_RING_IDX out_cons, out_prod;
+    bool consumed;
+
+    perfc_incr(vpl011_pv_kicks);
+
+    VPL011_LOCK(d, flags);
+
+    vpl011->pv.connected = true;
+
+    out_cons = intf->out_cons;
+    out_prod = ACCESS_ONCE(intf->out_prod);
+
+    smp_rmb();
+
+    /* Don't trust the guest's producer: consume at most one ring's worth. */
+    if ( cruxcons_queued(out_prod, out_cons, sizeof(intf->out)) >
+         sizeof(intf->out) )
+        out_cons = out_prod - sizeof(intf->out);
+
+    consumed = out_cons != out_prod;
+    perfc_add(vpl011_pv_bytes, out_prod - out_cons);
+
+    while ( out_cons != out_prod )
+        vpl011_crux_putc(d, input,
+                         intf->out[cruxcons_mask(out_cons++,
+                                                 sizeof(intf->out))]);
+
+    smp_mb();
+
+    intf->out_cons = out_cons;
+
+    VPL011_UNLOCK(d, flags);
+
+    console_put_domain(input);
+
+    /* Tell the guest there is room in the ring again. */
+    if ( consumed )
+        notify_via_crux_event_channel(d, vpl011->pv.evtchn);
+}
+
+static void vpl011_pv_deinit(struct domain *d)
+{
+    struct vpl011 *vpl011 = &d->arch.vpl011;
+
+    vpl011->pv.connected = false;
+
+    if ( vpl011->pv.evtchn )
+    {
+        free_crux_event_channel(d, vpl011->pv.evtchn);
+        vpl011->pv.evtchn = 0;
+    }
+
+    if ( vpl011->pv.intf )
+        destroy_ring_for_helper((void **)&vpl011->pv.intf, vpl011->pv.page);
+}
+
+int domain_vpl011_init_pv(struct domain *d)
+{
+    struct vpl011 *vpl011 = &d->arch.vpl011;
+    evtchn_bind_interdomain_t bind;
+    struct page_info *pg;
+    gfn_t gfn;
+    int rc;
+
+    /* A backend in another domain provides its own PV console. */
+    if ( vpl011->backend_in_domain || !vpl011->backend.crux ||
+         vpl011->pv.intf )
+        return -EINVAL;
+
+    if ( (UINT_MAX - d->max_pages) < 1 )
+    {
+        printk(CRUXLOG_ERR "%pd: Over-allocation for d->max_pages by 1 page.\n",
+               d);
+        return -EINVAL;
+    }
+
+    d->max_pages += 1;
+    pg = alloc_domheap_page(d, 0);
+    if ( pg == NULL )
+    {
+        rc = -ENOMEM;
+        goto out_max_pages;
+    }
+
+    if ( !is_domain_direct_mapped(d) )
+        gfn = gaddr_to_gfn(GUEST_MAGIC_BASE +
+                           (VPL011_PV_PFN_OFFSET << PAGE_SHIFT));
+    else
+        gfn = gaddr_to_gfn(page_to_maddr(pg));
+
+    rc = guest_physmap_add_page(d, gfn, page_to_mfn(pg), 0);
+    if ( rc )
+        goto out_free_page;
+
+    rc = prepare_ring_for_helper(d, gfn_x(gfn), &vpl011->pv.page,
+                                 (void **)&vpl011->pv.intf);
+    if ( rc < 0 )
+        goto out_remove_page;
+
+    clear_page(vpl011->pv.intf);
+
+    rc = alloc_unbound_crux_event_channel(d, 0, d->domain_id,
+                                         vpl011_pv_notification);
+    if ( rc < 0 )
+        goto out;
+
+    vpl011->pv.evtchn = rc;
+
+    /* Bind the guest's end of the channel; it is left pending. */
+    bind.remote_dom = d->domain_id;
+    bind.remote_port = vpl011->pv.evtchn;
+    rc = evtchn_bind_interdomain(&bind, d, 0);
+    if ( rc )
+        goto out;
+
+    d->arch.hvm.params[HVM_PARAM_CONSOLE_PFN] = gfn_x(gfn);
+    d->arch.hvm.params[HVM_PARAM_CONSOLE_EVTCHN] = bind.local_port;
+
+    return 0;
+
+out:
+    vpl011_pv_deinit(d);
+out_remove_page:
+    /* If it is still mapped, leave the page with the domain. */
+    if ( guest_physmap_remove_page(d, gfn, page_to_mfn(pg), 0) )
+        return rc;
+out_free_page:
+    free_domheap_page(pg);
+out_max_pages:
+    d->max_pages -= 1;
+
+    return rc;
+}
+
 /*
  * vpl011_rx_char_crux adds a char to a domain's vpl011 receive buffer.
  */
@@ -599,6 +802,10 @@ int vpl011_rx_char_crux(struct domain *d, char c)
     if ( intf == NULL )
         return -ENODEV;
 
+    /* Once the guest uses the PV ring, input goes there instead. */
+    if ( ACCESS_ONCE(vpl011->pv.connected) )
+        return vpl011_pv_rx_char(d, c);
+
     VPL011_LOCK(d, flags);
 
     in_cons = intf->in_cons;
@@ -798,7 +1005,10 @@ void domain_vpl011_deinit(struct domain *d)
         }
     }
     else
+    {
+        vpl011_pv_deinit(d);
         XFREE(vpl011->backend.crux);
+    }
 }
 
 /*
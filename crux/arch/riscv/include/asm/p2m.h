@@ -22,6 +22,14 @@ typedef enum {
 
 #include <crux/p2m-common.h>
 
+#define p2m_is_ram_writable(t) ((t) == p2m_ram_rw)
+
+/* No log-dirty support yet. */
+static inline void p2m_log_dirty_mark(struct domain *d, gfn_t gfn,
+                                      unsigned long nr)
+{
+}
+
 static inline int get_page_and_type(struct page_info *page,
                                     struct domain *domain,
                                     unsigned long type)
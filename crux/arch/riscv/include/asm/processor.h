@@ -54,8 +54,9 @@ struct cpu_user_regs
 };
 
 /* TODO: need to implement */
-#define cpu_to_core(cpu)   0
-#define cpu_to_socket(cpu) 0
+#define cpu_to_core(cpu)    0
+#define cpu_to_cluster(cpu) 0
+#define cpu_to_socket(cpu)  0
 
 static inline void cpu_relax(void)
 {
@@ -24,9 +24,11 @@
 #include <crux/lib.h>
 #include <crux/nospec.h>
 #include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/sched.h>
 #include <crux/sections.h>
 #include <crux/time.h>
+#include <crux/vmap.h>
 
 #include <xsm/xsm.h>
 
@@ -53,6 +55,8 @@ CHECK_argo_send_addr;
 #define MAX_RINGS_PER_DOMAIN            128U
 #define MAX_NOTIFY_COUNT                256U
 #define MAX_PENDING_PER_RING             32U
+/* Bytes sendv_batch copies before it considers returning early. */
+#define MAX_BATCH_BYTES              (256U << 10)
 
 /* All messages on the ring are padded to a multiple of the slot size. */
 #define ROUNDUP_MESSAGE(a) ROUNDUP((a), CRUX_ARGO_MSG_SLOT_SIZE)
@@ -74,6 +78,7 @@ DEFINE_CRUX_GUEST_HANDLE(crux_argo_ring_t);
 DEFINE_CRUX_GUEST_HANDLE(crux_argo_ring_data_t);
 DEFINE_CRUX_GUEST_HANDLE(crux_argo_ring_data_ent_t);
 DEFINE_CRUX_GUEST_HANDLE(crux_argo_send_addr_t);
+DEFINE_CRUX_GUEST_HANDLE(crux_argo_send_msg_t);
 DEFINE_CRUX_GUEST_HANDLE(crux_argo_unregister_ring_t);
 #ifdef CONFIG_COMPAT
 DEFINE_COMPAT_HANDLE(compat_argo_iov_t);
@@ -81,6 +86,7 @@ DEFINE_COMPAT_HANDLE(compat_argo_iov_t);
 
 static bool __read_mostly opt_argo;
 static bool __read_mostly opt_argo_mac_permissive;
+static bool __read_mostly opt_argo_ring_vmap;
 
 static int __init cf_check parse_argo(const char *s)
 {
@@ -96,6 +102,8 @@ static int __init cf_check parse_argo(const char *s)
             opt_argo = val;
         else if ( (val = parse_boolean("mac-permissive", s, ss)) >= 0 )
             opt_argo_mac_permissive = val;
+        else if ( (val = parse_boolean("ring-vmap", s, ss)) >= 0 )
+            opt_argo_ring_vmap = val;
         else
             rc = -EINVAL;
 
@@ -130,6 +138,8 @@ struct argo_ring_info
     unsigned int tx_ptr;
     /* mapped ring pages protected by L3 */
     void **mfn_mapping;
+    /* contiguous mapping of the whole ring, if any, protected by L3 */
+    void *va;
     /* list of mfns of guest ring, protected by L3 */
     mfn_t *mfns;
     /* list of struct pending_ent for this ring, protected by L3 */
@@ -440,6 +450,7 @@ signal_domain(struct domain *d)
 {
     argo_dprintk("signalling domid:%u\n", d->domain_id);
 
+    perfc_incr(argo_signal);
     send_guest_domain_virq(d, VIRQ_ARGO);
 }
 
@@ -462,6 +473,12 @@ ring_unmap(const struct domain *d, struct argo_ring_info *ring_info)
 
     ASSERT(LOCKING_L3(d, ring_info));
 
+    if ( ring_info->va )
+    {
+        vunmap(ring_info->va);
+        ring_info->va = NULL;
+    }
+
     if ( !ring_info->mfn_mapping )
         return;
 
@@ -488,11 +505,9 @@ ring_map_page(const struct domain *d, struct argo_ring_info *ring_info,
     ASSERT(LOCKING_L3(d, ring_info));
 
     /*
-     * FIXME: Investigate using vmap to create a single contiguous virtual
-     * address space mapping of the ring instead of using the array of single
-     * page mappings.
-     * Affects logic in memcpy_to_guest_ring, the mfn_mapping array data
-     * structure, and places where ring mappings are added or removed.
+     * With "argo=ring-vmap" the whole ring is mapped contiguously when it is
+     * registered, see ring_vmap(). Otherwise, or if that failed, single page
+     * mappings are made on demand and kept until the ring goes away.
      */
 
     if ( i >= ring_info->nmfns )
@@ -512,6 +527,14 @@ ring_map_page(const struct domain *d, struct argo_ring_info *ring_info,
         return -ENOMEM;
     }
 
+    if ( ring_info->va )
+    {
+        if ( out_ptr )
+            *out_ptr = ring_info->va + ((unsigned long)i << PAGE_SHIFT);
+
+        return 0;
+    }
+
     if ( !ring_info->mfn_mapping[i] )
     {
         ring_info->mfn_mapping[i] = map_domain_page_global(ring_info->mfns[i]);
@@ -533,6 +556,24 @@ ring_map_page(const struct domain *d, struct argo_ring_info *ring_info,
     return 0;
 }
 
+static void
+ring_vmap(const struct domain *d, struct argo_ring_info *ring_info)
+{
+    ASSERT(LOCKING_Write_rings_L2(d));
+    ASSERT(!ring_info->va);
+
+    if ( !opt_argo_ring_vmap )
+        return;
+
+    /* Not fatal: ring_map_page falls back to mapping single pages. */
+    ring_info->va = vmap(ring_info->mfns, ring_info->nmfns);
+    if ( !ring_info->va )
+        gprintk(CRUXLOG_WARNING,
+                "argo: ring (vm%u:%x vm%u) %p failed to vmap %u pages\n",
+                ring_info->id.domain_id, ring_info->id.aport,
+                ring_info->id.partner_id, ring_info, ring_info->nmfns);
+}
+
 static void
 update_tx_ptr(const struct domain *d, struct argo_ring_info *ring_info,
               uint32_t tx_ptr)
@@ -540,10 +581,10 @@ update_tx_ptr(const struct domain *d, struct argo_ring_info *ring_info,
     crux_argo_ring_t *ringp;
 
     ASSERT(LOCKING_L3(d, ring_info));
-    ASSERT(ring_info->mfn_mapping[0]);
+    ASSERT(ring_info->va || ring_info->mfn_mapping[0]);
 
     ring_info->tx_ptr = tx_ptr;
-    ringp = ring_info->mfn_mapping[0];
+    ringp = ring_info->va ?: ring_info->mfn_mapping[0];
 
     write_atomic(&ringp->tx_ptr, tx_ptr);
     smp_wmb();
@@ -562,6 +603,21 @@ memcpy_to_guest_ring(const struct domain *d, struct argo_ring_info *ring_info,
 
     ASSERT(LOCKING_L3(d, ring_info));
 
+    /* A contiguous mapping takes the whole write in one go. */
+    if ( ring_info->va )
+    {
+        if ( offset + len > ((unsigned long)ring_info->nmfns << PAGE_SHIFT) )
+            return -EFAULT;
+
+        dst = ring_info->va + offset;
+        if ( src )
+            memcpy(dst, src, len);
+        else if ( copy_from_guest(dst, src_hnd, len) )
+            return -EFAULT;
+
+        return 0;
+    }
+
     offset &= ~PAGE_MASK;
 
     if ( len + offset > CRUX_ARGO_MAX_RING_SIZE )
@@ -1426,17 +1482,12 @@ find_ring_mfn(struct domain *d, gfn_t gfn, mfn_t *mfn)
 
     *mfn = page_to_mfn(page);
 
-    switch ( p2mt )
-    {
-    case p2m_ram_rw:
-        if ( !get_page_type(page, PGT_writable_page) )
-            ret = -EINVAL;
-        break;
-
-    default:
+    if ( !p2m_is_ram_writable(p2mt) ||
+         !get_page_type(page, PGT_writable_page) )
         ret = -EINVAL;
-        break;
-    }
+    else
+        /* Senders write to the ring through crux's mapping. */
+        p2m_log_dirty_mark(d, gfn, 1);
 
     if ( unlikely(ret) )
         put_page(page);
@@ -1520,6 +1571,8 @@ find_ring_mfns(struct domain *d, struct argo_ring_info *ring_info,
     {
         ASSERT(ring_info->nmfns == NPAGES_RING(len));
 
+        ring_vmap(d, ring_info);
+
         argo_dprintk("argo: vm%u ring (vm%u:%x vm%u) %p "
                      "mfn_mapping %p len %u nmfns %u\n",
                      d->domain_id, ring_info->id.domain_id,
@@ -1961,6 +2014,59 @@ notify(struct domain *currd,
     return ret;
 }
 
+static int
+sendv_check_addr(const struct domain *src_d, crux_argo_addr_t *src_addr,
+                 const crux_argo_addr_t *dst_addr)
+{
+    /* Check padding is zeroed. */
+    if ( unlikely(src_addr->pad || dst_addr->pad) )
+        return -EINVAL;
+
+    if ( src_addr->domain_id == CRUX_ARGO_DOMID_ANY )
+         src_addr->domain_id = src_d->domain_id;
+
+    /* No domain is currently authorized to send on behalf of another */
+    if ( unlikely(src_addr->domain_id != src_d->domain_id) )
+        return -EPERM;
+
+    return 0;
+}
+
+static int
+sendv_ring(const struct domain *dst_d, struct argo_ring_info *ring_info,
+           const struct argo_ring_id *src_id, crux_argo_iov_t *iovs,
+           unsigned int niov, uint32_t message_type, unsigned int *len)
+{
+    int ret;
+
+    ASSERT(LOCKING_L3(dst_d, ring_info));
+
+    /*
+     * Obtain the total size of data to transmit -- sets the 'len' variable
+     * -- and sanity check that the iovs conform to size and number limits.
+     */
+    ret = iov_count(iovs, niov, len);
+    if ( ret )
+        return ret;
+
+    ret = ringbuf_insert(dst_d, ring_info, src_id, iovs, niov, message_type,
+                         *len);
+    if ( ret == -EAGAIN )
+    {
+        int rc;
+
+        argo_dprintk("argo_ringbuf_sendv failed, EAGAIN\n");
+        /* requeue to issue a notification when space is there */
+        rc = pending_requeue(dst_d, ring_info, src_id->domain_id, *len);
+        if ( rc )
+            ret = rc;
+    }
+    else if ( !ret )
+        perfc_incr(argo_msgs);
+
+    return ret;
+}
+
 static long
 sendv(struct domain *src_d, crux_argo_addr_t *src_addr,
       const crux_argo_addr_t *dst_addr, crux_argo_iov_t *iovs, unsigned int niov,
@@ -1976,16 +2082,9 @@ sendv(struct domain *src_d, crux_argo_addr_t *src_addr,
                  src_addr->domain_id, src_addr->aport, dst_addr->domain_id,
                  dst_addr->aport, niov, message_type);
 
-    /* Check padding is zeroed. */
-    if ( unlikely(src_addr->pad || dst_addr->pad) )
-        return -EINVAL;
-
-    if ( src_addr->domain_id == CRUX_ARGO_DOMID_ANY )
-         src_addr->domain_id = src_d->domain_id;
-
-    /* No domain is currently authorized to send on behalf of another */
-    if ( unlikely(src_addr->domain_id != src_d->domain_id) )
-        return -EPERM;
+    ret = sendv_check_addr(src_d, src_addr, dst_addr);
+    if ( ret )
+        return ret;
 
     src_id.aport = src_addr->aport;
     src_id.domain_id = src_d->domain_id;
@@ -2038,26 +2137,8 @@ sendv(struct domain *src_d, crux_argo_addr_t *src_addr,
     {
         spin_lock(&ring_info->L3_lock);
 
-        /*
-         * Obtain the total size of data to transmit -- sets the 'len' variable
-         * -- and sanity check that the iovs conform to size and number limits.
-         */
-        ret = iov_count(iovs, niov, &len);
-        if ( !ret )
-        {
-            ret = ringbuf_insert(dst_d, ring_info, &src_id, iovs, niov,
-                                 message_type, len);
-            if ( ret == -EAGAIN )
-            {
-                int rc;
-
-                argo_dprintk("argo_ringbuf_sendv failed, EAGAIN\n");
-                /* requeue to issue a notification when space is there */
-                rc = pending_requeue(dst_d, ring_info, src_id.domain_id, len);
-                if ( rc )
-                    ret = rc;
-            }
-        }
+        ret = sendv_ring(dst_d, ring_info, &src_id, iovs, niov, message_type,
+                         &len);
 
         spin_unlock(&ring_info->L3_lock);
     }
@@ -2076,6 +2157,146 @@ sendv(struct domain *src_d, crux_argo_addr_t *src_addr,
     return ( ret < 0 ) ? ret : len;
 }
 
+static int
+sendv_batch_check(const struct domain *src_d, crux_argo_send_msg_t *msg)
+{
+    if ( unlikely(msg->pad) )
+        return -EINVAL;
+
+    return sendv_check_addr(src_d, &msg->addr.src, &msg->addr.dst);
+}
+
+static long
+sendv_batch(struct domain *src_d,
+            CRUX_GUEST_HANDLE_PARAM(crux_argo_send_msg_t) msgs_hnd,
+            unsigned int nmsg)
+{
+    crux_argo_send_msg_t msg;
+    unsigned int sent = 0;
+    unsigned long bytes = 0;
+    bool stop = false;
+    int ret = 0;
+
+    if ( !nmsg )
+        return 0;
+
+    perfc_incr(argo_batch);
+
+    if ( __copy_from_guest(&msg, msgs_hnd, 1) )
+        return -EFAULT;
+
+    /* One pass per run of consecutive messages to the same ring. */
+    while ( !ret && !stop && sent < nmsg )
+    {
+        const crux_argo_addr_t dst_addr = msg.addr.dst;
+        struct argo_ring_info *ring_info;
+        struct domain *dst_d;
+        unsigned int run = 0;
+
+        ret = sendv_batch_check(src_d, &msg);
+        if ( ret )
+            break;
+
+        dst_d = rcu_lock_domain_by_id(dst_addr.domain_id);
+        if ( !dst_d )
+        {
+            ret = -ESRCH;
+            break;
+        }
+
+        ret = xsm_argo_send(src_d, dst_d);
+        if ( ret )
+        {
+            gprintk(CRUXLOG_ERR, "argo: XSM REJECTED %i -> %i\n",
+                    src_d->domain_id, dst_d->domain_id);
+
+            rcu_unlock_domain(dst_d);
+            break;
+        }
+
+        read_lock(&L1_global_argo_rwlock);
+
+        if ( !src_d->argo )
+            ret = -ENODEV;
+        else if ( !dst_d->argo )
+            ret = -ECONNREFUSED;
+        else
+        {
+            read_lock(&dst_d->argo->rings_L2_rwlock);
+
+            ring_info = find_ring_info_by_match(dst_d, dst_addr.aport,
+                                                src_d->domain_id);
+            if ( !ring_info )
+                ret = -ECONNREFUSED;
+            else
+            {
+                spin_lock(&ring_info->L3_lock);
+
+                for ( ; ; )
+                {
+                    struct argo_ring_id src_id = {
+                        .aport = msg.addr.src.aport,
+                        .domain_id = src_d->domain_id,
+                        .partner_id = dst_addr.domain_id,
+                    };
+                    unsigned int len;
+
+                    ret = sendv_ring(dst_d, ring_info, &src_id, &msg.iov, 1,
+                                     msg.message_type, &len);
+                    if ( ret )
+                        break;
+
+                    if ( sent + ++run == nmsg )
+                        break;
+
+                    /*
+                     * Bound the time spent with the ring locked, and in the
+                     * hypercall: the caller resubmits what is left.
+                     */
+                    bytes += len;
+                    if ( bytes >= MAX_BATCH_BYTES ||
+                         hypercall_preempt_check() )
+                    {
+                        stop = true;
+                        break;
+                    }
+
+                    if ( __copy_from_guest_offset(&msg, msgs_hnd, sent + run,
+                                                  1) )
+                    {
+                        ret = -EFAULT;
+                        break;
+                    }
+
+                    if ( msg.addr.dst.domain_id != dst_addr.domain_id ||
+                         msg.addr.dst.aport != dst_addr.aport )
+                        break;
+
+                    ret = sendv_batch_check(src_d, &msg);
+                    if ( ret )
+                        break;
+                }
+
+                spin_unlock(&ring_info->L3_lock);
+            }
+
+            read_unlock(&dst_d->argo->rings_L2_rwlock);
+        }
+
+        read_unlock(&L1_global_argo_rwlock);
+
+        /* A single signal covers the whole run. */
+        if ( run )
+            signal_domain(dst_d);
+
+        rcu_unlock_domain(dst_d);
+
+        sent += run;
+    }
+
+    return sent ?: ret;
+}
+
 long
 do_argo_op(unsigned int cmd, CRUX_GUEST_HANDLE_PARAM(void) arg1,
            CRUX_GUEST_HANDLE_PARAM(void) arg2, unsigned long raw_arg3,
@@ -2188,6 +2409,30 @@ do_argo_op(unsigned int cmd, CRUX_GUEST_HANDLE_PARAM(void) arg1,
         break;
     }
 
+    case CRUX_ARGO_OP_sendv_batch:
+    {
+        CRUX_GUEST_HANDLE_PARAM(crux_argo_send_msg_t) msgs_hnd =
+            guest_handle_cast(arg1, crux_argo_send_msg_t);
+        /* arg3 is nmsg */
+
+        if ( unlikely((!guest_handle_is_null(arg2)) || arg4 ||
+                      (arg3 > CRUX_ARGO_MAX_BATCH)) )
+        {
+            rc = -EINVAL;
+            break;
+        }
+
+        /* Check array to allow use of the faster __copy operations later */
+        if ( unlikely(!guest_handle_okay(msgs_hnd, arg3)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        rc = sendv_batch(currd, msgs_hnd, arg3);
+        break;
+    }
+
     case CRUX_ARGO_OP_notify:
     {
         CRUX_GUEST_HANDLE_PARAM(crux_argo_ring_data_t) ring_data_hnd =
@@ -2230,6 +2475,10 @@ compat_argo_op(unsigned int cmd, CRUX_GUEST_HANDLE_PARAM(void) arg1,
     /* check CRUX_ARGO_MAXIOV as it sizes stack arrays: iovs, compat_iovs */
     BUILD_BUG_ON(CRUX_ARGO_MAXIOV > 8);
 
+    /* There is no translation of crux_argo_send_msg_t (yet). */
+    if ( cmd == CRUX_ARGO_OP_sendv_batch )
+        return -EOPNOTSUPP;
+
     /* Forward all ops besides sendv to the native handler. */
     if ( cmd != CRUX_ARGO_OP_sendv )
         return do_argo_op(cmd, arg1, arg2, arg3, arg4);
@@ -739,6 +739,7 @@ static int __init construct_domU(struct kernel_info *kinfo,
     const char *dom0less_enhanced;
     int rc;
     u64 mem;
+    s_time_t start = NOW(), probed, populated, dtb_done;
 
     rc = dt_property_read_u64(node, "memory", &mem);
     if ( !rc )
@@ -780,6 +781,8 @@ static int __init construct_domU(struct kernel_info *kinfo,
     if ( rc < 0 )
         return rc;
 
+    probed = NOW();
+
     set_domain_type(d, kinfo);
 
     if ( is_hardware_domain(d) )
@@ -787,6 +790,8 @@ static int __init construct_domU(struct kernel_info *kinfo,
         rc = construct_hwdom(kinfo, node);
         if ( rc < 0 )
             return rc;
+
+        populated = dtb_done = NOW();
     }
     else
     {
@@ -805,10 +810,14 @@ static int __init construct_domU(struct kernel_info *kinfo,
         if ( rc < 0 )
             return rc;
 
+        populated = NOW();
+
         rc = prepare_dtb_domU(d, kinfo);
         if ( rc < 0 )
             return rc;
 
+        dtb_done = NOW();
+
         rc = construct_domain(d, kinfo);
         if ( rc < 0 )
             return rc;
@@ -820,6 +829,14 @@ static int __init construct_domU(struct kernel_info *kinfo,
 
     rangeset_destroy(kinfo->crux_reg_assigned);
 
+    printk("%pd: built in %"PRI_stime"ms: kernel %"PRI_stime"ms, "
+           "memory %"PRI_stime"ms, dtb %"PRI_stime"ms, load %"PRI_stime"ms\n",
+           d, (NOW() - start) / MILLISECS(1),
+           (probed - start) / MILLISECS(1),
+           (populated - probed) / MILLISECS(1),
+           (dtb_done - populated) / MILLISECS(1),
+           (NOW() - dtb_done) / MILLISECS(1));
+
     return rc;
 }
 
@@ -827,8 +844,12 @@ void __init create_domUs(void)
 {
     struct dt_device_node *node;
     const struct dt_device_node *chosen = dt_find_node_by_path("/chosen");
+    s_time_t start = NOW();
 
     BUG_ON(chosen == NULL);
+
+    kernel_decompress_all();
+
     dt_for_each_child_node(chosen, node)
     {
         struct kernel_info ki = KERNEL_INFO_INIT;
@@ -877,6 +898,9 @@ void __init create_domUs(void)
         panic("cruxstore requested, but cruxstore domain not present\n");
 
     initialize_domU_cruxstore();
+
+    printk("Boot-time domains built in %"PRI_stime"ms\n",
+           (NOW() - start) / MILLISECS(1));
 }
 
 /*
@@ -10,13 +10,18 @@
 #include <crux/mm.h>
 #include <crux/pfn.h>
 #include <crux/sched.h>
+#include <crux/softirq.h>
+#include <crux/tasklet.h>
 #include <crux/types.h>
+#include <crux/unlz4.h>
+#include <crux/unzstd.h>
 #include <crux/vmap.h>
 
 #include <asm/page.h>
 #include <asm/setup.h>
 
-static uint32_t __init output_length(char *image, unsigned long image_len)
+static unsigned long __init gzip_output_length(char *image,
+                                               unsigned long image_len)
 {
     uint32_t val;
 
@@ -25,16 +30,61 @@ static uint32_t __init output_length(char *image, unsigned long image_len)
     return val;
 }
 
-int __init kernel_decompress(struct boot_module *mod, uint32_t offset)
+static int __init gzip_decompress(char *output, unsigned long output_len,
+                                  char *image, unsigned long image_len)
+{
+    return perform_gunzip(output, image, image_len);
+}
+
+static const struct kernel_codec {
+    int (*check)(char *image, unsigned long image_len);
+    unsigned long (*output_length)(char *image, unsigned long image_len);
+    int (*decompress)(char *output, unsigned long output_len,
+                      char *image, unsigned long image_len);
+} kernel_codecs[] __initconst = {
+    { gzip_check, gzip_output_length, gzip_decompress },
+    { lz4_check, lz4_output_length, perform_unlz4 },
+    { zstd_check, zstd_output_length, perform_unzstd },
+};
+
+/*
+ * Identify the compression format from the first few bytes of an image.
+ * This goes through copy_from_paddr()'s single fixmap slot, so it must only
+ * be used on the boot CPU, never from kernel_unzip_worker().
+ */
+static const struct kernel_codec *__init kernel_codec(paddr_t addr,
+                                                      paddr_t size)
+{
+    char magic[4] = {};
+    unsigned int i;
+
+    copy_from_paddr(magic, addr, min_t(paddr_t, size, sizeof(magic)));
+
+    for ( i = 0; i < ARRAY_SIZE(kernel_codecs); i++ )
+        if ( kernel_codecs[i].check(magic, size) )
+            return &kernel_codecs[i];
+
+    return NULL;
+}
+
+/*
+ * Decompress the image found offset bytes into mod, already identified as
+ * compressed with codec, into freshly allocated pages, leaving mod itself
+ * alone.  The image is only accessed through its own mapping, so this is
+ * safe to run on several CPUs at once.  -EINVAL is reserved for images
+ * which turn out not to be compressed at all.
+ */
+static int __init kernel_unzip(const struct boot_module *mod, uint32_t offset,
+                               const struct kernel_codec *codec,
+                               struct page_info **pages_out,
+                               paddr_t *size_out)
 {
     char *output, *input;
-    char magic[2];
     int rc;
     unsigned int kernel_order_out;
     paddr_t output_size;
     struct page_info *pages;
     mfn_t mfn;
-    int i;
     paddr_t addr = mod->start;
     paddr_t size = mod->size;
 
@@ -42,9 +92,9 @@ int __init kernel_decompress(struct boot_module *mod, uint32_t offset)
         return -EINVAL;
 
     /*
-     * It might be that gzip header does not appear at the start address
-     * (e.g. in case of compressed uImage) so take into account offset to
-     * gzip header.
+     * It might be that the compressed image does not appear at the start
+     * address (e.g. in case of compressed uImage) so take into account
+     * offset to its header.
      */
     addr += offset;
     size -= offset;
@@ -52,17 +102,18 @@ int __init kernel_decompress(struct boot_module *mod, uint32_t offset)
     if ( size < 2 )
         return -EINVAL;
 
-    copy_from_paddr(magic, addr, sizeof(magic));
-
-    /* only gzip is supported */
-    if ( !gzip_check(magic, size) )
-        return -EINVAL;
-
     input = ioremap_cache(addr, size);
     if ( input == NULL )
         return -EFAULT;
 
-    output_size = output_length(input, size);
+    output_size = codec->output_length(input, size);
+    if ( !output_size )
+    {
+        printk(CRUXLOG_ERR
+               "Unable to tell the size of the decompressed kernel\n");
+        iounmap(input);
+        return -EILSEQ;
+    }
     kernel_order_out = get_order_from_bytes(output_size);
     pages = alloc_domheap_pages(NULL, kernel_order_out, 0);
     if ( pages == NULL )
@@ -73,7 +124,7 @@ int __init kernel_decompress(struct boot_module *mod, uint32_t offset)
     mfn = page_to_mfn(pages);
     output = vmap_contig(mfn, 1 << kernel_order_out);
 
-    rc = perform_gunzip(output, input, size);
+    rc = codec->decompress(output, output_size, input, size);
     clean_dcache_va_range(output, output_size);
     iounmap(input);
     vunmap(output);
@@ -84,6 +135,21 @@ int __init kernel_decompress(struct boot_module *mod, uint32_t offset)
         return rc;
     }
 
+    *pages_out = pages;
+    *size_out = output_size;
+
+    return 0;
+}
+
+/* Switch mod over to the output of kernel_unzip(). */
+static void __init kernel_adopt(struct boot_module *mod,
+                                struct page_info *pages, paddr_t output_size)
+{
+    unsigned int kernel_order_out = get_order_from_bytes(output_size);
+    paddr_t addr = mod->start;
+    paddr_t size = mod->size;
+    int i;
+
     mod->start = page_to_maddr(pages);
     mod->size = output_size;
 
@@ -100,21 +166,142 @@ int __init kernel_decompress(struct boot_module *mod, uint32_t offset)
      * the heap allocator
      */
     if ( using_static_heap )
-        return 0;
-
-    /*
-     * When freeing the kernel, we need to pass the module start address and
-     * size as they were before taking an offset to gzip header into account,
-     * so that the entire region will be freed.
-     */
-    addr -= offset;
-    size += offset;
+        return;
 
     /*
      * Free the original kernel, update the pointers to the
-     * decompressed kernel
+     * decompressed kernel.  This covers the whole module, including
+     * anything in front of the compressed image's header.
      */
     fw_unreserved_regions(addr, addr + size, init_domheap_pages, 0);
+}
+
+/*
+ * Kernels decompressed ahead of time by kernel_decompress_all(), waiting
+ * for kernel_decompress() to pick them up.
+ */
+static struct {
+    struct boot_module *mod;
+    const struct kernel_codec *codec;
+    struct page_info *pages;
+    paddr_t size;
+    int rc;
+} __initdata unzipped[MAX_MODULES];
+static unsigned int __initdata nr_unzipped;
+static atomic_t __initdata unzip_next;
+static atomic_t __initdata unzip_done;
+static struct tasklet __initdata unzip_tasklet[NR_CPUS];
+
+static void __init cf_check kernel_unzip_worker(void *unused)
+{
+    unsigned int i;
+
+    while ( (i = atomic_inc_return(&unzip_next) - 1) < nr_unzipped )
+        unzipped[i].rc = kernel_unzip(unzipped[i].mod, 0, unzipped[i].codec,
+                                      &unzipped[i].pages, &unzipped[i].size);
+
+    smp_wmb();
+    atomic_inc(&unzip_done);
+}
+
+/*
+ * Decompressing kernels is the bulk of the work when building several
+ * boot-time domains, and is independent of everything else. Do all the
+ * compressed kernels at once, spread across the online CPUs.
+ */
+void __init kernel_decompress_all(void)
+{
+    struct boot_modules *mods = &bootinfo.modules;
+    unsigned int i, cpu, helpers = 0;
+    s_time_t start = NOW();
+
+    /* Identify the codecs here, as the workers mustn't use the fixmap. */
+    for ( i = 0; i < mods->nr_mods; i++ )
+    {
+        struct boot_module *mod = &mods->module[i];
+        const struct kernel_codec *codec;
+
+        if ( mod->kind != BOOTMOD_KERNEL || mod->size < 2 )
+            continue;
+
+        codec = kernel_codec(mod->start, mod->size);
+        if ( codec )
+        {
+            unzipped[nr_unzipped].mod = mod;
+            unzipped[nr_unzipped++].codec = codec;
+        }
+    }
+
+    /* Nothing to run in parallel: leave it all to kernel_decompress(). */
+    if ( nr_unzipped < 2 || num_online_cpus() < 2 )
+    {
+        nr_unzipped = 0;
+        return;
+    }
+
+    atomic_set(&unzip_next, 0);
+    atomic_set(&unzip_done, 0);
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( cpu == smp_processor_id() )
+            continue;
+        if ( helpers + 1 >= nr_unzipped )
+            break;
+
+        tasklet_init(&unzip_tasklet[cpu], kernel_unzip_worker, NULL);
+        tasklet_schedule_on_cpu(&unzip_tasklet[cpu], cpu);
+        helpers++;
+    }
+
+    kernel_unzip_worker(NULL);
+
+    while ( atomic_read(&unzip_done) < helpers + 1 )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+
+    smp_rmb();
+
+    printk("Decompressed %u kernels on %u CPUs in %"PRI_stime"ms\n",
+           nr_unzipped, helpers + 1, (NOW() - start) / MILLISECS(1));
+}
+
+int __init kernel_decompress(struct boot_module *mod, uint32_t offset)
+{
+    const struct kernel_codec *codec;
+    struct page_info *pages;
+    paddr_t output_size;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; offset == 0 && i < nr_unzipped; i++ )
+    {
+        if ( unzipped[i].mod != mod )
+            continue;
+
+        unzipped[i].mod = NULL;
+        if ( unzipped[i].rc )
+            return unzipped[i].rc;
+
+        kernel_adopt(mod, unzipped[i].pages, unzipped[i].size);
+
+        return 0;
+    }
+
+    if ( mod->size < offset + 2 )
+        return -EINVAL;
+
+    codec = kernel_codec(mod->start + offset, mod->size - offset);
+    if ( !codec )
+        return -EINVAL;
+
+    rc = kernel_unzip(mod, offset, codec, &pages, &output_size);
+    if ( rc )
+        return rc;
+
+    kernel_adopt(mod, pages, output_size);
 
     return 0;
 }
@@ -227,9 +414,9 @@ int __init kernel_probe(struct kernel_info *info,
 #endif
 
     /*
-     * If it is a gzip'ed image, 32bit or 64bit, uncompress it.
-     * At this point, gzip header appears (if at all) at the top of the image,
-     * so pass 0 as an offset.
+     * If it is a gzip, lz4 or zstd compressed image, 32bit or 64bit,
+     * uncompress it. At this point, the compression header appears (if at
+     * all) at the top of the image, so pass 0 as an offset.
      */
     rc = kernel_decompress(mod, 0);
     if ( rc && rc != -EINVAL )
@@ -1459,8 +1459,11 @@ void domain_destroy(struct domain *d)
     /* Remove from the domlist/hash. */
     domlist_remove(d);
 
-    /* Schedule RCU asynchronous completion of domain destroy. */
-    call_rcu(&d->rcu, complete_domain_destroy);
+    /*
+     * Schedule RCU asynchronous completion of domain destroy. Expedite it, as
+     * the toolstack may well be waiting to build the domain's successor.
+     */
+    call_rcu_expedited(&d->rcu, complete_domain_destroy);
 }
 
 void vcpu_pause(struct vcpu *v)
@@ -1745,6 +1748,7 @@ int map_guest_area(struct vcpu *v, paddr_t gaddr, unsigned int size,
     struct domain *d = v->domain;
     void *map = NULL;
     struct page_info *pg = NULL;
+    gfn_t area_gfn = INVALID_GFN;
     int rc = 0;
 
     if ( ~gaddr ) /* Map (i.e. not just unmap)? */
@@ -1782,6 +1786,7 @@ int map_guest_area(struct vcpu *v, paddr_t gaddr, unsigned int size,
             return -ENOMEM;
         }
         map += PAGE_OFFSET(gaddr);
+        area_gfn = _gfn(gfn);
     }
 
     if ( v != current )
@@ -1807,6 +1812,7 @@ int map_guest_area(struct vcpu *v, paddr_t gaddr, unsigned int size,
 
         SWAP(area->pg, pg);
         SWAP(area->map, map);
+        area->gfn = area_gfn;
     }
     else
         rc = -EBUSY;
@@ -1881,6 +1887,30 @@ void unmap_guest_area(struct vcpu *v, struct guest_area *area)
     }
 }
 
+void domain_mark_guest_areas_dirty(struct domain *d)
+{
+    struct vcpu *v;
+
+    for_each_vcpu ( d, v )
+    {
+        gfn_t gfn[2] = { INVALID_GFN, INVALID_GFN };
+        unsigned int i;
+
+        domain_lock(d);
+        if ( v->vcpu_info_area.pg )
+            gfn[0] = v->vcpu_info_area.gfn;
+        if ( v->runstate_guest_area.pg )
+            gfn[1] = v->runstate_guest_area.gfn;
+        domain_unlock(d);
+
+        for ( i = 0; i < ARRAY_SIZE(gfn); i++ )
+            if ( !gfn_eq(gfn[i], INVALID_GFN) )
+                p2m_log_dirty_mark(d, gfn[i], 1);
+    }
+
+    evtchn_mark_dirty(d);
+}
+
 int default_initialise_vcpu(struct vcpu *v, CRUX_GUEST_HANDLE_PARAM(void) arg)
 {
     struct vcpu_guest_context *ctxt;
@@ -40,6 +40,8 @@
 
 #define consumer_is_crux(e) (!!(e)->crux_consumer)
 
+static DEFINE_PERCPU_RWLOCK_GLOBAL(evtchn_send_rwlock);
+
 /*
  * Lock an event channel exclusively. This is allowed only when the channel is
  * free or unbound either when taking or when releasing the lock, as any
@@ -379,6 +381,24 @@ static void double_evtchn_unlock(struct evtchn *lchn, struct evtchn *rchn)
     evtchn_write_unlock(rchn);
 }
 
+/*
+ * Both domains' event locks are held by all callers, so two writers can't
+ * meet here in opposite order.
+ */
+static void double_send_write_lock(struct domain *ld, struct domain *rd)
+{
+    percpu_write_lock(evtchn_send_rwlock, &ld->evtchn_send_lock);
+    if ( rd != ld )
+        percpu_write_lock(evtchn_send_rwlock, &rd->evtchn_send_lock);
+}
+
+static void double_send_write_unlock(struct domain *ld, struct domain *rd)
+{
+    if ( rd != ld )
+        percpu_write_unlock(evtchn_send_rwlock, &rd->evtchn_send_lock);
+    percpu_write_unlock(evtchn_send_rwlock, &ld->evtchn_send_lock);
+}
+
 /*
  * If lport is zero get the next free port and allocate. If port is non-zero
  * allocate the specified lport.
@@ -439,6 +459,7 @@ int evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind, struct domain *ld,
     if ( rc )
         goto out;
 
+    double_send_write_lock(ld, rd);
     double_evtchn_lock(lchn, rchn);
 
     lchn->u.interdomain.remote_dom  = rd;
@@ -457,6 +478,7 @@ int evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind, struct domain *ld,
     evtchn_port_set_pending(ld, lchn->notify_vcpu_id, lchn);
 
     double_evtchn_unlock(lchn, rchn);
+    double_send_write_unlock(ld, rd);
 
     bind->local_port = lport;
 
@@ -808,6 +830,7 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
         BUG_ON(chn2->state != ECS_INTERDOMAIN);
         BUG_ON(chn2->u.interdomain.remote_dom != d1);
 
+        double_send_write_lock(d1, d2);
         double_evtchn_lock(chn1, chn2);
 
         evtchn_free(d1, chn1);
@@ -816,6 +839,7 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
         chn2->u.unbound.remote_domid = d1->domain_id;
 
         double_evtchn_unlock(chn1, chn2);
+        double_send_write_unlock(d1, d2);
 
         goto out;
 
@@ -840,6 +864,43 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
     return rc;
 }
 
+/*
+ * Send on an established interdomain binding without taking the channel
+ * lock.  The per-CPU read side of evtchn_send_lock writes no shared cache
+ * lines, so senders on different CPUs don't bounce the channel's lock line
+ * between them.  Returns false if the caller needs to take the slow path.
+ */
+static bool evtchn_send_fast(struct domain *ld, struct evtchn *lchn, int *ret)
+{
+    struct evtchn *rchn;
+    struct domain *rd;
+    bool done = false;
+
+    percpu_read_lock(evtchn_send_rwlock, &ld->evtchn_send_lock);
+
+    /*
+     * Leaving ECS_INTERDOMAIN requires the write lock, so once observed the
+     * binding (including both ends' consumer) stays put until we unlock.
+     */
+    if ( read_atomic(&lchn->state) == ECS_INTERDOMAIN &&
+         !consumer_is_crux(lchn) )
+    {
+        rd   = lchn->u.interdomain.remote_dom;
+        rchn = evtchn_from_port(rd, lchn->u.interdomain.remote_port);
+        if ( !consumer_is_crux(rchn) )
+        {
+            *ret = xsm_evtchn_send(XSM_HOOK, ld, lchn);
+            if ( !*ret )
+                evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+            done = true;
+        }
+    }
+
+    percpu_read_unlock(evtchn_send_rwlock, &ld->evtchn_send_lock);
+
+    return done;
+}
+
 int evtchn_send(struct domain *ld, unsigned int lport)
 {
     struct evtchn *lchn = _evtchn_from_port(ld, lport), *rchn;
@@ -849,6 +910,14 @@ int evtchn_send(struct domain *ld, unsigned int lport)
     if ( !lchn )
         return -EINVAL;
 
+    if ( evtchn_send_fast(ld, lchn, &ret) )
+    {
+        perfc_incr(evtchn_send_fast);
+        return ret;
+    }
+
+    perfc_incr(evtchn_send_slow);
+
     evtchn_read_lock(lchn);
 
     /* Guest cannot send via a crux-attached event channel. */
@@ -899,6 +968,35 @@ out:
     return ret;
 }
 
+static long evtchn_send_batch(struct evtchn_send_batch *batch)
+{
+    struct domain *d = current->domain;
+    evtchn_port_t port;
+    int rc;
+
+    if ( batch->nr_done > batch->nr_ports )
+        return -EINVAL;
+
+    perfc_incr(evtchn_send_batch);
+
+    while ( batch->nr_done < batch->nr_ports )
+    {
+        if ( copy_from_guest_offset(&port, batch->ports, batch->nr_done, 1) )
+            return -EFAULT;
+
+        rc = evtchn_send(d, port);
+        if ( rc )
+            return rc;
+
+        /* Don't check too often (choice of frequency is arbitrary). */
+        if ( !(++batch->nr_done & 0x3f) && batch->nr_done < batch->nr_ports &&
+             hypercall_preempt_check() )
+            return -ERESTART;
+    }
+
+    return 0;
+}
+
 bool evtchn_virq_enabled(const struct vcpu *v, unsigned int virq)
 {
     if ( !v )
@@ -1425,6 +1523,19 @@ long do_event_channel_op(int cmd, CRUX_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_send_batch: {
+        struct evtchn_send_batch batch;
+        if ( copy_from_guest(&batch, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_send_batch(&batch);
+        if ( __copy_to_guest(arg, &batch, 1) )
+            rc = -EFAULT;
+        else if ( rc == -ERESTART )
+            rc = hypercall_create_continuation(__HYPERVISOR_event_channel_op,
+                                               "ih", EVTCHNOP_send_batch, arg);
+        break;
+    }
+
     case EVTCHNOP_status: {
         struct evtchn_status status;
         if ( copy_from_guest(&status, arg, 1) != 0 )
@@ -1621,6 +1732,8 @@ void evtchn_check_pollers(struct domain *d, unsigned int port)
 
 int evtchn_init(struct domain *d, unsigned int max_port)
 {
+    percpu_rwlock_resource_init(&d->evtchn_send_lock, evtchn_send_rwlock);
+
     evtchn_2l_init(d);
     d->max_evtchn_port = min_t(unsigned int, max_port, INT_MAX);
 
@@ -1686,6 +1799,14 @@ int evtchn_destroy(struct domain *d)
     return 0;
 }
 
+void evtchn_mark_dirty(struct domain *d)
+{
+    /* The 2-level ABI only writes to the shared info page. */
+    read_lock(&d->event_lock);
+    if ( d->evtchn_fifo )
+        evtchn_fifo_mark_dirty(d);
+    read_unlock(&d->event_lock);
+}
 
 void evtchn_destroy_final(struct domain *d)
 {
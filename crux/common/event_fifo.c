@@ -18,6 +18,7 @@
 #include <crux/domain_page.h>
 
 #include <asm/guest_atomics.h>
+#include <asm/p2m.h>
 
 #include <public/event_channel.h>
 
@@ -30,6 +31,7 @@ struct evtchn_fifo_queue {
 
 struct evtchn_fifo_vcpu {
     struct evtchn_fifo_control_block *control_block;
+    gfn_t control_block_gfn;
     struct evtchn_fifo_queue queue[EVTCHN_FIFO_MAX_QUEUES];
 };
 
@@ -39,6 +41,7 @@ struct evtchn_fifo_vcpu {
 
 struct evtchn_fifo_domain {
     event_word_t *event_array[EVTCHN_FIFO_MAX_EVENT_ARRAY_PAGES];
+    gfn_t event_array_gfn[EVTCHN_FIFO_MAX_EVENT_ARRAY_PAGES];
     unsigned int num_evtchns;
 };
 
@@ -499,6 +502,7 @@ static int map_control_block(struct vcpu *v, uint64_t gfn, uint32_t offset)
 
     for ( i = 0; i <= EVTCHN_FIFO_PRIORITY_MIN; i++ )
         v->evtchn_fifo->queue[i].head = &control_block->head[i];
+    v->evtchn_fifo->control_block_gfn = _gfn(gfn);
 
     /* All queue heads must have been set before setting the control block. */
     smp_wmb();
@@ -664,6 +668,7 @@ static int add_page_to_event_array(struct domain *d, unsigned long gfn)
         return rc;
 
     d->evtchn_fifo->event_array[slot] = virt;
+    d->evtchn_fifo->event_array_gfn[slot] = _gfn(gfn);
 
     /* Synchronize with evtchn_fifo_word_from_port(). */
     smp_wmb();
@@ -704,6 +709,21 @@ int evtchn_fifo_expand_array(const struct evtchn_expand_array *expand_array)
     return rc;
 }
 
+/* The caller holds d->event_lock. */
+void evtchn_fifo_mark_dirty(struct domain *d)
+{
+    const struct evtchn_fifo_domain *efd = d->evtchn_fifo;
+    unsigned int i;
+    struct vcpu *v;
+
+    for_each_vcpu ( d, v )
+        if ( v->evtchn_fifo && v->evtchn_fifo->control_block )
+            p2m_log_dirty_mark(d, v->evtchn_fifo->control_block_gfn, 1);
+
+    for ( i = 0; i < efd->num_evtchns / EVTCHN_FIFO_EVENT_WORDS_PER_PAGE; i++ )
+        p2m_log_dirty_mark(d, efd->event_array_gfn[i], 1);
+}
+
 void evtchn_fifo_destroy(struct domain *d)
 {
     struct vcpu *v;
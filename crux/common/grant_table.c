@@ -29,6 +29,7 @@
 #include <crux/sched.h>
 #include <crux/mm.h>
 #include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/event.h>
 #include <crux/trace.h>
 #include <crux/grant_table.h>
@@ -2843,54 +2844,75 @@ struct gnttab_copy_buf {
     bool have_type;
 };
 
+/*
+ * Buffers (i.e. acquired grants or frames, and their mappings) are kept
+ * across the operations of a batch, so that backends issuing many small
+ * copies from and to a few grants only acquire and map each of them once
+ * per hypercall (or until preempted), rather than whenever the previous
+ * operation happened to use a different one.  Each buffer holds its own
+ * RCU reference to the domain it belongs to.
+ */
+#define GNTTAB_COPY_NR_BUFS 4
+
+struct gnttab_copy_batch {
+    struct gnttab_copy_buf src[GNTTAB_COPY_NR_BUFS];
+    struct gnttab_copy_buf dest[GNTTAB_COPY_NR_BUFS];
+    unsigned int src_next, dest_next;   /* Next buffer to recycle */
+
+    /* Domains of the current operation (checked by XSM as a pair). */
+    struct domain *src_dom, *dest_dom;
+    domid_t src_domid, dest_domid;
+};
+
 static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
-                                   struct gnttab_copy_buf *buf)
+                                   struct domain **d)
 {
     /* Only DOMID_SELF may reference via frame. */
     if ( domid != DOMID_SELF && !is_gref )
         return GNTST_permission_denied;
 
-    buf->domain = rcu_lock_domain_by_any_id(domid);
+    *d = rcu_lock_domain_by_any_id(domid);
 
-    if ( !buf->domain )
+    if ( !*d )
         return GNTST_bad_domain;
 
-    buf->ptr.domid = domid;
-
     return GNTST_okay;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domains(struct gnttab_copy_batch *b)
 {
-    if ( src->domain )
+    if ( b->src_dom )
     {
-        rcu_unlock_domain(src->domain);
-        src->domain = NULL;
+        rcu_unlock_domain(b->src_dom);
+        b->src_dom = NULL;
     }
-    if ( dest->domain )
+    if ( b->dest_dom )
     {
-        rcu_unlock_domain(dest->domain);
-        dest->domain = NULL;
+        rcu_unlock_domain(b->dest_dom);
+        b->dest_dom = NULL;
     }
 }
 
 static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
+                                    struct gnttab_copy_batch *b)
 {
     int rc;
 
     rc = gnttab_copy_lock_domain(op->source.domid,
-                                 op->flags & GNTCOPY_source_gref, src);
+                                 op->flags & GNTCOPY_source_gref,
+                                 &b->src_dom);
     if ( rc < 0 )
         goto error;
+    b->src_domid = op->source.domid;
+
     rc = gnttab_copy_lock_domain(op->dest.domid,
-                                 op->flags & GNTCOPY_dest_gref, dest);
+                                 op->flags & GNTCOPY_dest_gref,
+                                 &b->dest_dom);
     if ( rc < 0 )
         goto error;
+    b->dest_domid = op->dest.domid;
 
-    rc = xsm_grant_copy(XSM_HOOK, src->domain, dest->domain);
+    rc = xsm_grant_copy(XSM_HOOK, b->src_dom, b->dest_dom);
     if ( rc < 0 )
     {
         rc = GNTST_permission_denied;
@@ -2899,7 +2921,7 @@ static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
     return 0;
 
  error:
-    gnttab_copy_unlock_domains(src, dest);
+    gnttab_copy_unlock_domains(b);
     return rc;
 }
 
@@ -2925,6 +2947,22 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
         put_page(buf->page);
         buf->page = NULL;
     }
+    if ( buf->domain )
+    {
+        rcu_unlock_domain(buf->domain);
+        buf->domain = NULL;
+    }
+}
+
+static void gnttab_copy_release_bufs(struct gnttab_copy_batch *b)
+{
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_NR_BUFS; i++ )
+    {
+        gnttab_copy_release_buf(&b->src[i]);
+        gnttab_copy_release_buf(&b->dest[i]);
+    }
 }
 
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
@@ -2994,7 +3032,48 @@ static bool gnttab_copy_buf_valid(
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
+
+/*
+ * Find the buffer for @ptr of domain @d among @bufs, or claim it, recycling
+ * the least recently claimed one.  On failure, the buffer is left released.
+ */
+static struct gnttab_copy_buf *gnttab_copy_get_buf(
+    const struct gnttab_copy *op, const struct gnttab_copy_ptr *ptr,
+    struct domain *d, struct gnttab_copy_buf *bufs, unsigned int *next,
+    unsigned int gref_flag, int *rc)
+{
+    struct gnttab_copy_buf *buf;
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_NR_BUFS; i++ )
+    {
+        buf = &bufs[i];
+        if ( buf->domain == d &&
+             gnttab_copy_buf_valid(ptr, buf, op->flags & gref_flag) )
+        {
+            perfc_incr(gnttab_copy_buf_hit);
+            return buf;
+        }
+    }
+
+    perfc_incr(gnttab_copy_buf_miss);
+
+    buf = &bufs[*next];
+    *next = (*next + 1) % GNTTAB_COPY_NR_BUFS;
+
+    gnttab_copy_release_buf(buf);
+    buf->domain = rcu_lock_domain(d);
+
+    *rc = gnttab_copy_claim_buf(op, ptr, buf, gref_flag);
+    if ( *rc )
+    {
+        gnttab_copy_release_buf(buf);
+        return NULL;
+    }
+
+    return buf;
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
@@ -3036,45 +3115,33 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_batch *b)
 {
-    int rc;
+    struct gnttab_copy_buf *src, *dest;
+    int rc = GNTST_okay;
 
     if ( unlikely(!op->len) )
         return GNTST_okay;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    if ( !b->src_dom || op->source.domid != b->src_domid ||
+         !b->dest_dom || op->dest.domid != b->dest_domid )
     {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
-        gnttab_copy_unlock_domains(src, dest);
+        gnttab_copy_unlock_domains(b);
 
-        rc = gnttab_copy_lock_domains(op, src, dest);
+        rc = gnttab_copy_lock_domains(op, b);
         if ( rc < 0 )
             goto out;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
-    {
-        gnttab_copy_release_buf(src);
-        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
-        if ( rc )
-            goto out;
-    }
+    src = gnttab_copy_get_buf(op, &op->source, b->src_dom, b->src,
+                              &b->src_next, GNTCOPY_source_gref, &rc);
+    if ( !src )
+        goto out;
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
-    {
-        gnttab_copy_release_buf(dest);
-        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
-        if ( rc )
-            goto out;
-    }
+    dest = gnttab_copy_get_buf(op, &op->dest, b->dest_dom, b->dest,
+                               &b->dest_next, GNTCOPY_dest_gref, &rc);
+    if ( !dest )
+        goto out;
 
     rc = gnttab_copy_buf(op, dest, src);
  out:
@@ -3094,8 +3161,7 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_batch batch = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -3112,17 +3178,14 @@ static long gnttab_copy(
             break;
         }
 
-        rc = gnttab_copy_one(&op, &dest, &src);
+        rc = gnttab_copy_one(&op, &batch);
         if ( rc > 0 )
         {
             rc = count - i;
             break;
         }
         if ( rc != GNTST_okay )
-        {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
-        }
+            gnttab_copy_release_bufs(&batch);
 
         op.status = rc;
         rc = 0;
@@ -3134,9 +3197,8 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
-    gnttab_copy_unlock_domains(&src, &dest);
+    gnttab_copy_release_bufs(&batch);
+    gnttab_copy_unlock_domains(&batch);
 
     return rc;
 }
@@ -24,6 +24,7 @@
 #include <crux/irq.h>
 #include <crux/lib.h>
 #include <crux/paging.h>
+#include <crux/perfc.h>
 #include <crux/sched.h>
 #include <crux/trace.h>
 
@@ -58,6 +59,19 @@ void ioreq_signal_mapcache_invalidate(void)
         gprintk(CRUXLOG_ERR, "Unsuccessful map-cache invalidate\n");
 }
 
+/*
+ * Discard the results ioreq_server_select() has cached in the vCPUs. Must
+ * be called, with the ioreq server lock held, after any change to the set
+ * of servers, their enabled state or their ranges.
+ */
+static void ioreq_select_invalidate(struct domain *d)
+{
+    ASSERT(rspin_is_locked(&d->ioreq_server.lock));
+
+    smp_wmb();
+    write_atomic(&d->ioreq_server.select_gen, d->ioreq_server.select_gen + 1);
+}
+
 static void set_ioreq_server(struct domain *d, unsigned int id,
                              struct ioreq_server *s)
 {
@@ -65,6 +79,7 @@ static void set_ioreq_server(struct domain *d, unsigned int id,
     ASSERT(!s || !d->ioreq_server.server[id]);
 
     d->ioreq_server.server[id] = s;
+    ioreq_select_invalidate(d);
 }
 
 #define GET_IOREQ_SERVER(d, id) \
@@ -548,6 +563,7 @@ static void ioreq_server_enable(struct ioreq_server *s)
     arch_ioreq_server_enable(s);
 
     s->enabled = true;
+    ioreq_select_invalidate(s->target);
 
     list_for_each_entry ( sv,
                           &s->ioreq_vcpu_list,
@@ -568,6 +584,7 @@ static void ioreq_server_disable(struct ioreq_server *s)
     arch_ioreq_server_disable(s);
 
     s->enabled = false;
+    ioreq_select_invalidate(s->target);
 
  done:
     spin_unlock(&s->lock);
@@ -589,6 +606,7 @@ static int ioreq_server_init(struct ioreq_server *s,
     spin_lock_init(&s->lock);
     INIT_LIST_HEAD(&s->ioreq_vcpu_list);
     spin_lock_init(&s->bufioreq_lock);
+    INIT_LIST_HEAD(&s->doorbell_list);
 
     s->ioreq.gfn = INVALID_GFN;
     s->bufioreq.gfn = INVALID_GFN;
@@ -618,9 +636,27 @@ static int ioreq_server_init(struct ioreq_server *s,
     return rc;
 }
 
+static void ioreq_server_free_doorbells(struct ioreq_server *s)
+{
+    struct ioreq_doorbell *db, *next;
+
+    list_for_each_entry_safe ( db, next, &s->doorbell_list, list_entry )
+    {
+        list_del(&db->list_entry);
+
+        if ( !(db->flags & CRUX_DMOP_DOORBELL_buffered) )
+            free_crux_event_channel(s->target, db->port);
+
+        xfree(db);
+    }
+
+    s->nr_doorbells = 0;
+}
+
 static void ioreq_server_deinit(struct ioreq_server *s)
 {
     ASSERT(!s->enabled);
+    ioreq_server_free_doorbells(s);
     ioreq_server_remove_all_vcpus(s);
 
     /*
@@ -647,9 +683,6 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
     unsigned int i;
     int rc;
 
-    if ( bufioreq_handling )
-        return -EINVAL;
-
     if ( bufioreq_handling > HVM_IOREQSRV_BUFIOREQ_ATOMIC )
         return -EINVAL;
 
@@ -884,6 +917,8 @@ static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_add_range(r, start, end);
+    if ( !rc )
+        ioreq_select_invalidate(d);
 
  out:
     rspin_unlock(&d->ioreq_server.lock);
@@ -936,6 +971,155 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_remove_range(r, start, end);
+    if ( !rc )
+        ioreq_select_invalidate(d);
+
+ out:
+    rspin_unlock(&d->ioreq_server.lock);
+
+    return rc;
+}
+
+/* Only the low address bits fit in a buf_ioreq_t. */
+#define IOREQ_BUFFER_ADDR_MASK 0xfffffUL
+
+static struct ioreq_doorbell *find_doorbell(const struct ioreq_server *s,
+                                            paddr_t addr, unsigned int size,
+                                            unsigned int flags, uint64_t data)
+{
+    struct ioreq_doorbell *db;
+
+    list_for_each_entry ( db, &s->doorbell_list, list_entry )
+        if ( db->addr == addr && db->size == size && db->flags == flags &&
+             (!(flags & CRUX_DMOP_DOORBELL_datamatch) || db->data == data) )
+            return db;
+
+    return NULL;
+}
+
+static int ioreq_server_map_doorbell(struct domain *d, ioservid_t id,
+                                     unsigned int flags, unsigned int size,
+                                     paddr_t addr, uint64_t data,
+                                     evtchn_port_t *port)
+{
+    const unsigned int valid_flags = CRUX_DMOP_DOORBELL_datamatch |
+                                     CRUX_DMOP_DOORBELL_buffered;
+    struct ioreq_server *s;
+    struct ioreq_doorbell *db;
+    int rc;
+
+    if ( (flags & ~valid_flags) ||
+         (size != 1 && size != 2 && size != 4 && size != 8) ||
+         (addr & (size - 1)) )
+        return -EINVAL;
+
+    rspin_lock(&d->ioreq_server.lock);
+
+    s = get_ioreq_server(d, id);
+
+    rc = -ENOENT;
+    if ( !s )
+        goto out;
+
+    rc = -EPERM;
+    if ( s->emulator != current->domain )
+        goto out;
+
+    rc = -EINVAL;
+    if ( (flags & CRUX_DMOP_DOORBELL_buffered) && !HANDLE_BUFIOREQ(s) )
+        goto out;
+
+    rc = -EEXIST;
+    list_for_each_entry ( db, &s->doorbell_list, list_entry )
+    {
+        /* Datamatch doorbells may share a register, but not a value. */
+        if ( db->addr < addr + size && addr < db->addr + db->size &&
+             (!(db->flags & flags & CRUX_DMOP_DOORBELL_datamatch) ||
+              db->data == data) )
+            goto out;
+
+        if ( (db->flags & flags & CRUX_DMOP_DOORBELL_buffered) &&
+             ((db->addr ^ addr) & IOREQ_BUFFER_ADDR_MASK) == 0 &&
+             db->addr != addr )
+            goto out;
+    }
+
+    rc = -ENOSPC;
+    if ( s->nr_doorbells >= MAX_NR_DOORBELLS )
+        goto out;
+
+    rc = -ENOMEM;
+    db = xzalloc(struct ioreq_doorbell);
+    if ( !db )
+        goto out;
+
+    db->addr = addr;
+    db->size = size;
+    db->flags = flags;
+    db->data = data;
+
+    if ( !(flags & CRUX_DMOP_DOORBELL_buffered) )
+    {
+        rc = alloc_unbound_crux_event_channel(d, 0, s->emulator->domain_id,
+                                             NULL);
+        if ( rc < 0 )
+        {
+            xfree(db);
+            goto out;
+        }
+
+        db->port = *port = rc;
+    }
+
+    domain_pause(d);
+    list_add_tail(&db->list_entry, &s->doorbell_list);
+    s->nr_doorbells++;
+    domain_unpause(d);
+
+    rc = 0;
+
+ out:
+    rspin_unlock(&d->ioreq_server.lock);
+
+    return rc;
+}
+
+static int ioreq_server_unmap_doorbell(struct domain *d, ioservid_t id,
+                                       unsigned int flags, unsigned int size,
+                                       paddr_t addr, uint64_t data)
+{
+    struct ioreq_server *s;
+    struct ioreq_doorbell *db;
+    int rc;
+
+    rspin_lock(&d->ioreq_server.lock);
+
+    s = get_ioreq_server(d, id);
+
+    rc = -ENOENT;
+    if ( !s )
+        goto out;
+
+    rc = -EPERM;
+    if ( s->emulator != current->domain )
+        goto out;
+
+    rc = -ENOENT;
+    db = find_doorbell(s, addr, size, flags, data);
+    if ( !db )
+        goto out;
+
+    domain_pause(d);
+    list_del(&db->list_entry);
+    s->nr_doorbells--;
+    domain_unpause(d);
+
+    if ( !(db->flags & CRUX_DMOP_DOORBELL_buffered) )
+        free_crux_event_channel(d, db->port);
+
+    xfree(db);
+
+    rc = 0;
 
  out:
     rspin_unlock(&d->ioreq_server.lock);
@@ -1100,57 +1284,82 @@ void ioreq_server_destroy_all(struct domain *d)
 struct ioreq_server *ioreq_server_select(struct domain *d,
                                          ioreq_t *p)
 {
+    struct vcpu *curr = current;
     struct ioreq_server *s;
     uint8_t type;
     uint64_t addr;
-    unsigned int id;
+    unsigned long start, end;
+    unsigned int id, gen;
 
     if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
         return NULL;
 
-    FOR_EACH_IOREQ_SERVER(d, id, s)
+    switch ( type )
     {
-        struct rangeset *r;
+    case CRUX_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = start + p->size - 1;
+        break;
 
-        if ( !s->enabled )
-            continue;
+    case CRUX_DMOP_IO_RANGE_MEMORY:
+        start = ioreq_mmio_first_byte(p);
+        end = ioreq_mmio_last_byte(p);
+        break;
 
-        r = s->range[type];
+    case CRUX_DMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
 
-        switch ( type )
-        {
-            unsigned long start, end;
+    default:
+        return NULL;
+    }
 
-        case CRUX_DMOP_IO_RANGE_PORT:
-            start = addr;
-            end = start + p->size - 1;
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    gen = read_atomic(&d->ioreq_server.select_gen);
+    smp_rmb();
 
-            break;
+    /*
+     * Guests tend to hit the same device register over and over (e.g. a
+     * virtio queue notification), so try the vCPU's last result first.
+     */
+    if ( curr->domain == d && curr->io.select.server &&
+         curr->io.select.gen == gen && curr->io.select.type == type &&
+         curr->io.select.start == start && curr->io.select.end == end )
+    {
+        perfc_incr(ioreq_select_hit);
+        s = curr->io.select.server;
+        goto found;
+    }
 
-        case CRUX_DMOP_IO_RANGE_MEMORY:
-            start = ioreq_mmio_first_byte(p);
-            end = ioreq_mmio_last_byte(p);
+    perfc_incr(ioreq_select_miss);
 
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( !s->enabled )
+            continue;
 
-            break;
+        if ( rangeset_contains_range(s->range[type], start, end) )
+            goto found;
+    }
 
-        case CRUX_DMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+    return NULL;
 
-            break;
-        }
+ found:
+    if ( curr->domain == d )
+    {
+        curr->io.select.server = s;
+        curr->io.select.start = start;
+        curr->io.select.end = end;
+        curr->io.select.gen = gen;
+        curr->io.select.type = type;
     }
 
-    return NULL;
+    if ( type == CRUX_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
+    }
+
+    return s;
 }
 
 static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
@@ -1182,7 +1391,8 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
      *  - the count field is usually used with data_is_ptr and since we don't
      *    support data_is_ptr we do not waste space for the count field either
      */
-    if ( (p->addr > 0xfffffUL) || p->data_is_ptr || (p->count != 1) )
+    if ( (p->addr > IOREQ_BUFFER_ADDR_MASK) || p->data_is_ptr ||
+         (p->count != 1) )
         return IOREQ_STATUS_UNHANDLED;
 
     switch ( p->size )
@@ -1310,6 +1520,46 @@ int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
     return IOREQ_STATUS_UNHANDLED;
 }
 
+/*
+ * Complete a write to one of s's doorbells without involving the emulator
+ * synchronously. Returns IOREQ_STATUS_UNHANDLED if p isn't for a doorbell,
+ * or if it couldn't be buffered and has to take the normal path.
+ */
+int ioreq_send_doorbell(struct ioreq_server *s, ioreq_t *p)
+{
+    const struct ioreq_doorbell *db;
+
+    ASSERT(p->dir == IOREQ_WRITE);
+
+    list_for_each_entry ( db, &s->doorbell_list, list_entry )
+    {
+        if ( db->addr != p->addr || db->size != p->size ||
+             ((db->flags & CRUX_DMOP_DOORBELL_datamatch) &&
+              db->data != p->data) )
+            continue;
+
+        if ( db->flags & CRUX_DMOP_DOORBELL_buffered )
+        {
+            ioreq_t bp = *p;
+
+            bp.addr &= IOREQ_BUFFER_ADDR_MASK;
+            if ( ioreq_send_buffered(s, &bp) != IOREQ_STATUS_HANDLED )
+                return IOREQ_STATUS_UNHANDLED;
+
+            perfc_incr(ioreq_doorbell_buffered);
+        }
+        else
+        {
+            notify_via_crux_event_channel(s->target, db->port);
+            perfc_incr(ioreq_doorbell_event);
+        }
+
+        return IOREQ_STATUS_HANDLED;
+    }
+
+    return IOREQ_STATUS_UNHANDLED;
+}
+
 unsigned int ioreq_broadcast(ioreq_t *p, bool buffered)
 {
     struct domain *d = current->domain;
@@ -1433,6 +1683,36 @@ int ioreq_server_dm_op(struct crux_dm_op *op, struct domain *d, bool *const_op)
         break;
     }
 
+    case CRUX_DMOP_map_doorbell_to_ioreq_server:
+    {
+        struct crux_dm_op_ioreq_server_doorbell *data =
+            &op->u.map_doorbell_to_ioreq_server;
+
+        *const_op = false;
+
+        rc = -EINVAL;
+        if ( data->pad )
+            break;
+
+        rc = ioreq_server_map_doorbell(d, data->id, data->flags, data->size,
+                                       data->addr, data->data, &data->port);
+        break;
+    }
+
+    case CRUX_DMOP_unmap_doorbell_from_ioreq_server:
+    {
+        const struct crux_dm_op_ioreq_server_doorbell *data =
+            &op->u.unmap_doorbell_from_ioreq_server;
+
+        rc = -EINVAL;
+        if ( data->pad )
+            break;
+
+        rc = ioreq_server_unmap_doorbell(d, data->id, data->flags,
+                                         data->size, data->addr, data->data);
+        break;
+    }
+
     default:
         rc = -EOPNOTSUPP;
         break;
@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Boot-time LZ4 decompression, for both the legacy format produced by
+ * "lz4 -l" (and hence Linux' Image.lz4) and the standard frame format.
+ * Block and content checksums are not verified.  Corrupt or truncated input
+ * fails with -EILSEQ.
+ */
+
+#include <crux/errno.h>
+#include <crux/init.h>
+#include <crux/lib.h>
+#include <crux/string.h>
+#include <crux/unaligned.h>
+#include <crux/unlz4.h>
+
+#define LZ4_LEGACY_MAGIC        0x184c2102U
+#define LZ4_FRAME_MAGIC         0x184d2204U
+
+#define LZ4_FLG_VERSION_MASK    0xc0
+#define LZ4_FLG_VERSION         0x40
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_CONTENT_CSUM    0x04
+#define LZ4_FLG_DICT_ID         0x01
+
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000U
+
+#define LZ4_MIN_MATCH           4
+
+/*
+ * Decode one block at in[0..in_len) to base + *pos, never writing at or
+ * beyond base + out_len.  Matches may reach back into earlier blocks, which
+ * covers the frame format's linked block mode for free as everything is
+ * decoded into one contiguous buffer.
+ */
+static int __init lz4_block(const uint8_t *in, size_t in_len,
+                            uint8_t *base, size_t *pos, size_t out_len)
+{
+    const uint8_t *ip = in, *iend = in + in_len;
+    uint8_t *op = base + *pos, *oend = base + out_len;
+
+    for ( ; ; )
+    {
+        unsigned int token;
+        size_t len, off;
+        const uint8_t *match;
+
+        if ( ip >= iend )
+            return -EILSEQ;
+
+        token = *ip++;
+
+        len = token >> 4;
+        if ( len == 15 )
+        {
+            unsigned int b;
+
+            do {
+                if ( ip >= iend )
+                    return -EILSEQ;
+                b = *ip++;
+                len += b;
+            } while ( b == 255 );
+        }
+
+        if ( len > iend - ip || len > oend - op )
+            return -EILSEQ;
+        /* Most literal runs are short, copy a fixed 16 bytes when possible. */
+        if ( len <= 16 && iend - ip >= 16 && oend - op >= 16 )
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* The last sequence of a block consists of literals only. */
+        if ( ip == iend )
+            break;
+
+        if ( iend - ip < 2 )
+            return -EILSEQ;
+        off = get_unaligned_le16(ip);
+        ip += 2;
+        if ( !off || off > op - base )
+            return -EILSEQ;
+
+        len = token & 15;
+        if ( len == 15 )
+        {
+            unsigned int b;
+
+            do {
+                if ( ip >= iend )
+                    return -EILSEQ;
+                b = *ip++;
+                len += b;
+            } while ( b == 255 );
+        }
+        len += LZ4_MIN_MATCH;
+
+        if ( len > oend - op )
+            return -EILSEQ;
+
+        match = op - off;
+        if ( off >= 8 && len + 8 <= oend - op )
+        {
+            /* Non-overlapping 8-byte chunks; may scribble up to 7 bytes. */
+            uint8_t *end = op + len;
+
+            do {
+                memcpy(op, match, 8);
+                op += 8;
+                match += 8;
+            } while ( op < end );
+            op = end;
+        }
+        else
+        {
+            while ( len-- )
+                *op++ = *match++;
+        }
+    }
+
+    *pos = op - base;
+
+    return 0;
+}
+
+static int __init unlz4_legacy(const uint8_t *in, size_t in_len,
+                               uint8_t *out, size_t out_len, size_t *pos)
+{
+    while ( in_len >= 4 )
+    {
+        uint32_t size = get_unaligned_le32(in);
+        int rc;
+
+        /*
+         * Exactly 4 bytes left is the decompressed size Linux appends to
+         * its compressed images, not a block.
+         */
+        if ( in_len == 4 )
+            break;
+
+        in += 4;
+        in_len -= 4;
+
+        /* Concatenated streams each start with another magic number. */
+        if ( size == LZ4_LEGACY_MAGIC )
+            continue;
+
+        if ( size > in_len )
+            return -EILSEQ;
+
+        rc = lz4_block(in, size, out, pos, out_len);
+        if ( rc )
+            return rc;
+
+        in += size;
+        in_len -= size;
+    }
+
+    return 0;
+}
+
+static int __init unlz4_frame(const uint8_t *in, size_t in_len,
+                              uint8_t *out, size_t out_len, size_t *pos)
+{
+    unsigned int flg, hdr = 2;
+
+    if ( in_len < 3 )
+        return -EILSEQ;
+
+    flg = in[0];
+    if ( (flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION )
+        return -EILSEQ;
+    if ( flg & LZ4_FLG_CONTENT_SIZE )
+        hdr += 8;
+    if ( flg & LZ4_FLG_DICT_ID )
+        hdr += 4;
+    /* Header checksum. */
+    hdr += 1;
+
+    if ( in_len < hdr )
+        return -EILSEQ;
+    in += hdr;
+    in_len -= hdr;
+
+    for ( ; ; )
+    {
+        uint32_t size;
+        int rc;
+
+        if ( in_len < 4 )
+            return -EILSEQ;
+        size = get_unaligned_le32(in);
+        in += 4;
+        in_len -= 4;
+
+        /* EndMark */
+        if ( !size )
+            break;
+
+        if ( (size & ~LZ4_BLOCK_UNCOMPRESSED) > in_len )
+            return -EILSEQ;
+
+        if ( size & LZ4_BLOCK_UNCOMPRESSED )
+        {
+            size &= ~LZ4_BLOCK_UNCOMPRESSED;
+            if ( size > out_len - *pos )
+                return -EILSEQ;
+            memcpy(out + *pos, in, size);
+            *pos += size;
+        }
+        else
+        {
+            rc = lz4_block(in, size, out, pos, out_len);
+            if ( rc )
+                return rc;
+        }
+
+        in += size;
+        in_len -= size;
+
+        if ( flg & LZ4_FLG_BLOCK_CHECKSUM )
+        {
+            if ( in_len < 4 )
+                return -EILSEQ;
+            in += 4;
+            in_len -= 4;
+        }
+    }
+
+    return 0;
+}
+
+int __init lz4_check(char *image, unsigned long image_len)
+{
+    uint32_t magic;
+
+    if ( image_len < 4 )
+        return 0;
+
+    magic = get_unaligned_le32(image);
+
+    return magic == LZ4_LEGACY_MAGIC || magic == LZ4_FRAME_MAGIC;
+}
+
+unsigned long __init lz4_output_length(char *image, unsigned long image_len)
+{
+    const uint8_t *in = (const uint8_t *)image;
+
+    /*
+     * Unlike the legacy format, frames don't get the size appended, so can
+     * only be handled if the compressor recorded it ("lz4 --content-size").
+     */
+    if ( get_unaligned_le32(in) == LZ4_FRAME_MAGIC )
+        return image_len >= 14 && (in[4] & LZ4_FLG_CONTENT_SIZE)
+               ? get_unaligned_le64(in + 6) : 0;
+
+    return get_unaligned_le32(in + image_len - 4);
+}
+
+int __init perform_unlz4(char *output, unsigned long output_len,
+                         char *image, unsigned long image_len)
+{
+    const uint8_t *in = (const uint8_t *)image;
+    size_t pos = 0;
+    int rc;
+
+    if ( !lz4_check(image, image_len) )
+        return 1;
+
+    if ( get_unaligned_le32(in) == LZ4_LEGACY_MAGIC )
+        rc = unlz4_legacy(in + 4, image_len - 4,
+                          (uint8_t *)output, output_len, &pos);
+    else
+        rc = unlz4_frame(in + 4, image_len - 4,
+                         (uint8_t *)output, output_len, &pos);
+
+    if ( !rc && pos != output_len )
+        rc = -EILSEQ;
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
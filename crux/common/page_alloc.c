@@ -120,6 +120,7 @@
  *   regions within it.
  */
 
+#include <crux/cpu.h>
 #include <crux/domain_page.h>
 #include <crux/event.h>
 #include <crux/init.h>
@@ -139,6 +140,7 @@
 #include <crux/sections.h>
 #include <crux/softirq.h>
 #include <crux/spinlock.h>
+#include <crux/tasklet.h>
 #include <crux/vm_event.h>
 #include <crux/xvmalloc.h>
 
@@ -924,43 +926,24 @@ static void init_free_page_fields(struct page_info *pg)
     page_set_owner(pg, NULL);
 }
 
-/* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+/*
+ * Take 2^@order contiguous pages off the free lists, splitting a larger
+ * buddy if necessary.  The pages are marked in use, with PGC_need_scrub
+ * preserved, and accounted as allocated.  Their remaining fields are left
+ * for the caller to initialise.  *@first_dirty is set to the index of the
+ * first possibly dirty page, or INVALID_DIRTY_IDX.
+ */
+static struct page_info *take_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
-    struct domain *d)
+    struct domain *d, unsigned int *first_dirty)
 {
     nodeid_t node;
-    unsigned int i, buddy_order, zone, first_dirty;
+    unsigned int i, buddy_order, zone;
     unsigned long request = 1UL << order;
     struct page_info *pg;
-    bool need_tlbflush = false;
-    uint32_t tlbflush_timestamp = 0;
-    unsigned int dirty_cnt = 0;
-    mfn_t mfn;
 
-    /* Make sure there are enough bits in memflags for nodeID. */
-    BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
-
-    ASSERT(zone_lo <= zone_hi);
-    ASSERT(zone_hi < NR_ZONES);
-
-    if ( unlikely(order > MAX_ORDER) )
-        return NULL;
-
-    spin_lock(&heap_lock);
-
-    /*
-     * Claimed memory is considered unavailable unless the request
-     * is made by a domain with sufficient unclaimed pages.
-     */
-    if ( (outstanding_claims + request > total_avail_pages) &&
-          ((memflags & MEMF_no_refcount) ||
-           !d || d->outstanding_pages < request) )
-    {
-        spin_unlock(&heap_lock);
-        return NULL;
-    }
+    ASSERT(spin_is_locked(&heap_lock));
 
     pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
     /* Try getting a dirty buddy if we couldn't get a clean one. */
@@ -968,34 +951,30 @@ static struct page_info *alloc_heap_pages(
         pg = get_free_buddy(zone_lo, zone_hi, order,
                             memflags | MEMF_no_scrub, d);
     if ( !pg )
-    {
-        /* No suitable memory blocks. Fail the request. */
-        spin_unlock(&heap_lock);
         return NULL;
-    }
 
     node = page_to_nid(pg);
     zone = page_to_zone(pg);
     buddy_order = PFN_ORDER(pg);
 
-    first_dirty = pg->u.free.first_dirty;
+    *first_dirty = pg->u.free.first_dirty;
 
     /* We may have to halve the chunk a number of times. */
     while ( buddy_order != order )
     {
         buddy_order--;
         page_list_add_scrub(pg, node, zone, buddy_order,
-                            (1U << buddy_order) > first_dirty ?
-                            first_dirty : INVALID_DIRTY_IDX);
+                            (1U << buddy_order) > *first_dirty ?
+                            *first_dirty : INVALID_DIRTY_IDX);
         pg += 1U << buddy_order;
 
-        if ( first_dirty != INVALID_DIRTY_IDX )
+        if ( *first_dirty != INVALID_DIRTY_IDX )
         {
             /* Adjust first_dirty */
-            if ( first_dirty >= 1U << buddy_order )
-                first_dirty -= 1U << buddy_order;
+            if ( *first_dirty >= 1U << buddy_order )
+                *first_dirty -= 1U << buddy_order;
             else
-                first_dirty = 0; /* We've moved past original first_dirty */
+                *first_dirty = 0; /* We've moved past original first_dirty */
         }
     }
 
@@ -1023,11 +1002,530 @@ static struct page_info *alloc_heap_pages(
         }
 
         /* PGC_need_scrub can only be set if first_dirty is valid */
-        ASSERT(first_dirty != INVALID_DIRTY_IDX || !(pg[i].count_info & PGC_need_scrub));
+        ASSERT(*first_dirty != INVALID_DIRTY_IDX ||
+               !(pg[i].count_info & PGC_need_scrub));
 
         /* Preserve PGC_need_scrub so we can check it after lock is dropped. */
         pg[i].count_info = PGC_state_inuse | (pg[i].count_info & PGC_need_scrub);
+    }
+
+    return pg;
+}
+
+static void free_heap_pages_locked(
+    struct page_info *pg, unsigned int order, bool need_scrub);
+
+/*
+ * Per-CPU page caches.
+ *
+ * Chunks of order below PCP_NR_ORDERS freed on a CPU are kept on a per-CPU
+ * list instead of going back to the buddy allocator, and allocations of
+ * such sizes are served from there first.  The lists are refilled from and
+ * drained to the heap PCP_BATCH chunks at a time, so heap_lock is taken
+ * once per batch rather than once per allocation.
+ *
+ * A CPU only caches memory from its own NUMA node.  Cached pages stay
+ * accounted as allocated and look like anonymous in-use pages: their state
+ * is PGC_state_inuse, they have no owner, and PGC_need_scrub as well as the
+ * TLB flush state in u.free are kept until the chunk is handed out (when it
+ * gets scrubbed and flushed as needed) or drained back to the heap.
+ *
+ * Lock order is cache lock -> heap_lock.
+ */
+#define PCP_NR_ORDERS 3
+#define PCP_BATCH     16
+#define PCP_HIGH      (4 * PCP_BATCH)
+
+struct page_cache {
+    spinlock_t lock;
+    unsigned int count[PCP_NR_ORDERS];
+    struct page_list_head list[PCP_NR_ORDERS];
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+/* page-cache -> cache small allocations per CPU */
+static bool __ro_after_init opt_page_cache = true;
+boolean_param("page-cache", opt_page_cache);
+
+static bool __read_mostly pcp_enabled;
+
+/* Move up to PCP_BATCH chunks of 2^@order pages from the heap into @pc. */
+static void pcp_refill(struct page_cache *pc, unsigned int zone_lo,
+                       unsigned int zone_hi, unsigned int order, nodeid_t node)
+{
+    unsigned int n, i, first_dirty, memflags = MEMF_node(node) |
+                                               MEMF_exact_node;
+    struct page_info *pg;
+
+    spin_lock(&heap_lock);
+
+    for ( n = 0; n < PCP_BATCH; n++ )
+    {
+        /* Leave memory claimed by domains to the slow path. */
+        if ( outstanding_claims )
+            break;
+
+        pg = take_heap_pages(zone_lo, zone_hi, order, memflags, NULL,
+                             &first_dirty);
+        if ( !pg )
+            break;
+
+        for ( i = 0; i < (1U << order); i++ )
+        {
+            /* Dirty pages in the cache aren't tracked per node. */
+            if ( pg[i].count_info & PGC_need_scrub )
+                node_need_scrub[node]--;
+            page_set_owner(&pg[i], NULL);
+        }
+
+        page_list_add_tail(pg, &pc->list[order]);
+        pc->count[order]++;
+    }
+
+    spin_unlock(&heap_lock);
+}
+
+/* Hand a list of cached 2^@order chunks back to the buddy allocator. */
+static void pcp_release(struct page_list_head *list, unsigned int order)
+{
+    struct page_info *pg;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    unsigned int i;
+
+    /*
+     * The pages no longer have an owner for mark_page_free() to derive the
+     * need for a safety TLB flush from, so deal with that here.
+     */
+    page_list_for_each ( pg, list )
+        for ( i = 0; i < (1U << order); i++ )
+            accumulate_tlbflush(&need_tlbflush, &pg[i], &tlbflush_timestamp);
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
 
+    spin_lock(&heap_lock);
+
+    while ( (pg = page_list_remove_head(list)) )
+    {
+        bool need_scrub = false;
+
+        for ( i = 0; i < (1U << order); i++ )
+            if ( pg[i].count_info & PGC_need_scrub )
+                need_scrub = true;
+
+        free_heap_pages_locked(pg, order, need_scrub);
+    }
+
+    spin_unlock(&heap_lock);
+}
+
+/* Return all chunks cached by @cpu to the heap. */
+static bool pcp_drain(unsigned int cpu)
+{
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    PAGE_LIST_HEAD(list);
+    unsigned int order;
+    bool drained = false;
+
+    for ( order = 0; order < PCP_NR_ORDERS; order++ )
+    {
+        spin_lock(&pc->lock);
+        page_list_move(&list, &pc->list[order]);
+        pc->count[order] = 0;
+        spin_unlock(&pc->lock);
+
+        if ( !page_list_empty(&list) )
+        {
+            pcp_release(&list, order);
+            drained = true;
+        }
+    }
+
+    return drained;
+}
+
+static bool pcp_drain_all(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    if ( !pcp_enabled )
+        return false;
+
+    for_each_online_cpu ( cpu )
+        if ( pcp_drain(cpu) )
+            drained = true;
+
+    return drained;
+}
+
+/*
+ * Allocate 2^@order pages from the local CPU's cache.  Returns NULL if the
+ * request can't be served from the cache, in which case the caller should
+ * go to the heap.
+ */
+static struct page_info *pcp_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    nodeid_t node = cpu_to_node(smp_processor_id());
+    nodeid_t req_node = MEMF_get_node(memflags);
+    struct page_cache *pc;
+    struct page_info *pg;
+    unsigned int i, zone;
+
+    /* A separate crux heap is never cached. */
+    if ( !pcp_enabled || order >= PCP_NR_ORDERS || zone_lo == MEMZONE_CRUX )
+        return NULL;
+
+    if ( (req_node != NUMA_NO_NODE && req_node != node) ||
+         (d && !nodemask_test(node, &d->node_affinity)) )
+        return NULL;
+
+    /* Claims are only enforced by the slow path. */
+    if ( ACCESS_ONCE(outstanding_claims) )
+        return NULL;
+
+    pc = &this_cpu(page_cache);
+
+    spin_lock(&pc->lock);
+
+    if ( !pc->count[order] )
+        pcp_refill(pc, zone_lo, zone_hi, order, node);
+
+    pg = page_list_first(&pc->list[order]);
+    if ( pg )
+    {
+        zone = page_to_zone(pg);
+        if ( zone < zone_lo || zone > zone_hi )
+            pg = NULL;
+        else
+        {
+            page_list_del(pg, &pc->list[order]);
+            pc->count[order]--;
+        }
+    }
+
+    spin_unlock(&pc->lock);
+
+    if ( !pg )
+        return NULL;
+
+    /* A page may have been marked for offlining while in the cache. */
+    for ( i = 0; i < (1U << order); i++ )
+        if ( !page_state_is(&pg[i], inuse) )
+        {
+            PAGE_LIST_HEAD(list);
+
+            page_list_add(pg, &list);
+            pcp_release(&list, order);
+
+            return NULL;
+        }
+
+    if ( d != NULL )
+        d->last_alloc_node = node;
+
+    return pg;
+}
+
+/*
+ * Free 2^@order pages into the local CPU's cache.  Returns false if the
+ * pages have to go back to the heap instead.
+ */
+static bool pcp_free(struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    struct page_cache *pc;
+    PAGE_LIST_HEAD(spill);
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned int i;
+
+    if ( !pcp_enabled || order >= PCP_NR_ORDERS || is_crux_heap_page(pg) ||
+         (pg->count_info & PGC_no_buddy_merge) ||
+         mfn_to_nid(mfn) != cpu_to_node(smp_processor_id()) )
+        return false;
+
+    /*
+     * Only plain in-use pages can be cached.  Anything being offlined or
+     * broken is left for free_heap_pages() to deal with.  Pages already
+     * converted if we bail out part way through are still in use, hence
+     * equally fine for the slow path.
+     */
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        unsigned long x = ACCESS_ONCE(pg[i].count_info);
+
+        if ( (x & PGC_state) != PGC_state_inuse || (x & PGC_broken) ||
+             cmpxchg(&pg[i].count_info, x,
+                     PGC_state_inuse | (need_scrub ? PGC_need_scrub : 0)) != x )
+            return false;
+    }
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        /* If a page has no owner it will need no safety TLB flush. */
+        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
+        if ( pg[i].u.free.need_tlbflush )
+            page_set_tlbflush_timestamp(&pg[i]);
+
+        page_set_owner(&pg[i], NULL);
+        set_gpfn_from_mfn(mfn_x(mfn) + i, INVALID_M2P_ENTRY);
+
+        if ( need_scrub )
+            poison_one_page(&pg[i]);
+    }
+
+    pc = &this_cpu(page_cache);
+
+    spin_lock(&pc->lock);
+
+    page_list_add(pg, &pc->list[order]);
+    if ( ++pc->count[order] > PCP_HIGH )
+    {
+        /* Spill the coldest chunks. */
+        for ( i = 0; i < PCP_BATCH; i++ )
+        {
+            struct page_info *cold = page_list_last(&pc->list[order]);
+
+            page_list_del(cold, &pc->list[order]);
+            page_list_add(cold, &spill);
+        }
+        pc->count[order] -= PCP_BATCH;
+    }
+
+    spin_unlock(&pc->lock);
+
+    if ( !page_list_empty(&spill) )
+        pcp_release(&spill, order);
+
+    return true;
+}
+
+static int cf_check pcp_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned int order;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        for ( order = 0; order < PCP_NR_ORDERS; order++ )
+        {
+            INIT_PAGE_LIST_HEAD(&pc->list[order]);
+            pc->count[order] = 0;
+        }
+        break;
+
+    case CPU_DEAD:
+        pcp_drain(cpu);
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block pcp_cpu_nfb = {
+    .notifier_call = pcp_cpu_callback
+};
+
+static int __init cf_check pcp_init(void)
+{
+    if ( !opt_page_cache )
+        return 0;
+
+    pcp_cpu_callback(&pcp_cpu_nfb, CPU_UP_PREPARE,
+                     (void *)(unsigned long)smp_processor_id());
+    register_cpu_notifier(&pcp_cpu_nfb);
+
+    pcp_enabled = true;
+
+    return 0;
+}
+presmp_initcall(pcp_init);
+
+#ifdef CONFIG_SELF_TESTS
+/*
+ * page-cache-bench -> time order-0 alloc/free cycles on all CPUs in
+ * parallel at boot, with and without the per-CPU caches.
+ */
+static bool __initdata opt_pcp_bench;
+boolean_param("page-cache-bench", opt_pcp_bench);
+
+#define PCP_BENCH_LOOPS 1024
+#define PCP_BENCH_DEPTH 32
+
+static struct tasklet __initdata pcp_bench_tasklet[NR_CPUS];
+static s_time_t __initdata pcp_bench_ns[NR_CPUS];
+static bool __initdata pcp_bench_go;
+static atomic_t __initdata pcp_bench_done;
+
+static void __init cf_check pcp_bench_cpu(void *unused)
+{
+    struct page_info *pg[PCP_BENCH_DEPTH];
+    unsigned int i, j;
+    s_time_t start;
+
+    while ( !ACCESS_ONCE(pcp_bench_go) )
+        cpu_relax();
+
+    start = NOW();
+
+    for ( i = 0; i < PCP_BENCH_LOOPS; i++ )
+    {
+        for ( j = 0; j < PCP_BENCH_DEPTH; j++ )
+            pg[j] = alloc_domheap_page(NULL, MEMF_no_scrub);
+        for ( j = 0; j < PCP_BENCH_DEPTH; j++ )
+            if ( pg[j] )
+                free_domheap_page(pg[j]);
+    }
+
+    pcp_bench_ns[smp_processor_id()] = NOW() - start;
+
+    smp_wmb();
+    atomic_inc(&pcp_bench_done);
+}
+
+/* Returns the aggregate number of allocations per second. */
+static uint64_t __init pcp_bench_run(void)
+{
+    unsigned int cpu, this_cpu = smp_processor_id();
+    uint64_t rate = 0;
+
+    pcp_bench_go = false;
+    atomic_set(&pcp_bench_done, 0);
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( cpu == this_cpu )
+            continue;
+        tasklet_init(&pcp_bench_tasklet[cpu], pcp_bench_cpu, NULL);
+        tasklet_schedule_on_cpu(&pcp_bench_tasklet[cpu], cpu);
+    }
+
+    smp_wmb();
+    pcp_bench_go = true;
+    pcp_bench_cpu(NULL);
+
+    while ( atomic_read(&pcp_bench_done) < num_online_cpus() )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+
+    smp_rmb();
+    for_each_online_cpu ( cpu )
+        rate += (uint64_t)PCP_BENCH_LOOPS * PCP_BENCH_DEPTH * SECONDS(1) /
+                max(pcp_bench_ns[cpu], (s_time_t)1);
+
+    return rate;
+}
+
+static int __init cf_check pcp_bench(void)
+{
+    bool enabled = pcp_enabled;
+    uint64_t cached, uncached;
+
+    if ( !opt_pcp_bench )
+        return 0;
+
+    pcp_drain_all();
+    pcp_enabled = false;
+    uncached = pcp_bench_run();
+
+    pcp_enabled = enabled;
+    cached = enabled ? pcp_bench_run() : 0;
+
+    printk("page-cache bench: %u CPUs, %"PRIu64" allocs/s uncached, "
+           "%"PRIu64" allocs/s cached\n",
+           num_online_cpus(), uncached, cached);
+
+    return 0;
+}
+__initcall(pcp_bench);
+#endif /* CONFIG_SELF_TESTS */
+
+/* Allocate 2^@order contiguous pages. */
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    nodeid_t node;
+    unsigned int i, first_dirty;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+    bool need_tlbflush = false, cached = false, drained = false;
+    uint32_t tlbflush_timestamp = 0;
+    unsigned int dirty_cnt = 0;
+    mfn_t mfn;
+
+    /* Make sure there are enough bits in memflags for nodeID. */
+    BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
+
+    ASSERT(zone_lo <= zone_hi);
+    ASSERT(zone_hi < NR_ZONES);
+
+    if ( unlikely(order > MAX_ORDER) )
+        return NULL;
+
+    if ( (pg = pcp_alloc(zone_lo, zone_hi, order, memflags, d)) != NULL )
+    {
+        cached = true;
+        first_dirty = INVALID_DIRTY_IDX;
+
+        for ( i = 0; i < (1U << order); i++ )
+        {
+            if ( pg[i].count_info & PGC_need_scrub )
+                first_dirty = 0;
+
+            if ( !(memflags & MEMF_no_tlbflush) )
+                accumulate_tlbflush(&need_tlbflush, &pg[i],
+                                    &tlbflush_timestamp);
+
+            init_free_page_fields(&pg[i]);
+        }
+
+        goto scrub;
+    }
+
+ retry:
+    spin_lock(&heap_lock);
+
+    /*
+     * Claimed memory is considered unavailable unless the request
+     * is made by a domain with sufficient unclaimed pages.
+     */
+    if ( (outstanding_claims + request > total_avail_pages) &&
+          ((memflags & MEMF_no_refcount) ||
+           !d || d->outstanding_pages < request) )
+        pg = NULL;
+    else
+        pg = take_heap_pages(zone_lo, zone_hi, order, memflags, d,
+                             &first_dirty);
+
+    if ( !pg )
+    {
+        spin_unlock(&heap_lock);
+
+        /* Memory sitting in per-CPU caches might satisfy the request. */
+        if ( !drained && pcp_drain_all() )
+        {
+            drained = true;
+            goto retry;
+        }
+
+        /* No suitable memory blocks. Fail the request. */
+        return NULL;
+    }
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
         if ( !(memflags & MEMF_no_tlbflush) )
             accumulate_tlbflush(&need_tlbflush, &pg[i],
                                 &tlbflush_timestamp);
@@ -1037,6 +1535,9 @@ static struct page_info *alloc_heap_pages(
 
     spin_unlock(&heap_lock);
 
+ scrub:
+    node = page_to_nid(pg);
+
     if ( first_dirty != INVALID_DIRTY_IDX ||
          (scrub_debug && !(memflags & MEMF_no_scrub)) )
     {
@@ -1055,7 +1556,8 @@ static struct page_info *alloc_heap_pages(
                 check_one_page(&pg[i]);
         }
 
-        if ( dirty_cnt )
+        /* Cached pages were already taken off node_need_scrub. */
+        if ( dirty_cnt && !cached )
         {
             spin_lock(&heap_lock);
             node_need_scrub[node] -= dirty_cnt;
@@ -1449,8 +1951,8 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
 
 static void free_color_heap_page(struct page_info *pg, bool need_scrub);
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
+/* Free 2^@order set of pages.  Must be called with heap_lock held. */
+static void free_heap_pages_locked(
     struct page_info *pg, unsigned int order, bool need_scrub)
 {
     unsigned long mask;
@@ -1460,8 +1962,7 @@ static void free_heap_pages(
     bool pg_offlined = false;
 
     ASSERT(order <= MAX_ORDER);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -1479,7 +1980,6 @@ static void free_heap_pages(
             ASSERT(order == 0);
 
             free_color_heap_page(pg, need_scrub);
-            spin_unlock(&heap_lock);
             return;
         }
     }
@@ -1553,7 +2053,17 @@ static void free_heap_pages(
 
     if ( pg_offlined )
         reserve_offlined_page(pg);
+}
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    if ( pcp_free(pg, order, need_scrub) )
+        return;
 
+    spin_lock(&heap_lock);
+    free_heap_pages_locked(pg, order, need_scrub);
     spin_unlock(&heap_lock);
 }
 
@@ -2769,6 +3279,18 @@ static void cf_check pagealloc_info(unsigned char key)
 
     printk("    dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
 
+    if ( pcp_enabled )
+    {
+        unsigned int cpu, order;
+
+        total = 0;
+        for_each_online_cpu ( cpu )
+            for ( order = 0; order < PCP_NR_ORDERS; order++ )
+                total += (unsigned long)per_cpu(page_cache, cpu).count[order]
+                         << order;
+        printk("    per-CPU caches: %lukB\n", total << (PAGE_SHIFT-10));
+    }
+
     dump_llc_coloring_info();
 }
 
@@ -35,6 +35,7 @@
 #include <crux/kernel.h>
 #include <crux/init.h>
 #include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/sections.h>
 #include <crux/spinlock.h>
 #include <crux/smp.h>
@@ -54,14 +55,17 @@ static struct rcu_ctrlblk {
     long cur;           /* Current batch number.                      */
     long completed;     /* Number of the last completed batch         */
     int  next_pending;  /* Is the next batch already waiting?         */
+    long expedite_upto; /* Last batch to expedite                     */
 
     spinlock_t  lock __cacheline_aligned;
     cpumask_t   cpumask; /* CPUs that need to switch in order ... */
     cpumask_t   idle_cpumask; /* ... unless they are already idle */
     /* for current batch to proceed.        */
+    cpumask_t   expedite_cpumask; /* CPUs waiting for expedited batches */
 } __cacheline_aligned rcu_ctrlblk = {
     .cur = -300,
     .completed = -300,
+    .expedite_upto = -300,
     .lock = SPIN_LOCK_UNLOCKED,
 };
 
@@ -94,6 +98,7 @@ struct rcu_data {
 
     bool            process_callbacks;
     bool            barrier_active;
+    bool            expedite;         /* Report quiescence without delay */
 };
 
 /*
@@ -146,6 +151,45 @@ static int qhimark = 10000;
 static int qlowmark = 100;
 static int rsinterval = 1000;
 
+/*
+ * Callback offloading: the CPUs in rcu_nocb_cpumask don't invoke their RCU
+ * callbacks themselves. Once the grace period of a batch is over, they hand
+ * the callbacks over to rcu_nocb_cpu instead, keeping their run time (and
+ * cache footprint) off e.g. CPUs dedicated to real-time guests.
+ */
+static cpumask_t __read_mostly rcu_nocb_cpumask;
+static unsigned int __read_mostly rcu_nocb_cpu;
+integer_param("rcu-nocb-cpu", rcu_nocb_cpu);
+
+static struct {
+    spinlock_t lock;
+    struct rcu_head *list, **tail;
+} rcu_nocb = {
+    .lock = SPIN_LOCK_UNLOCKED,
+    .tail = &rcu_nocb.list,
+};
+
+/* "rcu-nocb=<cpu>[-<cpu>][,...]" */
+static int __init cf_check parse_rcu_nocb(const char *s)
+{
+    do {
+        unsigned long start, end;
+
+        start = end = simple_strtoul(s, &s, 0);
+        if ( *s == '-' )
+            end = simple_strtoul(s + 1, &s, 0);
+
+        if ( start > end || end >= NR_CPUS )
+            return -EINVAL;
+
+        for ( ; start <= end; start++ )
+            cpumask_set_cpu(start, &rcu_nocb_cpumask);
+    } while ( *s++ == ',' );
+
+    return s[-1] ? -EINVAL : 0;
+}
+custom_param("rcu-nocb", parse_rcu_nocb);
+
 /*
  * rcu_barrier() handling:
  * Two counters are used to synchronize rcu_barrier() work:
@@ -262,6 +306,38 @@ static void force_quiescent_state(struct rcu_data *rdp,
     }
 }
 
+/*
+ * Have the CPUs in mask report a quiescent state as soon as they get to the
+ * RCU softirq, instead of waiting for their next time through it.
+ */
+static void rcu_expedite_cpus(const cpumask_t *mask)
+{
+    cpumask_t online;
+    unsigned int cpu;
+
+    cpumask_and(&online, mask, &cpu_online_map);
+    for_each_cpu ( cpu, &online )
+        per_cpu(rcu_data, cpu).expedite = true;
+
+    smp_wmb();
+    cpumask_raise_softirq(&online, RCU_SOFTIRQ);
+}
+
+/*
+ * Expedite the CPUs the current batch is waiting for. Idle CPUs are left
+ * alone, their idle timer reports for them, and so are the CPUs in
+ * rcu_nocb_cpumask, which offloading is meant to keep undisturbed: they
+ * report at their next time through the RCU softirq.
+ */
+static void rcu_expedite_batch(const struct rcu_ctrlblk *rcp)
+{
+    cpumask_t mask;
+
+    cpumask_andnot(&mask, &rcp->cpumask, &rcp->idle_cpumask);
+    cpumask_andnot(&mask, &mask, &rcu_nocb_cpumask);
+    rcu_expedite_cpus(&mask);
+}
+
 /**
  * call_rcu - Queue an RCU callback for invocation after a grace period.
  * @head: structure to be used for queueing the RCU updates.
@@ -292,6 +368,153 @@ void call_rcu(struct rcu_head *head,
     local_irq_restore(flags);
 }
 
+/**
+ * call_rcu_expedited - Queue an RCU callback, and hurry up its grace period.
+ * @head: structure to be used for queueing the RCU updates.
+ * @func: actual update function to be invoked after the grace period
+ *
+ * Like call_rcu(), except that the grace periods up to the one @func waits
+ * for are driven by IPIs to the non-idle CPUs outside of rcu_nocb_cpumask,
+ * rather than by each of them getting to the RCU softirq (twice) in its own
+ * good time, and that this CPU is poked to invoke @func as soon as its grace
+ * period is over.
+ */
+void call_rcu_expedited(struct rcu_head *head,
+                        void (*func)(struct rcu_head *rcu))
+{
+    struct rcu_ctrlblk *rcp = &rcu_ctrlblk;
+    long upto, old;
+
+    call_rcu(head, func);
+
+    perfc_incr(rcu_expedited);
+
+    /*
+     * @head ends up in one of the next two batches, depending on whether
+     * this CPU still has a batch of its own waiting. Only ever move
+     * expedite_upto forward.
+     */
+    upto = read_atomic(&rcp->cur) + 2;
+    while ( rcu_batch_before(old = read_atomic(&rcp->expedite_upto), upto) &&
+            cmpxchg(&rcp->expedite_upto, old, upto) != old )
+        continue;
+    cpumask_set_cpu(smp_processor_id(), &rcp->expedite_cpumask);
+
+    /*
+     * Hurry along the batch in progress, if any, as ours has to wait for it.
+     * rcu_start_batch() will take care of the following ones. Reading the
+     * masks without the lock only risks spurious or missed IPIs.
+     */
+    rcu_expedite_batch(rcp);
+
+    /* Get @head into a batch. */
+    raise_softirq(RCU_SOFTIRQ);
+}
+
+struct rcu_sync {
+    struct rcu_head head;
+    bool done;
+};
+
+static void cf_check rcu_sync_callback(struct rcu_head *head)
+{
+    struct rcu_sync *sync = container_of(head, struct rcu_sync, head);
+
+    smp_wmb();
+    write_atomic(&sync->done, true);
+}
+
+static void rcu_sync(bool expedited)
+{
+    struct rcu_sync sync = { .done = false };
+
+    ASSERT(!in_irq() && local_irq_is_enabled() && rcu_quiesce_allowed());
+
+    if ( expedited )
+        call_rcu_expedited(&sync.head, rcu_sync_callback);
+    else
+        call_rcu(&sync.head, rcu_sync_callback);
+
+    while ( !read_atomic(&sync.done) )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+    smp_rmb();
+}
+
+/**
+ * synchronize_rcu_expedited - Wait for an expedited grace period.
+ *
+ * On return, all RCU read-side critical sections that were running when
+ * this was called have completed. Must not be called in an RCU read-side
+ * critical section, or with interrupts disabled.
+ */
+void synchronize_rcu_expedited(void)
+{
+    rcu_sync(true);
+}
+
+/*
+ * Hand a CPU's completed callbacks over to rcu_nocb_cpu, see
+ * rcu_nocb_cpumask. Return false if rcu_nocb_cpu is offline, in which case
+ * the callbacks are left to the caller.
+ */
+static bool rcu_nocb_queue(struct rcu_data *rdp)
+{
+    struct rcu_head *list;
+    long count = 0;
+
+    for ( list = rdp->donelist; list; list = list->next )
+        count++;
+
+    spin_lock(&rcu_nocb.lock);
+
+    /*
+     * rcu_nocb_cpu drops out of cpu_online_map before its CPU_DEAD
+     * notification drains the list under the lock, so whatever is queued
+     * while it is seen online here still gets invoked.
+     */
+    if ( !cpu_online(rcu_nocb_cpu) )
+    {
+        spin_unlock(&rcu_nocb.lock);
+        return false;
+    }
+
+    *rcu_nocb.tail = rdp->donelist;
+    rcu_nocb.tail = rdp->donetail;
+    spin_unlock(&rcu_nocb.lock);
+
+    rdp->donelist = NULL;
+    rdp->donetail = &rdp->donelist;
+    rdp->qlen -= count;
+    if ( rdp->blimit == INT_MAX && rdp->qlen <= qlowmark )
+        rdp->blimit = blimit;
+
+    perfc_incr(rcu_nocb_handoff);
+    cpu_raise_softirq(rcu_nocb_cpu, RCU_SOFTIRQ);
+
+    return true;
+}
+
+/* Invoke the callbacks handed over to us by other CPUs. */
+static void rcu_nocb_run(void)
+{
+    struct rcu_head *list, *next;
+
+    spin_lock(&rcu_nocb.lock);
+    list = rcu_nocb.list;
+    rcu_nocb.list = NULL;
+    rcu_nocb.tail = &rcu_nocb.list;
+    spin_unlock(&rcu_nocb.lock);
+
+    for ( ; list; list = next )
+    {
+        next = list->next;
+        list->func(list);
+    }
+}
+
 /*
  * Invoke the completed RCU callbacks. They are expected to be in
  * a per-cpu list.
@@ -301,6 +524,10 @@ static void rcu_do_batch(struct rcu_data *rdp)
     struct rcu_head *next, *list;
     int count = 0;
 
+    if ( cpumask_test_cpu(rdp->cpu, &rcu_nocb_cpumask) &&
+         rcu_nocb_queue(rdp) )
+        return;
+
     list = rdp->donelist;
     while (list) {
         next = rdp->donelist = list->next;
@@ -366,6 +593,10 @@ static void rcu_start_batch(struct rcu_ctrlblk *rcp)
         */
         smp_mb();
         cpumask_andnot(&rcp->cpumask, &cpu_online_map, &rcp->idle_cpumask);
+
+        /* See call_rcu_expedited(). */
+        if ( !rcu_batch_before(rcp->expedite_upto, rcp->cur) )
+            rcu_expedite_batch(rcp);
     }
 }
 
@@ -380,6 +611,16 @@ static void cpu_quiet(int cpu, struct rcu_ctrlblk *rcp)
     if (cpumask_empty(&rcp->cpumask)) {
         /* batch completed ! */
         rcp->completed = rcp->cur;
+
+        /* Have whoever is waiting for an expedited batch look right away. */
+        if ( !rcu_batch_before(rcp->expedite_upto, rcp->completed) &&
+             !cpumask_empty(&rcp->expedite_cpumask) )
+        {
+            rcu_expedite_cpus(&rcp->expedite_cpumask);
+            if ( rcp->completed == rcp->expedite_upto )
+                cpumask_clear(&rcp->expedite_cpumask);
+        }
+
         rcu_start_batch(rcp);
     }
 }
@@ -470,13 +711,28 @@ static void __rcu_process_callbacks(struct rcu_ctrlblk *rcp,
 static void cf_check rcu_process_callbacks(void)
 {
     struct rcu_data *rdp = &this_cpu(rcu_data);
+    bool expedite = rdp->expedite;
 
-    if ( rdp->process_callbacks )
+    if ( expedite )
+        rdp->expedite = false;
+
+    if ( rdp->process_callbacks || expedite )
     {
         rdp->process_callbacks = false;
         __rcu_process_callbacks(&rcu_ctrlblk, rdp);
+
+        /*
+         * Being in the RCU softirq is a quiescent state in itself. If this
+         * pass only noticed the start of an expedited grace period, report
+         * the quiescent state right away rather than on the next pass.
+         */
+        if ( expedite )
+            rcu_check_quiescent_state(&rcu_ctrlblk, rdp);
     }
 
+    if ( rdp->cpu == rcu_nocb_cpu && rcu_nocb.list )
+        rcu_nocb_run();
+
     if ( atomic_read(&cpu_count) && !rdp->barrier_active )
     {
         rdp->barrier_active = true;
@@ -656,6 +912,8 @@ static int cf_check cpu_callback(
     case CPU_UP_CANCELED:
     case CPU_DEAD:
         rcu_offline_cpu(&this_cpu(rcu_data), &rcu_ctrlblk, rdp);
+        if ( cpu == rcu_nocb_cpu )
+            rcu_nocb_run();
         break;
     default:
         break;
@@ -686,6 +944,17 @@ void __init rcu_init(void)
     }
     idle_timer_period = MILLISECS(idle_timer_period_ms);
 
+    if ( rcu_nocb_cpu >= NR_CPUS )
+    {
+        printk("WARNING: rcu-nocb-cpu out of range, not offloading callbacks\n");
+        rcu_nocb_cpu = 0;
+        cpumask_clear(&rcu_nocb_cpumask);
+    }
+    cpumask_clear_cpu(rcu_nocb_cpu, &rcu_nocb_cpumask);
+    if ( !cpumask_empty(&rcu_nocb_cpumask) )
+        printk("RCU: callbacks of CPUs %*pbl run on CPU%u\n",
+               CPUMASK_PR(&rcu_nocb_cpumask), rcu_nocb_cpu);
+
     cpumask_clear(&rcu_ctrlblk.idle_cpumask);
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
@@ -719,3 +988,37 @@ void rcu_idle_exit(unsigned int cpu)
     ASSERT(cpumask_test_cpu(cpu, &rcu_ctrlblk.idle_cpumask));
     cpumask_clear_cpu(cpu, &rcu_ctrlblk.idle_cpumask);
 }
+
+#ifdef CONFIG_SELF_TESTS
+/*
+ * rcu-bench -> time grace periods at boot, as waited for by e.g. the final
+ * stage of domain destruction, with and without expediting them.
+ */
+static bool __initdata opt_rcu_bench;
+boolean_param("rcu-bench", opt_rcu_bench);
+
+#define RCU_BENCH_LOOPS 100
+
+static int __init cf_check rcu_bench(void)
+{
+    unsigned int i, exp;
+
+    if ( !opt_rcu_bench )
+        return 0;
+
+    for ( exp = 0; exp < 2; exp++ )
+    {
+        s_time_t start = NOW();
+
+        for ( i = 0; i < RCU_BENCH_LOOPS; i++ )
+            rcu_sync(exp);
+
+        printk(CRUXLOG_INFO "RCU: %s grace period: %"PRI_stime" ns\n",
+               exp ? "expedited" : "normal",
+               (NOW() - start) / RCU_BENCH_LOOPS);
+    }
+
+    return 0;
+}
+__initcall(rcu_bench);
+#endif /* CONFIG_SELF_TESTS */
@@ -1511,6 +1511,22 @@ long vcpu_yield(void)
     return 0;
 }
 
+/*
+ * Does v's unit have its pCPU to itself?  True in cpupools running the null
+ * scheduler, and for units hard pinned to a single pCPU, which is only a hint
+ * as nothing stops other units from being pinned to the same pCPU.
+ */
+bool vcpu_has_exclusive_pcpu(const struct vcpu *v)
+{
+    const struct domain *d = v->domain;
+
+    if ( is_idle_domain(d) )
+        return false;
+
+    return dom_scheduler(d)->sched_id == CRUX_SCHEDULER_NULL ||
+           cpumask_weight(v->sched_unit->cpu_hard_affinity) == 1;
+}
+
 static void cf_check domain_watchdog_timeout(void *data)
 {
     /*
@@ -18,6 +18,7 @@
 #include <crux/sched.h>
 #include <crux/sections.h>
 #include <crux/softirq.h>
+#include <crux/sort.h>
 #include <crux/time.h>
 #include <crux/trace.h>
 
@@ -429,6 +430,11 @@ integer_param("credit2_cap_period_ms", opt_cap_period);
  *             core of the host. This will happen if the opt_runqueue
  *             parameter is set to 'core';
  *
+ * - per-cluster: meaning that there will be one runqueue per each cluster
+ *                of cores (which, typically, share a last level cache) of
+ *                the host. This will happen if the opt_runqueue parameter
+ *                is set to 'cluster';
+ *
  * - per-socket: meaning that there will be one runqueue per each physical
  *               socket (AKA package, which often, but not always, also
  *               matches a NUMA node) of the host; This will happen if
@@ -443,17 +449,20 @@ integer_param("credit2_cap_period_ms", opt_cap_period);
  *           the opt_runqueue parameter is set to 'all'.
  *
  * Depending on the value of opt_runqueue, therefore, cpus that are part of
- * either the same physical core, the same physical socket, the same NUMA
- * node, or just all of them, will be put together to form runqueues.
+ * either the same physical core, the same cluster, the same physical socket,
+ * the same NUMA node, or just all of them, will be put together to form
+ * runqueues.
  */
-#define OPT_RUNQUEUE_CPU    0
-#define OPT_RUNQUEUE_CORE   1
-#define OPT_RUNQUEUE_SOCKET 2
-#define OPT_RUNQUEUE_NODE   3
-#define OPT_RUNQUEUE_ALL    4
+#define OPT_RUNQUEUE_CPU     0
+#define OPT_RUNQUEUE_CORE    1
+#define OPT_RUNQUEUE_CLUSTER 2
+#define OPT_RUNQUEUE_SOCKET  3
+#define OPT_RUNQUEUE_NODE    4
+#define OPT_RUNQUEUE_ALL     5
 static const char *const opt_runqueue_str[] = {
     [OPT_RUNQUEUE_CPU] = "cpu",
     [OPT_RUNQUEUE_CORE] = "core",
+    [OPT_RUNQUEUE_CLUSTER] = "cluster",
     [OPT_RUNQUEUE_SOCKET] = "socket",
     [OPT_RUNQUEUE_NODE] = "node",
     [OPT_RUNQUEUE_ALL] = "all"
@@ -493,6 +502,64 @@ custom_param("credit2_runqueue", parse_credit2_runqueue);
 static unsigned int __read_mostly opt_max_cpus_runqueue = MAX_CPUS_RUNQ;
 integer_param("sched_credit2_max_cpus_runqueue", opt_max_cpus_runqueue);
 
+/*
+ * Topology-aware migration cost.
+ *
+ * Moving a unit to another runqueue makes it lose (part of) its cache
+ * footprint and, the further apart the two runqueues are in the host
+ * topology, the more of it. The distance between two runqueues is the
+ * innermost topology level their CPUs have in common, and each level has a
+ * cost, expressed as a percentage of the load of one fully busy CPU. The
+ * cost of moving a unit is the cost of the distance, scaled by the load of
+ * the unit itself (a unit that hardly ever runs has little cache footprint
+ * to lose). It is charged:
+ *  - in csched2_res_pick(), on top of the load of any runqueue other than
+ *    the one the unit is currently in;
+ *  - in balance_load(), against the load imbalance that pushing, pulling
+ *    or swapping units would get rid of.
+ *
+ * The costs can be changed with the 'sched_credit2_migrate_cost' parameter,
+ * as a comma separated list of up to RQD_DIST_NR - 1 values, for distances
+ * core, cluster, socket, node and remote, in this order.
+ */
+enum rqd_dist {
+    RQD_DIST_LOCAL,     /* Same runqueue                                    */
+    RQD_DIST_CORE,      /* Different runqueues, but same core (SMT threads) */
+    RQD_DIST_CLUSTER,   /* Same cluster, typically sharing last level cache */
+    RQD_DIST_SOCKET,    /* Same socket                                      */
+    RQD_DIST_NODE,      /* Same NUMA node                                   */
+    RQD_DIST_REMOTE,    /* Different NUMA nodes                             */
+    RQD_DIST_NR
+};
+static unsigned int __read_mostly opt_migrate_cost[RQD_DIST_NR] = {
+    [RQD_DIST_CORE]    = 0,
+    [RQD_DIST_CLUSTER] = 2,
+    [RQD_DIST_SOCKET]  = 5,
+    [RQD_DIST_NODE]    = 8,
+    [RQD_DIST_REMOTE]  = 15,
+};
+
+static int __init cf_check parse_credit2_migrate_cost(const char *s)
+{
+    unsigned int i;
+
+    for ( i = RQD_DIST_CORE; i < RQD_DIST_NR; i++ )
+    {
+        unsigned long val = simple_strtoul(s, &s, 0);
+
+        if ( val > 100 )
+            return -EINVAL;
+        opt_migrate_cost[i] = val;
+
+        if ( *s != ',' )
+            break;
+        s++;
+    }
+
+    return *s ? -EINVAL : 0;
+}
+custom_param("sched_credit2_migrate_cost", parse_credit2_migrate_cost);
+
 /*
  * Per-runqueue data
  */
@@ -515,11 +582,14 @@ struct csched2_runqueue_data {
     cpumask_t active,          /* CPUs enabled for this runqueue             */
         smt_idle,              /* Fully idle-and-untickled cores (see below) */
         tickled,               /* Have been asked to go through schedule     */
-        idle;                  /* Currently idle pcpus                       */
+        idle,                  /* Currently idle pcpus                       */
+        idlers;                /* Idle and untickled pcpus (lockless, below) */
+    unsigned int idlers_gen;   /* Odd while idlers is being updated          */
 
     struct list_head svc;      /* List of all units assigned to the runqueue */
     unsigned int max_weight;   /* Max weight of the units in this runqueue   */
     unsigned int pick_bias;    /* Last picked pcpu. Start from it next time  */
+    unsigned int topo_cpu;     /* First pcpu, representing it in topology    */
 };
 
 /*
@@ -535,6 +605,8 @@ struct csched2_private {
     unsigned int active_queues;        /* Number of active runqueues         */
     struct list_head rql;              /* List of runqueues                  */
 
+    s_time_t migrate_cost[RQD_DIST_NR]; /* Cost of migrating a busy unit     */
+
     cpumask_t initialized;             /* CPUs part of this scheduler        */
     struct list_head sdom;             /* List of domains (for debug key)    */
 };
@@ -713,9 +785,68 @@ void smt_idle_mask_clear(unsigned int cpu, cpumask_t *mask)
         cpumask_andnot(mask, mask, cpu_siblings);
 }
 
+/*
+ * rqd->idlers mirrors rqd->idle & ~rqd->tickled, but, unlike those two, it
+ * can be looked at without holding the runqueue lock. This is what lets
+ * csched2_res_pick() find a good pcpu in a remote runqueue without having
+ * to (try to) grab its lock.
+ *
+ * Updates happen with the runqueue lock held (or, when pcpus are added to
+ * or removed from the runqueue, with the private lock held in write mode),
+ * so there is only one writer at a time. Each update is bracketed by two
+ * increments of idlers_gen, so that a lockless reader can tell whether the
+ * snapshot it took is consistent (the generation was even, and the same,
+ * before and after copying the mask). Of course, the snapshot may be stale
+ * by the time it is used, so it is a hint: runq_tickle() always re-checks
+ * under the lock.
+ *
+ * Call this after having changed either rqd->idle or rqd->tickled for cpu.
+ */
+static inline
+void idlers_update(unsigned int cpu, struct csched2_runqueue_data *rqd)
+{
+    bool idle = cpumask_test_cpu(cpu, &rqd->idle) &&
+                !cpumask_test_cpu(cpu, &rqd->tickled);
+
+    if ( idle == cpumask_test_cpu(cpu, &rqd->idlers) )
+        return;
+
+    write_atomic(&rqd->idlers_gen, rqd->idlers_gen + 1);
+    smp_wmb();
+    if ( idle )
+        cpumask_set_cpu(cpu, &rqd->idlers);
+    else
+        cpumask_clear_cpu(cpu, &rqd->idlers);
+    smp_wmb();
+    write_atomic(&rqd->idlers_gen, rqd->idlers_gen + 1);
+}
+
+/*
+ * Take a snapshot of rqd->idlers without holding rqd->lock. If we can't get
+ * a consistent one after a few attempts, give up (the runqueue is clearly
+ * very busy changing state) and return false.
+ */
+static bool idlers_snapshot(const struct csched2_runqueue_data *rqd,
+                            cpumask_t *mask)
+{
+    unsigned int gen, tries = 3;
+
+    do {
+        gen = read_atomic(&rqd->idlers_gen);
+        smp_rmb();
+        cpumask_copy(mask, &rqd->idlers);
+        smp_rmb();
+        if ( !(gen & 1) && gen == read_atomic(&rqd->idlers_gen) )
+            return true;
+        SCHED_STAT_CRANK(idlers_snapshot_retry);
+    } while ( --tries );
+
+    return false;
+}
+
 /*
  * In csched2_res_pick(), it may not be possible to actually look at remote
- * runqueues (the trylock-s on their spinlocks can fail!). If that happens,
+ * runqueues (the trylock on the private lock can fail!). If that happens,
  * we pick, in order of decreasing preference:
  *  1) svc's current pcpu, if it is part of svc's soft affinity;
  *  2) a pcpu in svc's current runqueue that is also in svc's soft affinity;
@@ -854,12 +985,52 @@ static inline bool same_socket(unsigned int cpua, unsigned int cpub)
     return cpu_to_socket(cpua) == cpu_to_socket(cpub);
 }
 
+static inline bool same_cluster(unsigned int cpua, unsigned int cpub)
+{
+    return same_socket(cpua, cpub) &&
+           cpu_to_cluster(cpua) == cpu_to_cluster(cpub);
+}
+
 static inline bool same_core(unsigned int cpua, unsigned int cpub)
 {
     return same_socket(cpua, cpub) &&
            cpu_to_core(cpua) == cpu_to_core(cpub);
 }
 
+static enum rqd_dist
+rqd_distance(const struct csched2_runqueue_data *a,
+             const struct csched2_runqueue_data *b)
+{
+    if ( a == b )
+        return RQD_DIST_LOCAL;
+    if ( !same_node(a->topo_cpu, b->topo_cpu) )
+        return RQD_DIST_REMOTE;
+    if ( !same_socket(a->topo_cpu, b->topo_cpu) )
+        return RQD_DIST_NODE;
+    if ( !same_cluster(a->topo_cpu, b->topo_cpu) )
+        return RQD_DIST_SOCKET;
+    if ( !same_core(a->topo_cpu, b->topo_cpu) )
+        return RQD_DIST_CLUSTER;
+    return RQD_DIST_CORE;
+}
+
+/*
+ * Cost, in load units, of moving svc from its current runqueue to trqd.
+ * Units which are not in any runqueue yet can go anywhere for free.
+ */
+static inline s_time_t migrate_cost(const struct csched2_private *prv,
+                                    const struct csched2_unit *svc,
+                                    const struct csched2_runqueue_data *trqd)
+{
+    if ( !svc->rqd )
+        return 0;
+
+    return (prv->migrate_cost[rqd_distance(svc->rqd, trqd)] *
+            min_t(s_time_t, svc->avgload,
+                  1LL << prv->load_precision_shift)) >>
+           prv->load_precision_shift;
+}
+
 static inline bool
 cpu_runqueue_match(const struct csched2_runqueue_data *rqd, unsigned int cpu)
 {
@@ -870,6 +1041,8 @@ cpu_runqueue_match(const struct csched2_runqueue_data *rqd, unsigned int cpu)
     /* OPT_RUNQUEUE_CPU will never find an existing runqueue. */
     return opt_runqueue == OPT_RUNQUEUE_ALL ||
            (opt_runqueue == OPT_RUNQUEUE_CORE && same_core(peer_cpu, cpu)) ||
+           (opt_runqueue == OPT_RUNQUEUE_CLUSTER &&
+            same_cluster(peer_cpu, cpu)) ||
            (opt_runqueue == OPT_RUNQUEUE_SOCKET && same_socket(peer_cpu, cpu)) ||
            (opt_runqueue == OPT_RUNQUEUE_NODE && same_node(peer_cpu, cpu));
 }
@@ -1039,6 +1212,7 @@ cpu_add_to_runqueue(const struct scheduler *ops, unsigned int cpu)
 
         list_add(&rqd->rql, rqd_ins);
         rqd->pick_bias = cpu;
+        rqd->topo_cpu = cpu;
         rqd->id = rqi;
     }
     else
@@ -1487,6 +1661,7 @@ static inline void
 tickle_cpu(unsigned int cpu, struct csched2_runqueue_data *rqd)
 {
     __cpumask_set_cpu(cpu, &rqd->tickled);
+    idlers_update(cpu, rqd);
     smt_idle_mask_clear(cpu, &rqd->smt_idle);
     cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
 }
@@ -1634,8 +1809,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_unit *new, s_time_t now)
      * with them quickly.
      */
     if ( unlikely((new->flags & CSFLAG_pinned) &&
-                  cpumask_test_cpu(cpu, &rqd->idle) &&
-                  !cpumask_test_cpu(cpu, &rqd->tickled)) )
+                  cpumask_test_cpu(cpu, &rqd->idlers)) )
     {
         ASSERT(cpumask_cycle(cpu, unit->cpu_hard_affinity) == cpu);
         SCHED_STAT_CRANK(tickled_idle_cpu_excl);
@@ -1678,11 +1852,10 @@ runq_tickle(const struct scheduler *ops, struct csched2_unit *new, s_time_t now)
         /*
          * If there are no fully idle cores, check all idlers, after
          * having filtered out pcpus that have been tickled but haven't
-         * gone through the scheduler yet.
+         * gone through the scheduler yet (which is what rqd->idlers is).
          */
-        cpumask_andnot(&mask, &rqd->idle, &rqd->tickled);
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu), online);
-        cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
+        cpumask_and(&mask, &rqd->idlers, cpumask_scratch_cpu(cpu));
         i = cpumask_test_or_cycle(cpu, &mask);
         if ( i < nr_cpu_ids )
         {
@@ -2355,6 +2528,7 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
     s_time_t min_avgload = MAX_LOAD, min_s_avgload = MAX_LOAD;
     bool has_soft;
     struct csched2_runqueue_data *rqd, *min_rqd = NULL, *min_s_rqd = NULL;
+    cpumask_t idlers;
 
     ASSERT(!list_empty(&prv->rql));
 
@@ -2364,11 +2538,10 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
      * - Runqueue lock of vc->processor is already locked
      * - Need to grab prv lock to make sure active runqueues don't
      *   change
-     * - Need to grab locks for other runqueues while checking
-     *   avgload
+     * - Other runqueues' avgload and idlers are read without taking
+     *   their locks (see idlers_update())
      * Locking constraint is:
      * - Lock prv before runqueue locks
-     * - Trylock between runqueue locks (no ordering)
      *
      * Since one of the runqueue locks is already held, we can't
      * just grab the prv lock.  Instead, we'll have to trylock, and
@@ -2450,22 +2623,22 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
             continue;
 
         /*
-         * If checking a different runqueue, grab the lock, read the avg,
-         * and then release the lock.
+         * If checking a different runqueue, just read the avg. It is
+         * updated under that runqueue's lock, which we don't take: a value
+         * which is slightly stale is fine for the purpose of picking a
+         * runqueue, and is a lot better than skipping the runqueue
+         * entirely when the lock is contended (e.g., because many units
+         * are waking up at the same time).
          *
-         * If on our own runqueue, don't grab or release the lock;
-         * but subtract our own load from the runqueue load to simulate
-         * impartiality.
+         * If on our own runqueue, subtract our own load from the runqueue
+         * load to simulate impartiality. Otherwise, account for what moving
+         * there would cost us, given how far it is.
          */
         if ( rqd == svc->rqd )
-        {
             rqd_avgload = max_t(s_time_t, rqd->b_avgload - svc->avgload, 0);
-        }
-        else if ( spin_trylock(&rqd->lock) )
-        {
-            rqd_avgload = rqd->b_avgload;
-            spin_unlock(&rqd->lock);
-        }
+        else
+            rqd_avgload = read_atomic(&rqd->b_avgload) +
+                          migrate_cost(prv, svc, rqd);
 
         /*
          * if svc has a soft-affinity, and some cpus of rqd are part of it,
@@ -2512,6 +2685,7 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
                     unit->cpu_soft_affinity);
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
                     &min_s_rqd->active);
+        rqd = min_s_rqd;
     }
     else if ( min_rqd )
     {
@@ -2526,12 +2700,13 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
          */
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
                     &min_rqd->active);
+        rqd = min_rqd;
     }
     else
     {
         /*
-         * We didn't find anyone at all (most likely because of spinlock
-         * contention).
+         * We didn't find anyone at all (which should not really happen, as
+         * we no longer need to take remote runqueue locks).
          */
         new_cpu = get_fallback_cpu(svc);
         min_rqd = c2rqd(new_cpu);
@@ -2539,7 +2714,20 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
         goto out_up;
     }
 
-    new_cpu = cpumask_cycle(min_rqd->pick_bias, cpumask_scratch_cpu(cpu));
+    /*
+     * If the lockless summary of the chosen runqueue says there are idle
+     * and untickled pcpus among the ones we can use, return one of them,
+     * so runq_tickle() will likely find it still idle and just poke it.
+     */
+    if ( idlers_snapshot(rqd, &idlers) &&
+         cpumask_intersects(&idlers, cpumask_scratch_cpu(cpu)) )
+    {
+        cpumask_and(&idlers, &idlers, cpumask_scratch_cpu(cpu));
+        new_cpu = cpumask_cycle(min_rqd->pick_bias, &idlers);
+        SCHED_STAT_CRANK(pick_resource_idle);
+    }
+    else
+        new_cpu = cpumask_cycle(min_rqd->pick_bias, cpumask_scratch_cpu(cpu));
     min_rqd->pick_bias = new_cpu;
     BUG_ON(new_cpu >= nr_cpu_ids);
 
@@ -2572,15 +2760,33 @@ typedef struct {
     s_time_t load_delta;
     struct csched2_unit * best_push_svc, *best_pull_svc;
     /* NB: Read by consider() */
+    const struct csched2_private *prv;
     struct csched2_runqueue_data *lrqd;
     struct csched2_runqueue_data *orqd;
 } balance_state_t;
 
+/*
+ * Load imbalance between lrqd and orqd, minus what fixing it by moving a
+ * fully busy unit would cost. This is what we compare against the balancing
+ * tolerances, so runqueues far apart must be more imbalanced before we act.
+ */
+static s_time_t balance_delta(const struct csched2_private *prv,
+                              const struct csched2_runqueue_data *lrqd,
+                              const struct csched2_runqueue_data *orqd)
+{
+    s_time_t delta = lrqd->b_avgload - orqd->b_avgload;
+
+    if ( delta < 0 )
+        delta = -delta;
+
+    return delta - prv->migrate_cost[rqd_distance(lrqd, orqd)];
+}
+
 static void consider(balance_state_t *st,
                      struct csched2_unit *push_svc,
                      struct csched2_unit *pull_svc)
 {
-    s_time_t l_load, o_load, delta;
+    s_time_t l_load, o_load, delta, cost = 0;
 
     l_load = st->lrqd->b_avgload;
     o_load = st->orqd->b_avgload;
@@ -2589,17 +2795,21 @@ static void consider(balance_state_t *st,
         /* What happens to the load on both if we push? */
         l_load -= push_svc->avgload;
         o_load += push_svc->avgload;
+        cost += migrate_cost(st->prv, push_svc, st->orqd);
     }
     if ( pull_svc )
     {
         /* What happens to the load on both if we pull? */
         l_load += pull_svc->avgload;
         o_load -= pull_svc->avgload;
+        cost += migrate_cost(st->prv, pull_svc, st->lrqd);
     }
 
+    /* Moves only pay off if they cut the imbalance by more than they cost. */
     delta = l_load - o_load;
     if ( delta < 0 )
         delta = -delta;
+    delta += cost;
 
     if ( delta < st->load_delta )
     {
@@ -2702,7 +2912,8 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
     bool inner_load_updated = 0;
     struct csched2_runqueue_data *rqd, *max_delta_rqd;
 
-    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
+    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL,
+                           .prv = prv };
 
     /*
      * Basic algorithm: Push, pull, or swap.
@@ -2735,9 +2946,7 @@ retry:
 
         update_runq_load(ops, st.orqd, 0, now);
 
-        delta = st.lrqd->b_avgload - st.orqd->b_avgload;
-        if ( delta < 0 )
-            delta = -delta;
+        delta = balance_delta(prv, st.lrqd, st.orqd);
 
         if ( delta > st.load_delta )
         {
@@ -2827,7 +3036,14 @@ retry:
     /* Look for "swap" which gives the best load average
      * FIXME: O(n^2)! */
 
-    /* Reuse load delta (as we're trying to minimize it) */
+    /*
+     * Reuse load delta (as we're trying to minimize it), but without the
+     * distance discount: consider() charges the cost of each actual move.
+     */
+    st.load_delta = st.lrqd->b_avgload - st.orqd->b_avgload;
+    if ( st.load_delta < 0 )
+        st.load_delta = -st.load_delta;
+
     list_for_each( push_iter, &st.lrqd->svc )
     {
         struct csched2_unit * push_svc = list_entry(push_iter, struct csched2_unit, rqd_elem);
@@ -3059,6 +3275,7 @@ csched2_dom_cntl(
                          */
                         burn_credits(rqd, svc, NOW());
                         __cpumask_set_cpu(cpu, &rqd->tickled);
+                        idlers_update(cpu, rqd);
                         ASSERT(!cpumask_test_cpu(cpu, &rqd->smt_idle));
                         cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
                     }
@@ -3606,8 +3823,8 @@ static void cf_check csched2_schedule(
     if ( tickled )
     {
         __cpumask_clear_cpu(sched_cpu, &rqd->tickled);
-        cpumask_andnot(cpumask_scratch, &rqd->idle, &rqd->tickled);
-        smt_idle_mask_set(sched_cpu, cpumask_scratch, &rqd->smt_idle);
+        idlers_update(sched_cpu, rqd);
+        smt_idle_mask_set(sched_cpu, &rqd->idlers, &rqd->smt_idle);
     }
 
     if ( unlikely(tb_init_done) )
@@ -3693,6 +3910,7 @@ static void cf_check csched2_schedule(
         if ( cpumask_test_cpu(sched_cpu, &rqd->idle) )
         {
             __cpumask_clear_cpu(sched_cpu, &rqd->idle);
+            idlers_update(sched_cpu, rqd);
             smt_idle_mask_clear(sched_cpu, &rqd->smt_idle);
         }
 
@@ -3750,14 +3968,15 @@ static void cf_check csched2_schedule(
             if ( cpumask_test_cpu(sched_cpu, &rqd->idle) )
             {
                 __cpumask_clear_cpu(sched_cpu, &rqd->idle);
+                idlers_update(sched_cpu, rqd);
                 smt_idle_mask_clear(sched_cpu, &rqd->smt_idle);
             }
         }
         else if ( !cpumask_test_cpu(sched_cpu, &rqd->idle) )
         {
             __cpumask_set_cpu(sched_cpu, &rqd->idle);
-            cpumask_andnot(cpumask_scratch, &rqd->idle, &rqd->tickled);
-            smt_idle_mask_set(sched_cpu, cpumask_scratch, &rqd->smt_idle);
+            idlers_update(sched_cpu, rqd);
+            smt_idle_mask_set(sched_cpu, &rqd->idlers, &rqd->smt_idle);
         }
         /* Make sure avgload gets updated periodically even
          * if there's no activity */
@@ -3985,6 +4204,7 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
             }
 
     __cpumask_set_cpu(cpu, &rqd->idle);
+    idlers_update(cpu, rqd);
     __cpumask_set_cpu(cpu, &rqd->active);
     __cpumask_set_cpu(cpu, &prv->initialized);
     __cpumask_set_cpu(cpu, &rqd->smt_idle);
@@ -3993,7 +4213,7 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
     ASSERT(cpumask_weight(&rqd->active) == rqd->nr_cpus);
 
     if ( rqd->nr_cpus == 1 )
-        rqd->pick_bias = cpu;
+        rqd->pick_bias = rqd->topo_cpu = cpu;
 }
 
 /* Returns a pointer to the runqueue the cpu is assigned to. */
@@ -4087,6 +4307,7 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     __cpumask_clear_cpu(cpu, &rqd->smt_idle);
     __cpumask_clear_cpu(cpu, &rqd->active);
     __cpumask_clear_cpu(cpu, &rqd->tickled);
+    idlers_update(cpu, rqd);
 
     for_each_cpu ( rcpu, &rqd->active )
         __cpumask_clear_cpu(cpu, &csched2_pcpu(rcpu)->sibling_mask);
@@ -4101,8 +4322,14 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
         BUG_ON(!cpumask_empty(&rqd->active));
         prv->active_queues--;
     }
-    else if ( rqd->pick_bias == cpu )
-        rqd->pick_bias = cpumask_first(&rqd->active);
+    else
+    {
+        if ( rqd->pick_bias == cpu )
+            rqd->pick_bias = cpumask_first(&rqd->active);
+        /* Keep measuring distances from a pcpu of the runqueue. */
+        if ( rqd->topo_cpu == cpu )
+            rqd->topo_cpu = cpumask_first(&rqd->active);
+    }
 
     spin_unlock(&rqd->lock);
 
@@ -4169,6 +4396,15 @@ csched2_global_init(void)
     return 0;
 }
 
+static void init_migrate_cost(struct csched2_private *prv)
+{
+    unsigned int i;
+
+    for ( i = 0; i < RQD_DIST_NR; i++ )
+        prv->migrate_cost[i] = ((s_time_t)opt_migrate_cost[i] <<
+                                prv->load_precision_shift) / 100;
+}
+
 static int cf_check
 csched2_init(struct scheduler *ops)
 {
@@ -4181,13 +4417,18 @@ csched2_init(struct scheduler *ops)
            CRUXLOG_INFO " underload_balance_tolerance: %d\n"
            CRUXLOG_INFO " overload_balance_tolerance: %d\n"
            CRUXLOG_INFO " runqueues arrangement: %s\n"
-           CRUXLOG_INFO " cap enforcement granularity: %dms\n",
+           CRUXLOG_INFO " cap enforcement granularity: %dms\n"
+           CRUXLOG_INFO " migration cost (core,cluster,socket,node,remote): "
+           "%u,%u,%u,%u,%u%%\n",
            opt_load_precision_shift,
            opt_load_window_shift,
            opt_underload_balance_tolerance,
            opt_overload_balance_tolerance,
            opt_runqueue_str[opt_runqueue],
-           opt_cap_period);
+           opt_cap_period,
+           opt_migrate_cost[RQD_DIST_CORE], opt_migrate_cost[RQD_DIST_CLUSTER],
+           opt_migrate_cost[RQD_DIST_SOCKET], opt_migrate_cost[RQD_DIST_NODE],
+           opt_migrate_cost[RQD_DIST_REMOTE]);
 
     printk(CRUXLOG_INFO "load tracking window length %llu ns\n",
            1ULL << opt_load_window_shift);
@@ -4214,6 +4455,8 @@ csched2_init(struct scheduler *ops)
     prv->load_window_shift = opt_load_window_shift - LOADAVG_GRANULARITY_SHIFT;
     ASSERT(opt_load_window_shift > 0);
 
+    init_migrate_cost(prv);
+
     return 0;
 }
 
@@ -4227,6 +4470,392 @@ csched2_deinit(struct scheduler *ops)
     xfree(prv);
 }
 
+#ifdef CONFIG_SELF_TESTS
+/*
+ * credit2-sim -> at boot, replay synthetic workloads through the load
+ * balancing decisions (balance_delta() and consider()), on a set of
+ * runqueues laid out like the online pCPUs of the host (one per pCPU), both
+ * with and without the migration costs, and report how many migrations of
+ * each distance were done and how well the load was balanced.
+ */
+static bool __initdata opt_credit2_sim;
+boolean_param("credit2-sim", opt_credit2_sim);
+
+#define SIM_UNITS_PER_RQ 4
+#define SIM_ROUNDS       256
+
+enum { SIM_STEADY, SIM_BURSTY, SIM_PACKED, SIM_NR };
+
+struct sim_stats {
+    unsigned long migrations[RQD_DIST_NR];
+    s_time_t imbalance;         /* Sum, over the rounds, of max - min load */
+    s_time_t elapsed;
+};
+
+/* Same sequence for every run, so that all of them replay the same loads. */
+static uint32_t __init sim_random(uint32_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+
+    return *seed;
+}
+
+static void __init sim_run(const struct csched2_private *prv,
+                           struct csched2_runqueue_data *rqds,
+                           unsigned int nr_rqs, struct csched2_unit *svcs,
+                           unsigned int nr_svcs, unsigned int workload,
+                           struct sim_stats *stats)
+{
+    s_time_t full = 1LL << prv->load_precision_shift;
+    s_time_t start = NOW();
+    uint32_t seed = 0x2545f491;
+    unsigned int round, i, j;
+
+    for ( i = 0; i < nr_svcs; i++ )
+    {
+        svcs[i].rqd = &rqds[workload == SIM_PACKED ? 0 : i % nr_rqs];
+        svcs[i].avgload = sim_random(&seed) % full;
+    }
+
+    for ( round = 0; round < SIM_ROUNDS; round++ )
+    {
+        s_time_t min_load = STIME_MAX, max_load = 0;
+
+        if ( workload == SIM_BURSTY )
+            for ( i = 0; i < nr_svcs; i++ )
+                if ( !(sim_random(&seed) & 3) )
+                    svcs[i].avgload = sim_random(&seed) % full;
+
+        for ( i = 0; i < nr_rqs; i++ )
+            rqds[i].b_avgload = 0;
+        for ( i = 0; i < nr_svcs; i++ )
+            svcs[i].rqd->b_avgload += svcs[i].avgload;
+
+        for ( i = 0; i < nr_rqs; i++ )
+        {
+            balance_state_t st = { .prv = prv, .lrqd = &rqds[i] };
+            struct csched2_runqueue_data *max_delta_rqd = NULL;
+
+            /* We assume to be busy, and use the overload tolerance. */
+            st.load_delta = 1LL << (prv->load_precision_shift +
+                                    opt_overload_balance_tolerance);
+            for ( j = 0; j < nr_rqs; j++ )
+            {
+                s_time_t delta;
+
+                if ( j == i )
+                    continue;
+                delta = balance_delta(prv, st.lrqd, &rqds[j]);
+                if ( delta > st.load_delta )
+                {
+                    st.load_delta = delta;
+                    max_delta_rqd = &rqds[j];
+                }
+            }
+            if ( !max_delta_rqd )
+                continue;
+
+            st.orqd = max_delta_rqd;
+            st.load_delta = st.lrqd->b_avgload - st.orqd->b_avgload;
+            if ( st.load_delta < 0 )
+                st.load_delta = -st.load_delta;
+
+            for ( j = 0; j < nr_svcs; j++ )
+            {
+                unsigned int k;
+
+                if ( svcs[j].rqd != st.lrqd )
+                    continue;
+                for ( k = 0; k < nr_svcs; k++ )
+                    if ( svcs[k].rqd == st.orqd )
+                        consider(&st, &svcs[j], &svcs[k]);
+                consider(&st, &svcs[j], NULL);
+            }
+            for ( j = 0; j < nr_svcs; j++ )
+                if ( svcs[j].rqd == st.orqd )
+                    consider(&st, NULL, &svcs[j]);
+
+            if ( st.best_push_svc )
+            {
+                stats->migrations[rqd_distance(st.lrqd, st.orqd)]++;
+                st.lrqd->b_avgload -= st.best_push_svc->avgload;
+                st.orqd->b_avgload += st.best_push_svc->avgload;
+                st.best_push_svc->rqd = st.orqd;
+            }
+            if ( st.best_pull_svc )
+            {
+                stats->migrations[rqd_distance(st.lrqd, st.orqd)]++;
+                st.orqd->b_avgload -= st.best_pull_svc->avgload;
+                st.lrqd->b_avgload += st.best_pull_svc->avgload;
+                st.best_pull_svc->rqd = st.lrqd;
+            }
+        }
+
+        for ( i = 0; i < nr_rqs; i++ )
+        {
+            min_load = min(min_load, rqds[i].b_avgload);
+            max_load = max(max_load, rqds[i].b_avgload);
+        }
+        stats->imbalance += max_load - min_load;
+    }
+
+    stats->elapsed = NOW() - start;
+}
+
+static int __init cf_check csched2_sim(void)
+{
+    static const char *const __initconst names[SIM_NR] = {
+        [SIM_STEADY] = "steady", [SIM_BURSTY] = "bursty",
+        [SIM_PACKED] = "packed",
+    };
+    struct csched2_private *prv;
+    struct csched2_runqueue_data *rqds;
+    struct csched2_unit *svcs;
+    unsigned int nr_rqs = num_online_cpus(), nr_svcs, cpu, i, w, costs;
+    int rc = -ENOMEM;
+
+    if ( !opt_credit2_sim )
+        return 0;
+
+    if ( nr_rqs < 2 )
+    {
+        printk(CRUXLOG_INFO "credit2-sim: need at least 2 pCPUs\n");
+        return 0;
+    }
+
+    nr_svcs = nr_rqs * SIM_UNITS_PER_RQ;
+    prv = xzalloc(struct csched2_private);
+    rqds = xzalloc_array(struct csched2_runqueue_data, nr_rqs);
+    svcs = xzalloc_array(struct csched2_unit, nr_svcs);
+    if ( !prv || !rqds || !svcs )
+        goto out;
+
+    i = 0;
+    for_each_online_cpu ( cpu )
+        rqds[i++].topo_cpu = cpu;
+
+    prv->load_precision_shift = opt_load_precision_shift;
+
+    for ( w = 0; w < SIM_NR; w++ )
+    {
+        for ( costs = 0; costs < 2; costs++ )
+        {
+            struct sim_stats stats = {};
+
+            if ( costs )
+                init_migrate_cost(prv);
+            else
+                memset(prv->migrate_cost, 0, sizeof(prv->migrate_cost));
+
+            sim_run(prv, rqds, nr_rqs, svcs, nr_svcs, w, &stats);
+
+            printk(CRUXLOG_INFO
+                   "credit2-sim: %s, costs %s: migrations core %lu cluster %lu "
+                   "socket %lu node %lu remote %lu, avg imbalance %"PRI_stime
+                   "%%, %"PRI_stime" ns/round\n",
+                   names[w], costs ? "on" : "off",
+                   stats.migrations[RQD_DIST_CORE],
+                   stats.migrations[RQD_DIST_CLUSTER],
+                   stats.migrations[RQD_DIST_SOCKET],
+                   stats.migrations[RQD_DIST_NODE],
+                   stats.migrations[RQD_DIST_REMOTE],
+                   ((stats.imbalance / SIM_ROUNDS) * 100) >>
+                   prv->load_precision_shift,
+                   stats.elapsed / SIM_ROUNDS);
+        }
+    }
+    rc = 0;
+
+ out:
+    xfree(svcs);
+    xfree(rqds);
+    xfree(prv);
+
+    return rc;
+}
+__initcall(csched2_sim);
+
+/*
+ * credit2-wake-bench -> at boot, have all the online pCPUs go idle and busy
+ * on a set of runqueues, the way waking and sleeping vCPUs make them, while
+ * looking for an idle and untickled pcpu in every runqueue, as a wakeup in
+ * csched2_res_pick() does. Report the p50 and p99 latency of that lookup,
+ * with the runqueue locks (trylock, as res_pick used to) and with the
+ * lockless idlers summary.
+ */
+static bool __initdata opt_credit2_wake_bench;
+boolean_param("credit2-wake-bench", opt_credit2_wake_bench);
+
+#define WB_LOOPS       2048
+#define WB_CPUS_PER_RQ 4
+
+static struct tasklet __initdata wb_tasklet[NR_CPUS];
+static struct csched2_runqueue_data *__initdata wb_rqds;
+static unsigned int __initdata wb_nr_rqs;
+static uint32_t *__initdata wb_samples;  /* WB_LOOPS per pCPU */
+static unsigned long __initdata wb_busy[NR_CPUS];
+static bool __initdata wb_lockless;
+static bool __initdata wb_go;
+static atomic_t __initdata wb_done;
+
+static void __init cf_check wb_cpu(void *unused)
+{
+    unsigned int cpu = smp_processor_id(), i, r;
+    struct csched2_runqueue_data *rqd = &wb_rqds[cpu % wb_nr_rqs];
+    uint32_t *samples = &wb_samples[cpu * WB_LOOPS];
+    unsigned long busy = 0;
+    unsigned long flags;
+    cpumask_t mask;
+    s_time_t start;
+
+    while ( !ACCESS_ONCE(wb_go) )
+        cpu_relax();
+
+    for ( i = 0; i < WB_LOOPS; i++ )
+    {
+        /* Go idle, get tickled, and run again, in turn. */
+        spin_lock_irqsave(&rqd->lock, flags);
+        switch ( i % 3 )
+        {
+        case 0:
+            __cpumask_set_cpu(cpu, &rqd->idle);
+            break;
+        case 1:
+            __cpumask_set_cpu(cpu, &rqd->tickled);
+            break;
+        case 2:
+            __cpumask_clear_cpu(cpu, &rqd->idle);
+            __cpumask_clear_cpu(cpu, &rqd->tickled);
+            break;
+        }
+        idlers_update(cpu, rqd);
+        spin_unlock_irqrestore(&rqd->lock, flags);
+
+        start = NOW();
+        for ( r = 0; r < wb_nr_rqs; r++ )
+        {
+            struct csched2_runqueue_data *trqd = &wb_rqds[r];
+
+            if ( wb_lockless )
+            {
+                if ( !idlers_snapshot(trqd, &mask) )
+                    busy++;
+                continue;
+            }
+
+            if ( !spin_trylock_irqsave(&trqd->lock, flags) )
+            {
+                busy++;
+                continue;
+            }
+            cpumask_andnot(&mask, &trqd->idle, &trqd->tickled);
+            spin_unlock_irqrestore(&trqd->lock, flags);
+        }
+        samples[i] = NOW() - start;
+    }
+
+    wb_busy[cpu] = busy;
+
+    smp_wmb();
+    atomic_inc(&wb_done);
+}
+
+static int __init cf_check wb_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void __init cf_check wb_swap(void *a, void *b)
+{
+    SWAP(*(uint32_t *)a, *(uint32_t *)b);
+}
+
+/* Returns the number of runqueues found busy (lock or summary). */
+static unsigned long __init wb_run(bool lockless, uint32_t *p50,
+                                   uint32_t *p99)
+{
+    unsigned int cpu, this_cpu = smp_processor_id(), n = 0;
+    unsigned long busy = 0;
+
+    wb_lockless = lockless;
+    wb_go = false;
+    atomic_set(&wb_done, 0);
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( cpu == this_cpu )
+            continue;
+        tasklet_init(&wb_tasklet[cpu], wb_cpu, NULL);
+        tasklet_schedule_on_cpu(&wb_tasklet[cpu], cpu);
+    }
+
+    smp_wmb();
+    wb_go = true;
+    wb_cpu(NULL);
+
+    while ( atomic_read(&wb_done) < num_online_cpus() )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+
+    smp_rmb();
+    /* Gather the samples of the online pCPUs at the start of the array. */
+    for_each_online_cpu ( cpu )
+    {
+        memmove(&wb_samples[n], &wb_samples[cpu * WB_LOOPS],
+                WB_LOOPS * sizeof(*wb_samples));
+        n += WB_LOOPS;
+        busy += wb_busy[cpu];
+    }
+
+    sort(wb_samples, n, sizeof(*wb_samples), wb_cmp, wb_swap);
+    *p50 = wb_samples[n / 2];
+    *p99 = wb_samples[n - n / 100 - 1];
+
+    return busy;
+}
+
+static int __init cf_check csched2_wake_bench(void)
+{
+    uint32_t p50[2], p99[2];
+    unsigned long busy[2];
+    unsigned int i;
+
+    if ( !opt_credit2_wake_bench )
+        return 0;
+
+    wb_nr_rqs = DIV_ROUND_UP(num_online_cpus(), WB_CPUS_PER_RQ);
+    wb_rqds = xzalloc_array(struct csched2_runqueue_data, wb_nr_rqs);
+    wb_samples = xmalloc_array(uint32_t, nr_cpu_ids * WB_LOOPS);
+    if ( !wb_rqds || !wb_samples )
+        goto out;
+
+    for ( i = 0; i < wb_nr_rqs; i++ )
+        spin_lock_init(&wb_rqds[i].lock);
+
+    for ( i = 0; i < 2; i++ )
+        busy[i] = wb_run(i, &p50[i], &p99[i]);
+
+    printk(CRUXLOG_INFO
+           "credit2-wake-bench: %u pCPUs, %u runqueues: locked p50 %u ns "
+           "p99 %u ns (%lu busy), lockless p50 %u ns p99 %u ns (%lu busy)\n",
+           num_online_cpus(), wb_nr_rqs, p50[0], p99[0], busy[0],
+           p50[1], p99[1], busy[1]);
+
+ out:
+    xfree(wb_samples);
+    xfree(wb_rqds);
+
+    return 0;
+}
+__initcall(csched2_wake_bench);
+#endif /* CONFIG_SELF_TESTS */
+
 static const struct scheduler sched_credit2_def = {
     .name           = "SMP Credit Scheduler rev2",
     .opt_name       = "credit2",
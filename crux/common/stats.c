@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Always-on per-CPU statistics, exported through hypfs.  See the
+ * description of the blob format in public/hypfs.h.
+ */
+
+#include <crux/cpu.h>
+#include <crux/guest_access.h>
+#include <crux/hypfs.h>
+#include <crux/init.h>
+#include <crux/lib.h>
+#include <crux/param.h>
+#include <crux/stats.h>
+#include <crux/xmalloc.h>
+
+DEFINE_PER_CPU(struct cpu_stats, cpu_stats);
+
+struct stats_file {
+    struct hypfs_entry_leaf leaf;
+    unsigned int offset;        /* Within struct cpu_stats. */
+    unsigned int nr;            /* Number of counters per CPU. */
+};
+
+static unsigned int cf_check stats_hypfs_getsize(
+    const struct hypfs_entry *entry)
+{
+    const struct stats_file *f =
+        container_of(entry, const struct stats_file, leaf.e);
+
+    return sizeof(struct crux_hypfs_stats) +
+           nr_cpu_ids * (sizeof(struct crux_hypfs_stats_cpu) +
+                         f->nr * sizeof(uint64_t));
+}
+
+static int cf_check stats_hypfs_read(const struct hypfs_entry *entry,
+                                     CRUX_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    const struct stats_file *f =
+        container_of(entry, const struct stats_file, leaf.e);
+    struct crux_hypfs_stats hdr = {
+        .version = CRUX_HYPFS_STATS_VERSION,
+        .nr_cpus = nr_cpu_ids,
+        .nr_counters = f->nr,
+        .tick_khz = cpu_khz,
+    };
+    unsigned int cpu;
+    int rc = 0;
+
+    if ( copy_to_guest(uaddr, &hdr, 1) )
+        return -EFAULT;
+    guest_handle_add_offset(uaddr, sizeof(hdr));
+
+    /* Keep the per-CPU areas of online CPUs from going away under our feet. */
+    if ( !get_cpu_maps() )
+        return -EBUSY;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        struct crux_hypfs_stats_cpu rec = {
+            .cpu = cpu,
+            .flags = cpu_online(cpu) ? CRUX_HYPFS_STATS_CPU_ONLINE : 0,
+        };
+
+        if ( copy_to_guest(uaddr, &rec, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+        guest_handle_add_offset(uaddr, sizeof(rec));
+
+        if ( rec.flags & CRUX_HYPFS_STATS_CPU_ONLINE )
+        {
+            const uint64_t *ctr =
+                (const void *)&per_cpu(cpu_stats, cpu) + f->offset;
+
+            rc = copy_to_guest(uaddr, ctr, f->nr) ? -EFAULT : 0;
+        }
+        else
+            rc = clear_guest(uaddr, f->nr * sizeof(uint64_t)) ? -EFAULT : 0;
+        if ( rc )
+            break;
+        guest_handle_add_offset(uaddr, f->nr * sizeof(uint64_t));
+    }
+
+    put_cpu_maps();
+
+    return rc;
+}
+
+static const struct hypfs_funcs stats_hypfs_funcs = {
+    .enter = hypfs_node_enter,
+    .exit = hypfs_node_exit,
+    .read = stats_hypfs_read,
+    .write = hypfs_write_deny,
+    .getsize = stats_hypfs_getsize,
+    .findentry = hypfs_leaf_findentry,
+};
+
+#define STATS_FILE(var, nam, field)                                       \
+    struct stats_file __read_mostly var = {                               \
+        .leaf.e.type = CRUX_HYPFS_TYPE_BLOB,                              \
+        .leaf.e.encoding = CRUX_HYPFS_ENC_PLAIN,                           \
+        .leaf.e.name = (nam),                                             \
+        .leaf.e.funcs = &stats_hypfs_funcs,                               \
+        .leaf.u.content = &(var),                                         \
+        .offset = offsetof(struct cpu_stats, field),                      \
+        .nr = sizeof_field(struct cpu_stats, field) / sizeof(uint64_t),   \
+    }
+
+static HYPFS_DIR_INIT(stats_dir, "stats");
+static STATS_FILE(stats_traps, "traps", trap);
+static STATS_FILE(stats_events, "events", event);
+static STATS_FILE(stats_hypercall_lat, "hypercall-latency", hypercall_lat);
+
+static int __init cf_check stats_init(void)
+{
+    hypfs_add_dir(&hypfs_root, &stats_dir, true);
+    hypfs_add_leaf(&stats_dir, &stats_traps.leaf, true);
+    hypfs_add_leaf(&stats_dir, &stats_events.leaf, true);
+    hypfs_add_leaf(&stats_dir, &stats_hypercall_lat.leaf, true);
+
+    return 0;
+}
+__initcall(stats_init);
+
+#ifdef CONFIG_SELF_TESTS
+/*
+ * cpu-stats-bench -> time the counter updates at boot, against an empty loop
+ * doing the same bookkeeping.
+ */
+static bool __initdata opt_stats_bench;
+boolean_param("cpu-stats-bench", opt_stats_bench);
+
+#define STATS_BENCH_LOOPS 1000000
+
+static s_time_t __init stats_bench_loop(unsigned int what)
+{
+    s_time_t start = NOW();
+    unsigned int i;
+
+    for ( i = 0; i < STATS_BENCH_LOOPS; i++ )
+    {
+        switch ( what )
+        {
+        case 1:
+            stats_event(CRUX_HYPFS_STATS_EV_IRQ);
+            break;
+        case 2:
+            stats_trap(i & (CRUX_HYPFS_STATS_NR_TRAPS - 1));
+            break;
+        case 3:
+            stats_hypercall_end(i & 7, stats_hypercall_start());
+            break;
+        }
+        /* Don't let the compiler batch the increments. */
+        barrier();
+    }
+
+    return NOW() - start;
+}
+
+static int __init cf_check stats_bench(void)
+{
+    static const char *const __initconst names[] = {
+        [1] = "event", [2] = "trap", [3] = "hypercall latency",
+    };
+    struct cpu_stats *saved;
+    s_time_t base;
+    unsigned int i;
+
+    if ( !opt_stats_bench )
+        return 0;
+
+    /* Don't leave the benchmark's counts behind. */
+    saved = xmalloc(struct cpu_stats);
+    if ( !saved )
+        return -ENOMEM;
+    *saved = this_cpu(cpu_stats);
+
+    base = stats_bench_loop(0);
+    for ( i = 1; i < ARRAY_SIZE(names); i++ )
+    {
+        s_time_t ns = stats_bench_loop(i) - base;
+
+        printk(CRUXLOG_INFO "cpu-stats: %s: %"PRI_stime" ps per update\n",
+               names[i], ns * 1000 / STATS_BENCH_LOOPS);
+    }
+
+    this_cpu(cpu_stats) = *saved;
+    xfree(saved);
+
+    return 0;
+}
+__initcall(stats_bench);
+#endif /* CONFIG_SELF_TESTS */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -54,9 +54,19 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
+/*
+ * Each CPU is the only producer for its buffer, so no lock is needed to
+ * insert records: space is reserved by advancing t_resv with interrupts
+ * disabled, filled in with interrupts enabled, and published by the
+ * outermost trace() (t_nest dropping to zero) copying t_resv into prod.
+ * Records nested from interrupt context are fully written before the
+ * interrupted one is published, so prod only ever covers complete ones.
+ */
+static DEFINE_PER_CPU(uint32_t, t_resv);
+static DEFINE_PER_CPU(unsigned int, t_nest);
+
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
 static u32 t_buf_highwater;
@@ -75,20 +85,10 @@ static cpumask_t tb_cpu_mask;
 /* which tracing events are enabled */
 static u32 tb_event_mask = TRC_ALL;
 
-static int cf_check cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
+/* Per-class sampling: record 1 in tb_sample_rate[] events (0/1: all). */
+#define TRC_NR_CLASSES 12
+static unsigned int tb_sample_rate[TRC_NR_CLASSES];
+static DEFINE_PER_CPU(unsigned int [TRC_NR_CLASSES], t_sample_count);
 
 static uint32_t calc_tinfo_first_offset(void)
 {
@@ -225,13 +225,12 @@ static int alloc_trace_bufs(unsigned int pages)
     {
         struct t_buf *buf;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
         per_cpu(t_bufs, cpu) = buf = mfn_to_virt(t_info_mfn_list[offset]);
         buf->cons = buf->prod = 0;
+        per_cpu(t_resv, cpu) = 0;
 
         printk(CRUXLOG_INFO "cruxtrace: p%d mfn %x offset %u\n",
                    cpu, t_info_mfn_list[offset], offset);
@@ -341,7 +340,6 @@ int trace_will_trace_event(u32 event)
 static void __init __constructor init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -397,6 +395,30 @@ int tb_control(struct crux_sysctl_tbuf_op *tbc)
     case CRUX_SYSCTL_TBUFOP_set_size:
         rc = tb_set_size(tbc->size);
         break;
+    case CRUX_SYSCTL_TBUFOP_set_sample_rate:
+    {
+        unsigned int classes = (tbc->evt_mask >> TRC_CLS_SHIFT) &
+                               ((1U << TRC_NR_CLASSES) - 1);
+
+        if ( !classes )
+        {
+            rc = -EINVAL;
+            break;
+        }
+        for_each_set_bit ( i, classes )
+            write_atomic(&tb_sample_rate[i], tbc->size);
+    }
+        break;
+    case CRUX_SYSCTL_TBUFOP_get_sample_rate:
+    {
+        unsigned int cls = ffs(tbc->evt_mask >> TRC_CLS_SHIFT);
+
+        if ( !cls || cls > TRC_NR_CLASSES )
+            rc = -EINVAL;
+        else
+            tbc->size = tb_sample_rate[cls - 1];
+    }
+        break;
     case CRUX_SYSCTL_TBUFOP_enable:
         /* Enable trace buffers. Check buffers are already allocated. */
         if ( opt_tbuf_size == 0 )
@@ -415,14 +437,15 @@ int tb_control(struct crux_sysctl_tbuf_op *tbc)
         tb_init_done = 0;
         smp_wmb();
         /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
+         * start tracing.  Wait for in-flight trace() calls to make sure we're not racing
+         * anyone (they re-check tb_init_done after entering, see trace()).  After this
          * hypercall returns, no more records should be placed into the buffers. */
+        smp_mb();
         for_each_online_cpu(i)
         {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
+            while ( ACCESS_ONCE(per_cpu(t_nest, i)) )
+                cpu_relax();
             per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
         }
     }
         break;
@@ -459,12 +482,12 @@ static inline bool bogus(u32 prod, u32 cons)
     return 0;
 }
 
-static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
+static inline u32 calc_unconsumed_bytes(const struct t_buf *buf, u32 prod)
 {
-    uint32_t prod = buf->prod, cons = buf->cons;
+    uint32_t cons = buf->cons;
     int32_t x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
+    barrier(); /* must read buf->cons only once */
     if ( bogus(prod, cons) )
         return data_size;
 
@@ -478,12 +501,12 @@ static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
+static inline u32 calc_bytes_to_wrap(const struct t_buf *buf, u32 prod)
 {
-    uint32_t prod = buf->prod, cons = buf->cons;
+    uint32_t cons = buf->cons;
     int32_t x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
+    barrier(); /* must read buf->cons only once */
     if ( bogus(prod, cons) )
         return 0;
 
@@ -497,24 +520,23 @@ static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_avail(const struct t_buf *buf)
+static inline u32 calc_bytes_avail(const struct t_buf *buf, u32 prod)
 {
-    return data_size - calc_unconsumed_bytes(buf);
+    return data_size - calc_unconsumed_bytes(buf, prod);
 }
 
-static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
+static unsigned char *next_record(const struct t_buf *buf, u32 prod,
                                  unsigned char **next_page,
                                  uint32_t *offset_in_page)
 {
-    u32 x = buf->prod, cons = buf->cons;
+    u32 x = prod, cons = buf->cons;
     uint16_t per_cpu_mfn_offset;
     uint32_t per_cpu_mfn_nr;
     uint32_t *mfn_list;
     uint32_t mfn;
     unsigned char *this_page;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    *next = x;
+    barrier(); /* must read buf->cons only once */
     if ( !tb_init_done || bogus(x, cons) )
         return NULL;
 
@@ -546,7 +568,9 @@ static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
     return this_page;
 }
 
+/* Write a record at *pos, in space reserved by trace(), and advance *pos. */
 static inline void __insert_record(struct t_buf *buf,
+                                   uint32_t *pos,
                                    unsigned long event,
                                    unsigned int extra,
                                    bool cycles,
@@ -558,14 +582,20 @@ static inline void __insert_record(struct t_buf *buf,
     unsigned char *this_page, *next_page;
     unsigned int extra_word = extra / sizeof(u32);
     unsigned int local_rec_size = calc_rec_size(cycles, extra);
-    uint32_t next;
+    uint32_t next = *pos;
     uint32_t offset;
     uint32_t remaining;
 
     BUG_ON(local_rec_size != rec_size);
     BUG_ON(extra & 3);
 
-    this_page = next_record(buf, &next, &next_page, &offset);
+    /* Whatever happens, the space has been used up. */
+    *pos += rec_size;
+    if ( *pos >= 2*data_size )
+        *pos -= 2*data_size;
+    ASSERT(*pos < 2*data_size);
+
+    this_page = next_record(buf, next, &next_page, &offset);
     if ( !this_page )
         return;
 
@@ -605,20 +635,12 @@ static inline void __insert_record(struct t_buf *buf,
         memcpy(this_page + offset, rec, remaining);
         memcpy(next_page, (char *)rec + remaining, rec_size - remaining);
     }
-
-    smp_wmb();
-
-    next += rec_size;
-    if ( next >= 2*data_size )
-        next -= 2*data_size;
-    ASSERT(next < 2*data_size);
-    buf->prod = next;
 }
 
-static inline void insert_wrap_record(struct t_buf *buf,
+static inline void insert_wrap_record(struct t_buf *buf, uint32_t *pos,
                                       unsigned int size)
 {
-    u32 space_left = calc_bytes_to_wrap(buf);
+    u32 space_left = calc_bytes_to_wrap(buf, *pos);
     unsigned int extra_space = space_left - sizeof(u32);
     bool cycles = false;
 
@@ -632,13 +654,14 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
+    __insert_record(buf, pos, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
                     space_left, NULL);
 }
 
 #define LOST_REC_SIZE (4 + 8 + 16) /* header + tsc + sizeof(struct ed) */
 
-static inline void insert_lost_records(struct t_buf *buf)
+static inline void insert_lost_records(struct t_buf *buf, uint32_t *pos,
+                                       unsigned long lost, u64 first_tsc)
 {
     struct __packed {
         u32 lost_records;
@@ -648,12 +671,10 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     ed.vid = current->vcpu_id;
     ed.did = current->domain->domain_id;
-    ed.lost_records = this_cpu(lost_records);
-    ed.first_tsc = this_cpu(lost_records_first_tsc);
-
-    this_cpu(lost_records) = 0;
+    ed.lost_records = lost;
+    ed.first_tsc = first_tsc;
 
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
+    __insert_record(buf, pos, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
                     LOST_REC_SIZE, &ed);
 }
 
@@ -679,10 +700,11 @@ static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
 void trace(uint32_t event, unsigned int extra, const void *extra_data)
 {
     struct t_buf *buf;
-    unsigned long flags;
-    u32 bytes_to_tail, bytes_to_wrap;
-    unsigned int rec_size, total_size;
-    bool started_below_highwater;
+    unsigned long flags, lost;
+    u64 lost_tsc;
+    u32 bytes_to_tail, bytes_to_wrap, pos, resv;
+    unsigned int rec_size, total_size, cls, rate;
+    bool started_below_highwater = false, notify = false;
     bool cycles = event & TRC_HD_CYCLE_FLAG;
 
     if( !tb_init_done )
@@ -714,27 +736,46 @@ void trace(uint32_t event, unsigned int extra, const void *extra_data)
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
         return;
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
-
     buf = this_cpu(t_bufs);
-
     if ( unlikely(!buf) )
+        return;
+
+    /*
+     * Sampling (only 1 in rate events of this class get recorded).  Events
+     * without any of the known class bits are never sampled.
+     */
+    cls = ffs((event >> TRC_CLS_SHIFT) & ((1U << TRC_NR_CLASSES) - 1));
+    rate = cls ? ACCESS_ONCE(tb_sample_rate[cls - 1]) : 0;
+    if ( unlikely(rate > 1) )
     {
-        /* Make gcc happy */
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        unsigned int *count = &this_cpu(t_sample_count)[cls - 1];
 
-    started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
+        if ( ++*count < rate )
+            return;
+        *count = 0;
+    }
 
     /* Calculate the record size */
     rec_size = calc_rec_size(cycles, extra);
 
+    local_irq_save(flags);
+
+    this_cpu(t_nest)++;
+    /* Pairs with CRUX_SYSCTL_TBUFOP_disable waiting for t_nest. */
+    smp_mb();
+    if ( !tb_init_done )
+        goto out;
+
+    pos = this_cpu(t_resv);
+
+    started_below_highwater =
+        (calc_unconsumed_bytes(buf, pos) < t_buf_highwater);
+
     /* How many bytes are available in the buffer? */
-    bytes_to_tail = calc_bytes_avail(buf);
+    bytes_to_tail = calc_bytes_avail(buf, pos);
 
     /* How many bytes until the next wrap-around? */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
+    bytes_to_wrap = calc_bytes_to_wrap(buf, pos);
 
     /*
      * Calculate expected total size to commit this record by
@@ -744,7 +785,8 @@ void trace(uint32_t event, unsigned int extra, const void *extra_data)
 
     /* First, check to see if we need to include a lost_record.
      */
-    if ( this_cpu(lost_records) )
+    lost = this_cpu(lost_records);
+    if ( lost )
     {
         if ( LOST_REC_SIZE > bytes_to_wrap )
         {
@@ -771,22 +813,36 @@ void trace(uint32_t event, unsigned int extra, const void *extra_data)
         if ( ++this_cpu(lost_records) == 1 )
             this_cpu(lost_records_first_tsc)=(u64)get_cycles();
         started_below_highwater = 0;
-        goto unlock;
+        goto out;
     }
 
+    /*
+     * Reserve the space.  Any trace() from interrupt context from now on
+     * will put its records after ours.
+     */
+    lost_tsc = this_cpu(lost_records_first_tsc);
+    this_cpu(lost_records) = 0;
+
+    resv = pos + total_size;
+    if ( resv >= 2*data_size )
+        resv -= 2*data_size;
+    this_cpu(t_resv) = resv;
+
+    local_irq_restore(flags);
+
     /*
      * Now, actually write information
      */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
+    bytes_to_wrap = calc_bytes_to_wrap(buf, pos);
 
-    if ( this_cpu(lost_records) )
+    if ( lost )
     {
         if ( LOST_REC_SIZE > bytes_to_wrap )
         {
-            insert_wrap_record(buf, LOST_REC_SIZE);
+            insert_wrap_record(buf, &pos, LOST_REC_SIZE);
             bytes_to_wrap = data_size;
         }
-        insert_lost_records(buf);
+        insert_lost_records(buf, &pos, lost, lost_tsc);
         bytes_to_wrap -= LOST_REC_SIZE;
 
         /* LOST_REC might line up perfectly with the buffer wrap */
@@ -795,21 +851,106 @@ void trace(uint32_t event, unsigned int extra, const void *extra_data)
     }
 
     if ( rec_size > bytes_to_wrap )
-        insert_wrap_record(buf, rec_size);
+        insert_wrap_record(buf, &pos, rec_size);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    __insert_record(buf, &pos, event, extra, cycles, rec_size, extra_data);
+
+    ASSERT(pos == resv);
 
-unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    local_irq_save(flags);
+
+ out:
+    /* Publish everything reserved so far, if we're the outermost writer. */
+    if ( --this_cpu(t_nest) == 0 && buf->prod != this_cpu(t_resv) )
+    {
+        smp_wmb();
+        buf->prod = this_cpu(t_resv);
+        notify = started_below_highwater &&
+                 (calc_unconsumed_bytes(buf, buf->prod) >= t_buf_highwater);
+    }
+
+    local_irq_restore(flags);
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
-    if ( likely(buf!=NULL)
-         && started_below_highwater
-         && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
+    if ( notify )
         tasklet_schedule(&trace_notify_dom0_tasklet);
 }
 
+#ifdef CONFIG_SELF_TESTS
+/*
+ * trace_bench -> measure the cost of a trace() call on the boot CPU, with
+ * tracing disabled, sampled and recording every event.  Needs the trace
+ * buffers to have been allocated (tbuf_size=), and discards the boot CPU's
+ * buffer contents afterwards.
+ */
+static bool __initdata opt_trace_bench;
+boolean_param("trace_bench", opt_trace_bench);
+
+#define TRACE_BENCH_LOOPS 2048
+#define TRACE_BENCH_RATE  16
+/* Not a real event; whatever gets recorded is thrown away. */
+#define TRC_TRACE_BENCH   (TRC_GEN + 0xff)
+
+static uint64_t __init trace_bench_run(void)
+{
+    uint32_t d[3] = { 1, 2, 3 };
+    uint64_t start = get_cycles();
+    unsigned int i;
+
+    for ( i = 0; i < TRACE_BENCH_LOOPS; i++ )
+        trace_time(TRC_TRACE_BENCH, sizeof(d), d);
+
+    return (get_cycles() - start) / TRACE_BENCH_LOOPS;
+}
+
+static int __init cf_check trace_bench(void)
+{
+    struct t_buf *buf = this_cpu(t_bufs);
+    bool init_done = tb_init_done;
+    uint32_t mask = tb_event_mask;
+    unsigned int rate = tb_sample_rate[0];
+    uint64_t off, sampled, full;
+    unsigned long flags;
+
+    if ( !opt_trace_bench )
+        return 0;
+
+    if ( !buf )
+    {
+        printk("cruxtrace: bench needs trace buffers (tbuf_size=)\n");
+        return 0;
+    }
+
+    tb_event_mask = TRC_ALL;
+
+    tb_init_done = false;
+    off = trace_bench_run();
+
+    tb_init_done = true;
+    tb_sample_rate[0] = TRACE_BENCH_RATE;
+    sampled = trace_bench_run();
+
+    tb_sample_rate[0] = 1;
+    full = trace_bench_run();
+
+    local_irq_save(flags);
+    buf->prod = this_cpu(t_resv) = buf->cons;
+    this_cpu(lost_records) = 0;
+    local_irq_restore(flags);
+
+    tb_sample_rate[0] = rate;
+    tb_event_mask = mask;
+    tb_init_done = init_done;
+
+    printk("cruxtrace: bench: %"PRIu64" cycles/call off, %"PRIu64" sampled "
+           "(1/%u), %"PRIu64" full\n", off, sampled, TRACE_BENCH_RATE, full);
+
+    return 0;
+}
+__initcall(trace_bench);
+#endif /* CONFIG_SELF_TESTS */
+
 void __trace_hypercall(uint32_t event, unsigned long op,
                        const crux_ulong_t *args)
 {
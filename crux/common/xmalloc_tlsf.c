@@ -23,9 +23,16 @@
  * Adapted for crux by Dan Magenheimer (dan.magenheimer@oracle.com)
  */
 
+#include <crux/cpu.h>
+#include <crux/hypfs.h>
+#include <crux/init.h>
 #include <crux/irq.h>
 #include <crux/mm.h>
+#include <crux/param.h>
+#include <crux/percpu.h>
 #include <crux/pfn.h>
+#include <crux/softirq.h>
+#include <crux/tasklet.h>
 #include <asm/time.h>
 #include <asm/page.h>
 
@@ -382,28 +389,16 @@ void xmem_pool_destroy(struct xmem_pool *pool)
     free_cruxheap_pages(pool,pool_order);
 }
 
-void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
+/*
+ * Allocate a block of (already rounded) @size bytes with pool->lock held.
+ * The lock is dropped and re-acquired if the pool needs to grow.
+ */
+static void *xmem_pool_alloc_locked(unsigned long size, struct xmem_pool *pool)
 {
     struct bhdr *b, *b2, *next_b, *region;
     int fl, sl;
     unsigned long tmp_size;
 
-    ASSERT_ALLOC_CONTEXT();
-
-    if ( size < MIN_BLOCK_SIZE )
-        size = MIN_BLOCK_SIZE;
-    else
-    {
-        tmp_size = ROUNDUP_SIZE(size);
-        /* Guard against overflow. */
-        if ( tmp_size < size )
-            return NULL;
-        size = tmp_size;
-    }
-
-    /* Rounding up the requested size and calculating fl and sl */
-
-    spin_lock(&pool->lock);
  retry_find:
     MAPPING_SEARCH(&size, &fl, &sl);
 
@@ -412,14 +407,15 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
     {
         /* Not found */
         if ( size > (pool->grow_size - 2 * BHDR_OVERHEAD) )
-            goto out_locked;
+            return NULL;
         if ( pool->max_size && (pool->num_regions * pool->grow_size
                                 > pool->max_size) )
-            goto out_locked;
+            return NULL;
         spin_unlock(&pool->lock);
-        if ( (region = pool->get_mem(pool->grow_size)) == NULL )
-            goto out;
+        region = pool->get_mem(pool->grow_size);
         spin_lock(&pool->lock);
+        if ( region == NULL )
+            return NULL;
         ADD_REGION(region, pool->grow_size, pool);
         goto retry_find;
     }
@@ -452,30 +448,50 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
 
     pool->used_size += (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
 
-    spin_unlock(&pool->lock);
     return (void *)b->ptr.buffer;
+}
 
-    /* Failed alloc */
- out_locked:
-    spin_unlock(&pool->lock);
+/* Round a request up to the size of the block serving it. */
+static unsigned long xmem_block_size(unsigned long size)
+{
+    unsigned long tmp_size;
+
+    if ( size < MIN_BLOCK_SIZE )
+        return MIN_BLOCK_SIZE;
+
+    tmp_size = ROUNDUP_SIZE(size);
+    /* Guard against overflow. */
+    if ( tmp_size < size )
+        return 0;
 
- out:
-    return NULL;
+    return tmp_size;
 }
 
-void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
 {
-    struct bhdr *b, *tmp_b;
-    int fl = 0, sl = 0;
+    void *p;
 
     ASSERT_ALLOC_CONTEXT();
 
-    if ( unlikely(ptr == NULL) )
-        return;
+    /* Rounding up the requested size and calculating fl and sl */
+    size = xmem_block_size(size);
+    if ( !size )
+        return NULL;
+
+    spin_lock(&pool->lock);
+    p = xmem_pool_alloc_locked(size, pool);
+    spin_unlock(&pool->lock);
+
+    return p;
+}
+
+static void xmem_pool_free_locked(void *ptr, struct xmem_pool *pool)
+{
+    struct bhdr *b, *tmp_b;
+    int fl = 0, sl = 0;
 
     b = (struct bhdr *)((char *) ptr - BHDR_OVERHEAD);
 
-    spin_lock(&pool->lock);
     b->size |= FREE_BLOCK;
     pool->used_size -= (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
     b->ptr.free_ptr = (struct free_ptr) { NULL, NULL};
@@ -504,14 +520,24 @@ void xmem_pool_free(void *ptr, struct xmem_pool *pool)
         pool->put_mem(b);
         pool->num_regions--;
         pool->used_size -= BHDR_OVERHEAD; /* sentinel block header */
-        goto out;
+        return;
     }
 
     INSERT_BLOCK(b, pool, fl, sl);
 
     tmp_b->size |= PREV_FREE;
     tmp_b->prev_hdr = b;
- out:
+}
+
+void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+{
+    ASSERT_ALLOC_CONTEXT();
+
+    if ( unlikely(ptr == NULL) )
+        return;
+
+    spin_lock(&pool->lock);
+    xmem_pool_free_locked(ptr, pool);
     spin_unlock(&pool->lock);
 }
 
@@ -569,6 +595,315 @@ static void tlsf_init(void)
     BUG_ON(!cruxpool);
 }
 
+/*
+ * Per-CPU object caches.
+ *
+ * Requests of up to XMC_MAX_SIZE bytes without special alignment needs are
+ * rounded up to one of a few size classes.  Blocks of exactly a class size
+ * freed on a CPU are kept in a per-CPU magazine for that class rather than
+ * going back to cruxpool, and allocations are served from there first.
+ * Magazines are refilled from and spilled to the pool XMC_BATCH blocks at a
+ * time under a single pool->lock acquisition, so the pool lock is no longer
+ * taken on every allocation of small, fixed-size objects.  Everything else
+ * goes to TLSF as before.
+ *
+ * Cached blocks stay accounted as used in the pool.  The per-CPU lock is
+ * only contended when draining another CPU's magazines.
+ *
+ * Lock order is cache lock -> pool->lock.
+ */
+#define XMC_MAX_SIZE    1024
+#define XMC_BATCH       16
+#define XMC_HIGH        (2 * XMC_BATCH)
+
+static const unsigned short xmc_size[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024,
+};
+#define XMC_NR_CLASSES  ARRAY_SIZE(xmc_size)
+
+/* Size class for each multiple of MEM_ALIGN up to XMC_MAX_SIZE. */
+static uint8_t __read_mostly xmc_class[XMC_MAX_SIZE / MEM_ALIGN + 1];
+
+struct xmalloc_cache {
+    spinlock_t lock;
+    unsigned int count[XMC_NR_CLASSES];
+    void *objs[XMC_NR_CLASSES][XMC_HIGH];
+
+    /* Statistics */
+    unsigned long alloc_hits, alloc_misses, frees, spills;
+};
+
+static DEFINE_PER_CPU(struct xmalloc_cache, xmalloc_cache);
+
+/* xmalloc-cache -> cache small xmalloc() blocks per CPU */
+static bool __ro_after_init opt_xmalloc_cache = true;
+boolean_param("xmalloc-cache", opt_xmalloc_cache);
+
+static bool __read_mostly xmc_enabled;
+
+static unsigned int xmc_size_class(unsigned long size)
+{
+    return xmc_class[(size + MEM_ALIGN - 1) / MEM_ALIGN];
+}
+
+/* Move up to XMC_BATCH blocks of class @cls from cruxpool into @xc. */
+static void xmc_refill(struct xmalloc_cache *xc, unsigned int cls)
+{
+    void *p;
+
+    spin_lock(&cruxpool->lock);
+
+    while ( xc->count[cls] < XMC_BATCH &&
+            (p = xmem_pool_alloc_locked(xmc_size[cls], cruxpool)) != NULL )
+        xc->objs[cls][xc->count[cls]++] = p;
+
+    spin_unlock(&cruxpool->lock);
+}
+
+/* Hand @nr cached blocks back to cruxpool. */
+static void xmc_release(void **objs, unsigned int nr)
+{
+    unsigned int i;
+
+    spin_lock(&cruxpool->lock);
+
+    for ( i = 0; i < nr; i++ )
+        xmem_pool_free_locked(objs[i], cruxpool);
+
+    spin_unlock(&cruxpool->lock);
+}
+
+/* Return all blocks cached by @cpu to cruxpool. */
+static bool xmc_drain(unsigned int cpu)
+{
+    struct xmalloc_cache *xc = &per_cpu(xmalloc_cache, cpu);
+    unsigned int cls;
+    bool drained = false;
+
+    spin_lock(&xc->lock);
+
+    for ( cls = 0; cls < XMC_NR_CLASSES; cls++ )
+    {
+        if ( !xc->count[cls] )
+            continue;
+
+        xmc_release(xc->objs[cls], xc->count[cls]);
+        xc->count[cls] = 0;
+        drained = true;
+    }
+
+    spin_unlock(&xc->lock);
+
+    return drained;
+}
+
+static bool xmc_drain_all(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    if ( !xmc_enabled )
+        return false;
+
+    for_each_online_cpu ( cpu )
+        if ( xmc_drain(cpu) )
+            drained = true;
+
+    return drained;
+}
+
+/*
+ * Allocate a block for @size bytes from the local CPU's cache.  Returns NULL
+ * if the request can't be served from the cache.
+ */
+static void *xmc_alloc(unsigned long size)
+{
+    struct xmalloc_cache *xc;
+    unsigned int cls;
+    void *p = NULL;
+
+    if ( !xmc_enabled || size > XMC_MAX_SIZE )
+        return NULL;
+
+    cls = xmc_size_class(size);
+    xc = &this_cpu(xmalloc_cache);
+
+    spin_lock(&xc->lock);
+
+    if ( xc->count[cls] )
+        xc->alloc_hits++;
+    else
+    {
+        xc->alloc_misses++;
+        xmc_refill(xc, cls);
+    }
+
+    if ( xc->count[cls] )
+        p = xc->objs[cls][--xc->count[cls]];
+
+    spin_unlock(&xc->lock);
+
+    return p;
+}
+
+/*
+ * Free block @p into the local CPU's cache.  Returns false if it has to go
+ * back to the pool instead.
+ */
+static bool xmc_free(void *p)
+{
+    const struct bhdr *b = p - BHDR_OVERHEAD;
+    unsigned long size = b->size & BLOCK_SIZE_MASK;
+    struct xmalloc_cache *xc;
+    void *spill[XMC_BATCH];
+    unsigned int cls, nr = 0;
+
+    if ( !xmc_enabled || size > XMC_MAX_SIZE )
+        return false;
+
+    /* Blocks TLSF didn't split down to a class size aren't cached. */
+    cls = xmc_size_class(size);
+    if ( xmc_size[cls] != size )
+        return false;
+
+    xc = &this_cpu(xmalloc_cache);
+
+    spin_lock(&xc->lock);
+
+    xc->frees++;
+
+    if ( xc->count[cls] == XMC_HIGH )
+    {
+        /* Spill the coldest blocks. */
+        nr = XMC_BATCH;
+        memcpy(spill, xc->objs[cls], sizeof(spill));
+        memmove(xc->objs[cls], &xc->objs[cls][nr],
+                (XMC_HIGH - nr) * sizeof(*spill));
+        xc->count[cls] -= nr;
+        xc->spills++;
+    }
+
+    xc->objs[cls][xc->count[cls]++] = p;
+
+    spin_unlock(&xc->lock);
+
+    if ( nr )
+        xmc_release(spill, nr);
+
+    return true;
+}
+
+static int cf_check xmc_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct xmalloc_cache *xc = &per_cpu(xmalloc_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&xc->lock);
+        memset(xc->count, 0, sizeof(xc->count));
+        break;
+
+    case CPU_DEAD:
+        xmc_drain(cpu);
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block xmc_cpu_nfb = {
+    .notifier_call = xmc_cpu_callback
+};
+
+#ifdef CONFIG_HYPFS
+static unsigned long xmc_stat_alloc_hits, xmc_stat_alloc_misses;
+static unsigned long xmc_stat_frees, xmc_stat_spills, xmc_stat_cached;
+
+static int cf_check xmc_hypfs_read(const struct hypfs_entry *entry,
+                                   CRUX_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    unsigned int cpu, cls;
+
+    xmc_stat_alloc_hits = xmc_stat_alloc_misses = 0;
+    xmc_stat_frees = xmc_stat_spills = xmc_stat_cached = 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct xmalloc_cache *xc = &per_cpu(xmalloc_cache, cpu);
+
+        xmc_stat_alloc_hits += xc->alloc_hits;
+        xmc_stat_alloc_misses += xc->alloc_misses;
+        xmc_stat_frees += xc->frees;
+        xmc_stat_spills += xc->spills;
+        for ( cls = 0; cls < XMC_NR_CLASSES; cls++ )
+            xmc_stat_cached += ACCESS_ONCE(xc->count[cls]) * xmc_size[cls];
+    }
+
+    return hypfs_read_leaf(entry, uaddr);
+}
+
+static const struct hypfs_funcs xmc_hypfs_funcs = {
+    .enter = hypfs_node_enter,
+    .exit = hypfs_node_exit,
+    .read = xmc_hypfs_read,
+    .write = hypfs_write_deny,
+    .getsize = hypfs_getsize,
+    .findentry = hypfs_leaf_findentry,
+};
+
+#define XMC_HYPFS_STAT(var, nam, contvar)                         \
+    HYPFS_FIXEDSIZE_INIT(var, CRUX_HYPFS_TYPE_UINT, nam, contvar, \
+                         &xmc_hypfs_funcs, 0)
+
+static HYPFS_DIR_INIT(xmc_hypfs_dir, "xmalloc");
+static XMC_HYPFS_STAT(xmc_hypfs_hits, "cache-alloc-hits", xmc_stat_alloc_hits);
+static XMC_HYPFS_STAT(xmc_hypfs_misses, "cache-alloc-misses",
+                      xmc_stat_alloc_misses);
+static XMC_HYPFS_STAT(xmc_hypfs_frees, "cache-frees", xmc_stat_frees);
+static XMC_HYPFS_STAT(xmc_hypfs_spills, "cache-spills", xmc_stat_spills);
+static XMC_HYPFS_STAT(xmc_hypfs_cached, "cache-bytes", xmc_stat_cached);
+#endif
+
+static int __init cf_check xmc_init(void)
+{
+    unsigned int i, cls = 0;
+
+    if ( !opt_xmalloc_cache )
+        return 0;
+
+    for ( i = 0; i < ARRAY_SIZE(xmc_class); i++ )
+    {
+        while ( xmc_size[cls] < i * MEM_ALIGN )
+            cls++;
+        xmc_class[i] = cls;
+    }
+
+    xmc_cpu_callback(&xmc_cpu_nfb, CPU_UP_PREPARE,
+                     (void *)(unsigned long)smp_processor_id());
+    register_cpu_notifier(&xmc_cpu_nfb);
+
+#ifdef CONFIG_HYPFS
+    hypfs_add_dir(&hypfs_root, &xmc_hypfs_dir, true);
+    hypfs_add_leaf(&xmc_hypfs_dir, &xmc_hypfs_hits, true);
+    hypfs_add_leaf(&xmc_hypfs_dir, &xmc_hypfs_misses, true);
+    hypfs_add_leaf(&xmc_hypfs_dir, &xmc_hypfs_frees, true);
+    hypfs_add_leaf(&xmc_hypfs_dir, &xmc_hypfs_spills, true);
+    hypfs_add_leaf(&xmc_hypfs_dir, &xmc_hypfs_cached, true);
+#endif
+
+    if ( !cruxpool )
+        tlsf_init();
+
+    xmc_enabled = true;
+
+    return 0;
+}
+presmp_initcall(xmc_init);
+
 /*
  * xmalloc()
  */
@@ -625,10 +960,22 @@ void *_xmalloc(unsigned long size, unsigned long align)
     if ( !cruxpool )
         tlsf_init();
 
+    if ( align == MEM_ALIGN && (p = xmc_alloc(size)) != NULL )
+        return p;
+
+ retry:
     if ( size < PAGE_SIZE )
         p = xmem_pool_alloc(size, cruxpool);
     if ( p == NULL )
-        return xmalloc_whole_pages(size - align + MEM_ALIGN, align);
+    {
+        p = xmalloc_whole_pages(size - align + MEM_ALIGN, align);
+
+        /* Memory sitting in per-CPU caches might satisfy the request. */
+        if ( p == NULL && xmc_drain_all() )
+            goto retry;
+
+        return p;
+    }
 
     /* Add alignment padding. */
     p = add_padding(p, align);
@@ -737,5 +1084,108 @@ void xfree(void *p)
     /* Strip alignment padding. */
     p = strip_padding(p);
 
+    if ( xmc_free(p) )
+        return;
+
     xmem_pool_free(p, cruxpool);
 }
+
+#ifdef CONFIG_SELF_TESTS
+/*
+ * xmalloc-bench -> time mixed-size xmalloc()/xfree() cycles on all CPUs in
+ * parallel at boot, with and without the per-CPU caches.
+ */
+static bool __initdata opt_xmc_bench;
+boolean_param("xmalloc-bench", opt_xmc_bench);
+
+#define XMC_BENCH_LOOPS 4096
+#define XMC_BENCH_DEPTH 32
+
+static struct tasklet __initdata xmc_bench_tasklet[NR_CPUS];
+static s_time_t __initdata xmc_bench_ns[NR_CPUS];
+static bool __initdata xmc_bench_go;
+static atomic_t __initdata xmc_bench_done;
+
+static void __init cf_check xmc_bench_cpu(void *unused)
+{
+    void *p[XMC_BENCH_DEPTH];
+    unsigned int i, j;
+    s_time_t start;
+
+    while ( !ACCESS_ONCE(xmc_bench_go) )
+        cpu_relax();
+
+    start = NOW();
+
+    for ( i = 0; i < XMC_BENCH_LOOPS; i++ )
+    {
+        for ( j = 0; j < XMC_BENCH_DEPTH; j++ )
+            p[j] = _xmalloc(24 + 40 * ((i + j) % 8), MEM_ALIGN);
+        for ( j = 0; j < XMC_BENCH_DEPTH; j++ )
+            xfree(p[j]);
+    }
+
+    xmc_bench_ns[smp_processor_id()] = NOW() - start;
+
+    smp_wmb();
+    atomic_inc(&xmc_bench_done);
+}
+
+/* Returns the aggregate number of allocations per second. */
+static uint64_t __init xmc_bench_run(void)
+{
+    unsigned int cpu, this_cpu = smp_processor_id();
+    uint64_t rate = 0;
+
+    xmc_bench_go = false;
+    atomic_set(&xmc_bench_done, 0);
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( cpu == this_cpu )
+            continue;
+        tasklet_init(&xmc_bench_tasklet[cpu], xmc_bench_cpu, NULL);
+        tasklet_schedule_on_cpu(&xmc_bench_tasklet[cpu], cpu);
+    }
+
+    smp_wmb();
+    xmc_bench_go = true;
+    xmc_bench_cpu(NULL);
+
+    while ( atomic_read(&xmc_bench_done) < num_online_cpus() )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+
+    smp_rmb();
+    for_each_online_cpu ( cpu )
+        rate += (uint64_t)XMC_BENCH_LOOPS * XMC_BENCH_DEPTH * SECONDS(1) /
+                max(xmc_bench_ns[cpu], (s_time_t)1);
+
+    return rate;
+}
+
+static int __init cf_check xmc_bench(void)
+{
+    bool enabled = xmc_enabled;
+    uint64_t cached, uncached;
+
+    if ( !opt_xmc_bench )
+        return 0;
+
+    xmc_drain_all();
+    xmc_enabled = false;
+    uncached = xmc_bench_run();
+
+    xmc_enabled = enabled;
+    cached = enabled ? xmc_bench_run() : 0;
+
+    printk("xmalloc bench: %u CPUs, %"PRIu64" allocs/s uncached, "
+           "%"PRIu64" allocs/s cached\n",
+           num_online_cpus(), uncached, cached);
+
+    return 0;
+}
+__initcall(xmc_bench);
+#endif /* CONFIG_SELF_TESTS */
@@ -0,0 +1,1071 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Boot-time Zstandard decompression (RFC 8878).
+ *
+ * The whole image is decoded into a single output buffer, so there is no
+ * window to maintain: matches simply refer back into what has been written
+ * for the current frame.  Dictionaries are not supported and the optional
+ * content checksum is skipped rather than verified.  Corrupt, truncated or
+ * unsupported input fails with -EILSEQ.
+ */
+
+#include <crux/bitops.h>
+#include <crux/errno.h>
+#include <crux/init.h>
+#include <crux/lib.h>
+#include <crux/string.h>
+#include <crux/unaligned.h>
+#include <crux/unzstd.h>
+#include <crux/xmalloc.h>
+
+#define ZSTD_MAGIC              0xfd2fb528U
+#define ZSTD_SKIPPABLE_MAGIC    0x184d2a50U
+#define ZSTD_SKIPPABLE_MASK     0xfffffff0U
+
+#define ZSTD_FHD_FCS_SHIFT      6
+#define ZSTD_FHD_SINGLE_SEGMENT 0x20
+#define ZSTD_FHD_RESERVED       0x08
+#define ZSTD_FHD_CHECKSUM       0x04
+#define ZSTD_FHD_DICT_ID_MASK   0x03
+
+#define ZSTD_BLOCK_MAX          (128 * 1024)
+
+enum { BLOCK_RAW, BLOCK_RLE, BLOCK_COMPRESSED, BLOCK_RESERVED };
+enum { LITS_RAW, LITS_RLE, LITS_COMPRESSED, LITS_TREELESS };
+enum { SEQ_PREDEFINED, SEQ_RLE, SEQ_FSE, SEQ_REPEAT };
+
+#define HUF_MAX_BITS            11
+#define HUF_MAX_WEIGHTS         255
+#define HUF_WEIGHT_MAX_LOG      6
+
+#define LL_MAX_CODE             35
+#define ML_MAX_CODE             52
+#define OF_MAX_CODE             31
+#define LL_MAX_LOG              9
+#define ML_MAX_LOG              9
+#define OF_MAX_LOG              8
+#define FSE_MAX_SYMBOLS         (ML_MAX_CODE + 1)
+
+struct fse_entry {
+    uint8_t symbol;
+    uint8_t nbits;
+    uint16_t base;
+};
+
+struct huf_entry {
+    uint8_t symbol;
+    uint8_t nbits;
+};
+
+struct fse_table {
+    struct fse_entry *e;
+    unsigned int log;
+    bool valid;
+};
+
+struct unzstd_state {
+    /* Start of the current frame's output, the write pointer and limit. */
+    uint8_t *base, *op, *oend;
+
+    uint32_t rep[3];
+
+    const uint8_t *lits;
+    size_t nlits;
+
+    unsigned int huf_bits;
+    bool huf_valid;
+
+    struct fse_table ll, ml, of;
+
+    struct huf_entry huf[1U << HUF_MAX_BITS];
+    struct fse_entry ll_e[1U << LL_MAX_LOG];
+    struct fse_entry ml_e[1U << ML_MAX_LOG];
+    struct fse_entry of_e[1U << OF_MAX_LOG];
+
+    uint8_t litbuf[ZSTD_BLOCK_MAX];
+};
+
+static const int16_t __initconst ll_default[LL_MAX_CODE + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1,
+};
+
+static const int16_t __initconst ml_default[ML_MAX_CODE + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1,
+};
+
+static const int16_t __initconst of_default[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1,
+};
+
+static const uint32_t __initconst ll_base[LL_MAX_CODE + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536,
+};
+
+static const uint8_t __initconst ll_bits[LL_MAX_CODE + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16,
+};
+
+static const uint32_t __initconst ml_base[ML_MAX_CODE + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539,
+};
+
+static const uint8_t __initconst ml_bits[ML_MAX_CODE + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16,
+};
+
+/*
+ * Huffman and FSE streams are read backwards, starting from the most
+ * significant set bit of their last byte.  Up to 64 bits are kept in a
+ * container; after a reload at least 57 of them can be consumed.  Reading
+ * beyond the start of the stream yields zeroes, which the FSE-compressed
+ * Huffman weights rely on.
+ */
+struct bitrd {
+    const uint8_t *start, *ptr;
+    uint64_t bits;
+    unsigned int consumed;
+};
+
+static int __init bitrd_init(struct bitrd *b, const uint8_t *in, size_t len)
+{
+    unsigned int i;
+
+    if ( !len || !in[len - 1] )
+        return -EILSEQ;
+
+    b->start = in;
+    if ( len >= sizeof(b->bits) )
+    {
+        b->ptr = in + len - sizeof(b->bits);
+        b->bits = get_unaligned_le64(b->ptr);
+        b->consumed = 0;
+    }
+    else
+    {
+        b->ptr = in;
+        b->bits = 0;
+        for ( i = 0; i < len; i++ )
+            b->bits |= (uint64_t)in[i] << (i * 8);
+        b->consumed = (sizeof(b->bits) - len) * 8;
+    }
+
+    /* Skip the padding, including the marker bit itself. */
+    b->consumed += 9 - fls(in[len - 1]);
+
+    return 0;
+}
+
+static inline uint64_t bitrd_look(const struct bitrd *b, unsigned int n)
+{
+    return (b->bits << (b->consumed & 63)) >> 1 >> (63 - n);
+}
+
+static inline uint64_t bitrd_read(struct bitrd *b, unsigned int n)
+{
+    uint64_t v = bitrd_look(b, n);
+
+    b->consumed += n;
+
+    return v;
+}
+
+static inline void bitrd_reload(struct bitrd *b)
+{
+    unsigned int nb = b->consumed >> 3;
+
+    if ( b->ptr < b->start + sizeof(b->bits) )
+    {
+        if ( b->ptr == b->start )
+            return;
+        if ( nb > b->ptr - b->start )
+            nb = b->ptr - b->start;
+    }
+
+    b->ptr -= nb;
+    b->consumed -= nb * 8;
+    b->bits = get_unaligned_le64(b->ptr);
+}
+
+/* Only meaningful straight after bitrd_reload(). */
+static inline bool bitrd_overflow(const struct bitrd *b)
+{
+    return b->consumed > 64;
+}
+
+static inline bool bitrd_done(const struct bitrd *b)
+{
+    return b->ptr == b->start && b->consumed == 64;
+}
+
+/* Forward little-endian bit reads, for FSE table descriptions. */
+static uint32_t __init fwd_peek(const uint8_t *in, size_t len, size_t bitpos)
+{
+    size_t i, byte = bitpos >> 3;
+    uint32_t v = 0;
+
+    for ( i = 0; i < 4 && byte + i < len; i++ )
+        v |= (uint32_t)in[byte + i] << (i * 8);
+
+    return v >> (bitpos & 7);
+}
+
+static int __init fse_read_ncount(const uint8_t *in, size_t len,
+                                  int16_t *norm, unsigned int max_sym,
+                                  unsigned int max_log, unsigned int *nsym,
+                                  unsigned int *log, size_t *used)
+{
+    unsigned int al, threshold, nbits, s = 0;
+    int remaining;
+    size_t bitpos = 4;
+
+    if ( !len )
+        return -EILSEQ;
+
+    al = (in[0] & 0xf) + 5;
+    if ( al > max_log )
+        return -EILSEQ;
+
+    remaining = (1 << al) + 1;
+    threshold = 1U << al;
+    nbits = al + 1;
+
+    while ( remaining > 1 )
+    {
+        uint32_t v = fwd_peek(in, len, bitpos);
+        unsigned int max = 2 * threshold - 1 - remaining;
+        int count;
+
+        if ( s > max_sym )
+            return -EILSEQ;
+
+        if ( (v & (threshold - 1)) < max )
+        {
+            count = v & (threshold - 1);
+            bitpos += nbits - 1;
+        }
+        else
+        {
+            count = v & (2 * threshold - 1);
+            if ( count >= (int)threshold )
+                count -= max;
+            bitpos += nbits;
+        }
+
+        count--;
+        remaining -= count < 0 ? -count : count;
+        if ( remaining < 1 )
+            return -EILSEQ;
+        norm[s++] = count;
+
+        /* A zero probability is followed by 2-bit repeat flags. */
+        if ( !count )
+        {
+            unsigned int rpt;
+
+            do {
+                rpt = fwd_peek(in, len, bitpos) & 3;
+                bitpos += 2;
+                if ( s + rpt > max_sym + 1 )
+                    return -EILSEQ;
+                memset(&norm[s], 0, rpt * sizeof(*norm));
+                s += rpt;
+            } while ( rpt == 3 );
+        }
+
+        while ( remaining < threshold )
+        {
+            nbits--;
+            threshold >>= 1;
+        }
+
+        if ( bitpos > len * 8 )
+            return -EILSEQ;
+    }
+
+    *nsym = s;
+    *log = al;
+    *used = (bitpos + 7) >> 3;
+
+    return 0;
+}
+
+static int __init fse_build(struct fse_entry *table, const int16_t *norm,
+                            unsigned int nsym, unsigned int log)
+{
+    unsigned int size = 1U << log, high = size - 1;
+    unsigned int step = (size >> 1) + (size >> 3) + 3;
+    unsigned int s, i, pos = 0;
+    uint16_t next[FSE_MAX_SYMBOLS];
+
+    for ( s = 0; s < nsym; s++ )
+    {
+        if ( norm[s] == -1 )
+        {
+            table[high--].symbol = s;
+            next[s] = 1;
+        }
+        else
+            next[s] = norm[s];
+    }
+
+    for ( s = 0; s < nsym; s++ )
+        for ( i = 0; (int)i < norm[s]; i++ )
+        {
+            table[pos].symbol = s;
+            do {
+                pos = (pos + step) & (size - 1);
+            } while ( pos > high );
+        }
+
+    if ( pos )
+        return -EILSEQ;
+
+    for ( i = 0; i < size; i++ )
+    {
+        unsigned int n = next[table[i].symbol]++;
+        unsigned int nb = log + 1 - fls(n);
+
+        table[i].nbits = nb;
+        table[i].base = (n << nb) - size;
+    }
+
+    return 0;
+}
+
+static int __init huf_read_table(struct unzstd_state *s, const uint8_t *in,
+                                 size_t len, size_t *used)
+{
+    uint8_t w[HUF_MAX_WEIGHTS + 1];
+    unsigned int n = 0, i, hb, bits, pos, weight, total = 0, rest;
+
+    if ( !len )
+        return -EILSEQ;
+
+    hb = in[0];
+    if ( hb >= 128 )
+    {
+        /* Direct representation: 4 bits per weight. */
+        n = hb - 127;
+        if ( 1 + (n + 1) / 2 > len )
+            return -EILSEQ;
+        for ( i = 0; i < n; i++ )
+            w[i] = (i & 1) ? in[1 + i / 2] & 0xf : in[1 + i / 2] >> 4;
+        *used = 1 + (n + 1) / 2;
+    }
+    else
+    {
+        struct fse_entry t[1U << HUF_WEIGHT_MAX_LOG];
+        int16_t norm[HUF_MAX_BITS + 2];
+        unsigned int nsym, log, s1, s2;
+        struct bitrd b;
+        size_t hdr;
+        int rc;
+
+        if ( hb + 1 > len )
+            return -EILSEQ;
+
+        rc = fse_read_ncount(in + 1, hb, norm, HUF_MAX_BITS + 1,
+                             HUF_WEIGHT_MAX_LOG, &nsym, &log, &hdr);
+        if ( !rc )
+            rc = fse_build(t, norm, nsym, log);
+        if ( !rc && hdr >= hb )
+            rc = -EILSEQ;
+        if ( !rc )
+            rc = bitrd_init(&b, in + 1 + hdr, hb - hdr);
+        if ( rc )
+            return rc;
+
+        /* Two interleaved states, until the stream is overrun. */
+        s1 = bitrd_read(&b, log);
+        s2 = bitrd_read(&b, log);
+        bitrd_reload(&b);
+
+        for ( ; ; )
+        {
+            if ( n + 2 > HUF_MAX_WEIGHTS )
+                return -EILSEQ;
+
+            w[n++] = t[s1].symbol;
+            s1 = t[s1].base + bitrd_read(&b, t[s1].nbits);
+            bitrd_reload(&b);
+            if ( bitrd_overflow(&b) )
+            {
+                w[n++] = t[s2].symbol;
+                break;
+            }
+
+            w[n++] = t[s2].symbol;
+            s2 = t[s2].base + bitrd_read(&b, t[s2].nbits);
+            bitrd_reload(&b);
+            if ( bitrd_overflow(&b) )
+            {
+                w[n++] = t[s1].symbol;
+                break;
+            }
+        }
+
+        *used = 1 + hb;
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( w[i] > HUF_MAX_BITS )
+            return -EILSEQ;
+        if ( w[i] )
+            total += 1U << (w[i] - 1);
+    }
+
+    if ( !total )
+        return -EILSEQ;
+
+    /* The last weight is implied by rounding up to a power of two. */
+    bits = fls(total);
+    if ( bits > HUF_MAX_BITS )
+        return -EILSEQ;
+    rest = (1U << bits) - total;
+    if ( rest & (rest - 1) )
+        return -EILSEQ;
+    w[n++] = fls(rest);
+
+    /* Lowest weights (longest codes) take the lowest table slots. */
+    pos = 0;
+    for ( weight = 1; weight <= bits; weight++ )
+        for ( i = 0; i < n; i++ )
+        {
+            unsigned int j, span = 1U << (weight - 1);
+
+            if ( w[i] != weight )
+                continue;
+
+            for ( j = 0; j < span; j++ )
+            {
+                s->huf[pos + j].symbol = i;
+                s->huf[pos + j].nbits = bits + 1 - weight;
+            }
+            pos += span;
+        }
+
+    s->huf_bits = bits;
+    s->huf_valid = true;
+
+    return 0;
+}
+
+static int __init huf_decode_stream(const struct unzstd_state *s,
+                                    const uint8_t *in, size_t len,
+                                    uint8_t *out, size_t n)
+{
+    unsigned int bits = s->huf_bits;
+    struct bitrd b;
+    int rc;
+
+    rc = bitrd_init(&b, in, len);
+    if ( rc )
+        return rc;
+
+    for ( ; n >= 4; n -= 4 )
+    {
+        const struct huf_entry *e;
+
+        e = &s->huf[bitrd_look(&b, bits)];
+        *out++ = e->symbol;
+        b.consumed += e->nbits;
+        e = &s->huf[bitrd_look(&b, bits)];
+        *out++ = e->symbol;
+        b.consumed += e->nbits;
+        e = &s->huf[bitrd_look(&b, bits)];
+        *out++ = e->symbol;
+        b.consumed += e->nbits;
+        e = &s->huf[bitrd_look(&b, bits)];
+        *out++ = e->symbol;
+        b.consumed += e->nbits;
+
+        bitrd_reload(&b);
+    }
+
+    while ( n-- )
+    {
+        const struct huf_entry *e = &s->huf[bitrd_look(&b, bits)];
+
+        *out++ = e->symbol;
+        b.consumed += e->nbits;
+        bitrd_reload(&b);
+    }
+
+    return bitrd_done(&b) ? 0 : -EILSEQ;
+}
+
+static int __init zstd_literals(struct unzstd_state *s, const uint8_t *in,
+                                size_t len, size_t *used)
+{
+    unsigned int type = in[0] & 3, sf = (in[0] >> 2) & 3;
+    size_t hdr, regen, comp;
+
+    if ( type == LITS_RAW || type == LITS_RLE )
+    {
+        switch ( sf )
+        {
+        case 1:
+            hdr = 2;
+            break;
+        case 3:
+            hdr = 3;
+            break;
+        default:
+            hdr = 1;
+            break;
+        }
+        if ( hdr > len )
+            return -EILSEQ;
+
+        if ( hdr == 1 )
+            regen = in[0] >> 3;
+        else if ( hdr == 2 )
+            regen = (in[0] >> 4) + (in[1] << 4);
+        else
+            regen = (in[0] >> 4) + (in[1] << 4) + (in[2] << 12);
+
+        if ( regen > ZSTD_BLOCK_MAX )
+            return -EILSEQ;
+
+        if ( type == LITS_RAW )
+        {
+            if ( regen > len - hdr )
+                return -EILSEQ;
+            s->lits = in + hdr;
+            *used = hdr + regen;
+        }
+        else
+        {
+            if ( hdr + 1 > len )
+                return -EILSEQ;
+            memset(s->litbuf, in[hdr], regen);
+            s->lits = s->litbuf;
+            *used = hdr + 1;
+        }
+    }
+    else
+    {
+        static const uint8_t __initconst hdr_len[] = { 3, 3, 4, 5 };
+        static const uint8_t __initconst size_bits[] = { 10, 10, 14, 18 };
+        unsigned int i, sbits = size_bits[sf];
+        uint64_t v = 0;
+        const uint8_t *p;
+        int rc;
+
+        hdr = hdr_len[sf];
+        if ( hdr > len )
+            return -EILSEQ;
+        for ( i = 0; i < hdr; i++ )
+            v |= (uint64_t)in[i] << (i * 8);
+        regen = (v >> 4) & ((1U << sbits) - 1);
+        comp = (v >> (4 + sbits)) & ((1U << sbits) - 1);
+
+        if ( regen > ZSTD_BLOCK_MAX || comp > len - hdr )
+            return -EILSEQ;
+
+        p = in + hdr;
+        if ( type == LITS_COMPRESSED )
+        {
+            size_t t;
+
+            rc = huf_read_table(s, p, comp, &t);
+            if ( rc )
+                return rc;
+            p += t;
+            comp -= t;
+        }
+        else if ( !s->huf_valid )
+            return -EILSEQ;
+
+        if ( sf == 0 )
+        {
+            rc = huf_decode_stream(s, p, comp, s->litbuf, regen);
+            p += comp;
+        }
+        else
+        {
+            size_t sz[4], seg = (regen + 3) / 4;
+            uint8_t *out = s->litbuf;
+
+            if ( comp < 6 || regen < 3 * seg )
+                return -EILSEQ;
+            sz[0] = get_unaligned_le16(p);
+            sz[1] = get_unaligned_le16(p + 2);
+            sz[2] = get_unaligned_le16(p + 4);
+            if ( sz[0] + sz[1] + sz[2] > comp - 6 )
+                return -EILSEQ;
+            sz[3] = comp - 6 - sz[0] - sz[1] - sz[2];
+            p += 6;
+
+            for ( i = 0, rc = 0; i < 4 && !rc; i++ )
+            {
+                size_t n = i < 3 ? seg : regen - 3 * seg;
+
+                rc = huf_decode_stream(s, p, sz[i], out, n);
+                p += sz[i];
+                out += n;
+            }
+        }
+        if ( rc )
+            return rc;
+
+        s->lits = s->litbuf;
+        *used = p - in;
+    }
+
+    s->nlits = regen;
+
+    return 0;
+}
+
+static int __init zstd_seq_table(struct fse_table *t, unsigned int mode,
+                                 const uint8_t *in, size_t len, size_t *used,
+                                 const int16_t *def, unsigned int def_nsym,
+                                 unsigned int def_log, unsigned int max_sym,
+                                 unsigned int max_log)
+{
+    int16_t norm[FSE_MAX_SYMBOLS];
+    unsigned int nsym;
+    int rc = 0;
+
+    *used = 0;
+
+    switch ( mode )
+    {
+    case SEQ_PREDEFINED:
+        rc = fse_build(t->e, def, def_nsym, def_log);
+        t->log = def_log;
+        break;
+
+    case SEQ_RLE:
+        if ( !len || in[0] > max_sym )
+            return -EILSEQ;
+        t->e[0].symbol = in[0];
+        t->e[0].nbits = 0;
+        t->e[0].base = 0;
+        t->log = 0;
+        *used = 1;
+        break;
+
+    case SEQ_FSE:
+        rc = fse_read_ncount(in, len, norm, max_sym, max_log, &nsym, &t->log,
+                             used);
+        if ( !rc )
+            rc = fse_build(t->e, norm, nsym, t->log);
+        break;
+
+    case SEQ_REPEAT:
+        if ( !t->valid )
+            return -EILSEQ;
+        break;
+    }
+
+    t->valid = !rc;
+
+    return rc;
+}
+
+static void __init zstd_copy_match(uint8_t *op, size_t off, size_t len,
+                                   const uint8_t *oend)
+{
+    const uint8_t *match = op - off;
+
+    if ( off >= 8 && len + 8 <= oend - op )
+    {
+        /* Non-overlapping 8-byte chunks; may scribble up to 7 bytes. */
+        uint8_t *end = op + len;
+
+        do {
+            memcpy(op, match, 8);
+            op += 8;
+            match += 8;
+        } while ( op < end );
+    }
+    else
+    {
+        while ( len-- )
+            *op++ = *match++;
+    }
+}
+
+static int __init zstd_sequences(struct unzstd_state *s, const uint8_t *in,
+                                 size_t len)
+{
+    const uint8_t *lits = s->lits, *lend = s->lits + s->nlits;
+    unsigned int nseq, modes, ll_state, of_state, ml_state, i;
+    size_t pos, used;
+    struct bitrd b;
+    int rc;
+
+    if ( !len )
+        return -EILSEQ;
+
+    if ( in[0] < 128 )
+    {
+        nseq = in[0];
+        pos = 1;
+    }
+    else if ( in[0] < 255 )
+    {
+        if ( len < 2 )
+            return -EILSEQ;
+        nseq = ((in[0] - 128) << 8) + in[1];
+        pos = 2;
+    }
+    else
+    {
+        if ( len < 3 )
+            return -EILSEQ;
+        nseq = in[1] + (in[2] << 8) + 0x7f00;
+        pos = 3;
+    }
+
+    if ( !nseq )
+        goto out;
+
+    if ( pos >= len )
+        return -EILSEQ;
+    modes = in[pos++];
+    if ( modes & 3 )
+        return -EILSEQ;
+
+    rc = zstd_seq_table(&s->ll, modes >> 6, in + pos, len - pos, &used,
+                        ll_default, ARRAY_SIZE(ll_default), 6,
+                        LL_MAX_CODE, LL_MAX_LOG);
+    if ( rc )
+        return rc;
+    pos += used;
+
+    rc = zstd_seq_table(&s->of, (modes >> 4) & 3, in + pos, len - pos,
+                        &used, of_default, ARRAY_SIZE(of_default), 5,
+                        OF_MAX_CODE, OF_MAX_LOG);
+    if ( rc )
+        return rc;
+    pos += used;
+
+    rc = zstd_seq_table(&s->ml, (modes >> 2) & 3, in + pos, len - pos,
+                        &used, ml_default, ARRAY_SIZE(ml_default), 6,
+                        ML_MAX_CODE, ML_MAX_LOG);
+    if ( rc )
+        return rc;
+    pos += used;
+
+    if ( pos >= len )
+        return -EILSEQ;
+    rc = bitrd_init(&b, in + pos, len - pos);
+    if ( rc )
+        return rc;
+
+    ll_state = bitrd_read(&b, s->ll.log);
+    of_state = bitrd_read(&b, s->of.log);
+    ml_state = bitrd_read(&b, s->ml.log);
+    bitrd_reload(&b);
+
+    for ( i = 0; i < nseq; i++ )
+    {
+        const struct fse_entry *ll = &s->ll.e[ll_state];
+        const struct fse_entry *ml = &s->ml.e[ml_state];
+        const struct fse_entry *of = &s->of.e[of_state];
+        size_t lit_len, match_len, off;
+        uint32_t ofv;
+
+        ofv = (1U << of->symbol) + bitrd_read(&b, of->symbol);
+        bitrd_reload(&b);
+        match_len = ml_base[ml->symbol] + bitrd_read(&b, ml_bits[ml->symbol]);
+        lit_len = ll_base[ll->symbol] + bitrd_read(&b, ll_bits[ll->symbol]);
+        bitrd_reload(&b);
+
+        if ( ofv > 3 )
+        {
+            off = ofv - 3;
+            s->rep[2] = s->rep[1];
+            s->rep[1] = s->rep[0];
+            s->rep[0] = off;
+        }
+        else
+        {
+            unsigned int idx = ofv - 1 + !lit_len;
+
+            if ( idx == 0 )
+                off = s->rep[0];
+            else
+            {
+                off = idx == 3 ? s->rep[0] - 1 : s->rep[idx];
+                if ( idx > 1 )
+                    s->rep[2] = s->rep[1];
+                s->rep[1] = s->rep[0];
+                s->rep[0] = off;
+            }
+        }
+
+        if ( i + 1 < nseq )
+        {
+            ll_state = ll->base + bitrd_read(&b, ll->nbits);
+            ml_state = ml->base + bitrd_read(&b, ml->nbits);
+            of_state = of->base + bitrd_read(&b, of->nbits);
+            bitrd_reload(&b);
+        }
+
+        if ( lit_len > lend - lits || lit_len > s->oend - s->op )
+            return -EILSEQ;
+        if ( lit_len <= 16 && lend - lits >= 16 && s->oend - s->op >= 16 )
+            memcpy(s->op, lits, 16);
+        else
+            memcpy(s->op, lits, lit_len);
+        s->op += lit_len;
+        lits += lit_len;
+
+        if ( !off || off > s->op - s->base || match_len > s->oend - s->op )
+            return -EILSEQ;
+        zstd_copy_match(s->op, off, match_len, s->oend);
+        s->op += match_len;
+    }
+
+    if ( !bitrd_done(&b) )
+        return -EILSEQ;
+
+ out:
+    if ( lend - lits > s->oend - s->op )
+        return -EILSEQ;
+    memcpy(s->op, lits, lend - lits);
+    s->op += lend - lits;
+
+    return 0;
+}
+
+static int __init zstd_block(struct unzstd_state *s, const uint8_t *in,
+                             size_t len)
+{
+    size_t used;
+    int rc;
+
+    if ( !len )
+        return -EILSEQ;
+
+    rc = zstd_literals(s, in, len, &used);
+    if ( rc )
+        return rc;
+
+    return zstd_sequences(s, in + used, len - used);
+}
+
+static int __init zstd_frame(struct unzstd_state *s, const uint8_t *in,
+                             size_t len, size_t *used)
+{
+    static const uint8_t __initconst did_len[] = { 0, 1, 2, 4 };
+    unsigned int fhd, fcs_len, i;
+    size_t pos = 5;
+    uint32_t did = 0;
+
+    if ( len < pos )
+        return -EILSEQ;
+
+    fhd = in[4];
+    if ( fhd & ZSTD_FHD_RESERVED )
+        return -EILSEQ;
+
+    if ( !(fhd & ZSTD_FHD_SINGLE_SEGMENT) )
+        pos++;
+
+    if ( pos + did_len[fhd & ZSTD_FHD_DICT_ID_MASK] > len )
+        return -EILSEQ;
+    for ( i = 0; i < did_len[fhd & ZSTD_FHD_DICT_ID_MASK]; i++ )
+        did |= (uint32_t)in[pos++] << (i * 8);
+    if ( did )
+        return -EOPNOTSUPP;
+
+    fcs_len = (fhd >> ZSTD_FHD_FCS_SHIFT) ? 1U << (fhd >> ZSTD_FHD_FCS_SHIFT)
+                                          : !!(fhd & ZSTD_FHD_SINGLE_SEGMENT);
+    pos += fcs_len;
+    if ( pos > len )
+        return -EILSEQ;
+
+    s->base = s->op;
+    s->rep[0] = 1;
+    s->rep[1] = 4;
+    s->rep[2] = 8;
+    s->huf_valid = false;
+    s->ll.valid = s->ml.valid = s->of.valid = false;
+
+    for ( ; ; )
+    {
+        uint32_t bh;
+        size_t size;
+        int rc = 0;
+
+        if ( len - pos < 3 )
+            return -EILSEQ;
+        bh = in[pos] | (in[pos + 1] << 8) | (in[pos + 2] << 16);
+        pos += 3;
+        size = bh >> 3;
+
+        switch ( (bh >> 1) & 3 )
+        {
+        case BLOCK_RAW:
+            if ( size > len - pos || size > s->oend - s->op )
+                return -EILSEQ;
+            memcpy(s->op, in + pos, size);
+            s->op += size;
+            pos += size;
+            break;
+
+        case BLOCK_RLE:
+            if ( pos >= len || size > s->oend - s->op )
+                return -EILSEQ;
+            memset(s->op, in[pos], size);
+            s->op += size;
+            pos++;
+            break;
+
+        case BLOCK_COMPRESSED:
+            if ( size > ZSTD_BLOCK_MAX || size > len - pos )
+                return -EILSEQ;
+            rc = zstd_block(s, in + pos, size);
+            pos += size;
+            break;
+
+        default:
+            return -EILSEQ;
+        }
+
+        if ( rc )
+            return rc;
+
+        /* Last_Block */
+        if ( bh & 1 )
+            break;
+    }
+
+    if ( fhd & ZSTD_FHD_CHECKSUM )
+        pos += 4;
+    if ( pos > len )
+        return -EILSEQ;
+
+    *used = pos;
+
+    return 0;
+}
+
+int __init zstd_check(char *image, unsigned long image_len)
+{
+    if ( image_len < 4 )
+        return 0;
+
+    return get_unaligned_le32(image) == ZSTD_MAGIC;
+}
+
+unsigned long __init zstd_output_length(char *image, unsigned long image_len)
+{
+    const uint8_t *in = (const uint8_t *)image;
+    unsigned int fhd, fcs, pos = 5;
+
+    if ( image_len < 6 )
+        return 0;
+
+    fhd = in[4];
+    fcs = fhd >> ZSTD_FHD_FCS_SHIFT;
+    if ( !(fhd & ZSTD_FHD_SINGLE_SEGMENT) )
+        pos++;
+    pos += (fhd & ZSTD_FHD_DICT_ID_MASK) == 3 ? 4
+                                               : fhd & ZSTD_FHD_DICT_ID_MASK;
+
+    /*
+     * Use the frame content size if the compressor recorded it; streamed
+     * output (as in Linux' Image.zst) instead has the size appended.
+     */
+    if ( pos + 8 <= image_len )
+    {
+        switch ( fcs )
+        {
+        case 0:
+            if ( fhd & ZSTD_FHD_SINGLE_SEGMENT )
+                return in[pos];
+            break;
+        case 1:
+            return get_unaligned_le16(in + pos) + 256;
+        case 2:
+            return get_unaligned_le32(in + pos);
+        case 3:
+            return get_unaligned_le64(in + pos);
+        }
+    }
+
+    return get_unaligned_le32(in + image_len - 4);
+}
+
+int __init perform_unzstd(char *output, unsigned long output_len,
+                          char *image, unsigned long image_len)
+{
+    const uint8_t *in = (const uint8_t *)image;
+    struct unzstd_state *s;
+    size_t pos = 0;
+    int rc = 0;
+
+    if ( !zstd_check(image, image_len) )
+        return 1;
+
+    s = xmalloc(struct unzstd_state);
+    if ( !s )
+        return -ENOMEM;
+
+    s->op = (uint8_t *)output;
+    s->oend = s->op + output_len;
+    s->ll.e = s->ll_e;
+    s->ml.e = s->ml_e;
+    s->of.e = s->of_e;
+
+    /* Anything after the last frame is the size Linux appends, if present. */
+    while ( !rc && image_len - pos >= 8 )
+    {
+        uint32_t magic = get_unaligned_le32(in + pos);
+        size_t used;
+
+        if ( magic == ZSTD_MAGIC )
+        {
+            rc = zstd_frame(s, in + pos, image_len - pos, &used);
+            pos += used;
+        }
+        else if ( (magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC )
+        {
+            used = get_unaligned_le32(in + pos + 4);
+            if ( used > image_len - pos - 8 )
+                rc = -EILSEQ;
+            pos += 8 + used;
+        }
+        else
+            break;
+    }
+
+    if ( !rc && s->op != s->oend )
+        rc = -EILSEQ;
+
+    xfree(s);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -13,11 +13,15 @@
 #include <crux/version.h>
 #include <crux/lib.h>
 #include <crux/init.h>
+#include <crux/cpu.h>
 #include <crux/event.h>
 #include <crux/console.h>
 #include <crux/param.h>
+#include <crux/perfc.h>
 #include <crux/serial.h>
 #include <crux/softirq.h>
+#include <crux/tasklet.h>
+#include <crux/xmalloc.h>
 #include <crux/keyhandler.h>
 #include <crux/guest_access.h>
 #include <crux/watchdog.h>
@@ -412,6 +416,398 @@ long read_console_ring(struct crux_sysctl_readconsole *op)
 #endif /* CONFIG_SYSCTL */
 
 
+/*
+ * ********************************************************
+ * *************** PER-CPU CONSOLE RINGS ******************
+ * ********************************************************
+ *
+ * With console-percpu, printk() no longer takes console_lock once boot is
+ * over. Each CPU formats its messages into a ring of its own, as records
+ * stamped with NOW(), and a tasklet merges the rings, oldest record first,
+ * into the console ring and the console devices. A CPU whose ring is full
+ * drops the message and counts it, instead of waiting for the drain.
+ *
+ * Each ring has a single producer (its CPU, with IRQs disabled) and a
+ * single consumer (whoever holds conring_drain_lock), so the producer and
+ * consumer indexes need no lock. Synchronous console mode (and hence
+ * panics and crashes) bypasses the rings after draining them.
+ */
+static bool __initdata opt_console_percpu;
+boolean_param("console-percpu", opt_console_percpu);
+
+/* conring-percpu-size: size of each per-CPU ring (default 8kB). */
+static uint32_t __initdata opt_conring_pcpu_size = KB(8);
+size_param("conring-percpu-size", opt_conring_pcpu_size);
+
+/* Longest record which fits the drain buffer (header excluded). */
+#define CONRING_PCPU_REC_MAX 2048
+
+struct conring_rec {
+    s_time_t stamp;             /* When the record was opened */
+    uint32_t len;               /* Bytes of text following the header */
+    uint32_t lost;              /* Records dropped just before this one */
+};
+
+struct conring_pcpu {
+    char *ring;
+    uint32_t size;
+    uint32_t prod, cons;        /* Free running byte indexes into ring */
+    uint32_t tail;              /* End of the record being written */
+    uint32_t lost;              /* Records dropped since the last queued */
+    s_time_t stamp;             /* Stamp of the record being written */
+    bool open, overflow;
+    char buf[1024];             /* vprintk_common() formatting buffer */
+};
+
+static DEFINE_PER_CPU(struct conring_pcpu *, conring_pcpu);
+static cpumask_t conring_pcpu_mask;     /* CPUs which have a ring */
+static uint32_t __read_mostly conring_pcpu_size;
+static bool __read_mostly conring_pcpu_enabled;
+static atomic_t conring_pcpu_bypass = ATOMIC_INIT(0);
+static bool conring_drain_pending;
+static DEFINE_SPINLOCK(conring_drain_lock);
+
+static void cf_check conring_drain_fn(void *unused);
+static DECLARE_SOFTIRQ_TASKLET(conring_drain_tasklet, conring_drain_fn, NULL);
+
+static void conring_pcpu_write(struct conring_pcpu *pc, uint32_t idx,
+                               const void *from, size_t len)
+{
+    const char *s = from;
+
+    while ( len-- )
+        pc->ring[idx++ & (pc->size - 1)] = *s++;
+}
+
+static void conring_pcpu_read(const struct conring_pcpu *pc, uint32_t idx,
+                              void *to, size_t len)
+{
+    char *d = to;
+
+    while ( len-- )
+        *d++ = pc->ring[idx++ & (pc->size - 1)];
+}
+
+/*
+ * Open a record in this CPU's ring, if the lockless path can be used. On
+ * success, __putstr() appends to the record until conring_pcpu_close().
+ * A printk() nested in the record's (e.g. from an NMI) takes console_lock,
+ * and vprintk_common() hides the open record from it meanwhile, so only
+ * the record's own text ends up in it.
+ */
+static struct conring_pcpu *conring_pcpu_open(void)
+{
+    struct conring_pcpu *pc;
+
+    ASSERT(!local_irq_is_enabled());
+
+    if ( !conring_pcpu_enabled || atomic_read(&conring_pcpu_bypass) )
+        return NULL;
+
+    pc = this_cpu(conring_pcpu);
+    /* Nested printk()-s (e.g. from printk_ratelimit()) take the lock. */
+    if ( !pc || pc->open )
+        return NULL;
+
+    pc->open = true;
+    pc->overflow = false;
+    pc->stamp = NOW();
+    pc->tail = pc->prod + sizeof(struct conring_rec);
+
+    return pc;
+}
+
+static void conring_pcpu_puts(struct conring_pcpu *pc, const char *str,
+                              size_t len)
+{
+    if ( pc->overflow )
+        return;
+
+    if ( pc->tail + len - read_atomic(&pc->cons) > pc->size ||
+         pc->tail + len - pc->prod >
+         sizeof(struct conring_rec) + CONRING_PCPU_REC_MAX )
+    {
+        pc->overflow = true;
+        return;
+    }
+
+    conring_pcpu_write(pc, pc->tail, str, len);
+    pc->tail += len;
+}
+
+static void conring_pcpu_close(struct conring_pcpu *pc)
+{
+    struct conring_rec rec;
+
+    pc->open = false;
+
+    if ( pc->overflow )
+    {
+        pc->lost++;
+        perfc_incr(conring_pcpu_lost);
+        return;
+    }
+
+    rec.stamp = pc->stamp;
+    rec.len = pc->tail - pc->prod - sizeof(rec);
+    rec.lost = pc->lost;
+
+    /* Nothing to print (e.g. the message got filtered by log level). */
+    if ( !rec.len )
+        return;
+
+    conring_pcpu_write(pc, pc->prod, &rec, sizeof(rec));
+    smp_wmb();
+    write_atomic(&pc->prod, pc->tail);
+    pc->lost = 0;
+
+    if ( !test_and_set_bool(conring_drain_pending) )
+        tasklet_schedule(&conring_drain_tasklet);
+}
+
+/*
+ * Move the records queued in the per-CPU rings into the console ring and
+ * onto the console devices, in timestamp order.
+ */
+static void conring_pcpu_drain(void)
+{
+    static char buf[CONRING_PCPU_REC_MAX];
+    unsigned int flags = CONSOLE_ALL, cpu, best_cpu;
+    struct conring_pcpu *pc, *best;
+    struct conring_rec rec, best_rec = {};
+    unsigned long irqflags;
+
+    if ( conring_no_notify )
+        flags &= ~CONSOLE_RING_VIRQ;
+
+    do {
+        if ( !spin_trylock_irqsave(&conring_drain_lock, irqflags) )
+            return; /* The holder will notice conring_drain_pending. */
+
+        write_atomic(&conring_drain_pending, false);
+        smp_mb();
+
+        for ( ; ; )
+        {
+            best = NULL;
+            best_cpu = nr_cpu_ids;
+
+            for_each_cpu ( cpu, &conring_pcpu_mask )
+            {
+                pc = per_cpu(conring_pcpu, cpu);
+                if ( pc->cons == read_atomic(&pc->prod) )
+                    continue;
+                smp_rmb();
+                conring_pcpu_read(pc, pc->cons, &rec, sizeof(rec));
+                if ( !best || rec.stamp < best_rec.stamp )
+                {
+                    best = pc;
+                    best_cpu = cpu;
+                    best_rec = rec;
+                }
+            }
+
+            if ( !best )
+                break;
+
+            conring_pcpu_read(best, best->cons + sizeof(best_rec), buf,
+                              best_rec.len);
+            smp_mb();
+            write_atomic(&best->cons,
+                         best->cons + sizeof(best_rec) + best_rec.len);
+
+            rspin_lock(&console_lock);
+            if ( best_rec.lost )
+            {
+                char lost[48];
+
+                snprintf(lost, sizeof(lost),
+                         "printk: %u messages lost on CPU%u\n",
+                         best_rec.lost, best_cpu);
+                console_send(lost, strlen(lost), flags);
+            }
+            console_send(buf, best_rec.len, flags);
+            rspin_unlock(&console_lock);
+        }
+
+        spin_unlock_irqrestore(&conring_drain_lock, irqflags);
+    } while ( read_atomic(&conring_drain_pending) );
+}
+
+static void cf_check conring_drain_fn(void *unused)
+{
+    conring_pcpu_drain();
+}
+
+static int conring_pcpu_alloc(unsigned int cpu)
+{
+    struct conring_pcpu *pc;
+
+    if ( per_cpu(conring_pcpu, cpu) )
+        return 0;
+
+    pc = xzalloc(struct conring_pcpu);
+    if ( !pc )
+        return -ENOMEM;
+
+    pc->ring = xmalloc_array(char, conring_pcpu_size);
+    if ( !pc->ring )
+    {
+        xfree(pc);
+        return -ENOMEM;
+    }
+    pc->size = conring_pcpu_size;
+
+    per_cpu(conring_pcpu, cpu) = pc;
+    smp_wmb();
+    /* Rings are kept when CPUs go offline, so they get drained anyway. */
+    cpumask_set_cpu(cpu, &conring_pcpu_mask);
+
+    return 0;
+}
+
+static int cf_check conring_pcpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    int rc = 0;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        rc = conring_pcpu_alloc(cpu);
+        break;
+    }
+
+    return notifier_from_errno(rc);
+}
+
+static struct notifier_block conring_pcpu_nfb = {
+    .notifier_call = conring_pcpu_callback
+};
+
+static void __init conring_pcpu_init(void)
+{
+    unsigned int cpu;
+
+    if ( !opt_console_percpu )
+        return;
+
+    conring_pcpu_size = max_t(uint32_t, opt_conring_pcpu_size,
+                              2 * (sizeof(struct conring_rec) +
+                                   CONRING_PCPU_REC_MAX));
+    conring_pcpu_size = 1U << fls(conring_pcpu_size - 1);
+
+    for_each_online_cpu ( cpu )
+        if ( conring_pcpu_alloc(cpu) )
+        {
+            printk(CRUXLOG_WARNING
+                   "Not enough memory for per-CPU console rings\n");
+            return;
+        }
+    register_cpu_notifier(&conring_pcpu_nfb);
+
+    conring_pcpu_enabled = true;
+
+    printk("allocated per-CPU console rings of %u KiB.\n",
+           conring_pcpu_size >> 10);
+}
+
+#ifdef CONFIG_SELF_TESTS
+/*
+ * console-percpu-bench -> time printk() with all CPUs printing at once, at
+ * boot, with and without the per-CPU rings.
+ */
+static bool __initdata opt_console_percpu_bench;
+boolean_param("console-percpu-bench", opt_console_percpu_bench);
+
+#define CONBENCH_LOOPS 32
+
+static struct tasklet __initdata conbench_tasklet[NR_CPUS];
+static s_time_t __initdata conbench_total[NR_CPUS], conbench_max[NR_CPUS];
+static bool __initdata conbench_go;
+static atomic_t __initdata conbench_done;
+
+static void __init cf_check conbench_cpu(void *unused)
+{
+    unsigned int i, cpu = smp_processor_id();
+    s_time_t start, t, worst = 0, total = 0;
+
+    while ( !ACCESS_ONCE(conbench_go) )
+        cpu_relax();
+
+    for ( i = 0; i < CONBENCH_LOOPS; i++ )
+    {
+        start = NOW();
+        printk("console bench: CPU%u line %u\n", cpu, i);
+        t = NOW() - start;
+        total += t;
+        worst = max(worst, t);
+    }
+
+    conbench_total[cpu] = total;
+    conbench_max[cpu] = worst;
+
+    smp_wmb();
+    atomic_inc(&conbench_done);
+}
+
+static void __init conbench_run(const char *what)
+{
+    unsigned int cpu, this_cpu = smp_processor_id();
+    s_time_t total = 0, worst = 0;
+
+    conbench_go = false;
+    atomic_set(&conbench_done, 0);
+
+    for_each_online_cpu ( cpu )
+    {
+        if ( cpu == this_cpu )
+            continue;
+        tasklet_init(&conbench_tasklet[cpu], conbench_cpu, NULL);
+        tasklet_schedule_on_cpu(&conbench_tasklet[cpu], cpu);
+    }
+
+    smp_wmb();
+    conbench_go = true;
+    conbench_cpu(NULL);
+
+    while ( atomic_read(&conbench_done) < num_online_cpus() )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+
+    smp_rmb();
+    for_each_online_cpu ( cpu )
+    {
+        total += conbench_total[cpu];
+        worst = max(worst, conbench_max[cpu]);
+    }
+
+    /* Let the rings drain, so the report isn't lost behind the flood. */
+    process_pending_softirqs();
+
+    printk("console bench (%s): %u CPUs, printk() avg %"PRI_stime"ns, "
+           "max %"PRI_stime"ns\n", what, num_online_cpus(),
+           total / (num_online_cpus() * CONBENCH_LOOPS), worst);
+}
+
+static void __init conring_pcpu_bench(void)
+{
+    if ( !opt_console_percpu_bench || !conring_pcpu_enabled )
+        return;
+
+    conring_pcpu_enabled = false;
+    conbench_run("console_lock");
+    conring_pcpu_enabled = true;
+    conbench_run("per-CPU rings");
+}
+#else
+static inline void conring_pcpu_bench(void) {}
+#endif /* CONFIG_SELF_TESTS */
+
+
 /*
  * *******************************************************
  * *************** ACCESS TO SERIAL LINE *****************
@@ -687,6 +1083,13 @@ static void console_send(const char *str, size_t len, unsigned int flags)
 static inline void __putstr(const char *str)
 {
     unsigned int flags = CONSOLE_ALL;
+    struct conring_pcpu *pc = this_cpu(conring_pcpu);
+
+    if ( pc && pc->open )
+    {
+        conring_pcpu_puts(pc, str, strlen(str));
+        return;
+    }
 
     ASSERT(rspin_is_locked(&console_lock));
 
@@ -948,16 +1351,34 @@ static void vprintk_common(const char *fmt, va_list args, const char *prefix)
         bool continued, do_print;
     }            *state;
     static DEFINE_PER_CPU(struct vps, state);
-    static char   buf[1024];
-    char         *p, *q;
+    static char   conbuf[sizeof_field(struct conring_pcpu, buf)];
+    char         *buf, *p, *q;
+    struct conring_pcpu *pc, *outer = NULL;
     unsigned long flags;
 
-    /* console_lock can be acquired recursively from __printk_ratelimit(). */
     local_irq_save(flags);
-    rspin_lock(&console_lock);
+    pc = conring_pcpu_open();
+    if ( pc )
+        buf = pc->buf;
+    else
+    {
+        /*
+         * console_lock can be acquired recursively from
+         * __printk_ratelimit().
+         */
+        rspin_lock(&console_lock);
+        buf = conbuf;
+
+        /* Keep __putstr() from appending to the record we interrupted. */
+        outer = this_cpu(conring_pcpu);
+        if ( outer && outer->open )
+            outer->open = false;
+        else
+            outer = NULL;
+    }
     state = &this_cpu(state);
 
-    (void)vsnprintf(buf, sizeof(buf), fmt, args);
+    (void)vsnprintf(buf, sizeof(conbuf), fmt, args);
 
     p = buf;
 
@@ -990,7 +1411,14 @@ static void vprintk_common(const char *fmt, va_list args, const char *prefix)
         state->continued = 1;
     }
 
-    rspin_unlock(&console_lock);
+    if ( pc )
+        conring_pcpu_close(pc);
+    else
+    {
+        if ( outer )
+            outer->open = true;
+        rspin_unlock(&console_lock);
+    }
     local_irq_restore(flags);
 }
 
@@ -1167,6 +1595,9 @@ void __init console_endboot(void)
     register_irq_keyhandler('G', &do_toggle_guest,
                             "toggle host/guest log level adjustment", 0);
 
+    conring_pcpu_init();
+    conring_pcpu_bench();
+
     /* Serial input is directed to DOM0 by default. */
     console_switch_input();
 }
@@ -1213,6 +1644,7 @@ void console_force_unlock(void)
     watchdog_disable();
     spin_debug_disable();
     rspin_lock_init(&console_lock);
+    spin_lock_init(&conring_drain_lock);
     serial_force_unlock(sercon_handle);
     conring_no_notify = true;
     console_start_sync();
@@ -1221,12 +1653,15 @@ void console_force_unlock(void)
 void console_start_sync(void)
 {
     atomic_inc(&print_everything);
+    atomic_inc(&conring_pcpu_bypass);
     serial_start_sync(sercon_handle);
+    conring_pcpu_drain();
 }
 
 void console_end_sync(void)
 {
     serial_end_sync(sercon_handle);
+    atomic_dec(&conring_pcpu_bypass);
     atomic_dec(&print_everything);
 }
 
@@ -251,11 +251,6 @@ static bool queue_empty(struct arm_smmu_ll_queue *q)
 	       Q_WRP(q, q->prod) == Q_WRP(q, q->cons);
 }
 
-static void queue_sync_cons_in(struct arm_smmu_queue *q)
-{
-	q->llq.cons = readl_relaxed(q->cons_reg);
-}
-
 static void queue_sync_cons_out(struct arm_smmu_queue *q)
 {
 	/*
@@ -302,35 +297,92 @@ static void queue_inc_prod(struct arm_smmu_ll_queue *q)
 	q->prod = Q_OVF(q->prod) | Q_WRP(q, prod) | Q_IDX(q, prod);
 }
 
+static u32 queue_inc_prod_n(struct arm_smmu_ll_queue *q, u32 n)
+{
+	u32 prod = (Q_WRP(q, q->prod) | Q_IDX(q, q->prod)) + n;
+	return Q_OVF(q->prod) | Q_WRP(q, prod) | Q_IDX(q, prod);
+}
+
+static bool queue_has_space(struct arm_smmu_ll_queue *q, u32 n)
+{
+	u32 space, prod, cons;
+
+	prod = Q_IDX(q, q->prod);
+	cons = Q_IDX(q, q->cons);
+
+	if (Q_WRP(q, q->prod) == Q_WRP(q, q->cons))
+		space = (1 << q->max_n_shift) - (prod - cons);
+	else
+		space = cons - prod;
+
+	return space >= n;
+}
+
+/* Has the SMMU consumed the entry at index prod? */
+static bool queue_consumed(struct arm_smmu_ll_queue *q, u32 prod)
+{
+	return ((Q_WRP(q, q->cons) == Q_WRP(q, prod)) &&
+		(Q_IDX(q, q->cons) > Q_IDX(q, prod))) ||
+	       ((Q_WRP(q, q->cons) != Q_WRP(q, prod)) &&
+		(Q_IDX(q, q->cons) <= Q_IDX(q, prod)));
+}
+
 /*
- * Wait for the SMMU to consume items. If sync is true, wait until the queue
- * is empty. Otherwise, wait until there is at least one free slot.
+ * Read CONS into the caller's llq and advance the copy cached in q for the
+ * other CPUs. Several CPUs poll the command queue at once, so the cached
+ * copy only ever moves forward: an older reading must not undo a newer one.
  */
-static int queue_poll_cons(struct arm_smmu_queue *q, bool sync, bool wfe)
+static void queue_sync_cons_in(struct arm_smmu_queue *q,
+			       struct arm_smmu_ll_queue *llq)
 {
-	s_time_t timeout;
-	unsigned int delay = 1, spin_cnt = 0;
+	u32 cons = readl_relaxed(q->cons_reg);
+	u32 old = ACCESS_ONCE(q->llq.cons);
+	u32 mask = (2U << q->llq.max_n_shift) - 1;
+
+	llq->cons = cons;
+
+	/* cons is ahead of old if it is at most a queue size away. */
+	while ((((cons - old) & mask) - 1) < (1U << q->llq.max_n_shift)) {
+		u32 prev = cmpxchg(&q->llq.cons, old, cons);
+
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+struct arm_smmu_queue_poll {
+	s_time_t			timeout;
+	unsigned int			delay;
+	unsigned int			spin_cnt;
+	bool				wfe;
+};
 
+static void queue_poll_init(struct arm_smmu_device *smmu,
+			    struct arm_smmu_queue_poll *qp, bool sync)
+{
+	qp->delay = 1;
+	qp->spin_cnt = 0;
+	qp->wfe = !!(smmu->features & ARM_SMMU_FEAT_SEV);
 	/* Wait longer if it's a CMD_SYNC */
-	timeout = NOW() + MICROSECS(sync ?
-					    ARM_SMMU_CMDQ_SYNC_TIMEOUT_US :
-					    ARM_SMMU_POLL_TIMEOUT_US);
-
-	while (queue_sync_cons_in(q),
-	      (sync ? !queue_empty(&q->llq) : queue_full(&q->llq))) {
-		if (NOW() > timeout)
-			return -ETIMEDOUT;
-
-		if (wfe) {
-			wfe();
-		} else if (++spin_cnt < ARM_SMMU_CMDQ_SYNC_SPIN_COUNT) {
-			cpu_relax();
-			continue;
-		} else {
-			udelay(delay);
-			delay *= 2;
-			spin_cnt = 0;
-		}
+	qp->timeout = NOW() + MICROSECS(sync ?
+					ARM_SMMU_CMDQ_SYNC_TIMEOUT_US :
+					ARM_SMMU_POLL_TIMEOUT_US);
+}
+
+static int queue_poll(struct arm_smmu_queue_poll *qp)
+{
+	if (NOW() > qp->timeout)
+		return -ETIMEDOUT;
+
+	if (qp->wfe) {
+		wfe();
+	} else if (++qp->spin_cnt < ARM_SMMU_CMDQ_SYNC_SPIN_COUNT) {
+		cpu_relax();
+	} else {
+		udelay(qp->delay);
+		qp->delay *= 2;
+		qp->spin_cnt = 0;
 	}
 
 	return 0;
@@ -344,17 +396,6 @@ static void queue_write(__le64 *dst, u64 *src, size_t n_dwords)
 		*dst++ = cpu_to_le64(*src++);
 }
 
-static int queue_insert_raw(struct arm_smmu_queue *q, u64 *ent)
-{
-	if (queue_full(&q->llq))
-		return -ENOSPC;
-
-	queue_write(Q_ENT(q, q->llq.prod), ent, q->ent_dwords);
-	queue_inc_prod(&q->llq);
-	queue_sync_prod_out(q);
-	return 0;
-}
-
 static void queue_read(u64 *dst, __le64 *src, size_t n_dwords)
 {
 	int i;
@@ -507,34 +548,42 @@ static void arm_smmu_cmdq_skip_err(struct arm_smmu_device *smmu)
 	queue_write(Q_ENT(q, cons), cmd, q->ent_dwords);
 }
 
-static void arm_smmu_cmdq_insert_cmd(struct arm_smmu_device *smmu, u64 *cmd)
-{
-	struct arm_smmu_queue *q = &smmu->cmdq.q;
-	bool wfe = !!(smmu->features & ARM_SMMU_FEAT_SEV);
-
-	smmu->prev_cmd_opcode = FIELD_GET(CMDQ_0_OP, cmd[0]);
-
-	while (queue_insert_raw(q, cmd) == -ENOSPC) {
-		if (queue_poll_cons(q, false, wfe))
-			dev_err_ratelimited(smmu->dev, "CMDQ timeout\n");
-	}
-}
-
-static void arm_smmu_cmdq_issue_cmd(struct arm_smmu_device *smmu,
-				    struct arm_smmu_cmdq_ent *ent)
-{
-	u64 cmd[CMDQ_ENT_DWORDS];
-	unsigned long flags;
+/*
+ * Reserve n slots in the command queue, waiting for the SMMU to free some
+ * up if needed. On return, llq->prod is the index of the first slot.
+ */
+static void arm_smmu_cmdq_reserve(struct arm_smmu_device *smmu,
+				  struct arm_smmu_ll_queue *llq, u32 n)
+{
+	struct arm_smmu_cmdq *cmdq = &smmu->cmdq;
+	struct arm_smmu_queue_poll qp;
+	u32 old, prev;
+
+	old = atomic_read(&cmdq->prod);
+	for (;;) {
+		llq->prod = old;
+		llq->cons = ACCESS_ONCE(cmdq->q.llq.cons);
+
+		if (!queue_has_space(llq, n)) {
+			queue_poll_init(smmu, &qp, false);
+			while (queue_sync_cons_in(&cmdq->q, llq),
+			       !queue_has_space(llq, n)) {
+				if (queue_poll(&qp)) {
+					dev_err_ratelimited(smmu->dev,
+							    "CMDQ timeout\n");
+					queue_poll_init(smmu, &qp, false);
+				}
+			}
+			old = atomic_read(&cmdq->prod);
+			continue;
+		}
 
-	if (arm_smmu_cmdq_build_cmd(cmd, ent)) {
-		dev_warn(smmu->dev, "ignoring unknown CMDQ opcode 0x%x\n",
-			 ent->opcode);
-		return;
+		prev = atomic_cmpxchg(&cmdq->prod, old,
+				      queue_inc_prod_n(llq, n));
+		if (prev == old)
+			return;
+		old = prev;
 	}
-
-	spin_lock_irqsave(&smmu->cmdq.lock, flags);
-	arm_smmu_cmdq_insert_cmd(smmu, cmd);
-	spin_unlock_irqrestore(&smmu->cmdq.lock, flags);
 }
 
 #ifdef CONFIG_MSI
@@ -555,69 +604,168 @@ static int __arm_smmu_sync_poll_msi(struct arm_smmu_device *smmu, u32 sync_idx)
 	return (int)(val - sync_idx) < 0 ? -ETIMEDOUT : 0;
 }
 
-static int __arm_smmu_cmdq_issue_sync_msi(struct arm_smmu_device *smmu)
+static void arm_smmu_cmdq_sync_set_msi(struct arm_smmu_device *smmu,
+				       struct arm_smmu_cmdq_ent *ent)
 {
-	u64 cmd[CMDQ_ENT_DWORDS];
-	unsigned long flags;
-	struct arm_smmu_cmdq_ent ent = {
-		.opcode = CMDQ_OP_CMD_SYNC,
-		.sync	= {
-			.msiaddr = virt_to_phys(&smmu->sync_count),
-		},
-	};
-
-	spin_lock_irqsave(&smmu->cmdq.lock, flags);
-
-	/* Piggy-back on the previous command if it's a SYNC */
-	if (smmu->prev_cmd_opcode == CMDQ_OP_CMD_SYNC) {
-		ent.sync.msidata = smmu->sync_nr;
-	} else {
-		ent.sync.msidata = ++smmu->sync_nr;
-		arm_smmu_cmdq_build_cmd(cmd, &ent);
-		arm_smmu_cmdq_insert_cmd(smmu, cmd);
-	}
-
-	spin_unlock_irqrestore(&smmu->cmdq.lock, flags);
-
-	return __arm_smmu_sync_poll_msi(smmu, ent.sync.msidata);
+	ent->sync.msiaddr = virt_to_phys(&smmu->sync_count);
+	ent->sync.msidata = ++smmu->sync_nr;
 }
 #else
-static inline int __arm_smmu_cmdq_issue_sync_msi(struct arm_smmu_device *smmu)
+static inline int __arm_smmu_sync_poll_msi(struct arm_smmu_device *smmu,
+					   u32 sync_idx)
 {
 	return 0;
 }
+
+static inline void arm_smmu_cmdq_sync_set_msi(struct arm_smmu_device *smmu,
+					      struct arm_smmu_cmdq_ent *ent)
+{
+}
 #endif /* CONFIG_MSI */
 
+/* Wait for the SMMU to consume the CMD_SYNC at index sync_prod. */
+static int __arm_smmu_sync_poll_cons(struct arm_smmu_device *smmu,
+				     u32 sync_prod)
+{
+	struct arm_smmu_queue *q = &smmu->cmdq.q;
+	struct arm_smmu_ll_queue llq = { .max_n_shift = q->llq.max_n_shift };
+	struct arm_smmu_queue_poll qp;
+	int ret = 0;
 
-static int __arm_smmu_cmdq_issue_sync(struct arm_smmu_device *smmu)
+	queue_poll_init(smmu, &qp, true);
+	while (queue_sync_cons_in(q, &llq),
+	       !queue_consumed(&llq, sync_prod)) {
+		ret = queue_poll(&qp);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Write n commands to the command queue, followed by a CMD_SYNC if sync is
+ * true, and wait for its completion.
+ *
+ * Slots are reserved without taking any lock, so concurrent callers only
+ * serialise for the PROD register update, and a whole batch costs a single
+ * register write and, at most, a single CMD_SYNC.
+ */
+static int arm_smmu_cmdq_issue_cmdlist(struct arm_smmu_device *smmu,
+				       u64 *cmds, int n, bool sync)
 {
-	u64 cmd[CMDQ_ENT_DWORDS];
-	unsigned long flags;
-	bool wfe = !!(smmu->features & ARM_SMMU_FEAT_SEV);
+	struct arm_smmu_cmdq *cmdq = &smmu->cmdq;
+	struct arm_smmu_queue *q = &cmdq->q;
+	struct arm_smmu_ll_queue llq = { .max_n_shift = q->llq.max_n_shift };
+	bool msi = (smmu->features & ARM_SMMU_FEAT_MSI) &&
+		   (smmu->features & ARM_SMMU_FEAT_COHERENCY);
 	struct arm_smmu_cmdq_ent ent = { .opcode = CMDQ_OP_CMD_SYNC };
-	int ret;
+	u64 cmd_sync[CMDQ_ENT_DWORDS];
+	unsigned long flags;
+	u32 head, sync_prod = 0;
+	int i, ret = 0;
+
+	if (!n && !sync)
+		return 0;
+
+	/*
+	 * Interrupts are masked between reservation and publication: a
+	 * producer in IRQ context would otherwise wait forever for the
+	 * slots reserved by the code it interrupted.
+	 */
+	local_irq_save(flags);
+
+	arm_smmu_cmdq_reserve(smmu, &llq, n + sync);
+	head = llq.prod;
 
-	arm_smmu_cmdq_build_cmd(cmd, &ent);
+	for (i = 0; i < n; i++) {
+		queue_write(Q_ENT(q, llq.prod), &cmds[i * CMDQ_ENT_DWORDS],
+			    CMDQ_ENT_DWORDS);
+		llq.prod = queue_inc_prod_n(&llq, 1);
+	}
+
+	if (sync) {
+		sync_prod = llq.prod;
+		llq.prod = queue_inc_prod_n(&llq, 1);
+	}
 
-	spin_lock_irqsave(&smmu->cmdq.lock, flags);
-	arm_smmu_cmdq_insert_cmd(smmu, cmd);
-	ret = queue_poll_cons(&smmu->cmdq.q, true, wfe);
-	spin_unlock_irqrestore(&smmu->cmdq.lock, flags);
+	/* Wait for the producers ahead of us to publish their commands. */
+	while (atomic_read(&cmdq->owner_prod) != head)
+		cpu_relax();
+
+	/*
+	 * CMD_SYNCs are now published in queue order, so the MSI sequence
+	 * numbers increase in the order the SMMU completes them.
+	 */
+	if (sync) {
+		if (msi)
+			arm_smmu_cmdq_sync_set_msi(smmu, &ent);
+		arm_smmu_cmdq_build_cmd(cmd_sync, &ent);
+		queue_write(Q_ENT(q, sync_prod), cmd_sync, CMDQ_ENT_DWORDS);
+	}
+
+	/*
+	 * writel() orders the queue writes above before the SMMU can observe
+	 * the new PROD.
+	 */
+	writel(llq.prod, q->prod_reg);
+	smp_mb();
+	atomic_set(&cmdq->owner_prod, llq.prod);
+
+	local_irq_restore(flags);
+
+	if (sync) {
+		ret = msi ? __arm_smmu_sync_poll_msi(smmu, ent.sync.msidata)
+			  : __arm_smmu_sync_poll_cons(smmu, sync_prod);
+		if (ret)
+			dev_err_ratelimited(smmu->dev, "CMD_SYNC timeout\n");
+	}
 
 	return ret;
 }
 
+static void arm_smmu_cmdq_issue_cmd(struct arm_smmu_device *smmu,
+				    struct arm_smmu_cmdq_ent *ent)
+{
+	u64 cmd[CMDQ_ENT_DWORDS];
+
+	if (arm_smmu_cmdq_build_cmd(cmd, ent)) {
+		dev_warn(smmu->dev, "ignoring unknown CMDQ opcode 0x%x\n",
+			 ent->opcode);
+		return;
+	}
+
+	arm_smmu_cmdq_issue_cmdlist(smmu, cmd, 1, false);
+}
+
 static int arm_smmu_cmdq_issue_sync(struct arm_smmu_device *smmu)
 {
-	int ret;
-	bool msi = (smmu->features & ARM_SMMU_FEAT_MSI) &&
-		   (smmu->features & ARM_SMMU_FEAT_COHERENCY);
+	return arm_smmu_cmdq_issue_cmdlist(smmu, NULL, 0, true);
+}
 
-	ret = msi ? __arm_smmu_cmdq_issue_sync_msi(smmu)
-		  : __arm_smmu_cmdq_issue_sync(smmu);
-	if (ret)
-		dev_err_ratelimited(smmu->dev, "CMD_SYNC timeout\n");
-	return ret;
+static void arm_smmu_cmdq_batch_add(struct arm_smmu_device *smmu,
+				    struct arm_smmu_cmdq_batch *cmds,
+				    struct arm_smmu_cmdq_ent *cmd)
+{
+	if (cmds->num == CMDQ_BATCH_ENTRIES) {
+		arm_smmu_cmdq_issue_cmdlist(smmu, cmds->cmds, cmds->num, false);
+		cmds->num = 0;
+	}
+
+	if (arm_smmu_cmdq_build_cmd(&cmds->cmds[cmds->num * CMDQ_ENT_DWORDS],
+				    cmd)) {
+		dev_warn(smmu->dev, "ignoring unknown CMDQ opcode 0x%x\n",
+			 cmd->opcode);
+		return;
+	}
+
+	cmds->num++;
+}
+
+static int arm_smmu_cmdq_batch_submit(struct arm_smmu_device *smmu,
+				      struct arm_smmu_cmdq_batch *cmds)
+{
+	return arm_smmu_cmdq_issue_cmdlist(smmu, cmds->cmds, cmds->num, true);
 }
 
 /* Stream table manipulation functions */
@@ -1022,16 +1170,17 @@ static int arm_smmu_atc_inv_master(struct arm_smmu_master *master,
 				   struct arm_smmu_cmdq_ent *cmd)
 {
 	int i;
+	struct arm_smmu_cmdq_batch cmds = {};
 
 	if (!master->ats_enabled)
 		return 0;
 
 	for (i = 0; i < master->num_sids; i++) {
 		cmd->atc.sid = master->sids[i];
-		arm_smmu_cmdq_issue_cmd(master->smmu, cmd);
+		arm_smmu_cmdq_batch_add(master->smmu, &cmds, cmd);
 	}
 
-	return arm_smmu_cmdq_issue_sync(master->smmu);
+	return arm_smmu_cmdq_batch_submit(master->smmu, &cmds);
 }
 
 static int arm_smmu_atc_inv_domain(struct arm_smmu_domain *smmu_domain,
@@ -1077,6 +1226,7 @@ static void arm_smmu_tlb_inv_context(void *cookie)
 {
 	struct arm_smmu_domain *smmu_domain = cookie;
 	struct arm_smmu_device *smmu = smmu_domain->smmu;
+	struct arm_smmu_cmdq_batch cmds = {};
 	struct arm_smmu_cmdq_ent cmd;
 
 	cmd.opcode	= CMDQ_OP_TLBI_S12_VMALL;
@@ -1085,12 +1235,39 @@ static void arm_smmu_tlb_inv_context(void *cookie)
 	/*
 	 * NOTE: when io-pgtable is in non-strict mode, we may get here with
 	 * PTEs previously cleared by unmaps on the current CPU not yet visible
-	 * to the SMMU. We are relying on the DSB implicit in
-	 * queue_sync_prod_out() to guarantee those are observed before the
+	 * to the SMMU. We are relying on the DSB implicit in the writel() of
+	 * the PROD register to guarantee those are observed before the
 	 * TLBI. Do be careful, 007.
 	 */
-	arm_smmu_cmdq_issue_cmd(smmu, &cmd);
-	arm_smmu_cmdq_issue_sync(smmu);
+	arm_smmu_cmdq_batch_add(smmu, &cmds, &cmd);
+	arm_smmu_cmdq_batch_submit(smmu, &cmds);
+}
+
+/*
+ * Invalidate the stage-2 TLB entries covering [ipa, ipa + size) using one
+ * TLBI per page and a single trailing CMD_SYNC.
+ */
+static void arm_smmu_tlb_inv_range(struct arm_smmu_domain *smmu_domain,
+				   paddr_t ipa, size_t size)
+{
+	struct arm_smmu_device *smmu = smmu_domain->smmu;
+	struct arm_smmu_cmdq_batch cmds = {};
+	struct arm_smmu_cmdq_ent cmd = {
+		.opcode	= CMDQ_OP_TLBI_S2_IPA,
+		.tlbi	= {
+			.vmid	= smmu_domain->s2_cfg.vmid,
+			/* Page-table pages may have been freed as well. */
+			.leaf	= false,
+		},
+	};
+	paddr_t end = ipa + size;
+
+	for (; ipa < end; ipa += PAGE_SIZE) {
+		cmd.tlbi.addr = ipa;
+		arm_smmu_cmdq_batch_add(smmu, &cmds, &cmd);
+	}
+
+	arm_smmu_cmdq_batch_submit(smmu, &cmds);
 }
 
 static struct iommu_domain *arm_smmu_domain_alloc(void)
@@ -1642,13 +1819,15 @@ static int __init arm_smmu_init_queues(struct arm_smmu_device *smmu)
 	int ret;
 
 	/* cmdq */
-	spin_lock_init(&smmu->cmdq.lock);
 	ret = arm_smmu_init_one_queue(smmu, &smmu->cmdq.q, smmu->base,
 					  ARM_SMMU_CMDQ_PROD, ARM_SMMU_CMDQ_CONS,
 					  CMDQ_ENT_DWORDS, "cmdq");
 	if (ret)
 		return ret;
 
+	atomic_set(&smmu->cmdq.prod, smmu->cmdq.q.llq.prod);
+	atomic_set(&smmu->cmdq.owner_prod, smmu->cmdq.q.llq.prod);
+
 	/* evtq */
 	ret = arm_smmu_init_one_queue(smmu, &smmu->evtq.q, smmu->page1,
 					  ARM_SMMU_EVTQ_PROD, ARM_SMMU_EVTQ_CONS,
@@ -2284,9 +2463,14 @@ static int arm_smmu_device_hw_probe(struct arm_smmu_device *smmu)
 	/* Queue sizes, capped to ensure natural alignment */
 	smmu->cmdq.q.llq.max_n_shift = min_t(u32, CMDQ_MAX_SZ_SHIFT,
 					     FIELD_GET(IDR1_CMDQS, reg));
-	if (!smmu->cmdq.q.llq.max_n_shift) {
-		/* Odd alignment restrictions on the base, so ignore for now */
-		dev_err(smmu->dev, "unit-length command queue not supported\n");
+	if (smmu->cmdq.q.llq.max_n_shift <= ilog2(CMDQ_BATCH_ENTRIES)) {
+		/*
+		 * A batch and its CMD_SYNC must fit in the queue. This also
+		 * rejects the unit-length queue, which has odd alignment
+		 * restrictions on the base.
+		 */
+		dev_err(smmu->dev, "command queue size <= %d entries not supported\n",
+			CMDQ_BATCH_ENTRIES);
 		return -ENXIO;
 	}
 
@@ -2585,6 +2769,40 @@ static const struct dt_device_match arm_smmu_of_match[] = {
  */
 static uint32_t __ro_after_init platform_features = ARM_SMMU_FEAT_COHERENCY;
 
+/*
+ * Above this many pages, invalidating the whole VMID is cheaper than
+ * issuing one TLBI per page.
+ */
+#define ARM_SMMU_TLBI_RANGE_MAX_PAGES	CMDQ_BATCH_ENTRIES
+
+static int __must_check arm_smmu_iotlb_flush_range(struct domain *d,
+						   dfn_t dfn,
+						   unsigned long page_count)
+{
+	struct arm_smmu_crux_domain *crux_domain = dom_iommu(d)->arch.priv;
+	struct iommu_domain *io_domain;
+
+	spin_lock(&crux_domain->lock);
+
+	list_for_each_entry(io_domain, &crux_domain->contexts, list) {
+		struct arm_smmu_domain *smmu_domain = to_smmu_domain(io_domain);
+
+		/* See arm_smmu_iotlb_flush_all(). */
+		if (unlikely(!ACCESS_ONCE(smmu_domain->smmu)))
+			continue;
+
+		if (page_count > ARM_SMMU_TLBI_RANGE_MAX_PAGES)
+			arm_smmu_tlb_inv_context(smmu_domain);
+		else
+			arm_smmu_tlb_inv_range(smmu_domain, pfn_to_paddr(dfn_x(dfn)),
+					       page_count << PAGE_SHIFT);
+	}
+
+	spin_unlock(&crux_domain->lock);
+
+	return 0;
+}
+
 static int __must_check arm_smmu_iotlb_flush_all(struct domain *d)
 {
 	struct arm_smmu_crux_domain *crux_domain = dom_iommu(d)->arch.priv;
@@ -2612,7 +2830,7 @@ static int __must_check arm_smmu_iotlb_flush_all(struct domain *d)
 static int __must_check arm_smmu_iotlb_flush(struct domain *d, dfn_t dfn,
 				unsigned long page_count, unsigned int flush_flags)
 {
-	return arm_smmu_iotlb_flush_all(d);
+	return arm_smmu_iotlb_flush_range(d, dfn, page_count);
 }
 
 static struct arm_smmu_device *arm_smmu_get_by_dev(const struct device *dev)
@@ -524,9 +524,22 @@ struct arm_smmu_queue {
 	u32 __iomem			*cons_reg;
 };
 
+/*
+ * Producers reserve slots by moving 'prod' forward with a cmpxchg and
+ * publish them to the SMMU in reservation order, using 'owner_prod' to
+ * hand over the PROD register from one producer to the next.
+ */
 struct arm_smmu_cmdq {
 	struct arm_smmu_queue		q;
-	spinlock_t			lock;
+	atomic_t			prod;
+	atomic_t			owner_prod;
+};
+
+#define CMDQ_BATCH_ENTRIES		32
+
+struct arm_smmu_cmdq_batch {
+	u64				cmds[CMDQ_BATCH_ENTRIES * CMDQ_ENT_DWORDS];
+	int				num;
 };
 
 struct arm_smmu_evtq {
@@ -609,7 +622,6 @@ struct arm_smmu_device {
 	int				gerr_irq;
 	int				combined_irq;
 	u32				sync_nr;
-	u8				prev_cmd_opcode;
 
 	unsigned long			ias; /* IPA */
 	unsigned long			oas; /* PA */
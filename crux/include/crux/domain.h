@@ -3,6 +3,7 @@
 #define __CRUX_DOMAIN_H__
 
 #include <crux/errno.h>
+#include <crux/mm-frame.h>
 #include <crux/numa.h>
 #include <crux/types.h>
 
@@ -11,6 +12,7 @@
 struct guest_area {
     struct page_info *pg;
     void *map;
+    gfn_t gfn;      /* For log-dirty, valid while pg is set. */
 };
 
 #include <asm/domain.h>
@@ -93,6 +95,12 @@ int map_guest_area(struct vcpu *v, paddr_t gaddr, unsigned int size,
                    void (*populate)(void *dst, struct vcpu *v));
 void unmap_guest_area(struct vcpu *v, struct guest_area *area);
 
+/*
+ * Record the guest pages crux keeps mapped and writes to behind the guest's
+ * back (vCPU info, runstate and event channel control areas) as dirty.
+ */
+void domain_mark_guest_areas_dirty(struct domain *d);
+
 struct crux_domctl_createdomain;
 int arch_domain_create(struct domain *d,
                        struct crux_domctl_createdomain *config,
@@ -86,6 +86,9 @@ int evtchn_unmask(unsigned int port);
 /* Move all PIRQs after a vCPU was moved to another pCPU. */
 void evtchn_move_pirqs(struct vcpu *v);
 
+/* Mark the guest pages the event channel ABI in use writes to as dirty. */
+void evtchn_mark_dirty(struct domain *d);
+
 /* Allocate/free a crux-attached event channel port. */
 typedef void (*crux_event_channel_notification_t)(
     struct vcpu *v, unsigned int port);
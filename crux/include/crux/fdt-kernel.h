@@ -121,6 +121,7 @@ int kernel_probe(struct kernel_info *info, const struct dt_device_node *domain);
 void kernel_load(struct kernel_info *info);
 
 int kernel_decompress(struct boot_module *mod, uint32_t offset);
+void kernel_decompress_all(void);
 
 int kernel_zimage_probe(struct kernel_info *info, paddr_t addr, paddr_t size);
 
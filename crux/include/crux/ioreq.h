@@ -38,6 +38,16 @@ struct ioreq_vcpu {
 
 #define NR_IO_RANGE_TYPES (CRUX_DMOP_IO_RANGE_PCI + 1)
 #define MAX_NR_IO_RANGES  256
+#define MAX_NR_DOORBELLS  64
+
+struct ioreq_doorbell {
+    struct list_head list_entry;
+    paddr_t          addr;
+    uint64_t         data;
+    unsigned int     size;
+    unsigned int     flags;  /* CRUX_DMOP_DOORBELL_* */
+    evtchn_port_t    port;
+};
 
 struct ioreq_server {
     struct domain          *target, *emulator;
@@ -53,6 +63,9 @@ struct ioreq_server {
     spinlock_t             bufioreq_lock;
     evtchn_port_t          bufioreq_evtchn;
     struct rangeset        *range[NR_IO_RANGE_TYPES];
+    /* Changed only with the target paused, so vCPUs walk it unlocked */
+    struct list_head       doorbell_list;
+    unsigned int           nr_doorbells;
     bool                   enabled;
     uint8_t                bufioreq_handling;
 };
@@ -102,6 +115,7 @@ struct ioreq_server *ioreq_server_select(struct domain *d,
                                          ioreq_t *p);
 int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
                bool buffered);
+int ioreq_send_doorbell(struct ioreq_server *s, ioreq_t *p);
 unsigned int ioreq_broadcast(ioreq_t *p, bool buffered);
 void ioreq_request_mapcache_invalidate(const struct domain *d);
 void ioreq_signal_mapcache_invalidate(void);
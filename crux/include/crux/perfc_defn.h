@@ -12,8 +12,27 @@ PERFCOUNTER(calls_from_multicall,       "calls from multicall")
 
 PERFCOUNTER(irqs,                   "#interrupts")
 PERFCOUNTER(ipis,                   "#IPIs")
+PERFCOUNTER(conring_pcpu_lost,      "console: per-CPU ring records lost")
+
+PERFCOUNTER(gnttab_copy_buf_hit,    "grant copy buffer reused")
+PERFCOUNTER(gnttab_copy_buf_miss,   "grant copy buffer claimed")
+
+PERFCOUNTER(ioreq_select_hit,       "ioreq server select cached")
+PERFCOUNTER(ioreq_select_miss,      "ioreq server select walked")
+PERFCOUNTER(ioreq_doorbell_event,   "ioreq doorbell signalled")
+PERFCOUNTER(ioreq_doorbell_buffered, "ioreq doorbell buffered")
+
+PERFCOUNTER(evtchn_send_fast,       "evtchn send lockless")
+PERFCOUNTER(evtchn_send_slow,       "evtchn send locked")
+PERFCOUNTER(evtchn_send_batch,      "evtchn send batches")
+
+PERFCOUNTER(argo_msgs,              "argo: messages sent")
+PERFCOUNTER(argo_batch,             "argo: sendv batches")
+PERFCOUNTER(argo_signal,            "argo: ring signals")
 
 PERFCOUNTER(rcu_idle_timer,         "RCU: idle_timer")
+PERFCOUNTER(rcu_expedited,          "RCU: expedited callbacks")
+PERFCOUNTER(rcu_nocb_handoff,       "RCU: callback batches offloaded")
 
 /* Generic scheduler counters (applicable to all schedulers) */
 PERFCOUNTER(sched_irq,              "sched: timer")
@@ -75,6 +94,8 @@ PERFCOUNTER(migrate_no_runq,        "csched2: migrate_no_runq")
 PERFCOUNTER(runtime_min_timer,      "csched2: runtime_min_timer")
 PERFCOUNTER(runtime_max_timer,      "csched2: runtime_max_timer")
 PERFCOUNTER(pick_resource,          "csched2: pick_resource")
+PERFCOUNTER(pick_resource_idle,     "csched2: pick_resource_idle")
+PERFCOUNTER(idlers_snapshot_retry,  "csched2: idlers_snapshot_retry")
 PERFCOUNTER(need_fallback_cpu,      "csched2: need_fallback_cpu")
 PERFCOUNTER(migrate_resisted,       "csched2: migrate_resisted")
 PERFCOUNTER(credit_reset,           "csched2: credit_reset")
@@ -174,6 +174,10 @@ void rcu_check_callbacks(int cpu);
 void call_rcu(struct rcu_head *head, 
               void (*func)(struct rcu_head *head));
 
+void call_rcu_expedited(struct rcu_head *head,
+                        void (*func)(struct rcu_head *head));
+void synchronize_rcu_expedited(void);
+
 void rcu_barrier(void);
 
 void rcu_idle_enter(unsigned int cpu);
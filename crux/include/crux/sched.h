@@ -171,6 +171,13 @@ struct vcpu_io {
     ioreq_t              req;
     /* Arch specific info pertaining to the io request */
     struct arch_vcpu_io  info;
+    /* Last ioreq_server_select() hit, valid while gen is current. */
+    struct {
+        struct ioreq_server *server;
+        unsigned long        start, end;
+        unsigned int         gen;
+        uint8_t              type;
+    } select;
 };
 
 struct vcpu
@@ -440,6 +447,12 @@ struct domain
     /* Port to resume from in evtchn_reset(), when in a continuation. */
     unsigned int     next_evtchn;
     rwlock_t         event_lock;
+    /*
+     * Read-held by EVTCHNOP_send's interdomain fast path instead of the
+     * channel lock.  Write-held, on both ends, while interdomain bindings
+     * are made or torn down.
+     */
+    percpu_rwlock_t  evtchn_send_lock;
     const struct evtchn_port_ops *evtchn_port_ops;
     struct evtchn_fifo_domain *evtchn_fifo;
 
@@ -638,6 +651,8 @@ struct domain
     struct {
         rspinlock_t             lock;
         struct ioreq_server     *server[MAX_NR_IOREQ_SERVERS];
+        /* Bumped whenever ioreq_server_select() results may change. */
+        unsigned int            select_gen;
     } ioreq_server;
 #endif
 
@@ -866,6 +881,7 @@ int sched_get_id_by_name(const char *sched_name);
 
 void vcpu_wake(struct vcpu *v);
 long vcpu_yield(void);
+bool vcpu_has_exclusive_pcpu(const struct vcpu *v);
 void vcpu_sleep_nosync(struct vcpu *v);
 void vcpu_sleep_sync(struct vcpu *v);
 
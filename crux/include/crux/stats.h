@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __CRUX_STATS_H__
+#define __CRUX_STATS_H__
+
+#include <crux/time.h>
+
+#include <public/hypfs.h>
+
+#ifdef CONFIG_CPU_STATS
+
+#include <crux/bitops.h>
+#include <crux/percpu.h>
+
+struct cpu_stats {
+    uint64_t trap[CRUX_HYPFS_STATS_NR_TRAPS];
+    uint64_t event[CRUX_HYPFS_STATS_NR_EVENTS];
+    uint64_t hypercall_lat[CRUX_HYPFS_STATS_NR_HYPERCALLS]
+                          [CRUX_HYPFS_STATS_LAT_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct cpu_stats, cpu_stats);
+
+/*
+ * The counters are plain per-CPU increments: no atomics, no locks.  A
+ * counter bumped from both interrupt and non-interrupt context may, rarely,
+ * lose a count.
+ */
+static inline void stats_trap(unsigned int class)
+{
+    if ( class < CRUX_HYPFS_STATS_NR_TRAPS )
+        this_cpu(cpu_stats).trap[class]++;
+}
+
+static inline void stats_event(unsigned int ev)
+{
+    this_cpu(cpu_stats).event[ev]++;
+}
+
+static inline cycles_t stats_hypercall_start(void)
+{
+    return get_cycles();
+}
+
+static inline void stats_hypercall_end(unsigned long nr, cycles_t start)
+{
+    unsigned int b = flsl(get_cycles() - start);
+
+    if ( nr >= CRUX_HYPFS_STATS_NR_HYPERCALLS )
+        return;
+    if ( b >= CRUX_HYPFS_STATS_LAT_BUCKETS )
+        b = CRUX_HYPFS_STATS_LAT_BUCKETS - 1;
+
+    this_cpu(cpu_stats).hypercall_lat[nr][b]++;
+}
+
+#else /* !CONFIG_CPU_STATS */
+
+static inline void stats_trap(unsigned int class) {}
+static inline void stats_event(unsigned int ev) {}
+static inline cycles_t stats_hypercall_start(void) { return 0; }
+static inline void stats_hypercall_end(unsigned long nr, cycles_t start) {}
+
+#endif /* CONFIG_CPU_STATS */
+
+#endif /* __CRUX_STATS_H__ */
@@ -0,0 +1,9 @@
+#ifndef __CRUX_UNLZ4_H
+#define __CRUX_UNLZ4_H
+
+int lz4_check(char *image, unsigned long image_len);
+unsigned long lz4_output_length(char *image, unsigned long image_len);
+int perform_unlz4(char *output, unsigned long output_len,
+                  char *image, unsigned long image_len);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __CRUX_UNZSTD_H
+#define __CRUX_UNZSTD_H
+
+int zstd_check(char *image, unsigned long image_len);
+unsigned long zstd_output_length(char *image, unsigned long image_len);
+int perform_unzstd(char *output, unsigned long output_len,
+                   char *image, unsigned long image_len);
+
+#endif
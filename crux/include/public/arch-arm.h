@@ -327,6 +327,18 @@ DEFINE_CRUX_GUEST_HANDLE(vcpu_guest_context_t);
 #define CRUX_DOMCTL_CONFIG_TEE_OPTEE     1
 #define CRUX_DOMCTL_CONFIG_TEE_FFA       2
 
+/* Follow the "vwfi" command line option. */
+#define CRUX_DOMCTL_CONFIG_WFI_DEFAULT   0
+/* Trap WFI/WFE and block/yield straight away. */
+#define CRUX_DOMCTL_CONFIG_WFI_TRAP      1
+/* Don't trap WFI/WFE. */
+#define CRUX_DOMCTL_CONFIG_WFI_NATIVE    2
+/*
+ * Don't trap WFI/WFE while a vCPU has its pCPU to itself; otherwise trap
+ * them, but poll for an interrupt for a short while before blocking.
+ */
+#define CRUX_DOMCTL_CONFIG_WFI_ADAPTIVE  3
+
 struct crux_arch_domainconfig {
     /* IN/OUT */
     uint8_t gic_version;
@@ -350,6 +362,9 @@ struct crux_arch_domainconfig {
      *
      */
     uint32_t clock_frequency;
+    /* IN - CRUX_DOMCTL_CONFIG_WFI_* */
+    uint8_t wfi_policy;
+    uint8_t pad[3];
 };
 #endif /* __CRUX__ || __CRUX_TOOLS__ */
 
@@ -54,6 +54,14 @@ typedef struct crux_argo_send_addr
     crux_argo_addr_t dst;
 } crux_argo_send_addr_t;
 
+typedef struct crux_argo_send_msg
+{
+    crux_argo_send_addr_t addr;
+    crux_argo_iov_t iov;
+    uint32_t message_type;
+    uint32_t pad;
+} crux_argo_send_msg_t;
+
 typedef struct crux_argo_ring
 {
     /* Guests should use atomic operations to access rx_ptr */
@@ -235,4 +243,30 @@ struct crux_argo_ring_message_header
  */
 #define CRUX_ARGO_OP_notify              4
 
+/*
+ * CRUX_ARGO_OP_sendv_batch
+ *
+ * Send several single-buffer messages, each as with CRUX_ARGO_OP_sendv.
+ * Consecutive messages for the same destination ring are written under a
+ * single lookup of that ring, and the destination domain is signalled once
+ * for all of them rather than once per message.
+ *
+ * Messages are sent in order, stopping at the first one that cannot be sent.
+ * Returns the number of messages sent if it is not zero, or else the error
+ * for the first message. If a message is stopped for lack of space, crux
+ * will notify the caller when it becomes available, as for sendv.
+ *
+ * crux may also return before all of the messages have been sent to bound
+ * the time spent in one call, having sent at least one. The caller should
+ * then submit the remaining messages again.
+ *
+ * arg1: CRUX_GUEST_HANDLE(crux_argo_send_msg_t) msgs
+ * arg2: NULL
+ * arg3: unsigned long nmsg, at most CRUX_ARGO_MAX_BATCH
+ * arg4: 0 (ZERO)
+ */
+#define CRUX_ARGO_OP_sendv_batch         5
+
+#define CRUX_ARGO_MAX_BATCH             64U
+
 #endif
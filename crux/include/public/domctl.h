@@ -32,7 +32,7 @@
  *
  * Last version bump: crux 4.19
  */
-#define CRUX_DOMCTL_INTERFACE_VERSION 0x00000017
+#define CRUX_DOMCTL_INTERFACE_VERSION 0x00000018
 
 /*
  * NB. crux_domctl.domain is an IN/OUT parameter for this operation.
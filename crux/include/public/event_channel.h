@@ -60,6 +60,7 @@
 #ifdef __CRUX__
 #define EVTCHNOP_reset_cont      14
 #endif
+#define EVTCHNOP_send_batch      15
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -181,6 +182,24 @@ struct evtchn_send {
 };
 typedef struct evtchn_send evtchn_send_t;
 
+/*
+ * EVTCHNOP_send_batch: Send an event on each of the <nr_ports> local ports
+ * listed in <ports>, as if by EVTCHNOP_send.
+ * NOTES:
+ *  1. <nr_done> must be zero on the initial call.
+ *  2. On return <nr_done> holds the number of ports signalled.  If an error
+ *     is returned, <ports>[<nr_done>] is the port which failed and none of
+ *     the ports after it have been signalled.
+ */
+struct evtchn_send_batch {
+    /* IN parameters. */
+    CRUX_GUEST_HANDLE(evtchn_port_t) ports;
+    uint32_t nr_ports;
+    /* IN/OUT parameters. */
+    uint32_t nr_done;
+};
+typedef struct evtchn_send_batch evtchn_send_batch_t;
+
 /*
  * EVTCHNOP_status: Get the current status of the communication channel which
  * has an endpoint at <dom, port>.
@@ -444,6 +444,54 @@ struct crux_dm_op_nr_vcpus {
 };
 typedef struct crux_dm_op_nr_vcpus crux_dm_op_nr_vcpus_t;
 
+/*
+ * CRUX_DMOP_map_doorbell_to_ioreq_server: Register a doorbell with IOREQ
+ *                                        Server <id>.
+ * CRUX_DMOP_unmap_doorbell_from_ioreq_server: Deregister a doorbell
+ *                                            previously registered with
+ *                                            IOREQ Server <id>.
+ *
+ * A doorbell is a register within a memory range mapped to the server
+ * whose writes the emulator is happy to consume asynchronously (e.g. a
+ * virtio-mmio QueueNotify). Writes of exactly <size> bytes to <addr> -
+ * and, with CRUX_DMOP_DOORBELL_datamatch, only those of value <data> -
+ * complete immediately rather than blocking the vCPU on an ioreq:
+ *
+ *  - by default crux signals <port>, an event channel allocated on map for
+ *    the emulator to bind to. The value written is not passed on, so use
+ *    datamatch (one doorbell per value) where it matters.
+ *  - with CRUX_DMOP_DOORBELL_buffered the write is queued on the server's
+ *    buffered ioreq page instead, data included. Buffered ioreqs only
+ *    carry 20 address bits, so those must differ between the buffered
+ *    doorbells of a server. <port> is not used.
+ *
+ * Any other access to a doorbell is forwarded as normal. Unmap matches on
+ * <addr>, <size>, <flags> and <data>.
+ */
+#define CRUX_DMOP_map_doorbell_to_ioreq_server 21
+#define CRUX_DMOP_unmap_doorbell_from_ioreq_server 22
+
+struct crux_dm_op_ioreq_server_doorbell {
+    /* IN - server id */
+    ioservid_t id;
+    /* IN - flags */
+    uint16_t flags;
+#define _CRUX_DMOP_DOORBELL_datamatch 0
+#define CRUX_DMOP_DOORBELL_datamatch (1u << _CRUX_DMOP_DOORBELL_datamatch)
+#define _CRUX_DMOP_DOORBELL_buffered 1
+#define CRUX_DMOP_DOORBELL_buffered (1u << _CRUX_DMOP_DOORBELL_buffered)
+    /* IN - access size in bytes: 1, 2, 4 or 8 */
+    uint32_t size;
+    /* IN - guest physical address, aligned to <size> */
+    uint64_aligned_t addr;
+    /* IN - value to match with CRUX_DMOP_DOORBELL_datamatch */
+    uint64_aligned_t data;
+    /* OUT - event channel to bind to (map, unbuffered only) */
+    evtchn_port_t port;
+    uint32_t pad;
+};
+typedef struct crux_dm_op_ioreq_server_doorbell crux_dm_op_ioreq_server_doorbell_t;
+
 struct crux_dm_op {
     uint32_t op;
     uint32_t pad;
@@ -468,6 +516,8 @@ struct crux_dm_op {
         crux_dm_op_relocate_memory_t relocate_memory;
         crux_dm_op_pin_memory_cacheattr_t pin_memory_cacheattr;
         crux_dm_op_nr_vcpus_t nr_vcpus;
+        crux_dm_op_ioreq_server_doorbell_t map_doorbell_to_ioreq_server;
+        crux_dm_op_ioreq_server_doorbell_t unmap_doorbell_from_ioreq_server;
     } u;
 };
 
@@ -110,4 +110,45 @@ struct crux_hypfs_dirlistentry {
  */
 #define CRUX_HYPFS_OP_write_contents    2
 
+/*
+ * Statistics
+ *
+ * The CRUX_HYPFS_TYPE_BLOB entries below /stats/ hold per-CPU counters: a
+ * struct crux_hypfs_stats followed by nr_cpus records, each of them a
+ * struct crux_hypfs_stats_cpu followed by nr_counters uint64_t counters.
+ * Counters of offline CPUs read as zero, and may restart from zero when a
+ * CPU is brought back online.
+ *
+ * /stats/traps: guest traps by architectural class (ESR_ELx.EC on Arm).
+ * /stats/events: indexed by CRUX_HYPFS_STATS_EV_*.
+ * /stats/hypercall-latency: CRUX_HYPFS_STATS_LAT_BUCKETS counters per
+ *   hypercall number, histogramming the time taken to handle a call in
+ *   ticks of a tick_khz clock.  Bucket 0 counts calls which took no tick,
+ *   bucket b > 0 the ones which took [2^(b-1), 2^b) ticks, and the last
+ *   bucket everything longer.
+ */
+#define CRUX_HYPFS_STATS_VERSION         1
+
+struct crux_hypfs_stats {
+    uint32_t version;        /* CRUX_HYPFS_STATS_VERSION */
+    uint32_t nr_cpus;
+    uint32_t nr_counters;    /* Per CPU */
+    uint32_t tick_khz;
+};
+
+struct crux_hypfs_stats_cpu {
+    uint32_t cpu;
+    uint32_t flags;
+#define CRUX_HYPFS_STATS_CPU_ONLINE      (1U << 0)
+};
+
+#define CRUX_HYPFS_STATS_EV_VGIC_INJECT  0 /* Virtual interrupts raised. */
+#define CRUX_HYPFS_STATS_EV_P2M_FAULT    1 /* Stage-2 aborts. */
+#define CRUX_HYPFS_STATS_EV_IRQ          2 /* Physical interrupts taken. */
+#define CRUX_HYPFS_STATS_NR_EVENTS       3
+
+#define CRUX_HYPFS_STATS_NR_TRAPS        64
+#define CRUX_HYPFS_STATS_NR_HYPERCALLS   64
+#define CRUX_HYPFS_STATS_LAT_BUCKETS     24
+
 #endif /* __CRUX_PUBLIC_HYPFS_H__ */
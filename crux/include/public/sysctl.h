@@ -28,7 +28,7 @@
  *
  * Last version bump: crux 4.21
  */
-#define CRUX_SYSCTL_INTERFACE_VERSION 0x00000016
+#define CRUX_SYSCTL_INTERFACE_VERSION 0x00000017
 
 /*
  * Read console content from crux buffer ring.
@@ -61,6 +61,13 @@ struct crux_sysctl_tbuf_op {
 #define CRUX_SYSCTL_TBUFOP_set_size     3
 #define CRUX_SYSCTL_TBUFOP_enable       4
 #define CRUX_SYSCTL_TBUFOP_disable      5
+/*
+ * Record only 1 in @size events of each trace class set in @evt_mask
+ * (a @size of 0 or 1 records all of them).  get_sample_rate returns, in
+ * @size, the rate of the lowest class set in @evt_mask.
+ */
+#define CRUX_SYSCTL_TBUFOP_set_sample_rate 6
+#define CRUX_SYSCTL_TBUFOP_get_sample_rate 7
     uint32_t cmd;
     /* IN/OUT variables */
     struct cruxctl_bitmap cpu_mask;
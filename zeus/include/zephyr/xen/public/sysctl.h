@@ -20,7 +20,7 @@
 #include "xen.h"
 #include "domctl.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x00000016
+#define XEN_SYSCTL_INTERFACE_VERSION 0x00000017
 
 /*
  * Get physical information about the host machine